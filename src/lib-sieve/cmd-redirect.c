@@ -58,6 +58,14 @@ const struct sieve_command_def cmd_redirect = {
 	.generate = cmd_redirect_generate
 };
 
+/* Header fields read by the redirect action to prevent mail loops */
+static const char *const _redirect_header_fields[] = {
+	"resent-message-id",
+	"resent-from",
+	"list-id",
+	NULL
+};
+
 /*
  * Redirect operation
  */
@@ -125,6 +133,8 @@ static bool cmd_redirect_validate
 	if ( !sieve_validator_argument_activate(validator, cmd, arg, FALSE) )
 		return FALSE;
 
+	sieve_command_header_fields_add(validator, _redirect_header_fields);
+
 	/* We can only assess the validity of the outgoing address when it is
 	 * a string literal. For runtime-generated strings this needs to be
 	 * done at runtime.
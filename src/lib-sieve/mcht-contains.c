@@ -5,21 +5,49 @@
  */
 
 #include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "buffer.h"
+#include "str-sanitize.h"
 
+#include "sieve-common.h"
+#include "sieve-stringlist.h"
+#include "sieve-runtime-trace.h"
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
+#include "sieve-match-automaton.h"
 #include "sieve-match.h"
 
 #include <string.h>
 #include <stdio.h>
 
+/*
+ * Configuration
+ */
+
+/* Key lists with more keys than this are matched using an Aho-Corasick
+   automaton, smaller ones are searched one key at a time using
+   Boyer-Moore-Horspool. */
+#define MCHT_CONTAINS_AUTOMATON_MIN_KEYS 4
+
 /*
  * Forward declarations
  */
 
+static void mcht_contains_match_init(struct sieve_match_context *mctx);
+static int mcht_contains_match_keys
+	(struct sieve_match_context *mctx, const char *val, size_t val_size,
+		struct sieve_stringlist *key_list);
 static int mcht_contains_match_key
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
 		const char *key, size_t key_size);
+static void mcht_contains_match_deinit(struct sieve_match_context *mctx);
+
+static int mcht_contains_match_value_begin
+	(struct sieve_match_context *mctx, struct sieve_stringlist *key_list);
+static int mcht_contains_match_value_more
+	(struct sieve_match_context *mctx, const char *data, size_t size);
+static int mcht_contains_match_value_end(struct sieve_match_context *mctx);
 
 /*
  * Match-type object
@@ -29,16 +57,359 @@ const struct sieve_match_type_def contains_match_type = {
 	SIEVE_OBJECT("contains",
 		&match_type_operand, SIEVE_MATCH_TYPE_CONTAINS),
 	.validate_context = sieve_match_substring_validate_context,
-	.match_key = mcht_contains_match_key
+	.match_init = mcht_contains_match_init,
+	.match_keys = mcht_contains_match_keys,
+	.match_key = mcht_contains_match_key,
+	.match_deinit = mcht_contains_match_deinit,
+	.match_value_begin = mcht_contains_match_value_begin,
+	.match_value_more = mcht_contains_match_value_more,
+	.match_value_end = mcht_contains_match_value_end
 };
 
 /*
  * Match-type implementation
  */
 
-/* FIXME: Naive substring match implementation. Should switch to more
- * efficient algorithm if large values need to be searched (e.g. message body).
+struct mcht_contains_key {
+	const unsigned char *data;
+	size_t size;
+
+	/* Boyer-Moore-Horspool bad character shift table; only created when
+	   the keys are searched one at a time. */
+	size_t *shift;
+};
+
+struct mcht_contains_context {
+	/* Byte translation applied to both keys and values: identity for
+	   i;octet, lowercase for i;ascii-casemap */
+	unsigned char fold[256];
+
+	ARRAY(struct mcht_contains_key) keys;
+	size_t max_key_size;
+	struct sieve_match_automaton *automaton;
+
+	/* Streamed value: automaton state or the last (max_key_size - 1) bytes
+	   of the previous chunk, so that keys spanning two chunks are found */
+	unsigned int state;
+	buffer_t *tail;
+	unsigned int found;
+
+	unsigned int keys_read:1;
+	unsigned int empty_key:1;
+	unsigned int generic:1;
+};
+
+static void mcht_contains_match_init
+(struct sieve_match_context *mctx)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_contains_context *ctx;
+	unsigned int i;
+
+	ctx = p_new(mctx->pool, struct mcht_contains_context, 1);
+	p_array_init(&ctx->keys, mctx->pool, 8);
+
+	if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) ) {
+		for ( i = 0; i < 256; i++ )
+			ctx->fold[i] = (unsigned char)i_tolower(i);
+	} else if ( sieve_comparator_is(cmp, i_octet_comparator) ) {
+		for ( i = 0; i < 256; i++ )
+			ctx->fold[i] = (unsigned char)i;
+	} else {
+		/* Unknown (extension) comparator; use its char_match() */
+		ctx->generic = TRUE;
+	}
+
+	mctx->data = (void *)ctx;
+}
+
+static void mcht_contains_match_deinit
+(struct sieve_match_context *mctx)
+{
+	struct mcht_contains_context *ctx =
+		(struct mcht_contains_context *)mctx->data;
+
+	if ( ctx->automaton != NULL )
+		sieve_match_automaton_free(&ctx->automaton);
+}
+
+/*
+ * Single key: Boyer-Moore-Horspool
+ */
+
+static void mcht_contains_key_prepare
+(struct sieve_match_context *mctx, struct mcht_contains_key *key)
+{
+	unsigned int i;
+	size_t j;
+
+	i_assert( key->size > 0 );
+
+	key->shift = p_new(mctx->pool, size_t, 256);
+	for ( i = 0; i < 256; i++ )
+		key->shift[i] = key->size;
+	for ( j = 0; j < key->size - 1; j++ )
+		key->shift[key->data[j]] = key->size - 1 - j;
+}
+
+static bool mcht_contains_key_search
+(const struct mcht_contains_context *ctx, const struct mcht_contains_key *key,
+	const unsigned char *val, size_t val_size)
+{
+	const unsigned char *fold = ctx->fold;
+	size_t last = key->size - 1;
+	size_t pos = 0;
+
+	while ( pos + last < val_size ) {
+		size_t j = last;
+
+		while ( fold[val[pos + j]] == key->data[j] ) {
+			if ( j == 0 )
+				return TRUE;
+			j--;
+		}
+		pos += key->shift[fold[val[pos + last]]];
+	}
+	return FALSE;
+}
+
+/*
+ * Key list
  */
+
+static int mcht_contains_read_keys
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	struct mcht_contains_context *ctx =
+		(struct mcht_contains_context *)mctx->data;
+	struct mcht_contains_key *key;
+	string_t *key_item = NULL;
+	unsigned int count, i;
+	int ret;
+
+	while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		size_t size = str_len(key_item);
+		unsigned char *data;
+		size_t j;
+
+		if ( size == 0 ) {
+			/* The empty key is contained in every value */
+			ctx->empty_key = TRUE;
+			continue;
+		}
+
+		data = p_malloc(mctx->pool, size);
+		if ( ctx->generic ) {
+			memcpy(data, str_data(key_item), size);
+		} else {
+			const unsigned char *kdata = str_data(key_item);
+
+			for ( j = 0; j < size; j++ )
+				data[j] = ctx->fold[kdata[j]];
+		}
+
+		key = array_append_space(&ctx->keys);
+		key->data = data;
+		key->size = size;
+
+		if ( size > ctx->max_key_size )
+			ctx->max_key_size = size;
+	}
+
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		return -1;
+	}
+
+	ctx->keys_read = TRUE;
+	if ( ctx->generic || ctx->empty_key )
+		return 0;
+
+	key = array_get_modifiable(&ctx->keys, &count);
+	if ( count >= MCHT_CONTAINS_AUTOMATON_MIN_KEYS ) {
+		ctx->automaton = sieve_match_automaton_create(ctx->fold);
+		for ( i = 0; i < count; i++ ) {
+			sieve_match_automaton_add
+				(ctx->automaton, key[i].data, key[i].size, i);
+		}
+		sieve_match_automaton_compile(ctx->automaton);
+	} else {
+		for ( i = 0; i < count; i++ )
+			mcht_contains_key_prepare(mctx, &key[i]);
+	}
+	return 0;
+}
+
+static unsigned int mcht_contains_search_keys
+(struct sieve_match_context *mctx, const unsigned char *val, size_t val_size)
+{
+	struct mcht_contains_context *ctx =
+		(struct mcht_contains_context *)mctx->data;
+	const struct mcht_contains_key *keys;
+	unsigned int count, i;
+
+	keys = array_get(&ctx->keys, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( ctx->generic ) {
+			if ( mcht_contains_match_key(mctx, (const char *)val, val_size,
+				(const char *)keys[i].data, keys[i].size) > 0 )
+				return i + 1;
+		} else if ( mcht_contains_key_search(ctx, &keys[i], val, val_size) ) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+static int mcht_contains_result
+(struct sieve_match_context *mctx, unsigned int found)
+{
+	struct mcht_contains_context *ctx =
+		(struct mcht_contains_context *)mctx->data;
+	const struct mcht_contains_key *keys;
+	unsigned int count;
+
+	if ( mctx->trace ) {
+		keys = array_get(&ctx->keys, &count);
+		if ( found > 0 ) {
+			sieve_runtime_trace(mctx->runenv, 0,
+				"with key `%s' => 1", str_sanitize(t_strndup
+					(keys[found-1].data, keys[found-1].size), 80));
+		} else {
+			sieve_runtime_trace(mctx->runenv, 0,
+				"with %u key(s) => 0", count);
+		}
+	}
+
+	return ( found > 0 ? 1 : 0 );
+}
+
+static int mcht_contains_match_keys
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	struct sieve_stringlist *key_list)
+{
+	struct mcht_contains_context *ctx =
+		(struct mcht_contains_context *)mctx->data;
+	const unsigned char *uval = (const unsigned char *)val;
+	unsigned int found = 0;
+
+	if ( !ctx->keys_read && mcht_contains_read_keys(mctx, key_list) < 0 )
+		return -1;
+
+	if ( ctx->empty_key ) {
+		if ( mctx->trace ) {
+			sieve_runtime_trace(mctx->runenv, 0,
+				"with empty key => 1");
+		}
+		return 1;
+	}
+
+	if ( ctx->automaton != NULL ) {
+		unsigned int state = 0, key_id;
+
+		/* All keys in one pass over the value */
+		if ( sieve_match_automaton_find
+			(ctx->automaton, &state, uval, val_size, &key_id) )
+			found = key_id + 1;
+	} else {
+		found = mcht_contains_search_keys(mctx, uval, val_size);
+	}
+
+	return mcht_contains_result(mctx, found);
+}
+
+/*
+ * Streamed value
+ */
+
+static int mcht_contains_match_value_begin
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	struct mcht_contains_context *ctx =
+		(struct mcht_contains_context *)mctx->data;
+
+	if ( !ctx->keys_read && mcht_contains_read_keys(mctx, key_list) < 0 )
+		return -1;
+
+	ctx->state = 0;
+	ctx->found = 0;
+
+	if ( ctx->empty_key || ctx->automaton != NULL )
+		return 0;
+
+	/* The overlap between chunks never exceeds the longest key */
+	if ( ctx->tail == NULL ) {
+		ctx->tail = buffer_create_dynamic
+			(mctx->pool, I_MAX(ctx->max_key_size, 1) * 2);
+	} else {
+		buffer_set_used_size(ctx->tail, 0);
+	}
+	return 0;
+}
+
+static int mcht_contains_match_value_more
+(struct sieve_match_context *mctx, const char *data, size_t size)
+{
+	struct mcht_contains_context *ctx =
+		(struct mcht_contains_context *)mctx->data;
+	const unsigned char *udata = (const unsigned char *)data;
+	size_t overlap;
+
+	if ( ctx->empty_key || ctx->found > 0 )
+		return 1;
+
+	if ( ctx->automaton != NULL ) {
+		unsigned int key_id;
+
+		/* The automaton state carries over to the next chunk */
+		if ( sieve_match_automaton_find
+			(ctx->automaton, &ctx->state, udata, size, &key_id) )
+			ctx->found = key_id + 1;
+		return ( ctx->found > 0 ? 1 : 0 );
+	}
+
+	overlap = ctx->max_key_size - 1;
+	if ( overlap > 0 && ctx->tail->used > 0 ) {
+		/* Keys spanning the boundary with the previous chunk */
+		buffer_append(ctx->tail, udata, I_MIN(size, overlap));
+		ctx->found = mcht_contains_search_keys
+			(mctx, ctx->tail->data, ctx->tail->used);
+	}
+	if ( ctx->found == 0 )
+		ctx->found = mcht_contains_search_keys(mctx, udata, size);
+	if ( ctx->found > 0 )
+		return 1;
+
+	/* Retain the end of the value seen so far */
+	if ( size >= overlap ) {
+		buffer_set_used_size(ctx->tail, 0);
+		buffer_append(ctx->tail, udata + size - overlap, overlap);
+	} else if ( ctx->tail->used > overlap ) {
+		buffer_delete(ctx->tail, 0, ctx->tail->used - overlap);
+	} else if ( ctx->tail->used == 0 ) {
+		buffer_append(ctx->tail, udata, size);
+	}
+	return 0;
+}
+
+static int mcht_contains_match_value_end
+(struct sieve_match_context *mctx)
+{
+	struct mcht_contains_context *ctx =
+		(struct mcht_contains_context *)mctx->data;
+
+	if ( ctx->empty_key ) {
+		if ( mctx->trace ) {
+			sieve_runtime_trace(mctx->runenv, 0,
+				"with empty key => 1");
+		}
+		return 1;
+	}
+
+	return mcht_contains_result(mctx, ctx->found);
+}
+
+/* Fallback for comparators that only provide char_match() */
 static int mcht_contains_match_key
 (struct sieve_match_context *mctx, const char *val, size_t val_size,
 	const char *key, size_t key_size)
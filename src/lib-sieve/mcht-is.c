@@ -5,7 +5,16 @@
  */
 
 #include "lib.h"
+#include "hash.h"
+#include "str.h"
+#include "str-sanitize.h"
 
+#include "sieve-common.h"
+#include "sieve-stringlist.h"
+#include "sieve-code.h"
+#include "sieve-binary.h"
+#include "sieve-runtime.h"
+#include "sieve-runtime-trace.h"
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
 #include "sieve-match.h"
@@ -13,10 +22,23 @@
 #include <string.h>
 #include <stdio.h>
 
+/*
+ * Configuration
+ */
+
+/* Literal key lists with at least this many keys are looked up in a hash set
+   that is built once and kept with the binary. Smaller lists are compared
+   one key at a time. */
+#define MCHT_IS_KEY_SET_MIN_KEYS 16
+
 /*
  * Forward declarations
  */
 
+static void mcht_is_match_init(struct sieve_match_context *mctx);
+static int mcht_is_match_keys
+	(struct sieve_match_context *mctx, const char *val, size_t val_size,
+		struct sieve_stringlist *key_list);
 static int mcht_is_match_key
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
 		const char *key, size_t key_size);
@@ -28,13 +50,264 @@ static int mcht_is_match_key
 const struct sieve_match_type_def is_match_type = {
 	SIEVE_OBJECT("is",
 		&match_type_operand, SIEVE_MATCH_TYPE_IS),
+	.match_init = mcht_is_match_init,
+	.match_keys = mcht_is_match_keys,
 	.match_key = mcht_is_match_key
 };
 
+/*
+ * Key set
+ */
+
+struct mcht_is_key {
+	const unsigned char *data;
+	/* Number of bytes that are significant for comparison */
+	size_t cmp_size;
+	size_t size;
+};
+
+struct mcht_is_key_set {
+	pool_t pool;
+	bool casemap;
+
+	HASH_TABLE(struct mcht_is_key *, struct mcht_is_key *) keys;
+	bool empty_key;
+};
+
+static void mcht_is_key_init
+(struct mcht_is_key *key, bool casemap, const unsigned char *data,
+	size_t size, unsigned char *buffer)
+{
+	size_t i;
+
+	key->size = size;
+	if ( !casemap ) {
+		key->data = data;
+		key->cmp_size = size;
+		return;
+	}
+
+	/* i;ascii-casemap compares using strncasecmp(), which stops at the first
+	   NUL character */
+	for ( i = 0; i < size && data[i] != '\0'; i++ )
+		buffer[i] = i_tolower(data[i]);
+	key->data = buffer;
+	key->cmp_size = i;
+}
+
+static unsigned int mcht_is_key_hash(const struct mcht_is_key *key)
+{
+	unsigned int g, h = key->size;
+	size_t i;
+
+	for ( i = 0; i < key->cmp_size; i++ ) {
+		h = (h << 4) + key->data[i];
+		if ( (g = h & 0xf0000000UL) != 0 ) {
+			h = h ^ (g >> 24);
+			h = h ^ g;
+		}
+	}
+	return h;
+}
+
+static int mcht_is_key_cmp
+(const struct mcht_is_key *key1, const struct mcht_is_key *key2)
+{
+	if ( key1->size != key2->size )
+		return ( key1->size < key2->size ? -1 : 1 );
+	if ( key1->cmp_size != key2->cmp_size )
+		return ( key1->cmp_size < key2->cmp_size ? -1 : 1 );
+	return memcmp(key1->data, key2->data, key1->cmp_size);
+}
+
+static void mcht_is_key_set_free(void *data)
+{
+	struct mcht_is_key_set *kset = (struct mcht_is_key_set *)data;
+
+	hash_table_destroy(&kset->keys);
+	pool_unref(&kset->pool);
+}
+
+static int mcht_is_key_set_build
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list,
+	bool casemap, struct mcht_is_key_set **kset_r)
+{
+	struct mcht_is_key_set *kset;
+	string_t *key_item = NULL;
+	pool_t pool;
+	int ret;
+
+	pool = pool_alloconly_create("mcht_is_key_set", 4096);
+	kset = p_new(pool, struct mcht_is_key_set, 1);
+	kset->pool = pool;
+	kset->casemap = casemap;
+	hash_table_create(&kset->keys, default_pool, 0,
+		mcht_is_key_hash, mcht_is_key_cmp);
+
+	while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		struct mcht_is_key *key;
+		const unsigned char *data;
+		size_t size = str_len(key_item);
+
+		if ( size == 0 ) {
+			kset->empty_key = TRUE;
+			continue;
+		}
+
+		key = p_new(pool, struct mcht_is_key, 1);
+		data = p_memdup(pool, str_data(key_item), size);
+		mcht_is_key_init(key, casemap, data, size,
+			( casemap ? p_malloc(pool, size) : NULL ));
+
+		if ( hash_table_lookup(kset->keys, key) == NULL )
+			hash_table_insert(kset->keys, key, key);
+	}
+
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		mcht_is_key_set_free(kset);
+		return -1;
+	}
+
+	*kset_r = kset;
+	return 0;
+}
+
 /*
  * Match-type implementation
  */
 
+struct mcht_is_context {
+	/* Key set shared through the binary; NULL when keys must be compared
+	   one at a time */
+	struct mcht_is_key_set *key_set;
+
+	unsigned int key_set_checked:1;
+	unsigned int casemap:1;
+	unsigned int hashable:1;
+};
+
+static void mcht_is_match_init
+(struct sieve_match_context *mctx)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_is_context *ctx;
+
+	ctx = p_new(mctx->pool, struct mcht_is_context, 1);
+	if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) ) {
+		ctx->casemap = TRUE;
+		ctx->hashable = TRUE;
+	} else if ( sieve_comparator_is(cmp, i_octet_comparator) ) {
+		ctx->hashable = TRUE;
+	}
+
+	mctx->data = (void *)ctx;
+}
+
+static int mcht_is_get_key_set
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	struct mcht_is_context *ctx = (struct mcht_is_context *)mctx->data;
+	struct mcht_is_key_set *kset = NULL;
+	sieve_size_t address;
+	const char *cache_key;
+	void *data;
+
+	ctx->key_set_checked = TRUE;
+
+	/* The lookup must not decode the key list; that is what the key set
+	   avoids */
+	if ( !ctx->hashable ||
+		!sieve_code_stringlist_get_address(key_list, &address) )
+		return 0;
+
+	cache_key = t_strdup_printf("mcht-is:%u:%llu:%s",
+		sieve_binary_block_get_id(renv->sblock), (unsigned long long)address,
+		( ctx->casemap ? "casemap" : "octet" ));
+
+	if ( sieve_binary_cache_lookup(renv->sbin, cache_key, &data) ) {
+		/* NULL when the list is not suitable for a key set */
+		ctx->key_set = (struct mcht_is_key_set *)data;
+		return 0;
+	}
+
+	if ( sieve_stringlist_get_length(key_list) < MCHT_IS_KEY_SET_MIN_KEYS ||
+		!sieve_code_stringlist_is_literal(key_list, &address) ) {
+		sieve_binary_cache_insert(renv->sbin, cache_key, NULL, NULL);
+		return 0;
+	}
+
+	if ( mcht_is_key_set_build(mctx, key_list, ctx->casemap, &kset) < 0 )
+		return -1;
+
+	sieve_binary_cache_insert(renv->sbin, cache_key, kset,
+		mcht_is_key_set_free);
+	ctx->key_set = kset;
+	return 0;
+}
+
+static int mcht_is_match_keys
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	struct sieve_stringlist *key_list)
+{
+	struct mcht_is_context *ctx = (struct mcht_is_context *)mctx->data;
+	struct mcht_is_key_set *kset;
+	struct mcht_is_key vkey;
+	string_t *key_item = NULL;
+	int match, ret;
+
+	if ( !ctx->key_set_checked ) {
+		T_BEGIN {
+			ret = mcht_is_get_key_set(mctx, key_list);
+		} T_END;
+		if ( ret < 0 )
+			return -1;
+	}
+
+	if ( (kset=ctx->key_set) != NULL ) {
+		T_BEGIN {
+			if ( val_size == 0 ) {
+				match = ( kset->empty_key ? 1 : 0 );
+			} else {
+				mcht_is_key_init(&vkey, kset->casemap,
+					(const unsigned char *)val, val_size,
+					( kset->casemap ? t_malloc(val_size) : NULL ));
+				match = ( hash_table_lookup(kset->keys, &vkey) != NULL ? 1 : 0 );
+			}
+		} T_END;
+
+		if ( mctx->trace ) {
+			sieve_runtime_trace(mctx->runenv, 0,
+				"with key set of %u key(s) => %d",
+				hash_table_count(kset->keys) +
+					( kset->empty_key ? 1 : 0 ), match);
+		}
+		return match;
+	}
+
+	/* Default key match loop */
+	match = 0;
+	while ( match == 0 &&
+		(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		match = mcht_is_match_key
+			(mctx, val, val_size, str_c(key_item), str_len(key_item));
+
+		if ( mctx->trace ) {
+			sieve_runtime_trace(mctx->runenv, 0,
+				"with key `%s' => %d", str_sanitize(str_c(key_item), 80),
+				match);
+		}
+	}
+
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		return -1;
+	}
+
+	return match;
+}
+
 static int mcht_is_match_key
 (struct sieve_match_context *mctx ATTR_UNUSED,
 	const char *val, size_t val_size,
@@ -49,4 +322,3 @@ static int mcht_is_match_key
 
 	return FALSE;
 }
-
@@ -5,22 +5,41 @@
  */
 
 #include "lib.h"
+#include "array.h"
 #include "str.h"
+#include "str-sanitize.h"
 
+#include "sieve-common.h"
+#include "sieve-stringlist.h"
+#include "sieve-runtime-trace.h"
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
+#include "sieve-match-automaton.h"
 #include "sieve-match.h"
 
 #include <string.h>
 #include <stdio.h>
 
+/*
+ * Configuration
+ */
+
+/* Key lists with at least this many keys are pre-filtered using an automaton
+   that searches the literal parts of all keys in one pass over the value. */
+#define MCHT_MATCHES_COMBINED_MIN_KEYS 4
+
 /*
  * Forward declarations
  */
 
+static void mcht_matches_match_init(struct sieve_match_context *mctx);
+static int mcht_matches_match_keys
+	(struct sieve_match_context *mctx, const char *val, size_t val_size,
+		struct sieve_stringlist *key_list);
 static int mcht_matches_match_key
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
 		const char *key, size_t key_size);
+static void mcht_matches_match_deinit(struct sieve_match_context *mctx);
 
 /*
  * Match-type object
@@ -30,11 +49,459 @@ const struct sieve_match_type_def matches_match_type = {
 	SIEVE_OBJECT("matches",
 		&match_type_operand, SIEVE_MATCH_TYPE_MATCHES),
 	.validate_context = sieve_match_substring_validate_context,
-	.match_key = mcht_matches_match_key
+	.match_init = mcht_matches_match_init,
+	.match_keys = mcht_matches_match_keys,
+	.match_key = mcht_matches_match_key,
+	.match_deinit = mcht_matches_match_deinit
+};
+
+/*
+ * Compiled patterns
+ */
+
+/* A pattern is compiled into a list of fixed-length segments separated by
+ * '*' wildcards:
+ *
+ *   <segment 0> * <segment 1> * ... * <segment n>
+ *
+ * Segment 0 is anchored at the beginning of the value and, when the pattern
+ * contains at least one '*', segment n is anchored at its end. The segments in
+ * between are matched at the leftmost possible position, which yields the
+ * same match values as the interpreting implementation below. Within a
+ * segment, '?' wildcards are marked in the wild[] array.
+ */
+
+struct mcht_matches_segment {
+	const unsigned char *chars;
+	const bool *wild;
+	size_t size;
+};
+
+struct mcht_matches_key {
+	const char *key;
+	size_t key_size;
+
+	struct mcht_matches_segment *segments;
+	unsigned int segment_count;
+
+	/* Sum of all segment sizes: values shorter than this never match */
+	size_t min_size;
+	/* Number of wildcards, i.e. the number of produced match values */
+	unsigned int wildcards;
+
+	/* Key must be tried for every value (no literal part to search for) */
+	unsigned int unfiltered:1;
 };
 
+struct mcht_matches_context {
+	unsigned char fold[256];
+
+	ARRAY(struct mcht_matches_key) keys;
+
+	/* Combined mode: searches the longest literal run of each key */
+	struct sieve_match_automaton *automaton;
+	bool *candidates;
+
+	unsigned int keys_read:1;
+	unsigned int generic:1;
+};
+
+struct mcht_matches_capture {
+	size_t offset, size;
+	bool single;
+};
+
+static void mcht_matches_match_init
+(struct sieve_match_context *mctx)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_matches_context *ctx;
+	unsigned int i;
+
+	ctx = p_new(mctx->pool, struct mcht_matches_context, 1);
+	p_array_init(&ctx->keys, mctx->pool, 8);
+
+	if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) ) {
+		for ( i = 0; i < 256; i++ )
+			ctx->fold[i] = (unsigned char)i_tolower(i);
+	} else if ( sieve_comparator_is(cmp, i_octet_comparator) ) {
+		for ( i = 0; i < 256; i++ )
+			ctx->fold[i] = (unsigned char)i;
+	} else {
+		/* Unknown (extension) comparator; use its char_match() */
+		ctx->generic = TRUE;
+	}
+
+	mctx->data = (void *)ctx;
+}
+
+static void mcht_matches_match_deinit
+(struct sieve_match_context *mctx)
+{
+	struct mcht_matches_context *ctx =
+		(struct mcht_matches_context *)mctx->data;
+
+	if ( ctx->automaton != NULL )
+		sieve_match_automaton_free(&ctx->automaton);
+}
+
+static void mcht_matches_segment_finish
+(pool_t pool, buffer_t *chars, buffer_t *wild,
+	struct mcht_matches_segment *seg)
+{
+	seg->size = chars->used;
+	if ( seg->size > 0 ) {
+		seg->chars = p_memdup(pool, chars->data, chars->used);
+		seg->wild = p_memdup(pool, wild->data, wild->used);
+	}
+	buffer_set_used_size(chars, 0);
+	buffer_set_used_size(wild, 0);
+}
+
+static void mcht_matches_key_compile
+(struct sieve_match_context *mctx, struct mcht_matches_key *mkey,
+	size_t *anchor_offset_r, size_t *anchor_size_r, unsigned int *anchor_seg_r)
+{
+	struct mcht_matches_context *ctx =
+		(struct mcht_matches_context *)mctx->data;
+	const unsigned char *kp = (const unsigned char *)mkey->key;
+	const unsigned char *kend = kp + mkey->key_size;
+	ARRAY(struct mcht_matches_segment) segs;
+	struct mcht_matches_segment *seg;
+	buffer_t *chars, *wild;
+	size_t run = 0, best_run = 0;
+	unsigned int i;
+
+	t_array_init(&segs, 8);
+	chars = buffer_create_dynamic(pool_datastack_create(), 64);
+	wild = buffer_create_dynamic(pool_datastack_create(), 64);
+
+	*anchor_offset_r = *anchor_size_r = 0;
+	*anchor_seg_r = 0;
+
+	while ( kp < kend ) {
+		bool is_wild = FALSE;
+		unsigned char c = *kp++;
+
+		switch ( c ) {
+		case '*':
+			seg = array_append_space(&segs);
+			mcht_matches_segment_finish(mctx->pool, chars, wild, seg);
+			mkey->wildcards++;
+			run = 0;
+			continue;
+		case '?':
+			is_wild = TRUE;
+			c = '\0';
+			mkey->wildcards++;
+			break;
+		case '\\':
+			if ( kp < kend )
+				c = *kp++;
+			break;
+		default:
+			break;
+		}
+
+		c = ctx->fold[c];
+		buffer_append_c(chars, c);
+		buffer_append(wild, &is_wild, sizeof(is_wild));
+
+		/* Track the longest literal run for the combined mode */
+		if ( is_wild ) {
+			run = 0;
+		} else if ( ++run > best_run ) {
+			best_run = run;
+			*anchor_seg_r = array_count(&segs);
+			*anchor_offset_r = chars->used - run;
+			*anchor_size_r = run;
+		}
+	}
+	seg = array_append_space(&segs);
+	mcht_matches_segment_finish(mctx->pool, chars, wild, seg);
+
+	mkey->segments = p_new(mctx->pool, struct mcht_matches_segment,
+		array_count(&segs));
+	mkey->segment_count = array_count(&segs);
+	memcpy(mkey->segments, array_idx(&segs, 0),
+		sizeof(*mkey->segments) * mkey->segment_count);
+
+	for ( i = 0; i < mkey->segment_count; i++ )
+		mkey->min_size += mkey->segments[i].size;
+}
+
+static inline bool mcht_matches_segment_match
+(const struct mcht_matches_context *ctx,
+	const struct mcht_matches_segment *seg, const unsigned char *val)
+{
+	const unsigned char *fold = ctx->fold;
+	size_t i;
+
+	for ( i = 0; i < seg->size; i++ ) {
+		if ( !seg->wild[i] && fold[val[i]] != seg->chars[i] )
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void mcht_matches_segment_capture
+(const struct mcht_matches_segment *seg, size_t offset,
+	struct mcht_matches_capture **capp)
+{
+	size_t i;
+
+	for ( i = 0; i < seg->size; i++ ) {
+		if ( seg->wild[i] ) {
+			(*capp)->offset = offset + i;
+			(*capp)->size = 1;
+			(*capp)->single = TRUE;
+			(*capp)++;
+		}
+	}
+}
+
+static bool mcht_matches_key_match
+(const struct mcht_matches_context *ctx, const struct mcht_matches_key *mkey,
+	const unsigned char *val, size_t val_size,
+	struct mcht_matches_capture *captures)
+{
+	const struct mcht_matches_segment *segs = mkey->segments;
+	const struct mcht_matches_segment *last;
+	struct mcht_matches_capture *cap = captures;
+	size_t pos, end, remain;
+	unsigned int i;
+
+	if ( val_size < mkey->min_size )
+		return FALSE;
+
+	/* No '*': the value must match segment 0 exactly */
+	if ( mkey->segment_count == 1 ) {
+		if ( val_size != segs[0].size ||
+			!mcht_matches_segment_match(ctx, &segs[0], val) )
+			return FALSE;
+		if ( cap != NULL )
+			mcht_matches_segment_capture(&segs[0], 0, &cap);
+		return TRUE;
+	}
+
+	/* Fast reject on the anchored prefix and suffix */
+	last = &segs[mkey->segment_count-1];
+	end = val_size - last->size;
+	if ( !mcht_matches_segment_match(ctx, &segs[0], val) ||
+		!mcht_matches_segment_match(ctx, last, val + end) )
+		return FALSE;
+
+	if ( cap != NULL )
+		mcht_matches_segment_capture(&segs[0], 0, &cap);
+
+	/* Find the segments in between at their leftmost position */
+	pos = segs[0].size;
+	remain = mkey->min_size - segs[0].size - last->size;
+	for ( i = 1; i < mkey->segment_count - 1; i++ ) {
+		const struct mcht_matches_segment *seg = &segs[i];
+		size_t start = pos;
+
+		remain -= seg->size;
+		for (;;) {
+			if ( pos + seg->size + remain > end )
+				return FALSE;
+			if ( mcht_matches_segment_match(ctx, seg, val + pos) )
+				break;
+			pos++;
+		}
+
+		if ( cap != NULL ) {
+			cap->offset = start;
+			cap->size = pos - start;
+			cap->single = FALSE;
+			cap++;
+			mcht_matches_segment_capture(seg, pos, &cap);
+		}
+		pos += seg->size;
+	}
+
+	if ( cap != NULL ) {
+		cap->offset = pos;
+		cap->size = end - pos;
+		cap->single = FALSE;
+		cap++;
+		mcht_matches_segment_capture(last, end, &cap);
+	}
+	return TRUE;
+}
+
+static void mcht_matches_values_set
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	const struct mcht_matches_capture *captures, unsigned int count)
+{
+	struct sieve_match_values *mvalues;
+	string_t *mvalue;
+	unsigned int i;
+
+	if ( (mvalues = sieve_match_values_start(mctx->runenv)) == NULL )
+		return;
+
+	T_BEGIN {
+		mvalue = t_str_new(32);
+
+		/* ${0} */
+		str_append_n(mvalue, val, val_size);
+		sieve_match_values_add(mvalues, mvalue);
+
+		for ( i = 0; i < count; i++ ) {
+			if ( captures[i].single ) {
+				sieve_match_values_add_char
+					(mvalues, val[captures[i].offset]);
+			} else {
+				str_truncate(mvalue, 0);
+				str_append_n(mvalue, val + captures[i].offset, captures[i].size);
+				sieve_match_values_add(mvalues, mvalue);
+			}
+		}
+
+		sieve_match_values_commit(mctx->runenv, &mvalues);
+	} T_END;
+}
+
+static int mcht_matches_read_keys
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	struct mcht_matches_context *ctx =
+		(struct mcht_matches_context *)mctx->data;
+	struct mcht_matches_key *mkey;
+	string_t *key_item = NULL;
+	unsigned int count, i;
+	int ret;
+
+	while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		mkey = array_append_space(&ctx->keys);
+		mkey->key_size = str_len(key_item);
+		mkey->key = p_memdup(mctx->pool, str_c(key_item), mkey->key_size + 1);
+	}
+
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		return -1;
+	}
+
+	ctx->keys_read = TRUE;
+	if ( ctx->generic )
+		return 0;
+
+	mkey = array_get_modifiable(&ctx->keys, &count);
+	if ( count >= MCHT_MATCHES_COMBINED_MIN_KEYS ) {
+		ctx->automaton = sieve_match_automaton_create(ctx->fold);
+		ctx->candidates = p_new(mctx->pool, bool, count);
+	}
+
+	for ( i = 0; i < count; i++ ) T_BEGIN {
+		size_t anchor_offset, anchor_size;
+		unsigned int anchor_seg;
+
+		mcht_matches_key_compile(mctx, &mkey[i],
+			&anchor_offset, &anchor_size, &anchor_seg);
+
+		if ( ctx->automaton == NULL )
+			;
+		else if ( anchor_size == 0 )
+			mkey[i].unfiltered = TRUE;
+		else {
+			sieve_match_automaton_add(ctx->automaton,
+				mkey[i].segments[anchor_seg].chars + anchor_offset,
+				anchor_size, i);
+		}
+	} T_END;
+
+	if ( ctx->automaton != NULL )
+		sieve_match_automaton_compile(ctx->automaton);
+	return 0;
+}
+
+static bool mcht_matches_candidate_found(void *context, unsigned int key_id)
+{
+	struct mcht_matches_context *ctx = (struct mcht_matches_context *)context;
+
+	ctx->candidates[key_id] = TRUE;
+	return FALSE;
+}
+
+static int mcht_matches_match_keys
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	struct sieve_stringlist *key_list)
+{
+	struct mcht_matches_context *ctx =
+		(struct mcht_matches_context *)mctx->data;
+	const unsigned char *uval = (const unsigned char *)val;
+	const struct mcht_matches_key *mkeys;
+	struct mcht_matches_capture *captures = NULL;
+	unsigned int count, i, found = 0;
+
+	if ( !ctx->keys_read && mcht_matches_read_keys(mctx, key_list) < 0 )
+		return -1;
+
+	mkeys = array_get(&ctx->keys, &count);
+
+	if ( ctx->generic ) {
+		for ( i = 0; i < count && found == 0; i++ ) T_BEGIN {
+			if ( mcht_matches_match_key(mctx, val, val_size,
+				mkeys[i].key, mkeys[i].key_size) > 0 )
+				found = i + 1;
+		} T_END;
+	} else {
+		bool mvalues = sieve_match_values_are_enabled(mctx->runenv);
+
+		if ( ctx->automaton != NULL ) {
+			unsigned int state = 0;
+
+			memset(ctx->candidates, 0, sizeof(bool) * count);
+			(void)sieve_match_automaton_scan(ctx->automaton, &state,
+				uval, val_size, mcht_matches_candidate_found, ctx);
+		}
+
+		for ( i = 0; i < count && found == 0; i++ ) {
+			if ( ctx->automaton != NULL &&
+				!mkeys[i].unfiltered && !ctx->candidates[i] )
+				continue;
+
+			if ( mvalues && captures == NULL ) {
+				unsigned int max = 0, j;
+
+				for ( j = 0; j < count; j++ ) {
+					if ( mkeys[j].wildcards > max )
+						max = mkeys[j].wildcards;
+				}
+				captures = t_new(struct mcht_matches_capture, max + 1);
+			}
+
+			if ( mcht_matches_key_match
+				(ctx, &mkeys[i], uval, val_size, captures) ) {
+				found = i + 1;
+				if ( mvalues ) {
+					mcht_matches_values_set
+						(mctx, val, val_size, captures, mkeys[i].wildcards);
+				}
+			}
+		}
+	}
+
+	if ( mctx->trace ) {
+		if ( found > 0 ) {
+			sieve_runtime_trace(mctx->runenv, 0,
+				"with key `%s' => 1", str_sanitize(t_strndup
+					(mkeys[found-1].key, mkeys[found-1].key_size), 80));
+		} else {
+			sieve_runtime_trace(mctx->runenv, 0,
+				"with %u key(s) => 0", count);
+		}
+	}
+
+	return ( found > 0 ? 1 : 0 );
+}
+
 /*
- * Match-type implementation
+ * Interpreting implementation
+ *
+ * Used for comparators other than i;octet and i;ascii-casemap.
  */
 
 /* Quick 'n dirty debug */
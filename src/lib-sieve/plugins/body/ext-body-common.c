@@ -14,6 +14,7 @@
 #include "sieve-code.h"
 #include "sieve-message.h"
 #include "sieve-interpreter.h"
+#include "sieve-match.h"
 
 #include "ext-body-common.h"
 
@@ -100,3 +101,91 @@ static void ext_body_stringlist_reset
 
 	strlist->body_parts_iter = strlist->body_parts;
 }
+
+/*
+ * Streamed body matching
+ */
+
+struct ext_body_stream_context {
+	struct sieve_match_context *mctx;
+	struct sieve_stringlist *key_list;
+};
+
+static int ext_body_stream_part_begin
+(void *context, const struct sieve_message_part_data *part ATTR_UNUSED)
+{
+	struct ext_body_stream_context *sctx =
+		(struct ext_body_stream_context *)context;
+
+	return sieve_match_value_begin(sctx->mctx, sctx->key_list);
+}
+
+static int ext_body_stream_part_more
+(void *context, const unsigned char *data, size_t size)
+{
+	struct ext_body_stream_context *sctx =
+		(struct ext_body_stream_context *)context;
+
+	return sieve_match_value_more(sctx->mctx, (const char *)data, size);
+}
+
+static int ext_body_stream_part_end(void *context)
+{
+	struct ext_body_stream_context *sctx =
+		(struct ext_body_stream_context *)context;
+
+	/* Any matching part determines the result */
+	return ( sieve_match_value_end(sctx->mctx) != 0 ? 1 : 0 );
+}
+
+static const struct sieve_message_body_stream_callbacks
+ext_body_stream_callbacks = {
+	ext_body_stream_part_begin,
+	ext_body_stream_part_more,
+	ext_body_stream_part_end
+};
+
+int ext_body_stream_match
+(const struct sieve_runtime_env *renv, enum tst_body_transform transform,
+	const char * const *content_types,
+	const struct sieve_match_type *mcht,
+	const struct sieve_comparator *cmp,
+	struct sieve_stringlist *key_list, int *exec_status)
+{
+	static const char * const _no_content_types[] = { "", NULL };
+	struct ext_body_stream_context sctx;
+	int match, ret;
+
+	*exec_status = SIEVE_EXEC_OK;
+
+	if ( content_types == NULL ) content_types = _no_content_types;
+
+	memset(&sctx, 0, sizeof(sctx));
+	sctx.key_list = key_list;
+	if ( (sctx.mctx=sieve_match_begin(renv, mcht, cmp)) == NULL )
+		return 0;
+
+	switch ( transform ) {
+	case TST_BODY_TRANSFORM_RAW:
+		ret = sieve_message_body_stream_raw
+			(renv, &ext_body_stream_callbacks, &sctx);
+		break;
+	case TST_BODY_TRANSFORM_CONTENT:
+		ret = sieve_message_body_stream_content
+			(renv, content_types, &ext_body_stream_callbacks, &sctx);
+		break;
+	case TST_BODY_TRANSFORM_TEXT:
+		ret = sieve_message_body_stream_text
+			(renv, &ext_body_stream_callbacks, &sctx);
+		break;
+	default:
+		i_unreached();
+	}
+
+	match = sieve_match_end(&sctx.mctx, exec_status);
+	if ( ret <= 0 ) {
+		*exec_status = ret;
+		return -1;
+	}
+	return match;
+}
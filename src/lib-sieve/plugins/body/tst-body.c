@@ -362,16 +362,25 @@ static int ext_body_operation_execute
 
 	sieve_runtime_trace(renv, SIEVE_TRLVL_TESTS, "body test");
 
-	/* Extract requested parts */
-	if ( (ret=ext_body_get_part_list(renv,
-		(enum tst_body_transform) transform, content_types,&value_list)) <= 0 )
-		return ret;
+	if ( sieve_match_type_can_stream(&mcht) ) {
+		/* Disable match values processing as required by RFC */
+		mvalues_active = sieve_match_values_set_enabled(renv, FALSE);
+
+		/* Match the body parts while these are read */
+		match = ext_body_stream_match(renv, (enum tst_body_transform) transform,
+			content_types, &mcht, &cmp, key_list, &ret);
+	} else {
+		/* Extract requested parts */
+		if ( (ret=ext_body_get_part_list(renv,
+			(enum tst_body_transform) transform, content_types,&value_list)) <= 0 )
+			return ret;
 
-	/* Disable match values processing as required by RFC */
-	mvalues_active = sieve_match_values_set_enabled(renv, FALSE);
+		/* Disable match values processing as required by RFC */
+		mvalues_active = sieve_match_values_set_enabled(renv, FALSE);
 
-	/* Perform match */
-	match = sieve_match(renv, &mcht, &cmp, value_list, key_list, &ret);
+		/* Perform match */
+		match = sieve_match(renv, &mcht, &cmp, value_list, key_list, &ret);
+	}
 
 	/* Restore match values processing */
 	(void)sieve_match_values_set_enabled(renv, mvalues_active);
@@ -313,6 +313,10 @@ static bool cmd_notify_validate
 	if ( !sieve_validator_argument_activate(valdtr, cmd, arg, FALSE) )
 		return FALSE;
 
+	/* Which header fields are read depends on the notification method, which
+	   may only be known at runtime */
+	sieve_ast_header_field_add(sieve_validator_ast(valdtr), NULL);
+
 	return ext_enotify_compile_check_arguments
 		(valdtr, cmd, arg, ctx_data->message, ctx_data->from, ctx_data->options);
 }
@@ -366,10 +366,15 @@ static bool opc_include_dump
 	included = ext_include_binary_script_get_included(binctx, include_id);
 	if ( included == NULL )
 		return FALSE;
+	(void)ext_include_binary_script_resolve
+		(denv->oprtn->ext, binctx, include_id);
 
 	sieve_code_descend(denv);
 	sieve_code_dumpf(denv, "script: `%s' from %s %s%s[ID: %d, BLOCK: %d]",
-		sieve_script_name(included->script), sieve_script_location(included->script),
+		included->script_name,
+		( included->script == NULL ?
+			ext_include_script_location_name(included->location) :
+			sieve_script_location(included->script) ),
 		(flags & EXT_INCLUDE_FLAG_ONCE ? "(once) " : ""), 
 		(flags & EXT_INCLUDE_FLAG_OPTIONAL ? "(optional) " : ""), include_id,
 		sieve_binary_block_get_id(included->block));
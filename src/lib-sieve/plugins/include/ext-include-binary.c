@@ -125,10 +125,10 @@ struct ext_include_binary_context *ext_include_binary_init
  * Script inclusion
  */
 
-struct ext_include_script_info *ext_include_binary_script_include
-(struct ext_include_binary_context *binctx, 
+static struct ext_include_script_info *ext_include_binary_script_add
+(struct ext_include_binary_context *binctx,
 	enum ext_include_script_location location, enum ext_include_flags flags,
-	struct sieve_script *script,	struct sieve_binary_block *inc_block)
+	const char *script_name, struct sieve_binary_block *inc_block)
 {
 	pool_t pool = sieve_binary_pool(binctx->binary);
 	struct ext_include_script_info *incscript;
@@ -137,14 +137,29 @@ struct ext_include_script_info *ext_include_binary_script_include
 	incscript->id = array_count(&binctx->include_index)+1;
 	incscript->location = location;
 	incscript->flags = flags;
-	incscript->script = script;
+	incscript->script_name = p_strdup(pool, script_name);
 	incscript->block = inc_block;
 
+	array_append(&binctx->include_index, &incscript, 1);
+
+	return incscript;
+}
+
+struct ext_include_script_info *ext_include_binary_script_include
+(struct ext_include_binary_context *binctx, 
+	enum ext_include_script_location location, enum ext_include_flags flags,
+	struct sieve_script *script,	struct sieve_binary_block *inc_block)
+{
+	struct ext_include_script_info *incscript;
+
+	incscript = ext_include_binary_script_add
+		(binctx, location, flags, sieve_script_name(script), inc_block);
+	incscript->script = script;
+
 	/* Unreferenced on binary_free */
 	sieve_script_ref(script);
 
 	hash_table_insert(binctx->included_scripts, script, incscript);
-	array_append(&binctx->include_index, &incscript, 1);
 
 	return incscript;
 }
@@ -184,6 +199,34 @@ unsigned int ext_include_binary_script_get_count
 	return array_count(&binctx->include_index);
 }
 
+int ext_include_binary_script_resolve
+(const struct sieve_extension *this_ext,
+	struct ext_include_binary_context *binctx, unsigned int include_id)
+{
+	struct ext_include_script_info *const *sinfo;
+	struct ext_include_script_info *incscript;
+	struct ext_include_dependency *dep;
+
+	i_assert( include_id > 0 &&
+		(include_id - 1) < array_count(&binctx->include_index) );
+
+	sinfo = array_idx(&binctx->include_index, include_id - 1);
+	incscript = *sinfo;
+	if ( incscript->script != NULL )
+		return 0;
+
+	/* Only the script object is needed here; whether it changed was
+	   already checked when the binary was found to be up-to-date */
+	dep = ext_include_dependency_lookup
+		(this_ext, incscript->location, incscript->script_name);
+	if ( dep->script == NULL )
+		return -1;
+
+	incscript->script = dep->script;
+	sieve_script_ref(incscript->script);
+	return 0;
+}
+
 /*
  * Variables
  */
@@ -210,6 +253,7 @@ static bool ext_include_binary_pre_save
 		(struct ext_include_binary_context *) context;
 	struct ext_include_script_info *const *scripts;
 	struct sieve_binary_block *sblock = binctx->dependency_block;
+	sieve_size_t meta_address;
 	unsigned int script_count, i;
 	bool result = TRUE;
 
@@ -231,7 +275,14 @@ static bool ext_include_binary_pre_save
 		sieve_binary_emit_byte(sblock, incscript->location);
 		sieve_binary_emit_cstring(sblock, sieve_script_name(incscript->script));
 		sieve_binary_emit_byte(sblock, incscript->flags);
+
+		/* The metadata is prefixed with its size, so that the dependency
+		   block can be read without resolving the script */
+		meta_address = sieve_binary_emit_offset(sblock, 0);
+		incscript->metadata_offset = sieve_binary_block_get_size(sblock);
 		sieve_script_binary_write_metadata(incscript->script, sblock);
+		incscript->metadata_end = sieve_binary_block_get_size(sblock);
+		sieve_binary_resolve_offset(sblock, meta_address);
 	}
 
 	result = ext_include_variables_save(sblock, binctx->global_vars, error_r);
@@ -253,6 +304,7 @@ static bool ext_include_binary_open
 
 	sblock = sieve_binary_extension_get_block(sbin, ext);
 	block_id = sieve_binary_block_get_id(sblock);
+	binctx->dependency_block = sblock;
 
 	offset = 0;
 
@@ -272,16 +324,17 @@ static bool ext_include_binary_open
 		return FALSE;
 	}
 
-	/* Read dependencies */
+	/* Read dependencies; the included scripts themselves are only resolved
+	   when the binary is checked for being up-to-date or when an include is
+	   executed */
 	for ( i = 0; i < depcount; i++ ) {
+		struct ext_include_script_info *incscript;
 		unsigned int inc_block_id;
 		struct sieve_binary_block *inc_block = NULL;
 		unsigned int location, flags;
 		string_t *script_name;
-		struct sieve_storage *storage;
-		struct sieve_script *script;
-		enum sieve_error error;
-		int ret;
+		sieve_size_t meta_address;
+		sieve_offset_t meta_size;
 
 		if (
 			!sieve_binary_read_unsigned(sblock, &offset, &inc_block_id) ||
@@ -296,6 +349,18 @@ static bool ext_include_binary_open
 			return FALSE;
 		}
 
+		meta_address = offset;
+		if ( !sieve_binary_read_offset(sblock, &offset, &meta_size) ||
+			meta_size < (offset - meta_address) ||
+			meta_address + meta_size > sieve_binary_block_get_size(sblock) ) {
+			/* Binary is corrupt, recompile */
+			sieve_sys_error(svinst,
+				"include: dependency block %d of binary %s "
+				"contains invalid script metadata for script %s",
+				block_id, sieve_binary_path(sbin), str_c(script_name));
+			return FALSE;
+		}
+
 		if ( inc_block_id != 0 &&
 			(inc_block=sieve_binary_block_get(sbin, inc_block_id)) == NULL ) {
 			sieve_sys_error(svinst,
@@ -314,88 +379,136 @@ static bool ext_include_binary_open
 			return FALSE;
 		}
 
-		/* Can we find the script dependency ? */
-		storage = ext_include_get_script_storage
-			(ext, location, str_c(script_name), NULL);
-		if ( storage == NULL ) {
-			/* No, recompile */
-			// FIXME: handle ':optional' in this case
-			return FALSE;
-		}
+		incscript = ext_include_binary_script_add
+			(binctx, location, flags, str_c(script_name), inc_block);
+		incscript->metadata_offset = offset;
+		incscript->metadata_end = meta_address + meta_size;
+
+		offset = incscript->metadata_end;
+	}
+
+	if ( !ext_include_variables_load
+		(ext, sblock, &offset, &binctx->global_vars) )
+		return FALSE;
+
+	return TRUE;
+}
 
-		/* Can we open the script dependency ? */
-		script = sieve_storage_get_script
-			(storage, str_c(script_name), &error);
-		if ( script == NULL ) {
+static bool ext_include_binary_check_dependency
+(struct ext_include_binary_context *binctx,
+	struct ext_include_script_info *incscript,
+	struct ext_include_dependency *dep)
+{
+	struct sieve_binary *sbin = binctx->binary;
+	struct sieve_instance *svinst = sieve_binary_svinst(sbin);
+	sieve_size_t offset;
+	int ret;
+
+	/* Can we find and open the script dependency ? */
+	if ( dep->script == NULL ) {
+		/* No, recompile */
+		// FIXME: handle ':optional' in this case
+		return FALSE;
+	}
+	if ( dep->error != SIEVE_ERROR_NONE ) {
+		if ( dep->error != SIEVE_ERROR_NOT_FOUND ) {
 			/* No, recompile */
 			return FALSE;
 		}
-		if ( sieve_script_open(script, &error) < 0 ) {
-			if ( error != SIEVE_ERROR_NOT_FOUND ) {
-				/* No, recompile */
-				return FALSE;
-			}
 
-			if ( (flags & EXT_INCLUDE_FLAG_OPTIONAL) == 0 ) {
-				/* Not supposed to be missing, recompile */
-				if ( svinst->debug ) {
-					sieve_sys_debug(svinst,
-						"include: script '%s' included in binary %s is missing, "
-						"so recompile", str_c(script_name), sieve_binary_path(sbin));
-				}
-				return FALSE;
-			}
-
-		} else if (inc_block == NULL) {
-			/* Script exists, but it is missing from the binary, recompile no matter
-			 * what.
-			 */
+		if ( (incscript->flags & EXT_INCLUDE_FLAG_OPTIONAL) == 0 ) {
+			/* Not supposed to be missing, recompile */
 			if ( svinst->debug ) {
 				sieve_sys_debug(svinst,
-					"include: script '%s' is missing in binary %s, but is now available, "
-					"so recompile", str_c(script_name), sieve_binary_path(sbin));
+					"include: script '%s' included in binary %s is missing, "
+					"so recompile", incscript->script_name,
+					sieve_binary_path(sbin));
 			}
-			sieve_script_unref(&script);
 			return FALSE;
 		}
 
-		/* Can we read script metadata ? */
-		if ( (ret=sieve_script_binary_read_metadata
-			(script, sblock, &offset))	< 0 ) {
-			/* Binary is corrupt, recompile */
-			sieve_sys_error(svinst,
-				"include: dependency block %d of binary %s "
-				"contains invalid script metadata for script %s",
-				block_id, sieve_binary_path(sbin), sieve_script_location(script));
-			sieve_script_unref(&script);
-			return FALSE;
+	} else if ( incscript->block == NULL ) {
+		/* Script exists, but it is missing from the binary, recompile no matter
+		 * what.
+		 */
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst,
+				"include: script '%s' is missing in binary %s, but is now available, "
+				"so recompile", incscript->script_name, sieve_binary_path(sbin));
 		}
-
-		if ( ret == 0 )
-			binctx->outdated = TRUE;
-
-		(void)ext_include_binary_script_include
-			(binctx, location, flags, script, inc_block);
-
-		sieve_script_unref(&script);
+		return FALSE;
 	}
 
-	if ( !ext_include_variables_load
-		(ext, sblock, &offset, &binctx->global_vars) )
+	/* Is the script metadata still current ? */
+	if ( incscript->metadata_end <= incscript->metadata_offset )
+		return FALSE;
+	offset = incscript->metadata_offset;
+	if ( (ret=sieve_script_binary_read_metadata
+		(dep->script, binctx->dependency_block, &offset)) < 0 ) {
+		/* Binary is corrupt, recompile */
+		sieve_sys_error(svinst,
+			"include: dependency block %d of binary %s "
+			"contains invalid script metadata for script %s",
+			sieve_binary_block_get_id(binctx->dependency_block),
+			sieve_binary_path(sbin), sieve_script_location(dep->script));
+		return FALSE;
+	}
+	if ( ret == 0 )
 		return FALSE;
 
+	if ( incscript->script != dep->script ) {
+		if ( incscript->script != NULL )
+			sieve_script_unref(&incscript->script);
+		incscript->script = dep->script;
+		sieve_script_ref(incscript->script);
+	}
 	return TRUE;
 }
 
 static bool ext_include_binary_up_to_date
-(const struct sieve_extension *ext ATTR_UNUSED,
-	struct sieve_binary *sbin ATTR_UNUSED, void *context,
-	enum sieve_compile_flags cpflags ATTR_UNUSED)
+(const struct sieve_extension *ext, struct sieve_binary *sbin ATTR_UNUSED,
+	void *context, enum sieve_compile_flags cpflags ATTR_UNUSED)
 {
+	struct ext_include_context *ext_ctx = ext_include_get_context(ext);
 	struct ext_include_binary_context *binctx =
 		(struct ext_include_binary_context *) context;
+	struct ext_include_script_info *const *scripts;
+	struct ext_include_dependency **deps;
+	unsigned int count, i;
 
-	return !binctx->outdated;
+	if ( binctx->outdated )
+		return FALSE;
+
+	scripts = array_get(&binctx->include_index, &count);
+	if ( count == 0 )
+		return TRUE;
+
+	/* Dependencies are shared with other binaries of this instance, so
+	   first collect them all and only then open the scripts that were not
+	   checked recently in a single pass */
+	deps = t_new(struct ext_include_dependency *, count);
+	for ( i = 0; i < count; i++ ) {
+		/* Binaries may be outdated with respect to global scripts when
+		   these are not checked */
+		if ( ext_ctx->no_global_check &&
+			scripts[i]->location == EXT_INCLUDE_LOCATION_GLOBAL )
+			continue;
+		deps[i] = ext_include_dependency_lookup
+			(ext, scripts[i]->location, scripts[i]->script_name);
+	}
+	for ( i = 0; i < count; i++ ) {
+		if ( deps[i] != NULL )
+			ext_include_dependency_open(deps[i]);
+	}
+
+	for ( i = 0; i < count; i++ ) {
+		if ( deps[i] != NULL && !ext_include_binary_check_dependency
+			(binctx, scripts[i], deps[i]) ) {
+			binctx->outdated = TRUE;
+			return FALSE;
+		}
+	}
+	return TRUE;
 }
 
 static void ext_include_binary_free
@@ -404,16 +517,13 @@ static void ext_include_binary_free
 {
 	struct ext_include_binary_context *binctx =
 		(struct ext_include_binary_context *) context;
-	struct hash_iterate_context *hctx;
-	struct sieve_script *script;
-	struct ext_include_script_info *incscript;
+	struct ext_include_script_info *const *incscript;
 
 	/* Release references to all included script objects */
-	hctx = hash_table_iterate_init(binctx->included_scripts);
-	while ( hash_table_iterate
-		(hctx, binctx->included_scripts, &script, &incscript) )
-		sieve_script_unref(&incscript->script);
-	hash_table_iterate_deinit(&hctx);
+	array_foreach(&binctx->include_index, incscript) {
+		if ( (*incscript)->script != NULL )
+			sieve_script_unref(&(*incscript)->script);
+	}
 
 	hash_table_destroy(&binctx->included_scripts);
 
@@ -431,28 +541,27 @@ bool ext_include_binary_dump
 	struct sieve_binary *sbin = denv->sbin;
 	struct ext_include_binary_context *binctx =
 		ext_include_binary_get_context(ext, sbin);
-	struct hash_iterate_context *hctx;
-	struct sieve_script *script;
-	struct ext_include_script_info *incscript;
+	struct ext_include_script_info *const *incscripts;
+	unsigned int count, i;
 
 	if ( !ext_include_variables_dump(denv, binctx->global_vars) )
 		return FALSE;
 
-	hctx = hash_table_iterate_init(binctx->included_scripts);
-	while ( hash_table_iterate
-		(hctx, binctx->included_scripts, &script, &incscript) ) {
+	incscripts = array_get(&binctx->include_index, &count);
+	for ( i = 0; i < count; i++ ) {
+		struct ext_include_script_info *incscript = incscripts[i];
 
 		if ( incscript->block == NULL ) {
 			sieve_binary_dump_sectionf(denv, "Included %s script '%s' (MISSING)",
 				ext_include_script_location_name(incscript->location),
-				sieve_script_name(incscript->script));
+				incscript->script_name);
 
 		} else {
 			unsigned int block_id = sieve_binary_block_get_id(incscript->block);
 
 			sieve_binary_dump_sectionf(denv, "Included %s script '%s' (block: %d)",
 				ext_include_script_location_name(incscript->location),
-				sieve_script_name(incscript->script), block_id);
+				incscript->script_name, block_id);
 
 			denv->sblock = incscript->block;
 			denv->cdumper = sieve_code_dumper_create(denv);
@@ -464,7 +573,6 @@ bool ext_include_binary_dump
 			sieve_code_dumper_free(&(denv->cdumper));
 		}
 	}
-	hash_table_iterate_deinit(&hctx);
 
 	return TRUE;
 }
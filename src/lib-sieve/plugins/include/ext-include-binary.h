@@ -32,11 +32,17 @@ struct sieve_variable_scope_binary *ext_include_binary_get_global_scope
 struct ext_include_script_info {
 	unsigned int id;
 
+	/* For binaries loaded from disk, the script object is only resolved
+	   once it is needed; until then it is NULL */
 	struct sieve_script *script;
+	const char *script_name;
 	enum ext_include_flags flags;
 	enum ext_include_script_location location;
 
 	struct sieve_binary_block *block;
+
+	/* Script metadata range in the dependency block */
+	sieve_size_t metadata_offset, metadata_end;
 };
 
 struct ext_include_script_info *ext_include_binary_script_include
@@ -53,6 +59,10 @@ const struct ext_include_script_info *ext_include_binary_script_get
 unsigned int ext_include_binary_script_get_count
 	(struct ext_include_binary_context *binctx);
 
+int ext_include_binary_script_resolve
+	(const struct sieve_extension *this_ext,
+		struct ext_include_binary_context *binctx, unsigned int include_id);
+
 /*
  * Dumping the binary
  */
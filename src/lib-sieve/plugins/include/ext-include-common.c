@@ -3,6 +3,8 @@
 
 #include "lib.h"
 #include "array.h"
+#include "hash.h"
+#include "ioloop.h"
 #include "str-sanitize.h"
 #include "home-expand.h"
 
@@ -78,6 +80,7 @@ bool ext_include_load
 	struct ext_include_context *ctx;
 	const char *location;
 	unsigned long long int uint_setting;
+	bool bool_setting;
 
 	if ( *context != NULL ) {
 		ext_include_unload(ext);
@@ -97,6 +100,8 @@ bool ext_include_load
 
 	ctx->global_location = i_strdup(location);
 
+	hash_table_create(&ctx->dependencies, default_pool, 0, str_hash, strcmp);
+
 	/* Get limits */
 	ctx->max_nesting_depth = EXT_INCLUDE_DEFAULT_MAX_NESTING_DEPTH;
 	ctx->max_includes = EXT_INCLUDE_DEFAULT_MAX_INCLUDES;
@@ -111,6 +116,10 @@ bool ext_include_load
 		ctx->max_includes = (unsigned int) uint_setting;
 	}
 
+	if ( sieve_setting_get_bool_value
+		(svinst, "sieve_include_global_check", &bool_setting) )
+		ctx->no_global_check = !bool_setting;
+
 	/* Extension dependencies */
 	ctx->var_ext = sieve_ext_variables_get_extension(ext->svinst);
 
@@ -119,12 +128,38 @@ bool ext_include_load
 	return TRUE;
 }
 
+static void ext_include_dependencies_clear
+(struct ext_include_context *ctx, bool all)
+{
+	struct hash_iterate_context *hctx;
+	struct ext_include_dependency *dep;
+	char *key;
+
+	hctx = hash_table_iterate_init(ctx->dependencies);
+	while ( hash_table_iterate(hctx, ctx->dependencies, &key, &dep) ) {
+		if ( !all && dep->location == EXT_INCLUDE_LOCATION_GLOBAL )
+			continue;
+
+		hash_table_remove(ctx->dependencies, key);
+		if ( dep->script != NULL )
+			sieve_script_unref(&dep->script);
+		i_free(dep->key);
+		i_free(dep->script_name);
+		i_free(dep);
+	}
+	hash_table_iterate_deinit(&hctx);
+}
+
 void ext_include_unload
 (const struct sieve_extension *ext)
 {
 	struct ext_include_context *ctx =
 		(struct ext_include_context *) ext->context;
 
+	/* Release cached dependencies before the storages they came from */
+	ext_include_dependencies_clear(ctx, TRUE);
+	hash_table_destroy(&ctx->dependencies);
+
 	if ( ctx->global_storage != NULL )
 		sieve_storage_unref(&ctx->global_storage);
 	if ( ctx->personal_storage != NULL )
@@ -134,6 +169,28 @@ void ext_include_unload
 	i_free(ctx);
 }
 
+void ext_include_reset
+(const struct sieve_extension *ext)
+{
+	struct ext_include_context *ctx =
+		(struct ext_include_context *) ext->context;
+
+	/* The personal storage and the dependencies resolved from it belong to
+	   the previous user; their keys are not qualified by the user. The
+	   global ones are kept for the next user, unless the global location is
+	   relative to the home directory. */
+	if ( ctx->global_location != NULL &&
+		strchr(ctx->global_location, '~') != NULL ) {
+		ext_include_dependencies_clear(ctx, TRUE);
+		if ( ctx->global_storage != NULL )
+			sieve_storage_unref(&ctx->global_storage);
+	} else {
+		ext_include_dependencies_clear(ctx, FALSE);
+	}
+	if ( ctx->personal_storage != NULL )
+		sieve_storage_unref(&ctx->personal_storage);
+}
+
 /*
  * Script access
  */
@@ -176,6 +233,74 @@ struct sieve_storage *ext_include_get_script_storage
 	return NULL;
 }
 
+/*
+ * Dependency cache
+ */
+
+static void ext_include_dependency_resolve
+(const struct sieve_extension *ext, struct ext_include_dependency *dep)
+{
+	struct sieve_storage *storage;
+	enum sieve_error error = SIEVE_ERROR_NONE;
+
+	if ( dep->script != NULL )
+		sieve_script_unref(&dep->script);
+	dep->error = SIEVE_ERROR_NONE;
+	dep->opened = FALSE;
+	dep->resolved = ioloop_time;
+
+	storage = ext_include_get_script_storage
+		(ext, dep->location, dep->script_name, &error);
+	if ( storage == NULL ) {
+		dep->error = error;
+		return;
+	}
+
+	dep->script = sieve_storage_get_script
+		(storage, dep->script_name, &error);
+	if ( dep->script == NULL )
+		dep->error = error;
+}
+
+struct ext_include_dependency *ext_include_dependency_lookup
+(const struct sieve_extension *ext,
+	enum ext_include_script_location location, const char *script_name)
+{
+	struct ext_include_context *ctx =
+		(struct ext_include_context *) ext->context;
+	struct ext_include_dependency *dep;
+	const char *key;
+
+	key = t_strdup_printf("%d:%s", location, script_name);
+	dep = hash_table_lookup(ctx->dependencies, key);
+	if ( dep == NULL ) {
+		dep = i_new(struct ext_include_dependency, 1);
+		dep->key = i_strdup(key);
+		dep->location = location;
+		dep->script_name = i_strdup(script_name);
+		hash_table_insert(ctx->dependencies, dep->key, dep);
+
+	} else if ( dep->resolved + EXT_INCLUDE_DEPENDENCY_CACHE_SECS >
+		ioloop_time ) {
+		return dep;
+	}
+
+	ext_include_dependency_resolve(ext, dep);
+	return dep;
+}
+
+void ext_include_dependency_open(struct ext_include_dependency *dep)
+{
+	enum sieve_error error;
+
+	if ( dep->opened || dep->script == NULL )
+		return;
+
+	dep->opened = TRUE;
+	if ( sieve_script_open(dep->script, &error) < 0 )
+		dep->error = error;
+}
+
 /*
  * AST context management
  */
@@ -659,6 +784,17 @@ int ext_include_execute_include
 		return SIEVE_EXEC_BIN_CORRUPT;
 	}
 
+	/* Binaries loaded from disk only record the names of included scripts */
+	if ( included->script == NULL &&
+		ext_include_binary_script_resolve(this_ext, binctx, include_id) < 0 ) {
+		sieve_runtime_critical(renv, NULL,
+			"failed to include script",
+			"include: failed to resolve %s script '%s' [inc id: %d]",
+			ext_include_script_location_name(included->location),
+			str_sanitize(included->script_name, 80), include_id);
+		return SIEVE_EXEC_TEMP_FAILURE;
+	}
+
 	ctx = ext_include_get_interpreter_context(this_ext, renv->interp);
 
 	block_id = sieve_binary_block_get_id(included->block);
@@ -62,6 +62,8 @@ bool ext_include_load
 	(const struct sieve_extension *ext, void **context);
 void ext_include_unload
 	(const struct sieve_extension *ext);
+void ext_include_reset
+	(const struct sieve_extension *ext);
 
 /*
  * Commands
@@ -97,6 +99,35 @@ struct sieve_storage *ext_include_get_script_storage
 	(const struct sieve_extension *ext,
 		enum ext_include_script_location location,
 		const char *script_name, enum sieve_error *error_r);
+
+/*
+ * Dependency cache
+ */
+
+/* Included scripts are resolved once per instance and shared between all
+   binaries that depend on them. An entry is re-resolved (and thereby its
+   script re-opened) when it is older than EXT_INCLUDE_DEPENDENCY_CACHE_SECS,
+   so that long-lived instances still notice changed scripts. */
+
+struct ext_include_dependency {
+	char *key;
+
+	enum ext_include_script_location location;
+	char *script_name;
+
+	/* NULL when the storage or script is unavailable */
+	struct sieve_script *script;
+	enum sieve_error error;
+	time_t resolved;
+
+	unsigned int opened:1;
+};
+
+struct ext_include_dependency *ext_include_dependency_lookup
+	(const struct sieve_extension *ext,
+		enum ext_include_script_location location, const char *script_name);
+void ext_include_dependency_open(struct ext_include_dependency *dep);
+
 /*
  * Context
  */
@@ -113,8 +144,14 @@ struct ext_include_context {
 	struct sieve_storage *global_storage;
 	struct sieve_storage *personal_storage;
 
+	HASH_TABLE(char *, struct ext_include_dependency *) dependencies;
+
 	unsigned int max_nesting_depth;
 	unsigned int max_includes;
+
+	/* Scripts included from the global location are not checked for
+	   changes once compiled into a binary; personal ones still are */
+	unsigned int no_global_check:1;
 };
 
 static inline struct ext_include_context *ext_include_get_context
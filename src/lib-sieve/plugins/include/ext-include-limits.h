@@ -9,4 +9,6 @@
 #define EXT_INCLUDE_DEFAULT_MAX_NESTING_DEPTH 10
 #define EXT_INCLUDE_DEFAULT_MAX_INCLUDES      255
 
+#define EXT_INCLUDE_DEPENDENCY_CACHE_SECS     2
+
 #endif /* __EXT_INCLUDE_LIMITS_H */
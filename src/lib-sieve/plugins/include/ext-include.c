@@ -63,10 +63,11 @@ static bool ext_include_binary_load
 
 const struct sieve_extension_def include_extension = {
 	.name = "include",
-	.version = 1,
+	.version = 2,
 
 	.load = ext_include_load,
 	.unload = ext_include_unload,
+	.reset = ext_include_reset,
 	.validator_load = ext_include_validator_load,
 	.generator_load = ext_include_generator_load,
 	.interpreter_load = ext_include_interpreter_load,
@@ -302,6 +302,14 @@ static int cmd_notify_address_validate
 	return TRUE;
 }
 
+/* Header fields read by the notify action */
+static const char *const _notify_header_fields[] = {
+	"auto-submitted",
+	"from",
+	"subject",
+	NULL
+};
+
 static bool cmd_notify_validate
 (struct sieve_validator *valdtr, struct sieve_command *cmd)
 {
@@ -334,6 +342,7 @@ static bool cmd_notify_validate
 			"no :options (and hence recipients) specified for the notify command");
 	}
 
+	sieve_command_header_fields_add(valdtr, _notify_header_fields);
 	return TRUE;
 }
 
@@ -0,0 +1,197 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "hash.h"
+#include "str.h"
+#include "time-util.h"
+
+#include "sieve-common.h"
+#include "sieve-extensions.h"
+#include "sieve-error.h"
+#include "sieve-binary.h"
+#include "sieve-runtime.h"
+
+#include "ext-regex-common.h"
+
+#include <sys/time.h>
+
+/*
+ * Configuration
+ */
+
+/* Maximum number of compiled expressions kept per binary. This prevents
+   expressions built from variables from growing the cache without bound. */
+#define EXT_REGEX_CACHE_MAX_ENTRIES 256
+
+/*
+ * Forward declarations
+ */
+
+static void ext_regex_binary_free
+	(const struct sieve_extension *ext, struct sieve_binary *sbin,
+		void *context);
+
+/*
+ * Binary regex extension
+ */
+
+const struct sieve_binary_extension regex_binary_ext = {
+	.extension = &regex_extension,
+	.binary_free = ext_regex_binary_free
+};
+
+/*
+ * Binary context management
+ */
+
+struct ext_regex_cache_entry {
+	struct ext_regex rx;
+
+	/* Error message for an invalid expression; rx is unused then */
+	const char *error;
+};
+
+struct ext_regex_binary_context {
+	pool_t pool;
+	struct sieve_binary *binary;
+
+	/* "<cflags>:<expression>" => entry */
+	HASH_TABLE(const char *, struct ext_regex_cache_entry *) regexes;
+
+	struct ext_regex_cache_stats stats;
+};
+
+static struct ext_regex_binary_context *ext_regex_binary_get_context
+(const struct sieve_extension *this_ext, struct sieve_binary *sbin,
+	bool create)
+{
+	struct ext_regex_binary_context *binctx =
+		(struct ext_regex_binary_context *)
+			sieve_binary_extension_get_context(sbin, this_ext);
+	pool_t pool;
+
+	if ( binctx != NULL || !create )
+		return binctx;
+
+	pool = pool_alloconly_create("ext_regex_binary_context", 4096);
+	binctx = p_new(pool, struct ext_regex_binary_context, 1);
+	binctx->pool = pool;
+	binctx->binary = sbin;
+	hash_table_create(&binctx->regexes, default_pool, 0, str_hash, strcmp);
+
+	sieve_binary_extension_set(sbin, this_ext, &regex_binary_ext, binctx);
+	return binctx;
+}
+
+static void ext_regex_binary_free
+(const struct sieve_extension *ext, struct sieve_binary *sbin ATTR_UNUSED,
+	void *context)
+{
+	struct ext_regex_binary_context *binctx =
+		(struct ext_regex_binary_context *) context;
+	struct hash_iterate_context *hctx;
+	const char *key;
+	struct ext_regex_cache_entry *entry;
+
+	if ( binctx == NULL )
+		return;
+
+	if ( ext->svinst->debug ) {
+		sieve_sys_debug(ext->svinst, "regex: "
+			"compiled %u expressions in %llu usecs; %u cache hits",
+			binctx->stats.compiled, binctx->stats.compile_usecs,
+			binctx->stats.hits);
+	}
+
+	hctx = hash_table_iterate_init(binctx->regexes);
+	while ( hash_table_iterate(hctx, binctx->regexes, &key, &entry) ) {
+		if ( entry->error == NULL )
+			ext_regex_free(&entry->rx);
+	}
+	hash_table_iterate_deinit(&hctx);
+
+	hash_table_destroy(&binctx->regexes);
+	pool_unref(&binctx->pool);
+}
+
+/*
+ * Cache
+ */
+
+static int ext_regex_binary_compile
+(struct ext_regex_binary_context *binctx, const struct sieve_extension *ext,
+	struct ext_regex *rx, const char *regex_str, int cflags,
+	const char **error_r)
+{
+	struct timeval start, end;
+	int ret;
+
+	if ( gettimeofday(&start, NULL) < 0 )
+		i_fatal("gettimeofday(): %m");
+
+	ret = ext_regex_compile(ext, rx, regex_str, cflags, error_r);
+
+	if ( gettimeofday(&end, NULL) < 0 )
+		i_fatal("gettimeofday(): %m");
+
+	binctx->stats.compiled++;
+	binctx->stats.compile_usecs += timeval_diff_usecs(&end, &start);
+	return ret;
+}
+
+struct ext_regex *ext_regex_binary_get_regex
+(const struct sieve_runtime_env *renv, const struct sieve_extension *ext,
+	const char *regex_str, int cflags, struct ext_regex *tmp_rx,
+	bool *cached_r, const char **error_r)
+{
+	struct ext_regex_binary_context *binctx =
+		ext_regex_binary_get_context(ext, renv->sbin, TRUE);
+	struct ext_regex_cache_entry *entry;
+	const char *key;
+
+	*cached_r = FALSE;
+	*error_r = NULL;
+
+	key = t_strdup_printf("%d:%s", cflags, regex_str);
+	entry = hash_table_lookup(binctx->regexes, key);
+	if ( entry != NULL ) {
+		binctx->stats.hits++;
+		*cached_r = TRUE;
+		if ( entry->error != NULL ) {
+			*error_r = entry->error;
+			return NULL;
+		}
+		return &entry->rx;
+	}
+
+	if ( hash_table_count(binctx->regexes) >= EXT_REGEX_CACHE_MAX_ENTRIES ) {
+		/* Cache is full; compile into caller's storage */
+		if ( ext_regex_binary_compile
+			(binctx, ext, tmp_rx, regex_str, cflags, error_r) < 0 )
+			return NULL;
+		return tmp_rx;
+	}
+
+	entry = p_new(binctx->pool, struct ext_regex_cache_entry, 1);
+	if ( ext_regex_binary_compile
+		(binctx, ext, &entry->rx, regex_str, cflags, error_r) < 0 )
+		entry->error = p_strdup(binctx->pool, *error_r);
+	hash_table_insert(binctx->regexes, p_strdup(binctx->pool, key), entry);
+
+	*cached_r = TRUE;
+	return ( entry->error == NULL ? &entry->rx : NULL );
+}
+
+void ext_regex_binary_get_stats
+(const struct sieve_extension *ext, struct sieve_binary *sbin,
+	struct ext_regex_cache_stats *stats_r)
+{
+	struct ext_regex_binary_context *binctx =
+		ext_regex_binary_get_context(ext, sbin, FALSE);
+
+	if ( binctx == NULL )
+		memset(stats_r, 0, sizeof(*stats_r));
+	else
+		*stats_r = binctx->stats;
+}
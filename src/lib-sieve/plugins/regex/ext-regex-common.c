@@ -1,7 +1,14 @@
 /* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
  */
 
+#include "lib.h"
+#include "buffer.h"
+#include "str.h"
+
 #include "sieve-common.h"
+#include "sieve-settings.h"
+#include "sieve-error.h"
+#include "sieve-extensions.h"
 #include "sieve-match-types.h"
 
 #include "ext-regex-common.h"
@@ -20,3 +27,197 @@ const struct sieve_operand_def regex_match_type_operand = {
 	.interface = &ext_match_types
 };
 
+/*
+ * Extension configuration
+ */
+
+bool ext_regex_load
+(const struct sieve_extension *ext, void **context)
+{
+	struct sieve_instance *svinst = ext->svinst;
+	struct ext_regex_config *config;
+	const char *engine;
+
+	if ( *context != NULL )
+		ext_regex_unload(ext);
+
+	config = i_new(struct ext_regex_config, 1);
+	config->engine = EXT_REGEX_ENGINE_POSIX;
+
+	engine = sieve_setting_get(svinst, "sieve_regex_engine");
+	if ( engine == NULL || *engine == '\0' ||
+		strcasecmp(engine, "posix") == 0 ) {
+		/* Default */
+	} else if ( strcasecmp(engine, "pcre2") == 0 ) {
+#ifdef HAVE_PCRE2
+		config->engine = EXT_REGEX_ENGINE_PCRE2;
+#else
+		sieve_sys_warning(svinst, "regex: "
+			"sieve_regex_engine = pcre2 is not supported by this build; "
+			"using POSIX regular expressions");
+#endif
+	} else {
+		sieve_sys_warning(svinst, "regex: "
+			"invalid value for sieve_regex_engine setting: %s", engine);
+	}
+
+	*context = (void *) config;
+	return TRUE;
+}
+
+void ext_regex_unload
+(const struct sieve_extension *ext)
+{
+	struct ext_regex_config *config =
+		(struct ext_regex_config *) ext->context;
+
+	i_free(config);
+}
+
+/*
+ * Regular expressions
+ */
+
+/* Wrapper around the regerror function for easy access */
+static const char *_regexp_error(regex_t *regexp, int errorcode)
+{
+	size_t errsize = regerror(errorcode, regexp, NULL, 0);
+
+	if ( errsize > 0 ) {
+		char *errbuf;
+
+		buffer_t *error_buf =
+			buffer_create_dynamic(pool_datastack_create(), errsize);
+		errbuf = buffer_get_space_unsafe(error_buf, 0, errsize);
+
+		errsize = regerror(errorcode, regexp, errbuf, errsize);
+
+		/* We don't want the error to start with a capital letter */
+		errbuf[0] = i_tolower(errbuf[0]);
+
+		buffer_append_space_unsafe(error_buf, errsize);
+
+		return str_c(error_buf);
+	}
+
+	return "";
+}
+
+#ifdef HAVE_PCRE2
+static int ext_regex_pcre2_compile
+(struct ext_regex *rx, const char *regex_str, int cflags,
+	const char **error_r)
+{
+	uint32_t options = 0;
+	PCRE2_SIZE erroffset;
+	int errcode;
+
+	if ( (cflags & REG_ICASE) != 0 )
+		options |= PCRE2_CASELESS;
+	if ( (cflags & REG_NOSUB) != 0 )
+		options |= PCRE2_NO_AUTO_CAPTURE;
+
+	rx->pcode = pcre2_compile((PCRE2_SPTR)regex_str, PCRE2_ZERO_TERMINATED,
+		options, &errcode, &erroffset, NULL);
+	if ( rx->pcode == NULL ) {
+		PCRE2_UCHAR errbuf[256];
+
+		(void)pcre2_get_error_message(errcode, errbuf, sizeof(errbuf));
+		*error_r = t_strdup_printf("%s at offset %lu",
+			(const char *)errbuf, (unsigned long)erroffset);
+		return -1;
+	}
+
+	/* JIT compilation is optional; pcre2_match() falls back to the
+	   interpreter when it is not available */
+	(void)pcre2_jit_compile(rx->pcode, PCRE2_JIT_COMPLETE);
+
+	rx->mdata = pcre2_match_data_create_from_pattern(rx->pcode, NULL);
+	return 0;
+}
+
+static int ext_regex_pcre2_exec
+(struct ext_regex *rx, const char *val, size_t val_size,
+	regmatch_t *pmatch, size_t nmatch)
+{
+	PCRE2_SIZE *ovector;
+	uint32_t ovcount;
+	size_t i;
+	int ret;
+
+	ret = pcre2_match(rx->pcode, (PCRE2_SPTR)val, val_size, 0, 0,
+		rx->mdata, NULL);
+	if ( ret == PCRE2_ERROR_NOMATCH )
+		return 0;
+	if ( ret < 0 )
+		return -1;
+
+	ovector = pcre2_get_ovector_pointer(rx->mdata);
+	ovcount = pcre2_get_ovector_count(rx->mdata);
+	for ( i = 0; i < nmatch; i++ ) {
+		if ( i < ovcount && ovector[2*i] != PCRE2_UNSET ) {
+			pmatch[i].rm_so = (regoff_t)ovector[2*i];
+			pmatch[i].rm_eo = (regoff_t)ovector[2*i+1];
+		} else {
+			pmatch[i].rm_so = pmatch[i].rm_eo = -1;
+		}
+	}
+	return 1;
+}
+#endif
+
+int ext_regex_compile
+(const struct sieve_extension *ext, struct ext_regex *rx,
+	const char *regex_str, int cflags, const char **error_r)
+{
+	const struct ext_regex_config *config =
+		(const struct ext_regex_config *) ext->context;
+	int ret;
+
+	memset(rx, 0, sizeof(*rx));
+	rx->engine = ( config == NULL ? EXT_REGEX_ENGINE_POSIX : config->engine );
+	rx->cflags = cflags;
+
+#ifdef HAVE_PCRE2
+	if ( rx->engine == EXT_REGEX_ENGINE_PCRE2 )
+		return ext_regex_pcre2_compile(rx, regex_str, cflags, error_r);
+#endif
+
+	if ( (ret=regcomp(&rx->regexp, regex_str, cflags)) != 0 ) {
+		*error_r = _regexp_error(&rx->regexp, ret);
+		regfree(&rx->regexp);
+		return -1;
+	}
+	return 0;
+}
+
+int ext_regex_exec
+(struct ext_regex *rx, const char *val, size_t val_size,
+	regmatch_t *pmatch, size_t nmatch)
+{
+#ifdef HAVE_PCRE2
+	if ( rx->engine == EXT_REGEX_ENGINE_PCRE2 )
+		return ext_regex_pcre2_exec(rx, val, val_size, pmatch, nmatch);
+#else
+	(void)val_size;
+#endif
+
+	return ( regexec(&rx->regexp, val, nmatch, pmatch, 0) == 0 ? 1 : 0 );
+}
+
+void ext_regex_free(struct ext_regex *rx)
+{
+#ifdef HAVE_PCRE2
+	if ( rx->engine == EXT_REGEX_ENGINE_PCRE2 ) {
+		if ( rx->mdata != NULL )
+			pcre2_match_data_free(rx->mdata);
+		if ( rx->pcode != NULL )
+			pcre2_code_free(rx->pcode);
+		rx->mdata = NULL;
+		rx->pcode = NULL;
+		return;
+	}
+#endif
+
+	regfree(&rx->regexp);
+}
@@ -4,12 +4,38 @@
 #ifndef __EXT_REGEX_COMMON_H
 #define __EXT_REGEX_COMMON_H
 
+#include "sieve-common.h"
+
+#include <sys/types.h>
+#include <regex.h>
+
+#ifdef HAVE_PCRE2
+#  define PCRE2_CODE_UNIT_WIDTH 8
+#  include <pcre2.h>
+#endif
+
 /*
  * Extension
  */
 
 extern const struct sieve_extension_def regex_extension;
 
+/*
+ * Extension configuration
+ */
+
+enum ext_regex_engine {
+	EXT_REGEX_ENGINE_POSIX = 0,
+	EXT_REGEX_ENGINE_PCRE2
+};
+
+struct ext_regex_config {
+	enum ext_regex_engine engine;
+};
+
+bool ext_regex_load(const struct sieve_extension *ext, void **context);
+void ext_regex_unload(const struct sieve_extension *ext);
+
 /*
  * Operand
  */
@@ -22,6 +48,55 @@ extern const struct sieve_operand_def regex_match_type_operand;
 
 extern const struct sieve_match_type_def regex_match_type;
 
-#endif /* __EXT_REGEX_COMMON_H */
+/*
+ * Regular expressions
+ */
+
+/* The cflags are those of regcomp(); they are translated for other engines. */
+
+struct ext_regex {
+	enum ext_regex_engine engine;
+	int cflags;
 
+	regex_t regexp;
+#ifdef HAVE_PCRE2
+	pcre2_code *pcode;
+	pcre2_match_data *mdata;
+#endif
+};
 
+int ext_regex_compile
+	(const struct sieve_extension *ext, struct ext_regex *rx,
+		const char *regex_str, int cflags, const char **error_r);
+int ext_regex_exec
+	(struct ext_regex *rx, const char *val, size_t val_size,
+		regmatch_t *pmatch, size_t nmatch);
+void ext_regex_free(struct ext_regex *rx);
+
+/*
+ * Binary context
+ */
+
+struct ext_regex_cache_stats {
+	/* Lookups answered from the cache */
+	unsigned int hits;
+	/* Expressions compiled (cache misses) */
+	unsigned int compiled;
+	/* Total time spent compiling expressions */
+	unsigned long long compile_usecs;
+};
+
+/* Returns the compiled expression for the given key from the cache attached
+   to the binary, compiling it first if necessary. When the cache is full, the
+   expression is compiled into *tmp_rx, which the caller must free. Returns NULL
+   when the expression is invalid. */
+struct ext_regex *ext_regex_binary_get_regex
+	(const struct sieve_runtime_env *renv, const struct sieve_extension *ext,
+		const char *regex_str, int cflags, struct ext_regex *tmp_rx,
+		bool *cached_r, const char **error_r);
+
+void ext_regex_binary_get_stats
+	(const struct sieve_extension *ext, struct sieve_binary *sbin,
+		struct ext_regex_cache_stats *stats_r);
+
+#endif /* __EXT_REGEX_COMMON_H */
@@ -38,9 +38,6 @@
 
 #include "ext-regex-common.h"
 
-#include <sys/types.h>
-#include <regex.h>
-
 /*
  * Extension
  */
@@ -50,6 +47,8 @@ static bool ext_regex_validator_load
 
 const struct sieve_extension_def regex_extension = {
 	.name = "regex",
+	.load = ext_regex_load,
+	.unload = ext_regex_unload,
 	.validator_load = ext_regex_validator_load,
 	SIEVE_EXT_DEFINE_OPERAND(regex_match_type_operand)
 };
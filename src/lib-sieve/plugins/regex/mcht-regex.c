@@ -24,8 +24,6 @@
 
 #include "ext-regex-common.h"
 
-#include <sys/types.h>
-#include <regex.h>
 #include <ctype.h>
 
 /*
@@ -60,50 +58,24 @@ const struct sieve_match_type_def regex_match_type = {
  * Match type validation
  */
 
-/* Wrapper around the regerror function for easy access */
-static const char *_regexp_error(regex_t *regexp, int errorcode)
-{
-	size_t errsize = regerror(errorcode, regexp, NULL, 0);
-
-	if ( errsize > 0 ) {
-		char *errbuf;
-
-		buffer_t *error_buf =
-			buffer_create_dynamic(pool_datastack_create(), errsize);
-		errbuf = buffer_get_space_unsafe(error_buf, 0, errsize);
-
-		errsize = regerror(errorcode, regexp, errbuf, errsize);
-
-		/* We don't want the error to start with a capital letter */
-		errbuf[0] = i_tolower(errbuf[0]);
-
-		buffer_append_space_unsafe(error_buf, errsize);
-
-		return str_c(error_buf);
-	}
-
-	return "";
-}
-
 static int mcht_regex_validate_regexp
 (struct sieve_validator *valdtr,
-	struct sieve_match_type_context *mtctx ATTR_UNUSED,
+	struct sieve_match_type_context *mtctx,
 	struct sieve_ast_argument *key, int cflags)
 {
-	int ret;
-	regex_t regexp;
+	const struct sieve_extension *ext = mtctx->match_type->object.ext;
 	const char *regex_str = sieve_ast_argument_strc(key);
+	struct ext_regex rx;
+	const char *error;
 
-	if ( (ret=regcomp(&regexp, regex_str, cflags)) != 0 ) {
+	if ( ext_regex_compile(ext, &rx, regex_str, cflags, &error) < 0 ) {
 		sieve_argument_validate_error(valdtr, key,
 			"invalid regular expression '%s' for regex match: %s",
-			str_sanitize(regex_str, 128), _regexp_error(&regexp, ret));
-
-		regfree(&regexp);
+			str_sanitize(regex_str, 128), error);
 		return FALSE;
 	}
 
-	regfree(&regexp);
+	ext_regex_free(&rx);
 	return TRUE;
 }
 
@@ -170,8 +142,10 @@ static bool mcht_regex_validate_context
  */
 
 struct mcht_regex_key {
-	regex_t regexp;
-	int status;
+	/* Compiled expression; either held by the binary cache or allocated
+	   from the match context pool */
+	struct ext_regex *rx;
+	unsigned int cached:1;
 };
 
 struct mcht_regex_context {
@@ -204,19 +178,19 @@ static void mcht_regex_match_init
 }
 
 static int mcht_regex_match_key
-(struct sieve_match_context *mctx, const char *val,
-	const regex_t *regexp)
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	struct ext_regex *rx)
 {
 	struct mcht_regex_context *ctx = (struct mcht_regex_context *) mctx->data;
 	int ret;
 
 	/* Execute regex */
 
-	ret = regexec(regexp, val, ctx->nmatch, ctx->pmatch, 0);
+	ret = ext_regex_exec(rx, val, val_size, ctx->pmatch, ctx->nmatch);
 
 	/* Handle match values if necessary */
 
-	if ( ret == 0 ) {
+	if ( ret > 0 ) {
 		if ( ctx->nmatch > 0 ) {
 			struct sieve_match_values *mvalues;
 			size_t i;
@@ -252,14 +226,15 @@ static int mcht_regex_match_key
 		return 1;
 	}
 
-	return 0;
+	return ( ret < 0 ? -1 : 0 );
 }
 
 static int mcht_regex_match_keys
-(struct sieve_match_context *mctx, const char *val, size_t val_size ATTR_UNUSED,
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
 	struct sieve_stringlist *key_list)
 {
 	const struct sieve_runtime_env *renv = mctx->runenv;
+	const struct sieve_extension *ext = mctx->match_type->object.ext;
 	bool trace = sieve_runtime_trace_active(renv, SIEVE_TRLVL_MATCHING);
 	struct mcht_regex_context *ctx = (struct mcht_regex_context *) mctx->data;
 	const struct sieve_comparator *cmp = mctx->comparator;
@@ -284,7 +259,10 @@ static int mcht_regex_match_keys
 				struct mcht_regex_key *rkey;
 
 				if ( i >= array_count(&ctx->reg_expressions) ) {
-					int cflags;
+					const char *regex_str = str_c(key_item);
+					const char *error;
+					bool cached;
+					int cflags = 0;
 
 					rkey = array_append_space(&ctx->reg_expressions);
 
@@ -294,32 +272,33 @@ static int mcht_regex_match_keys
 					else if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
 						cflags =  REG_EXTENDED | REG_ICASE;
 					else
-						rkey->status = -1; /* Not supported */
-
-					if ( rkey->status >= 0 ) {
-						const char *regex_str = str_c(key_item);
-						int rxret;
+						cflags = -1; /* Not supported */
 
+					if ( cflags >= 0 ) {
 						/* Indicate whether match values need to be produced */
 						if ( ctx->nmatch == 0 ) cflags |= REG_NOSUB;
 
-						/* Compile regular expression */
-						if ( (rxret=regcomp(&rkey->regexp, regex_str, cflags)) != 0 ) {
+						/* Fetch compiled regular expression from binary cache */
+						rkey->rx = ext_regex_binary_get_regex(renv, ext,
+							regex_str, cflags, p_new(mctx->pool, struct ext_regex, 1),
+							&cached, &error);
+						rkey->cached = cached;
+
+						if ( rkey->rx == NULL ) {
 							sieve_runtime_error(renv, NULL,
 								"invalid regular expression '%s' for regex match: %s",
-								str_sanitize(regex_str, 128),
-								_regexp_error(&rkey->regexp, rxret));
-							rkey->status = -1;
-						} else {
-							rkey->status = 1;
+								str_sanitize(regex_str, 128), error);
+						} else if ( trace && cached ) {
+							sieve_runtime_trace(renv, 0,
+								"using cached regex `%s'", str_sanitize(regex_str, 80));
 						}
 					}
 				} else {
-					rkey = array_idx_modifiable(&ctx->reg_expressions, 1);
+					rkey = array_idx_modifiable(&ctx->reg_expressions, i);
 				}
 
-				if ( rkey->status > 0 ) {
-					match = mcht_regex_match_key(mctx, val, &rkey->regexp);
+				if ( rkey->rx != NULL ) {
+					match = mcht_regex_match_key(mctx, val, val_size, rkey->rx);
 
 					if ( trace ) {
 						sieve_runtime_trace(renv, 0,
@@ -351,8 +330,8 @@ static int mcht_regex_match_keys
 		i = 0;
 		match = 0;
 		while ( match == 0 && i < count ) {
-			if ( rkeys[i].status > 0 ) {
-				match = mcht_regex_match_key(mctx, val, &rkeys[i].regexp);
+			if ( rkeys[i].rx != NULL ) {
+				match = mcht_regex_match_key(mctx, val, val_size, rkeys[i].rx);
 
 				if ( trace ) {
 					sieve_runtime_trace(renv, 0,
@@ -370,15 +349,28 @@ static int mcht_regex_match_keys
 void mcht_regex_match_deinit
 (struct sieve_match_context *mctx)
 {
+	const struct sieve_runtime_env *renv = mctx->runenv;
 	struct mcht_regex_context *ctx = (struct mcht_regex_context *) mctx->data;
 	struct mcht_regex_key *rkeys;
 	unsigned int count, i;
 
-	/* Clean up compiled regular expressions */
+	if ( array_is_created(&ctx->reg_expressions) &&
+		sieve_runtime_trace_active(renv, SIEVE_TRLVL_MATCHING) ) {
+		struct ext_regex_cache_stats stats;
+
+		ext_regex_binary_get_stats
+			(mctx->match_type->object.ext, renv->sbin, &stats);
+		sieve_runtime_trace(renv, 0,
+			"regex cache: %u hits, %u compiled in %llu usecs",
+			stats.hits, stats.compiled, stats.compile_usecs);
+	}
+
+	/* Clean up compiled regular expressions not held by the binary cache */
 	if ( array_is_created(&ctx->reg_expressions) ) {
 		rkeys = array_get_modifiable(&ctx->reg_expressions, &count);
 		for ( i = 0; i < count; i++ ) {
-			regfree(&rkeys[i].regexp);
+			if ( rkeys[i].rx != NULL && !rkeys[i].cached )
+				ext_regex_free(rkeys[i].rx);
 		}
 	}
 }
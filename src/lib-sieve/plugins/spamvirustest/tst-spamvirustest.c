@@ -172,6 +172,10 @@ static bool tst_spamvirustest_validate
 	if ( !sieve_validator_argument_activate(valdtr, tst, arg, FALSE) )
 		return FALSE;
 
+	/* The header fields read by the test are configured rather than named in
+	   the script, so these are only known at runtime */
+	sieve_ast_header_field_add(sieve_validator_ast(valdtr), NULL);
+
 	/* Validate the key argument to a specified match type */
 	return sieve_match_type_validate
 		(valdtr, tst, arg, &mcht_default, &cmp_default);
@@ -434,6 +434,43 @@ static bool cmd_vacation_pre_validate
 	return TRUE;
 }
 
+/* Headers known to be associated with mailing lists
+ */
+static const char * const _list_headers[] = {
+	"list-id",
+	"list-owner",
+	"list-subscribe",
+	"list-post",
+	"list-unsubscribe",
+	"list-help",
+	"list-archive",
+	NULL
+};
+
+/* Headers that should be searched for the user's own mail address(es)
+ */
+
+static const char * const _my_address_headers[] = {
+	"to",
+	"cc",
+	"bcc",
+	"resent-to",
+	"resent-cc",
+	"resent-bcc",
+	NULL
+};
+
+/* Other headers read by the vacation action
+ */
+
+static const char * const _other_headers[] = {
+	"auto-submitted",
+	"precedence",
+	"subject",
+	"references",
+	NULL
+};
+
 static const char _handle_empty_subject[] = "<default-subject>";
 static const char _handle_empty_from[] = "<default-from>";
 static const char _handle_mime_enabled[] = "<MIME>";
@@ -454,6 +491,12 @@ static bool cmd_vacation_validate
 	if ( !sieve_validator_argument_activate(valdtr, cmd, arg, FALSE) )
 		return FALSE;
 
+	/* Remember the header fields the action reads, so that these can be
+	   prefetched */
+	sieve_command_header_fields_add(valdtr, _list_headers);
+	sieve_command_header_fields_add(valdtr, _my_address_headers);
+	sieve_command_header_fields_add(valdtr, _other_headers);
+
 	/* Construct handle if not set explicitly */
 	if ( ctx_data->handle_arg == NULL ) {
 		T_BEGIN {
@@ -787,32 +830,6 @@ static void act_vacation_print
 
 /* Result execution */
 
-/* Headers known to be associated with mailing lists
- */
-static const char * const _list_headers[] = {
-	"list-id",
-	"list-owner",
-	"list-subscribe",
-	"list-post",
-	"list-unsubscribe",
-	"list-help",
-	"list-archive",
-	NULL
-};
-
-/* Headers that should be searched for the user's own mail address(es)
- */
-
-static const char * const _my_address_headers[] = {
-	"to",
-	"cc",
-	"bcc",
-	"resent-to",
-	"resent-cc",
-	"resent-bcc",
-	NULL
-};
-
 static inline bool _is_system_address(const char *address)
 {
 	if ( strncasecmp(address, "MAILER-DAEMON", 13) == 0 )
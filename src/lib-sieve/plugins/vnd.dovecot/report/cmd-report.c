@@ -150,11 +150,19 @@ static bool cmd_report_registered
  * Command validation
  */
 
+/* Header fields read by the report action */
+static const char *const _report_header_fields[] = {
+	"subject",
+	NULL
+};
+
 static bool cmd_report_validate
 (struct sieve_validator *valdtr, struct sieve_command *cmd)
 {
 	struct sieve_ast_argument *arg = cmd->first_positional;
 
+	sieve_command_header_fields_add(valdtr, _report_header_fields);
+
 	/* type */
 	if ( !sieve_validate_positional_argument
 		(valdtr, cmd, arg, "feedback-type", 1, SAAT_STRING) ) {
@@ -13,6 +13,7 @@
 #include "ostream.h"
 #include "mail-deliver.h"
 #include "mail-storage.h"
+#include "mail-user.h"
 #include "message-date.h"
 #include "message-size.h"
 
@@ -28,6 +29,7 @@
 #include "sieve-actions.h"
 #include "sieve-message.h"
 #include "sieve-smtp.h"
+#include "sieve-duplicate.h"
 
 #include <ctype.h>
 
@@ -763,15 +765,28 @@ static void act_store_rollback
 
 /* Checking for duplicates */
 
+static inline const char *
+sieve_action_duplicate_user(const struct sieve_script_env *senv)
+{
+	return ( senv->user == NULL ? NULL : senv->user->username );
+}
+
 bool sieve_action_duplicate_check_available
 (const struct sieve_script_env *senv)
 {
+	if ( senv->duplicate_db != NULL )
+		return TRUE;
 	return ( senv->duplicate_check != NULL && senv->duplicate_mark != NULL );
 }
 
 int sieve_action_duplicate_check
 (const struct sieve_script_env *senv, const void *id, size_t id_size)
 {
+	if ( senv->duplicate_db != NULL ) {
+		return sieve_duplicate_db_check(senv->duplicate_db,
+			sieve_action_duplicate_user(senv), id, id_size);
+	}
+
 	if ( senv->duplicate_check == NULL || senv->duplicate_mark == NULL)
 		return 0;
 
@@ -782,6 +797,12 @@ void sieve_action_duplicate_mark
 (const struct sieve_script_env *senv, const void *id, size_t id_size,
 	time_t time)
 {
+	if ( senv->duplicate_db != NULL ) {
+		sieve_duplicate_db_mark(senv->duplicate_db,
+			sieve_action_duplicate_user(senv), id, id_size, time);
+		return;
+	}
+
 	if ( senv->duplicate_check == NULL || senv->duplicate_mark == NULL)
 		return;
 
@@ -791,6 +812,11 @@ void sieve_action_duplicate_mark
 void sieve_action_duplicate_flush
 (const struct sieve_script_env *senv)
 {
+	if ( senv->duplicate_db != NULL ) {
+		sieve_duplicate_db_flush(senv->duplicate_db);
+		return;
+	}
+
 	if ( senv->duplicate_flush == NULL )
 		return;
 	senv->duplicate_flush(senv);
@@ -52,6 +52,9 @@ struct sieve_ast {
 
 	ARRAY(const struct sieve_extension *) linked_extensions;
 	ARRAY(struct sieve_ast_extension_reg) extensions;
+
+	ARRAY(const char *) header_fields;
+	unsigned int header_fields_dynamic:1;
 };
 
 struct sieve_ast *sieve_ast_create
@@ -76,6 +79,7 @@ struct sieve_ast *sieve_ast_create
 	ext_count = sieve_extensions_get_count(ast->svinst);
 	p_array_init(&ast->linked_extensions, pool, ext_count);
 	p_array_init(&ast->extensions, pool, ext_count);
+	p_array_init(&ast->header_fields, pool, 8);
 
 	return ast;
 }
@@ -217,6 +221,39 @@ bool sieve_ast_extension_is_required
 	return reg->required;
 }
 
+/*
+ * Header field references
+ */
+
+void sieve_ast_header_field_add
+(struct sieve_ast *ast, const char *field_name)
+{
+	const char *const *fields;
+	unsigned int count, i;
+
+	if ( field_name == NULL ) {
+		ast->header_fields_dynamic = TRUE;
+		return;
+	}
+
+	/* Prevent duplicates */
+	fields = array_get(&ast->header_fields, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( strcasecmp(fields[i], field_name) == 0 )
+			return;
+	}
+
+	field_name = p_strdup(ast->pool, field_name);
+	array_append(&ast->header_fields, &field_name, 1);
+}
+
+const char *const *sieve_ast_header_fields_get
+(struct sieve_ast *ast, unsigned int *count_r, bool *dynamic_r)
+{
+	*dynamic_r = ast->header_fields_dynamic;
+	return array_get(&ast->header_fields, count_r);
+}
+
 /*
  * AST list implementations
  */
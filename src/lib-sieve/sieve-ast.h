@@ -203,6 +203,16 @@ void *sieve_ast_extension_get_context
 bool sieve_ast_extension_is_required
 	(struct sieve_ast *ast, const struct sieve_extension *ext);
 
+/* Header field references */
+
+/* Records a header field name the script inspects; a NULL field name means
+   that the script also inspects header fields that are only known at
+   runtime. */
+void sieve_ast_header_field_add
+	(struct sieve_ast *ast, const char *field_name);
+const char *const *sieve_ast_header_fields_get
+	(struct sieve_ast *ast, unsigned int *count_r, bool *dynamic_r);
+
 /*
  * AST node manipulation
  */
@@ -180,6 +180,27 @@ bool sieve_binary_dumper_run
 		}
 	}
 
+	/* Dump referenced header fields */
+
+	T_BEGIN {
+		const char *const *fields;
+		bool dynamic;
+
+		fields = sieve_binary_get_header_fields(sbin, &dynamic);
+		if ( fields == NULL ) {
+			success = FALSE;
+		} else if ( *fields != NULL || dynamic ) {
+			sieve_binary_dump_sectionf(denv, "Header fields (block: %d)",
+				SBIN_SYSBLOCK_HEADER_FIELDS);
+
+			for ( i = 0; fields[i] != NULL; i++ )
+				sieve_binary_dumpf(denv, "%3d: %s\n", i, fields[i]);
+			if ( dynamic )
+				sieve_binary_dumpf(denv, "  *: (determined at runtime)\n");
+		}
+	} T_END;
+	if ( !success ) return FALSE;
+
 	/* Dump main program */
 
 	sieve_binary_dump_sectionf
@@ -22,6 +22,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -451,6 +452,9 @@ bool sieve_binary_file_open
 
 void sieve_binary_file_close(struct sieve_binary_file **file)
 {
+	if ( (*file)->close != NULL )
+		(*file)->close(*file);
+
 	if ( (*file)->fd != -1 ) {
 		if ( close((*file)->fd) < 0 ) {
 			sieve_sys_error((*file)->svinst,
@@ -464,120 +468,6 @@ void sieve_binary_file_close(struct sieve_binary_file **file)
 	*file = NULL;
 }
 
-#if 0 /* file_memory is currently unused */
-
-/* File loaded/mapped to memory */
-
-struct _file_memory {
-	struct sieve_binary_file binfile;
-
-	/* Pointer to the binary in memory */
-	const void *memory;
-	off_t memory_size;
-};
-
-static const void *_file_memory_load_data
-	(struct sieve_binary_file *file, off_t *offset, size_t size)
-{
-	struct _file_memory *fmem = (struct _file_memory *) file;
-
-	*offset = SIEVE_BINARY_ALIGN(*offset);
-
-	if ( (*offset) + size <= fmem->memory_size ) {
-		const void *data = PTR_OFFSET(fmem->memory, *offset);
-		*offset += size;
-		file->offset = *offset;
-
-		return data;
-	}
-
-	return NULL;
-}
-
-static buffer_t *_file_memory_load_buffer
-	(struct sieve_binary_file *file, off_t *offset, size_t size)
-{
-	struct _file_memory *fmem = (struct _file_memory *) file;
-
-	*offset = SIEVE_BINARY_ALIGN(*offset);
-
-	if ( (*offset) + size <= fmem->memory_size ) {
-		const void *data = PTR_OFFSET(fmem->memory, *offset);
-		*offset += size;
-		file->offset = *offset;
-
-		return buffer_create_const_data(file->pool, data, size);
-	}
-
-	return NULL;
-}
-
-static bool _file_memory_load(struct sieve_binary_file *file)
-{
-	struct _file_memory *fmem = (struct _file_memory *) file;
-	int ret;
-	size_t size;
-	void *indata;
-
-	i_assert(file->fd > 0);
-
-	/* Allocate memory buffer
-	 */
-	indata = p_malloc(file->pool, file->st.st_size);
-	size = file->st.st_size;
-
-	file->offset = 0;
-	fmem->memory = indata;
-	fmem->memory_size = file->st.st_size;
-
-	/* Return to beginning of the file */
-	if ( lseek(file->fd, 0, SEEK_SET) == (off_t) -1 ) {
-		sieve_sys_error("failed to seek() in binary %s: %m", file->path);
-		return FALSE;
-	}
-
-	/* Read the whole file into memory */
-	while (size > 0) {
-		if ( (ret=read(file->fd, indata, size)) <= 0 ) {
-			sieve_sys_error("failed to read from binary %s: %m", file->path);
-			break;
-		}
-
-		indata = PTR_OFFSET(indata, ret);
-		size -= ret;
-	}
-
-	if ( size != 0 ) {
-		/* Failed to read the whole file */
-		return FALSE;
-	}
-
-	return TRUE;
-}
-
-static struct sieve_binary_file *_file_memory_open(const char *path)
-{
-	pool_t pool;
-	struct _file_memory *file;
-
-	pool = pool_alloconly_create("sieve_binary_file_memory", 1024);
-	file = p_new(pool, struct _file_memory, 1);
-	file->binfile.pool = pool;
-	file->binfile.path = p_strdup(pool, path);
-	file->binfile.load = _file_memory_load;
-	file->binfile.load_data = _file_memory_load_data;
-	file->binfile.load_buffer = _file_memory_load_buffer;
-
-	if ( !sieve_binary_file_open(&file->binfile, path) ) {
-		pool_unref(&pool);
-		return NULL;
-	}
-
-	return &file->binfile;
-}
-
-#endif /* file_memory is currently unused */
-
 /* File open in lazy mode (only read what is needed into memory) */
 
 static bool _file_lazy_read
@@ -673,6 +563,122 @@ static struct sieve_binary_file *_file_lazy_open
 	return file;
 }
 
+/* File mapped into memory (blocks point directly into the shared mapping) */
+
+struct _file_mmap {
+	struct sieve_binary_file binfile;
+
+	const void *memory;
+	size_t memory_size;
+};
+
+static const void *_file_mmap_get
+(struct sieve_binary_file *file, off_t *offset, size_t size)
+{
+	struct _file_mmap *fmap = (struct _file_mmap *) file;
+	const void *data;
+
+	*offset = SIEVE_BINARY_ALIGN(*offset);
+
+	if ( (uoff_t)*offset > fmap->memory_size ||
+		size > fmap->memory_size - (uoff_t)*offset ) {
+		sieve_sys_error(file->svinst,
+			"binary read: binary %s is truncated (more data expected)",
+			file->path);
+		return NULL;
+	}
+
+	data = CONST_PTR_OFFSET(fmap->memory, *offset);
+	*offset += size;
+	file->offset = *offset;
+	return data;
+}
+
+static const void *_file_mmap_load_data
+(struct sieve_binary_file *file, off_t *offset, size_t size)
+{
+	return _file_mmap_get(file, offset, size);
+}
+
+static buffer_t *_file_mmap_load_buffer
+(struct sieve_binary_file *file, off_t *offset, size_t size)
+{
+	const void *data = _file_mmap_get(file, offset, size);
+
+	if ( data == NULL )
+		return NULL;
+	return buffer_create_const_data(file->pool, data, size);
+}
+
+static void _file_mmap_close(struct sieve_binary_file *file)
+{
+	struct _file_mmap *fmap = (struct _file_mmap *) file;
+
+	if ( fmap->memory == NULL )
+		return;
+
+	if ( munmap((void *)fmap->memory, fmap->memory_size) < 0 ) {
+		sieve_sys_error(file->svinst,
+			"binary close: munmap(%s) failed: %m", file->path);
+	}
+	fmap->memory = NULL;
+}
+
+static struct sieve_binary_file *_file_mmap_open
+(struct sieve_instance *svinst, const char *path, enum sieve_error *error_r)
+{
+	pool_t pool;
+	struct _file_mmap *fmap;
+	struct sieve_binary_file *file;
+	void *memory;
+
+	pool = pool_alloconly_create("sieve_binary_file_mmap", 4096);
+	fmap = p_new(pool, struct _file_mmap, 1);
+	file = &fmap->binfile;
+	file->pool = pool;
+	file->path = p_strdup(pool, path);
+
+	if ( !sieve_binary_file_open(file, svinst, path, error_r) ) {
+		pool_unref(&pool);
+		return NULL;
+	}
+
+	if ( file->st.st_size <= 0 ||
+		(uoff_t)file->st.st_size > SSIZE_T_MAX ) {
+		/* Nothing to map; let the lazy reader report the problem */
+		file->load_data = _file_lazy_load_data;
+		file->load_buffer = _file_lazy_load_buffer;
+		return file;
+	}
+
+	memory = mmap(NULL, (size_t)file->st.st_size, PROT_READ, MAP_SHARED,
+		file->fd, 0);
+	if ( memory == MAP_FAILED ) {
+		sieve_sys_warning(svinst, "binary open: "
+			"mmap(%s) failed, reading binary instead: %m", path);
+		file->load_data = _file_lazy_load_data;
+		file->load_buffer = _file_lazy_load_buffer;
+		return file;
+	}
+
+	fmap->memory = memory;
+	fmap->memory_size = (size_t)file->st.st_size;
+	file->load_data = _file_mmap_load_data;
+	file->load_buffer = _file_mmap_load_buffer;
+	file->close = _file_mmap_close;
+	file->mapped = TRUE;
+
+	/* The mapping stays valid without the descriptor; binaries are replaced
+	   atomically by rename(), so the mapped inode is never modified. */
+	if ( close(file->fd) < 0 ) {
+		sieve_sys_error(svinst,
+			"binary open: close(fd=%s) failed: %m", path);
+	}
+	file->fd = -1;
+
+	return file;
+}
+
 /*
  * Load binary from a file
  */
@@ -711,6 +717,7 @@ bool sieve_binary_load_block
 			id, sbin->path, header->size);
 		return FALSE;
 	}
+	sblock->mapped = sbin->file->mapped;
 
 	return TRUE;
 }
@@ -897,8 +904,11 @@ struct sieve_binary *sieve_binary_open
 
 	i_assert( script == NULL || sieve_script_svinst(script) == svinst );
 
-	//file = _file_memory_open(path);
-	if ( (file=_file_lazy_open(svinst, path, error_r)) == NULL )
+	if ( svinst->binary_mmap_disable )
+		file = _file_lazy_open(svinst, path, error_r);
+	else
+		file = _file_mmap_open(svinst, path, error_r);
+	if ( file == NULL )
 		return NULL;
 
 	/* Create binary object */
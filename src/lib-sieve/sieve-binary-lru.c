@@ -0,0 +1,256 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "llist.h"
+#include "hash.h"
+
+#include "sieve-common.h"
+#include "sieve-error.h"
+#include "sieve-script-private.h"
+#include "sieve-storage-private.h"
+
+#include "sieve-binary-private.h"
+#include "sieve-binary-lru.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Types
+ */
+
+struct sieve_binary_lru_stats {
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int invalidations;
+	unsigned int evictions;
+
+	unsigned int entries;
+	size_t size;
+};
+
+struct sieve_binary_lru_entry {
+	struct sieve_binary_lru_entry *prev, *next;
+
+	char *key;
+	struct sieve_binary *sbin;
+	size_t size;
+
+	/* Compiled from a script of the user's main storage */
+	unsigned int personal:1;
+};
+
+struct sieve_binary_lru {
+	size_t max_size;
+
+	HASH_TABLE(char *, struct sieve_binary_lru_entry *) entries;
+	/* Most recently used first */
+	struct sieve_binary_lru_entry *head, *tail;
+
+	struct sieve_binary_lru_stats stats;
+};
+
+/*
+ * Cache management
+ */
+
+void sieve_binary_lru_init(struct sieve_instance *svinst, size_t max_size)
+{
+	struct sieve_binary_lru *lru;
+
+	if ( max_size == 0 )
+		return;
+
+	lru = i_new(struct sieve_binary_lru, 1);
+	lru->max_size = max_size;
+	hash_table_create(&lru->entries, default_pool, 0, str_hash, strcmp);
+
+	svinst->binary_lru = lru;
+}
+
+static void sieve_binary_lru_remove
+(struct sieve_binary_lru *lru, struct sieve_binary_lru_entry *entry)
+{
+	hash_table_remove(lru->entries, entry->key);
+	DLLIST2_REMOVE(&lru->head, &lru->tail, entry);
+
+	lru->stats.entries--;
+	lru->stats.size -= entry->size;
+
+	sieve_binary_unref(&entry->sbin);
+	i_free(entry->key);
+	i_free(entry);
+}
+
+void sieve_binary_lru_deinit(struct sieve_instance *svinst)
+{
+	struct sieve_binary_lru *lru = svinst->binary_lru;
+
+	if ( lru == NULL )
+		return;
+
+	if ( svinst->debug ) {
+		sieve_sys_debug(svinst, "binary cache: "
+			"%u hits, %u misses, %u invalidations, %u evictions",
+			lru->stats.hits, lru->stats.misses, lru->stats.invalidations,
+			lru->stats.evictions);
+	}
+
+	while ( lru->head != NULL )
+		sieve_binary_lru_remove(lru, lru->head);
+
+	hash_table_destroy(&lru->entries);
+	i_free(lru);
+	svinst->binary_lru = NULL;
+}
+
+void sieve_binary_lru_detach(struct sieve_instance *svinst)
+{
+	struct sieve_binary_lru *lru = svinst->binary_lru;
+	struct sieve_binary_lru_entry *entry, *next;
+
+	if ( lru == NULL )
+		return;
+
+	for ( entry = lru->head; entry != NULL; entry = next ) {
+		next = entry->next;
+		if ( entry->personal )
+			sieve_binary_lru_remove(lru, entry);
+	}
+}
+
+static const char *sieve_binary_lru_key
+(struct sieve_script *script, enum sieve_compile_flags cpflags)
+{
+	return t_strdup_printf("%x:%s", (unsigned int)cpflags,
+		sieve_script_location(script));
+}
+
+static bool sieve_binary_lru_entry_valid
+(struct sieve_binary_lru_entry *entry, struct sieve_script *script,
+	enum sieve_compile_flags cpflags)
+{
+	struct sieve_binary *sbin = entry->sbin;
+	struct stat st;
+
+	/* Was the binary replaced on disk? */
+	if ( stat(sbin->path, &st) < 0 ) {
+		if ( errno != ENOENT ) {
+			sieve_sys_error(sbin->svinst,
+				"binary cache: stat(%s) failed: %m", sbin->path);
+		}
+		return FALSE;
+	}
+	if ( st.st_ino != sbin->file->st.st_ino ||
+		!CMP_DEV_T(st.st_dev, sbin->file->st.st_dev) ||
+		st.st_mtime != sbin->file->st.st_mtime ||
+		st.st_size != sbin->file->st.st_size )
+		return FALSE;
+
+	/* Was the script (or any of its dependencies) changed? */
+	return sieve_binary_check_up_to_date(sbin, script, cpflags);
+}
+
+struct sieve_binary *sieve_binary_lru_lookup
+(struct sieve_instance *svinst, struct sieve_script *script,
+	enum sieve_compile_flags cpflags)
+{
+	struct sieve_binary_lru *lru = svinst->binary_lru;
+	struct sieve_binary_lru_entry *entry;
+	struct sieve_binary *sbin;
+
+	if ( lru == NULL )
+		return NULL;
+
+	entry = hash_table_lookup
+		(lru->entries, sieve_binary_lru_key(script, cpflags));
+	if ( entry == NULL ) {
+		lru->stats.misses++;
+		return NULL;
+	}
+
+	if ( !sieve_binary_lru_entry_valid(entry, script, cpflags) ) {
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "binary cache: "
+				"cached binary %s is not up-to-date", entry->sbin->path);
+		}
+		lru->stats.invalidations++;
+		lru->stats.misses++;
+		sieve_binary_lru_remove(lru, entry);
+		return NULL;
+	}
+
+	/* Move to front */
+	if ( lru->head != entry ) {
+		DLLIST2_REMOVE(&lru->head, &lru->tail, entry);
+		DLLIST2_PREPEND(&lru->head, &lru->tail, entry);
+	}
+	lru->stats.hits++;
+
+	sbin = entry->sbin;
+	sieve_binary_ref(sbin);
+	return sbin;
+}
+
+void sieve_binary_lru_insert
+(struct sieve_instance *svinst, struct sieve_script *script,
+	enum sieve_compile_flags cpflags, struct sieve_binary *sbin)
+{
+	struct sieve_binary_lru *lru = svinst->binary_lru;
+	struct sieve_binary_lru_entry *entry;
+	const char *key;
+	size_t size;
+
+	/* Only binaries loaded from disk can be verified cheaply */
+	if ( lru == NULL || sbin->file == NULL || sbin->path == NULL )
+		return;
+
+	size = (size_t)sbin->file->st.st_size;
+	if ( size > lru->max_size )
+		return;
+
+	key = sieve_binary_lru_key(script, cpflags);
+	if ( (entry=hash_table_lookup(lru->entries, key)) != NULL ) {
+		if ( entry->sbin == sbin )
+			return;
+		sieve_binary_lru_remove(lru, entry);
+	}
+
+	/* Make room */
+	while ( lru->tail != NULL && lru->stats.size + size > lru->max_size ) {
+		lru->stats.evictions++;
+		sieve_binary_lru_remove(lru, lru->tail);
+	}
+
+	entry = i_new(struct sieve_binary_lru_entry, 1);
+	entry->key = i_strdup(key);
+	entry->sbin = sbin;
+	entry->size = size;
+	entry->personal = script->storage->main_storage;
+	sieve_binary_ref(sbin);
+
+	hash_table_insert(lru->entries, entry->key, entry);
+	DLLIST2_PREPEND(&lru->head, &lru->tail, entry);
+
+	lru->stats.entries++;
+	lru->stats.size += size;
+}
+
+void sieve_binary_lru_invalidate
+(struct sieve_instance *svinst, struct sieve_binary *sbin)
+{
+	struct sieve_binary_lru *lru = svinst->binary_lru;
+	struct sieve_binary_lru_entry *entry;
+
+	if ( lru == NULL )
+		return;
+
+	for ( entry = lru->head; entry != NULL; entry = entry->next ) {
+		if ( entry->sbin == sbin ) {
+			lru->stats.invalidations++;
+			sieve_binary_lru_remove(lru, entry);
+			return;
+		}
+	}
+}
@@ -0,0 +1,39 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __SIEVE_BINARY_LRU_H
+#define __SIEVE_BINARY_LRU_H
+
+#include "sieve-common.h"
+
+/*
+ * Cache of loaded binaries
+ */
+
+/* Binaries opened from disk are kept in the instance, so that opening the
+   same script again (e.g. a global sieve_before script for the next
+   delivery) only needs to verify that the binary and script were not
+   changed. The cache is limited by the total size of the cached binaries
+   and evicts the least recently used ones first. The hit/miss counters are
+   logged when debugging is enabled. */
+
+void sieve_binary_lru_init(struct sieve_instance *svinst, size_t max_size);
+void sieve_binary_lru_deinit(struct sieve_instance *svinst);
+/* Drop the binaries of the user's own scripts; those of global scripts
+   (e.g. sieve_before) are keyed by their full location and stay cached
+   for the next user of the instance. */
+void sieve_binary_lru_detach(struct sieve_instance *svinst);
+
+/* Returns a new reference to the cached binary for this script, or NULL
+   when it is not cached or no longer up-to-date. */
+struct sieve_binary *sieve_binary_lru_lookup
+	(struct sieve_instance *svinst, struct sieve_script *script,
+		enum sieve_compile_flags cpflags);
+void sieve_binary_lru_insert
+	(struct sieve_instance *svinst, struct sieve_script *script,
+		enum sieve_compile_flags cpflags, struct sieve_binary *sbin);
+/* Drop the binary from the cache (e.g. because it turned out corrupt) */
+void sieve_binary_lru_invalidate
+	(struct sieve_instance *svinst, struct sieve_binary *sbin);
+
+#endif /* __SIEVE_BINARY_LRU_H */
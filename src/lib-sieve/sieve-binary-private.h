@@ -27,6 +27,10 @@ struct sieve_binary_file {
 		(struct sieve_binary_file *file, off_t *offset, size_t size);
 	buffer_t *(*load_buffer)
 		(struct sieve_binary_file *file, off_t *offset, size_t size);
+	void (*close)(struct sieve_binary_file *file);
+
+	/* Loaded buffers point directly into a read-only mapping */
+	unsigned int mapped:1;
 };
 
 bool sieve_binary_file_open
@@ -70,6 +74,10 @@ struct sieve_binary_block {
 	buffer_t *data;
 
 	uoff_t offset;
+
+	/* Data is read-only memory of the binary file; copied before it is
+	   modified */
+	unsigned int mapped:1;
 };
 
 /*
@@ -108,11 +116,20 @@ struct sieve_binary {
 
 	/* Blocks */
 	ARRAY(struct sieve_binary_block *) blocks;
+
+	/* Runtime cache */
+	HASH_TABLE(char *, struct sieve_binary_cache_item *) cache;
 };
 
 struct sieve_binary *sieve_binary_create
 	(struct sieve_instance *svinst, struct sieve_script *script);
 
+/* Like sieve_binary_up_to_date(), but checks the binary against the provided
+   (freshly opened) script rather than the one it was loaded for */
+bool sieve_binary_check_up_to_date
+	(struct sieve_binary *sbin, struct sieve_script *script,
+		enum sieve_compile_flags cpflags);
+
 /* Blocks management */
 
 static inline struct sieve_binary_block *sieve_binary_block_index
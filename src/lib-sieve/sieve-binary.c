@@ -31,6 +31,8 @@ static inline int sieve_binary_extension_register
 	(struct sieve_binary *sbin, const struct sieve_extension *ext,
 		struct sieve_binary_extension_reg **reg);
 
+static void sieve_binary_cache_free(struct sieve_binary *sbin);
+
 /*
  * Binary object
  */
@@ -120,6 +122,7 @@ void sieve_binary_unref(struct sieve_binary **sbin)
 		return;
 
 	sieve_binary_extensions_free(*sbin);
+	sieve_binary_cache_free(*sbin);
 
 	if ( (*sbin)->file != NULL )
 		sieve_binary_file_close(&(*sbin)->file);
@@ -191,6 +194,69 @@ const char *sieve_binary_script_location(struct sieve_binary *sbin)
 	return ( sbin->script == NULL ? NULL : sieve_script_location(sbin->script) );
 }
 
+/*
+ * Runtime cache
+ */
+
+struct sieve_binary_cache_item {
+	void *data;
+	sieve_binary_cache_free_func_t *free_func;
+};
+
+bool sieve_binary_cache_lookup
+(struct sieve_binary *sbin, const char *key, void **data_r)
+{
+	struct sieve_binary_cache_item *item;
+
+	*data_r = NULL;
+
+	if ( !hash_table_is_created(sbin->cache) )
+		return FALSE;
+
+	if ( (item=hash_table_lookup(sbin->cache, key)) == NULL )
+		return FALSE;
+
+	*data_r = item->data;
+	return TRUE;
+}
+
+void sieve_binary_cache_insert
+(struct sieve_binary *sbin, const char *key, void *data,
+	sieve_binary_cache_free_func_t *free_func)
+{
+	struct sieve_binary_cache_item *item;
+
+	if ( !hash_table_is_created(sbin->cache) )
+		hash_table_create(&sbin->cache, default_pool, 0, str_hash, strcmp);
+
+	i_assert( hash_table_lookup(sbin->cache, key) == NULL );
+
+	item = p_new(sbin->pool, struct sieve_binary_cache_item, 1);
+	item->data = data;
+	item->free_func = free_func;
+
+	hash_table_insert(sbin->cache, p_strdup(sbin->pool, key), item);
+}
+
+static void sieve_binary_cache_free(struct sieve_binary *sbin)
+{
+	struct hash_iterate_context *hctx;
+	struct sieve_binary_cache_item *item;
+	char *key;
+
+	if ( !hash_table_is_created(sbin->cache) )
+		return;
+
+	hctx = hash_table_iterate_init(sbin->cache);
+	while ( hash_table_iterate(hctx, sbin->cache, &key, &item) ) {
+		if ( item->data != NULL && item->free_func != NULL )
+			item->free_func(item->data);
+	}
+	hash_table_iterate_deinit(&hctx);
+
+	hash_table_destroy(&sbin->cache);
+}
+
 /*
  * Utility
  */
@@ -274,6 +340,13 @@ struct sieve_binary_block *sieve_binary_block_get
 void sieve_binary_block_clear
 (struct sieve_binary_block *sblock)
 {
+	if ( sblock->mapped ) {
+		/* Never write into the mapped file */
+		sblock->data = buffer_create_dynamic(sblock->sbin->pool, 64);
+		sblock->mapped = FALSE;
+		return;
+	}
+
 	buffer_set_used_size(sblock->data, 0);
 }
 
@@ -304,12 +377,75 @@ size_t sieve_binary_block_get_size
 	return _sieve_binary_block_get_size(sblock);
 }
 
+/*
+ * Header field references
+ */
+
+const char *const *sieve_binary_get_header_fields
+(struct sieve_binary *sbin, bool *dynamic_r)
+{
+	struct sieve_binary_block *sblock;
+	ARRAY_TYPE(const_string) fields;
+	sieve_size_t offset = 0;
+	size_t size;
+
+	*dynamic_r = FALSE;
+
+	t_array_init(&fields, 16);
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_HEADER_FIELDS);
+	if ( sblock == NULL )
+		return NULL;
+
+	/* One record for each script compiled into this binary:
+	   <dynamic: byte> <count: number> <field-name: string>* */
+	size = sieve_binary_block_get_size(sblock);
+	while ( offset < size ) {
+		unsigned int dynamic, count, i;
+
+		if ( !sieve_binary_read_byte(sblock, &offset, &dynamic) ||
+			!sieve_binary_read_unsigned(sblock, &offset, &count) )
+			return NULL;
+		if ( dynamic != 0 )
+			*dynamic_r = TRUE;
+
+		for ( i = 0; i < count; i++ ) {
+			const char *const *known, *field;
+			unsigned int known_count, j;
+			string_t *name;
+
+			if ( !sieve_binary_read_string(sblock, &offset, &name) )
+				return NULL;
+
+			/* Included scripts may reference the same fields */
+			known = array_get(&fields, &known_count);
+			for ( j = 0; j < known_count; j++ ) {
+				if ( strcasecmp(known[j], str_c(name)) == 0 )
+					break;
+			}
+			if ( j == known_count ) {
+				field = t_strdup(str_c(name));
+				array_append(&fields, &field, 1);
+			}
+		}
+	}
+
+	array_append_zero(&fields);
+	return array_idx(&fields, 0);
+}
+
 /*
  * Up-to-date checking
  */
 
 bool sieve_binary_up_to_date
 (struct sieve_binary *sbin, enum sieve_compile_flags cpflags)
+{
+	return sieve_binary_check_up_to_date(sbin, sbin->script, cpflags);
+}
+
+bool sieve_binary_check_up_to_date
+(struct sieve_binary *sbin, struct sieve_script *script,
+	enum sieve_compile_flags cpflags)
 {
 	struct sieve_binary_extension_reg *const *regs;
 	struct sieve_binary_block *sblock;
@@ -320,11 +456,11 @@ bool sieve_binary_up_to_date
 	i_assert(sbin->file != NULL);
 
 	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_SCRIPT_DATA);
-	if ( sblock == NULL || sbin->script == NULL )
+	if ( sblock == NULL || script == NULL )
 		return FALSE;
 
 	if ( (ret=sieve_script_binary_read_metadata
-		(sbin->script, sblock, &offset)) <= 0 ) {
+		(script, sblock, &offset)) <= 0 ) {
 		if (ret < 0) {
 			sieve_sys_debug(sbin->svinst, "binary up-to-date: "
 				"failed to read script metadata from binary %s",
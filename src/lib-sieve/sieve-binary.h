@@ -13,7 +13,7 @@
  */
 
 #define SIEVE_BINARY_VERSION_MAJOR     1
-#define SIEVE_BINARY_VERSION_MINOR     4
+#define SIEVE_BINARY_VERSION_MINOR     5
 
 /*
  * Binary object
@@ -72,6 +72,36 @@ struct sieve_binary *sieve_binary_open
 bool sieve_binary_up_to_date
 	(struct sieve_binary *sbin, enum sieve_compile_flags cpflags);
 
+/*
+ * Runtime cache
+ */
+
+/* Data derived from the binary's code at runtime (e.g. prepared key lists) can
+   be stored with the binary, so that it is kept for as long as the binary is
+   loaded. The free function is called when the binary is freed. Negative
+   results can be cached by storing NULL data. */
+
+typedef void sieve_binary_cache_free_func_t(void *data);
+
+bool sieve_binary_cache_lookup
+	(struct sieve_binary *sbin, const char *key, void **data_r);
+void sieve_binary_cache_insert
+	(struct sieve_binary *sbin, const char *key, void *data,
+		sieve_binary_cache_free_func_t *free_func);
+
+/*
+ * Header field references
+ */
+
+/* Returns the names of the header fields the script (and the scripts it
+   includes) inspects, allocated on the data stack. This includes the fields
+   actions like vacation and redirect read implicitly. The dynamic_r flag is
+   set when the script also inspects header fields whose names are only known
+   at runtime, e.g. those configured for spamtest or read by a notification
+   method. Returns NULL when the binary is corrupt. */
+const char *const *sieve_binary_get_header_fields
+	(struct sieve_binary *sbin, bool *dynamic_r);
+
 /*
  * Block management
  */
@@ -80,6 +110,7 @@ enum sieve_binary_system_block {
 	SBIN_SYSBLOCK_SCRIPT_DATA,
 	SBIN_SYSBLOCK_EXTENSIONS,
 	SBIN_SYSBLOCK_MAIN_PROGRAM,
+	SBIN_SYSBLOCK_HEADER_FIELDS,
 	SBIN_SYSBLOCK_LAST
 };
 
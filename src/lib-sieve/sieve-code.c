@@ -115,6 +115,51 @@ static int sieve_code_stringlist_get_length
 	return strlist->length;
 }
 
+/* Constant lists */
+
+bool sieve_code_stringlist_get_address
+(struct sieve_stringlist *_strlist, sieve_size_t *address_r)
+{
+	struct sieve_code_stringlist *strlist =
+		(struct sieve_code_stringlist *) _strlist;
+
+	if ( _strlist->next_item != sieve_code_stringlist_next_item )
+		return FALSE;
+
+	*address_r = strlist->start_address;
+	return TRUE;
+}
+
+bool sieve_code_stringlist_is_literal
+(struct sieve_stringlist *_strlist, sieve_size_t *address_r)
+{
+	struct sieve_code_stringlist *strlist =
+		(struct sieve_code_stringlist *) _strlist;
+	const struct sieve_runtime_env *renv = _strlist->runenv;
+	sieve_size_t address;
+	int i;
+
+	if ( _strlist->next_item != sieve_code_stringlist_next_item )
+		return FALSE;
+
+	/* Check that none of the items is substituted at runtime */
+	address = strlist->start_address;
+	for ( i = 0; i < strlist->length; i++ ) {
+		struct sieve_operand operand;
+
+		if ( !sieve_operand_read(renv->sblock, &address, NULL, &operand) ||
+			!sieve_operand_is_string_literal(&operand) ||
+			!sieve_binary_read_string(renv->sblock, &address, NULL) )
+			return FALSE;
+	}
+
+	if ( address != strlist->end_address )
+		return FALSE;
+
+	*address_r = strlist->start_address;
+	return TRUE;
+}
+
 static bool sieve_code_stringlist_dump
 (const struct sieve_dumptime_env *denv, sieve_size_t *address,
 	unsigned int length, sieve_size_t end, const char *field_name)
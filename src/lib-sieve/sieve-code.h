@@ -266,6 +266,17 @@ int sieve_opr_stringlist_read_ex
 	(const struct sieve_runtime_env *renv, sieve_size_t *address,
 		const char *field_name, bool optional, struct sieve_stringlist **strlist_r);
 
+/* Returns TRUE when the list is read directly from the binary. The returned
+   address is where the list starts; nothing is decoded. */
+bool sieve_code_stringlist_get_address
+	(struct sieve_stringlist *strlist, sieve_size_t *address_r);
+
+/* Returns TRUE when the list is read directly from the binary and consists
+   of string literals only. The returned address uniquely identifies the list
+   within the current block, so that data derived from it can be cached. */
+bool sieve_code_stringlist_is_literal
+	(struct sieve_stringlist *strlist, sieve_size_t *address_r);
+
 static inline bool sieve_operand_is_stringlist
 (const struct sieve_operand *operand)
 {
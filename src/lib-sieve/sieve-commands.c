@@ -381,10 +381,16 @@ static int _verify_header_name_item
 (void *context, struct sieve_ast_argument *header)
 {
 	struct sieve_validator *valdtr = (struct sieve_validator *) context;
+	struct sieve_ast *ast = sieve_validator_ast(valdtr);
 	string_t *name = sieve_ast_argument_str(header);
 
-	if ( sieve_argument_is_string_literal(header) &&
-		!rfc2822_header_field_name_verify(str_c(name), str_len(name)) ) {
+	if ( !sieve_argument_is_string_literal(header) ) {
+		/* Name only known at runtime */
+		sieve_ast_header_field_add(ast, NULL);
+		return TRUE;
+	}
+
+	if ( !rfc2822_header_field_name_verify(str_c(name), str_len(name)) ) {
 		sieve_argument_validate_warning
 			(valdtr, header, "specified header field name '%s' is invalid",
 				str_sanitize(str_c(name), 80));
@@ -392,6 +398,8 @@ static int _verify_header_name_item
 		return FALSE;
 	}
 
+	/* Remember it, so that the header can be prefetched */
+	sieve_ast_header_field_add(ast, str_c(name));
 	return TRUE;
 }
 
@@ -401,3 +409,12 @@ bool sieve_command_verify_headers_argument
 	return ( sieve_ast_stringlist_map
 		(&headers, (void *) valdtr, _verify_header_name_item) >= 0 );
 }
+
+void sieve_command_header_fields_add
+(struct sieve_validator *valdtr, const char *const *fields)
+{
+	struct sieve_ast *ast = sieve_validator_ast(valdtr);
+
+	for ( ; *fields != NULL; fields++ )
+		sieve_ast_header_field_add(ast, *fields);
+}
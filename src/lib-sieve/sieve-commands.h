@@ -286,4 +286,9 @@ extern const unsigned int sieve_core_tests_count;
 bool sieve_command_verify_headers_argument
 (struct sieve_validator *valdtr, struct sieve_ast_argument *headers);
 
+/* Records header fields a command reads from the message implicitly, e.g. to
+   prevent mail loops. A NULL field name marks the set as dynamic. */
+void sieve_command_header_fields_add
+(struct sieve_validator *valdtr, const char *const *fields);
+
 #endif /* __SIEVE_COMMANDS_H */
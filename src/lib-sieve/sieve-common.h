@@ -92,6 +92,7 @@ struct sieve_coded_stringlist;
 
 /* sieve-binary.h */
 struct sieve_binary;
+struct sieve_binary_lru;
 struct sieve_binary_block;
 struct sieve_binary_debug_writer;
 struct sieve_binary_debug_reader;
@@ -162,6 +163,9 @@ bool sieve_validate
 struct sieve_instance {
 	/* Main engine pool */
 	pool_t pool;
+	/* Pool for the environment strings below; replaced when the instance
+	   is reused for another user */
+	pool_t env_pool;
 
 	/* System environment */
 	const char *hostname;
@@ -189,6 +193,9 @@ struct sieve_instance {
 	/* Storage class registry */
 	struct sieve_storage_class_registry *storage_reg;
 
+	/* Duplicate database class registry */
+	struct sieve_duplicate_db_class_registry *duplicate_reg;
+
 	/* System error handler */
 	struct sieve_error_handler *system_ehandler;
 
@@ -203,6 +210,18 @@ struct sieve_instance {
 	unsigned int max_redirects;
 	const struct sieve_address *user_email;
 	struct sieve_address_source redirect_from;
+	bool binary_mmap_disable;
+	size_t binary_cache_size;
+	size_t body_stream_min_size;
+	const char *trace_ring_path;
+	unsigned int trace_ring_sample;
+	size_t trace_ring_max_size;
+
+	/* Settings read while initializing the instance */
+	struct sieve_settings_snapshot *settings_snapshot;
+
+	/* Cache of loaded binaries */
+	struct sieve_binary_lru *binary_lru;
 };
 
 /*
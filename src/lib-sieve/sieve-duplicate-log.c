@@ -0,0 +1,872 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "buffer.h"
+#include "hash.h"
+#include "llist.h"
+#include "md5.h"
+#include "ioloop.h"
+#include "strnum.h"
+#include "home-expand.h"
+#include "mkdir-parents.h"
+#include "eacces-error.h"
+#include "safe-mkstemp.h"
+#include "write-full.h"
+#include "file-lock.h"
+
+#include "sieve-common.h"
+#include "sieve-error.h"
+
+#include "sieve-duplicate-private.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+/* Append-only duplicate log
+
+   The log is a directory with one file per time bucket. A record is appended
+   to the bucket in which it expires, so expired records are removed by
+   unlinking whole bucket files rather than by rewriting anything. All
+   records of the live buckets are indexed in memory, which is refreshed
+   from the mapped files when other processes appended to them.
+
+   Logs are shared within the process and stay open for a while after the
+   last delivery using them. Records are written to the files at each flush,
+   but the files are only fsync()ed once per fsync interval. That way a
+   burst of deliveries shares the cost of fsync(); at worst, a crash of the
+   whole system loses the records of the last interval, causing a repeated
+   vacation response. An interval of 0 syncs at every flush.
+ */
+
+/*
+ * Configuration
+ */
+
+#define SIEVE_DUPLICATE_LOG_MAGIC 0x50554453
+#define SIEVE_DUPLICATE_LOG_VERSION 1
+#define SIEVE_DUPLICATE_LOG_FILE_PREFIX "dup."
+
+#define SIEVE_DUPLICATE_LOG_DEFAULT_BUCKET_SECS (24*60*60)
+#define SIEVE_DUPLICATE_LOG_DEFAULT_FSYNC_SECS 2
+
+/* Seconds to wait for another process appending to the same bucket */
+#define SIEVE_DUPLICATE_LOG_LOCK_TIMEOUT 10
+
+/* Number of logs kept open by the process while not in use */
+#define SIEVE_DUPLICATE_LOG_MAX_UNUSED 8
+
+/*
+ * File format
+ */
+
+struct sieve_duplicate_log_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t bucket_secs;
+	uint32_t bucket;
+};
+
+struct sieve_duplicate_log_record {
+	/* MD5(user NUL id) */
+	unsigned char digest[MD5_RESULTLEN];
+	uint32_t expire;
+	uint32_t unused;
+};
+
+#define SIEVE_DUPLICATE_LOG_RECORDS_SIZE(size) \
+	((((size) - sizeof(struct sieve_duplicate_log_header)) / \
+		sizeof(struct sieve_duplicate_log_record)) * \
+		sizeof(struct sieve_duplicate_log_record))
+
+/*
+ * Types
+ */
+
+struct sieve_duplicate_log_entry {
+	unsigned char digest[MD5_RESULTLEN];
+	time_t expire;
+};
+
+struct sieve_duplicate_log_bucket {
+	unsigned int bucket;
+	char *path;
+	int fd;
+
+	void *mmap_base;
+	size_t mmap_size;
+
+	/* File offset up to which records are indexed */
+	uoff_t indexed_offset;
+
+	/* Records not yet written to the file */
+	buffer_t *pending;
+
+	unsigned int fsync_pending:1;
+	unsigned int broken:1;
+};
+
+struct sieve_duplicate_log {
+	struct sieve_duplicate_log *prev, *next;
+	unsigned int refcount;
+
+	char *path;
+	unsigned int bucket_secs, fsync_secs;
+
+	/* Sorted by bucket number */
+	ARRAY(struct sieve_duplicate_log_bucket *) buckets;
+	time_t dir_mtime, dir_scan_time;
+
+	pool_t entry_pool;
+	HASH_TABLE(const struct sieve_duplicate_log_entry *,
+		struct sieve_duplicate_log_entry *) entries;
+
+	time_t last_fsync;
+};
+
+struct sieve_duplicate_log_db {
+	struct sieve_duplicate_db db;
+
+	struct sieve_duplicate_log *log;
+};
+
+static struct sieve_duplicate_log *sieve_duplicate_logs = NULL;
+
+/*
+ * Index
+ */
+
+static unsigned int
+sieve_duplicate_log_entry_hash(const struct sieve_duplicate_log_entry *entry)
+{
+	unsigned int value;
+
+	/* The digest is uniformly distributed already */
+	memcpy(&value, entry->digest, sizeof(value));
+	return value;
+}
+
+static int
+sieve_duplicate_log_entry_cmp(const struct sieve_duplicate_log_entry *entry1,
+	const struct sieve_duplicate_log_entry *entry2)
+{
+	return memcmp(entry1->digest, entry2->digest, MD5_RESULTLEN);
+}
+
+static void sieve_duplicate_log_index_add
+(struct sieve_duplicate_log *log, const unsigned char *digest,
+	time_t expire)
+{
+	struct sieve_duplicate_log_entry lookup, *entry;
+
+	memcpy(lookup.digest, digest, MD5_RESULTLEN);
+	entry = hash_table_lookup(log->entries, &lookup);
+	if ( entry == NULL ) {
+		entry = p_new(log->entry_pool, struct sieve_duplicate_log_entry, 1);
+		memcpy(entry->digest, digest, MD5_RESULTLEN);
+		entry->expire = expire;
+		hash_table_insert(log->entries, entry, entry);
+	} else if ( expire > entry->expire ) {
+		entry->expire = expire;
+	}
+}
+
+static void sieve_duplicate_log_digest
+(const char *user, const void *id, size_t id_size,
+	unsigned char digest_r[MD5_RESULTLEN])
+{
+	struct md5_context ctx;
+
+	md5_init(&ctx);
+	md5_update(&ctx, user, strlen(user) + 1);
+	md5_update(&ctx, id, id_size);
+	md5_final(&ctx, digest_r);
+}
+
+/*
+ * Buckets
+ */
+
+static void sieve_duplicate_log_bucket_unmap
+(struct sieve_duplicate_log_bucket *bucket)
+{
+	if ( bucket->mmap_base == NULL )
+		return;
+	if ( munmap(bucket->mmap_base, bucket->mmap_size) < 0 )
+		i_error("duplicate log: munmap(%s) failed: %m", bucket->path);
+	bucket->mmap_base = NULL;
+	bucket->mmap_size = 0;
+}
+
+static void sieve_duplicate_log_bucket_free
+(struct sieve_duplicate_log_bucket *bucket)
+{
+	sieve_duplicate_log_bucket_unmap(bucket);
+
+	if ( bucket->fd != -1 && close(bucket->fd) < 0 )
+		i_error("duplicate log: close(%s) failed: %m", bucket->path);
+	if ( bucket->pending != NULL )
+		buffer_free(&bucket->pending);
+	i_free(bucket->path);
+	i_free(bucket);
+}
+
+static struct sieve_duplicate_log_bucket *sieve_duplicate_log_bucket_find
+(struct sieve_duplicate_log *log, unsigned int bucket_no, unsigned int *idx_r)
+{
+	struct sieve_duplicate_log_bucket *const *buckets;
+	unsigned int i, count;
+
+	buckets = array_get(&log->buckets, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( buckets[i]->bucket >= bucket_no )
+			break;
+	}
+
+	*idx_r = i;
+	return ( i < count && buckets[i]->bucket == bucket_no ?
+		buckets[i] : NULL );
+}
+
+static struct sieve_duplicate_log_bucket *sieve_duplicate_log_bucket_get
+(struct sieve_duplicate_log *log, unsigned int bucket_no)
+{
+	struct sieve_duplicate_log_bucket *bucket;
+	unsigned int idx;
+
+	bucket = sieve_duplicate_log_bucket_find(log, bucket_no, &idx);
+	if ( bucket != NULL )
+		return bucket;
+
+	bucket = i_new(struct sieve_duplicate_log_bucket, 1);
+	bucket->bucket = bucket_no;
+	bucket->path = i_strdup_printf("%s/"SIEVE_DUPLICATE_LOG_FILE_PREFIX"%u",
+		log->path, bucket_no);
+	bucket->fd = -1;
+	array_insert(&log->buckets, idx, &bucket, 1);
+	return bucket;
+}
+
+static int sieve_duplicate_log_bucket_check_header
+(struct sieve_duplicate_log *log, struct sieve_duplicate_log_bucket *bucket)
+{
+	struct sieve_duplicate_log_header hdr;
+
+	memcpy(&hdr, bucket->mmap_base, sizeof(hdr));
+	if ( hdr.magic != SIEVE_DUPLICATE_LOG_MAGIC ||
+		hdr.version != SIEVE_DUPLICATE_LOG_VERSION ||
+		hdr.record_size != sizeof(struct sieve_duplicate_log_record) ) {
+		i_error("duplicate log: File %s is corrupt: Invalid header",
+			bucket->path);
+		return -1;
+	}
+	if ( hdr.bucket_secs != log->bucket_secs ||
+		hdr.bucket != bucket->bucket ) {
+		i_error("duplicate log: File %s was created with "
+			"bucket_secs=%u rather than %u", bucket->path,
+			hdr.bucket_secs, log->bucket_secs);
+		return -1;
+	}
+	return 0;
+}
+
+static int sieve_duplicate_log_bucket_refresh
+(struct sieve_duplicate_log *log, struct sieve_duplicate_log_bucket *bucket)
+{
+	const unsigned char *data;
+	struct stat st;
+	uoff_t offset, end;
+
+	if ( bucket->fd == -1 || bucket->broken )
+		return 0;
+
+	if ( fstat(bucket->fd, &st) < 0 ) {
+		i_error("duplicate log: fstat(%s) failed: %m", bucket->path);
+		return -1;
+	}
+	if ( (uoff_t)st.st_size < sizeof(struct sieve_duplicate_log_header) )
+		return 0;
+
+	end = sizeof(struct sieve_duplicate_log_header) +
+		SIEVE_DUPLICATE_LOG_RECORDS_SIZE((uoff_t)st.st_size);
+	if ( end <= bucket->indexed_offset )
+		return 0;
+
+	/* Map the file again to include the new records */
+	if ( end > bucket->mmap_size ) {
+		sieve_duplicate_log_bucket_unmap(bucket);
+		bucket->mmap_base = mmap(NULL, (size_t)end, PROT_READ, MAP_SHARED,
+			bucket->fd, 0);
+		if ( bucket->mmap_base == MAP_FAILED ) {
+			bucket->mmap_base = NULL;
+			i_error("duplicate log: mmap(%s) failed: %m", bucket->path);
+			return -1;
+		}
+		bucket->mmap_size = (size_t)end;
+	}
+
+	if ( bucket->indexed_offset == 0 ) {
+		if ( sieve_duplicate_log_bucket_check_header(log, bucket) < 0 ) {
+			sieve_duplicate_log_bucket_unmap(bucket);
+			bucket->broken = TRUE;
+			return -1;
+		}
+		bucket->indexed_offset = sizeof(struct sieve_duplicate_log_header);
+	}
+
+	data = bucket->mmap_base;
+	for ( offset = bucket->indexed_offset; offset < end;
+		offset += sizeof(struct sieve_duplicate_log_record) ) {
+		struct sieve_duplicate_log_record rec;
+
+		memcpy(&rec, data + offset, sizeof(rec));
+		sieve_duplicate_log_index_add(log, rec.digest, (time_t)rec.expire);
+	}
+	bucket->indexed_offset = end;
+	return 0;
+}
+
+static int sieve_duplicate_log_bucket_open
+(struct sieve_duplicate_log_bucket *bucket)
+{
+	if ( bucket->fd != -1 )
+		return 1;
+
+	bucket->fd = open(bucket->path, O_RDWR | O_APPEND);
+	if ( bucket->fd == -1 ) {
+		if ( errno == ENOENT )
+			return 0;
+		if ( errno == EACCES ) {
+			i_error("duplicate log: %s",
+				eacces_error_get("open", bucket->path));
+		} else {
+			i_error("duplicate log: open(%s) failed: %m", bucket->path);
+		}
+		return -1;
+	}
+	return 1;
+}
+
+static int sieve_duplicate_log_bucket_create
+(struct sieve_duplicate_log *log, struct sieve_duplicate_log_bucket *bucket)
+{
+	struct sieve_duplicate_log_header hdr;
+	string_t *temp_path;
+	int fd, ret;
+
+	if ( (ret=sieve_duplicate_log_bucket_open(bucket)) != 0 )
+		return ( ret > 0 ? 0 : -1 );
+
+	/* Create the file with its header under a temporary name, so that
+	   other processes never append to a file without a header */
+	temp_path = t_str_new(256);
+	str_printfa(temp_path, "%s/.%s", log->path,
+		SIEVE_DUPLICATE_LOG_FILE_PREFIX);
+	fd = safe_mkstemp_hostpid(temp_path, 0600, (uid_t)-1, (gid_t)-1);
+	if ( fd == -1 && errno == ENOENT ) {
+		if ( mkdir_parents(log->path, 0700) < 0 && errno != EEXIST ) {
+			i_error("duplicate log: mkdir_parents(%s) failed: %m",
+				log->path);
+			return -1;
+		}
+		str_truncate(temp_path, 0);
+		str_printfa(temp_path, "%s/.%s", log->path,
+			SIEVE_DUPLICATE_LOG_FILE_PREFIX);
+		fd = safe_mkstemp_hostpid(temp_path, 0600, (uid_t)-1, (gid_t)-1);
+	}
+	if ( fd == -1 ) {
+		i_error("duplicate log: safe_mkstemp(%s) failed: %m",
+			str_c(temp_path));
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SIEVE_DUPLICATE_LOG_MAGIC;
+	hdr.version = SIEVE_DUPLICATE_LOG_VERSION;
+	hdr.record_size = sizeof(struct sieve_duplicate_log_record);
+	hdr.bucket_secs = log->bucket_secs;
+	hdr.bucket = bucket->bucket;
+
+	ret = 0;
+	if ( write_full(fd, &hdr, sizeof(hdr)) < 0 ) {
+		i_error("duplicate log: write(%s) failed: %m", str_c(temp_path));
+		ret = -1;
+	} else if ( link(str_c(temp_path), bucket->path) < 0 &&
+		errno != EEXIST ) {
+		i_error("duplicate log: link(%s, %s) failed: %m",
+			str_c(temp_path), bucket->path);
+		ret = -1;
+	}
+
+	if ( close(fd) < 0 )
+		i_error("duplicate log: close(%s) failed: %m", str_c(temp_path));
+	if ( unlink(str_c(temp_path)) < 0 && errno != ENOENT )
+		i_error("duplicate log: unlink(%s) failed: %m", str_c(temp_path));
+	if ( ret < 0 )
+		return -1;
+
+	/* Created by us or concurrently by another process */
+	return ( sieve_duplicate_log_bucket_open(bucket) > 0 ? 0 : -1 );
+}
+
+static void sieve_duplicate_log_bucket_recreate
+(struct sieve_duplicate_log_bucket *bucket)
+{
+	/* The records of a broken file cannot be used, and appending to it
+	   would only lose the new ones as well; replace it with a new file */
+	i_warning("duplicate log: Replacing broken file %s", bucket->path);
+
+	sieve_duplicate_log_bucket_unmap(bucket);
+	if ( bucket->fd != -1 && close(bucket->fd) < 0 )
+		i_error("duplicate log: close(%s) failed: %m", bucket->path);
+	bucket->fd = -1;
+	bucket->indexed_offset = 0;
+	bucket->broken = FALSE;
+
+	if ( unlink(bucket->path) < 0 && errno != ENOENT )
+		i_error("duplicate log: unlink(%s) failed: %m", bucket->path);
+}
+
+static int sieve_duplicate_log_bucket_write
+(struct sieve_duplicate_log *log, struct sieve_duplicate_log_bucket *bucket)
+{
+	struct file_lock *lock;
+	struct stat st;
+	uoff_t size;
+	int ret = 0;
+
+	if ( bucket->pending == NULL || bucket->pending->used == 0 )
+		return 0;
+
+	if ( bucket->broken )
+		sieve_duplicate_log_bucket_recreate(bucket);
+
+	T_BEGIN {
+		ret = sieve_duplicate_log_bucket_create(log, bucket);
+	} T_END;
+	if ( ret < 0 )
+		return -1;
+
+	/* Appenders hold the lock while writing, so a partial record found at
+	   the end of the file under the lock was left behind by a crash */
+	ret = file_wait_lock(bucket->fd, bucket->path, F_WRLCK,
+		FILE_LOCK_METHOD_FCNTL, SIEVE_DUPLICATE_LOG_LOCK_TIMEOUT, &lock);
+	if ( ret <= 0 ) {
+		if ( ret == 0 ) {
+			i_error("duplicate log: timed out locking %s", bucket->path);
+		} else {
+			i_error("duplicate log: failed to lock %s: %m", bucket->path);
+		}
+		return -1;
+	}
+
+	ret = 0;
+	if ( fstat(bucket->fd, &st) < 0 ) {
+		i_error("duplicate log: fstat(%s) failed: %m", bucket->path);
+		ret = -1;
+	} else {
+		/* Appending after a partial record would corrupt all later
+		   records */
+		size = sizeof(struct sieve_duplicate_log_header) +
+			SIEVE_DUPLICATE_LOG_RECORDS_SIZE((uoff_t)st.st_size);
+		if ( (uoff_t)st.st_size > size && ftruncate(bucket->fd, size) < 0 ) {
+			i_error("duplicate log: ftruncate(%s) failed: %m", bucket->path);
+			ret = -1;
+		}
+	}
+
+	if ( ret == 0 && write_full(bucket->fd, bucket->pending->data,
+		bucket->pending->used) < 0 ) {
+		i_error("duplicate log: write(%s) failed: %m", bucket->path);
+		ret = -1;
+	}
+	file_unlock(&lock);
+	if ( ret < 0 )
+		return -1;
+
+	buffer_set_used_size(bucket->pending, 0);
+	bucket->fsync_pending = TRUE;
+	return 0;
+}
+
+static void sieve_duplicate_log_fsync(struct sieve_duplicate_log *log)
+{
+	struct sieve_duplicate_log_bucket *const *bucketp;
+
+	array_foreach(&log->buckets, bucketp) {
+		struct sieve_duplicate_log_bucket *bucket = *bucketp;
+
+		if ( !bucket->fsync_pending )
+			continue;
+		if ( fdatasync(bucket->fd) < 0 )
+			i_error("duplicate log: fdatasync(%s) failed: %m", bucket->path);
+		bucket->fsync_pending = FALSE;
+	}
+	log->last_fsync = ioloop_time;
+}
+
+/*
+ * Log
+ */
+
+static void sieve_duplicate_log_reindex(struct sieve_duplicate_log *log)
+{
+	struct sieve_duplicate_log_bucket *const *bucketp;
+
+	hash_table_clear(log->entries, FALSE);
+	p_clear(log->entry_pool);
+
+	array_foreach(&log->buckets, bucketp) {
+		struct sieve_duplicate_log_bucket *bucket = *bucketp;
+
+		bucket->indexed_offset = 0;
+		(void)sieve_duplicate_log_bucket_refresh(log, bucket);
+	}
+}
+
+static void sieve_duplicate_log_expire(struct sieve_duplicate_log *log)
+{
+	struct sieve_duplicate_log_bucket *bucket;
+	unsigned int cutoff = ioloop_time / log->bucket_secs;
+	bool expired = FALSE;
+
+	/* Buckets before the current one only contain expired records */
+	while ( array_count(&log->buckets) > 0 ) {
+		bucket = *array_idx(&log->buckets, 0);
+		if ( bucket->bucket >= cutoff )
+			break;
+
+		if ( unlink(bucket->path) < 0 && errno != ENOENT )
+			i_error("duplicate log: unlink(%s) failed: %m", bucket->path);
+		array_delete(&log->buckets, 0, 1);
+		sieve_duplicate_log_bucket_free(bucket);
+		expired = TRUE;
+	}
+
+	/* Compact the index */
+	if ( expired )
+		sieve_duplicate_log_reindex(log);
+}
+
+static int sieve_duplicate_log_scan_dir(struct sieve_duplicate_log *log)
+{
+	unsigned int cutoff = ioloop_time / log->bucket_secs;
+	DIR *dirp;
+	struct dirent *dp;
+	int ret = 0;
+
+	if ( (dirp=opendir(log->path)) == NULL ) {
+		if ( errno == ENOENT )
+			return 0;
+		i_error("duplicate log: opendir(%s) failed: %m", log->path);
+		return -1;
+	}
+
+	errno = 0;
+	while ( (dp=readdir(dirp)) != NULL ) {
+		struct sieve_duplicate_log_bucket *bucket;
+		unsigned int bucket_no;
+
+		if ( strncmp(dp->d_name, SIEVE_DUPLICATE_LOG_FILE_PREFIX,
+			strlen(SIEVE_DUPLICATE_LOG_FILE_PREFIX)) != 0 )
+			continue;
+		if ( str_to_uint(dp->d_name +
+			strlen(SIEVE_DUPLICATE_LOG_FILE_PREFIX), &bucket_no) < 0 )
+			continue;
+		if ( bucket_no < cutoff )
+			continue;
+
+		/* Also opens buckets that only had records pending so far */
+		bucket = sieve_duplicate_log_bucket_get(log, bucket_no);
+		if ( sieve_duplicate_log_bucket_open(bucket) < 0 )
+			ret = -1;
+		errno = 0;
+	}
+	if ( errno != 0 ) {
+		i_error("duplicate log: readdir(%s) failed: %m", log->path);
+		ret = -1;
+	}
+	if ( closedir(dirp) < 0 )
+		i_error("duplicate log: closedir(%s) failed: %m", log->path);
+	return ret;
+}
+
+static void sieve_duplicate_log_refresh(struct sieve_duplicate_log *log)
+{
+	struct sieve_duplicate_log_bucket *const *bucketp;
+	struct stat st;
+
+	/* Look for buckets created by other processes */
+	if ( stat(log->path, &st) < 0 ) {
+		if ( errno != ENOENT )
+			i_error("duplicate log: stat(%s) failed: %m", log->path);
+	} else if ( st.st_mtime != log->dir_mtime ||
+		st.st_mtime >= log->dir_scan_time ) {
+		log->dir_mtime = st.st_mtime;
+		log->dir_scan_time = ioloop_time;
+		(void)sieve_duplicate_log_scan_dir(log);
+	}
+
+	/* Index records appended by other processes */
+	array_foreach(&log->buckets, bucketp)
+		(void)sieve_duplicate_log_bucket_refresh(log, *bucketp);
+}
+
+static struct sieve_duplicate_log *sieve_duplicate_log_create
+(const char *path, unsigned int bucket_secs, unsigned int fsync_secs)
+{
+	struct sieve_duplicate_log *log;
+
+	log = i_new(struct sieve_duplicate_log, 1);
+	log->path = i_strdup(path);
+	log->bucket_secs = bucket_secs;
+	log->fsync_secs = fsync_secs;
+	log->last_fsync = ioloop_time;
+
+	i_array_init(&log->buckets, 16);
+	log->entry_pool = pool_alloconly_create("sieve duplicate log", 8192);
+	hash_table_create(&log->entries, default_pool, 0,
+		sieve_duplicate_log_entry_hash, sieve_duplicate_log_entry_cmp);
+
+	sieve_duplicate_log_refresh(log);
+	sieve_duplicate_log_expire(log);
+	return log;
+}
+
+static void sieve_duplicate_log_destroy(struct sieve_duplicate_log *log)
+{
+	struct sieve_duplicate_log_bucket *const *bucketp;
+
+	DLLIST_REMOVE(&sieve_duplicate_logs, log);
+
+	array_foreach(&log->buckets, bucketp)
+		(void)sieve_duplicate_log_bucket_write(log, *bucketp);
+	sieve_duplicate_log_fsync(log);
+
+	array_foreach(&log->buckets, bucketp)
+		sieve_duplicate_log_bucket_free(*bucketp);
+	array_free(&log->buckets);
+
+	hash_table_destroy(&log->entries);
+	pool_unref(&log->entry_pool);
+	i_free(log->path);
+	i_free(log);
+}
+
+void sieve_duplicate_log_deinit(void)
+{
+	struct sieve_duplicate_log *log, *next;
+
+	/* Logs still referenced belong to another instance of this process */
+	for ( log = sieve_duplicate_logs; log != NULL; log = next ) {
+		next = log->next;
+		if ( log->refcount == 0 )
+			sieve_duplicate_log_destroy(log);
+	}
+}
+
+static struct sieve_duplicate_log *sieve_duplicate_log_get
+(const char *path, unsigned int bucket_secs, unsigned int fsync_secs)
+{
+	struct sieve_duplicate_log *log;
+
+	for ( log = sieve_duplicate_logs; log != NULL; log = log->next ) {
+		if ( strcmp(log->path, path) == 0 )
+			break;
+	}
+
+	if ( log == NULL ) {
+		log = sieve_duplicate_log_create(path, bucket_secs, fsync_secs);
+	} else {
+		DLLIST_REMOVE(&sieve_duplicate_logs, log);
+	}
+
+	/* Most recently used first */
+	DLLIST_PREPEND(&sieve_duplicate_logs, log);
+	log->refcount++;
+	return log;
+}
+
+static void sieve_duplicate_log_unref(struct sieve_duplicate_log **_log)
+{
+	struct sieve_duplicate_log *log = *_log, *unused, *next;
+	unsigned int count = 0;
+
+	*_log = NULL;
+
+	i_assert( log->refcount > 0 );
+	if ( --log->refcount > 0 )
+		return;
+
+	/* Keep it open for the next delivery, but limit the number of unused
+	   logs */
+	for ( unused = sieve_duplicate_logs; unused != NULL; unused = next ) {
+		next = unused->next;
+
+		if ( unused->refcount > 0 )
+			continue;
+		if ( ++count > SIEVE_DUPLICATE_LOG_MAX_UNUSED )
+			sieve_duplicate_log_destroy(unused);
+	}
+}
+
+static void sieve_duplicate_log_flush(struct sieve_duplicate_log *log)
+{
+	struct sieve_duplicate_log_bucket *const *bucketp;
+
+	array_foreach(&log->buckets, bucketp)
+		(void)sieve_duplicate_log_bucket_write(log, *bucketp);
+
+	if ( log->fsync_secs == 0 ||
+		ioloop_time - log->last_fsync >= (time_t)log->fsync_secs )
+		sieve_duplicate_log_fsync(log);
+
+	sieve_duplicate_log_expire(log);
+}
+
+/*
+ * Driver
+ */
+
+static struct sieve_duplicate_db *sieve_duplicate_log_db_alloc(void)
+{
+	struct sieve_duplicate_log_db *ldb;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_duplicate_log_db", 256);
+	ldb = p_new(pool, struct sieve_duplicate_log_db, 1);
+	ldb->db = sieve_duplicate_log_db;
+	ldb->db.pool = pool;
+
+	return &ldb->db;
+}
+
+static void sieve_duplicate_log_db_destroy(struct sieve_duplicate_db *db)
+{
+	struct sieve_duplicate_log_db *ldb =
+		(struct sieve_duplicate_log_db *)db;
+
+	if ( ldb->log != NULL )
+		sieve_duplicate_log_unref(&ldb->log);
+}
+
+static int sieve_duplicate_log_db_init
+(struct sieve_duplicate_db *db, const char *data,
+	const char *const *options)
+{
+	struct sieve_duplicate_log_db *ldb =
+		(struct sieve_duplicate_log_db *)db;
+	struct sieve_instance *svinst = db->svinst;
+	unsigned int bucket_secs = SIEVE_DUPLICATE_LOG_DEFAULT_BUCKET_SECS;
+	unsigned int fsync_secs = SIEVE_DUPLICATE_LOG_DEFAULT_FSYNC_SECS;
+	const char *path = data;
+
+	for ( ; *options != NULL; options++ ) {
+		const char *option = *options;
+
+		if ( strncasecmp(option, "bucket_secs=", 12) == 0 ) {
+			if ( str_to_uint(option+12, &bucket_secs) < 0 ||
+				bucket_secs == 0 ) {
+				sieve_sys_error(svinst, "duplicate log: "
+					"Invalid bucket_secs value: %s", option+12);
+				return -1;
+			}
+		} else if ( strncasecmp(option, "fsync_interval=", 15) == 0 ) {
+			if ( str_to_uint(option+15, &fsync_secs) < 0 ) {
+				sieve_sys_error(svinst, "duplicate log: "
+					"Invalid fsync_interval value: %s", option+15);
+				return -1;
+			}
+		} else {
+			sieve_sys_error(svinst,
+				"duplicate log: Invalid option `%s'", option);
+			return -1;
+		}
+	}
+
+	if ( *path == '\0' ) {
+		sieve_sys_error(svinst, "duplicate log: No directory specified");
+		return -1;
+	}
+	if ( *path == '~' ) {
+		if ( svinst->home_dir == NULL ) {
+			sieve_sys_error(svinst, "duplicate log: "
+				"Directory `%s' is relative to home directory, "
+				"but home directory is not available", path);
+			return -1;
+		}
+		path = home_expand_tilde(path, svinst->home_dir);
+	}
+
+	ldb->log = sieve_duplicate_log_get(path, bucket_secs, fsync_secs);
+	return 0;
+}
+
+static int sieve_duplicate_log_db_check
+(struct sieve_duplicate_db *db, const char *user,
+	const void *id, size_t id_size)
+{
+	struct sieve_duplicate_log_db *ldb =
+		(struct sieve_duplicate_log_db *)db;
+	struct sieve_duplicate_log_entry lookup, *entry;
+
+	sieve_duplicate_log_refresh(ldb->log);
+
+	sieve_duplicate_log_digest(user, id, id_size, lookup.digest);
+	entry = hash_table_lookup(ldb->log->entries, &lookup);
+	return ( entry != NULL && entry->expire > ioloop_time ? 1 : 0 );
+}
+
+static void sieve_duplicate_log_db_mark
+(struct sieve_duplicate_db *db, const char *user,
+	const void *id, size_t id_size, time_t time)
+{
+	struct sieve_duplicate_log_db *ldb =
+		(struct sieve_duplicate_log_db *)db;
+	struct sieve_duplicate_log *log = ldb->log;
+	struct sieve_duplicate_log_bucket *bucket;
+	struct sieve_duplicate_log_record rec;
+
+	if ( time <= ioloop_time )
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	sieve_duplicate_log_digest(user, id, id_size, rec.digest);
+	rec.expire = (uint32_t)time;
+
+	sieve_duplicate_log_index_add(log, rec.digest, time);
+
+	bucket = sieve_duplicate_log_bucket_get
+		(log, (unsigned int)(time / log->bucket_secs));
+	if ( bucket->pending == NULL )
+		bucket->pending = buffer_create_dynamic(default_pool, 256);
+	buffer_append(bucket->pending, &rec, sizeof(rec));
+}
+
+static void sieve_duplicate_log_db_flush(struct sieve_duplicate_db *db)
+{
+	struct sieve_duplicate_log_db *ldb =
+		(struct sieve_duplicate_log_db *)db;
+
+	sieve_duplicate_log_flush(ldb->log);
+}
+
+const struct sieve_duplicate_db sieve_duplicate_log_db = {
+	.driver_name = "log",
+	.v = {
+		sieve_duplicate_log_db_alloc,
+		sieve_duplicate_log_db_destroy,
+		sieve_duplicate_log_db_init,
+
+		sieve_duplicate_log_db_check,
+		sieve_duplicate_log_db_mark,
+		sieve_duplicate_log_db_flush
+	}
+};
@@ -0,0 +1,47 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __SIEVE_DUPLICATE_PRIVATE_H
+#define __SIEVE_DUPLICATE_PRIVATE_H
+
+#include "sieve-duplicate.h"
+
+ARRAY_DEFINE_TYPE(sieve_duplicate_db_class,
+	const struct sieve_duplicate_db *);
+
+struct sieve_duplicate_db_vfuncs {
+	struct sieve_duplicate_db *(*alloc)(void);
+	void (*destroy)(struct sieve_duplicate_db *db);
+	int (*init)
+		(struct sieve_duplicate_db *db, const char *data,
+			const char *const *options);
+
+	int (*check)
+		(struct sieve_duplicate_db *db, const char *user,
+			const void *id, size_t id_size);
+	void (*mark)
+		(struct sieve_duplicate_db *db, const char *user,
+			const void *id, size_t id_size, time_t time);
+	void (*flush)(struct sieve_duplicate_db *db);
+};
+
+struct sieve_duplicate_db {
+	pool_t pool;
+	struct sieve_instance *svinst;
+
+	const char *driver_name;
+	struct sieve_duplicate_db_vfuncs v;
+
+	const char *location;
+};
+
+/*
+ * Drivers
+ */
+
+extern const struct sieve_duplicate_db sieve_duplicate_log_db;
+
+/* Writes and closes the logs that are no longer used */
+void sieve_duplicate_log_deinit(void);
+
+#endif /* __SIEVE_DUPLICATE_PRIVATE_H */
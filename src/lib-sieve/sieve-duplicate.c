@@ -0,0 +1,167 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+
+#include "sieve-common.h"
+#include "sieve-error.h"
+
+#include "sieve-duplicate-private.h"
+
+/*
+ * Database class registry
+ */
+
+struct sieve_duplicate_db_class_registry {
+	ARRAY_TYPE(sieve_duplicate_db_class) db_classes;
+};
+
+void sieve_duplicate_dbs_init(struct sieve_instance *svinst)
+{
+	svinst->duplicate_reg =
+		p_new(svinst->pool, struct sieve_duplicate_db_class_registry, 1);
+	p_array_init(&svinst->duplicate_reg->db_classes, svinst->pool, 4);
+
+	sieve_duplicate_db_class_register(svinst, &sieve_duplicate_log_db);
+}
+
+void sieve_duplicate_dbs_deinit(struct sieve_instance *svinst ATTR_UNUSED)
+{
+	sieve_duplicate_log_deinit();
+}
+
+static const struct sieve_duplicate_db *sieve_duplicate_db_find_class
+(struct sieve_instance *svinst, const char *name)
+{
+	struct sieve_duplicate_db_class_registry *reg = svinst->duplicate_reg;
+	const struct sieve_duplicate_db *const *classes;
+	unsigned int i, count;
+
+	classes = array_get(&reg->db_classes, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( strcasecmp(classes[i]->driver_name, name) == 0 )
+			return classes[i];
+	}
+	return NULL;
+}
+
+void sieve_duplicate_db_class_register
+(struct sieve_instance *svinst, const struct sieve_duplicate_db *db_class)
+{
+	struct sieve_duplicate_db_class_registry *reg = svinst->duplicate_reg;
+
+	if ( sieve_duplicate_db_find_class
+		(svinst, db_class->driver_name) != NULL ) {
+		i_panic("sieve_duplicate_db_class_register(%s): "
+			"Already registered", db_class->driver_name);
+	}
+
+	array_append(&reg->db_classes, &db_class, 1);
+}
+
+void sieve_duplicate_db_class_unregister
+(struct sieve_instance *svinst, const struct sieve_duplicate_db *db_class)
+{
+	struct sieve_duplicate_db_class_registry *reg = svinst->duplicate_reg;
+	const struct sieve_duplicate_db *const *classes;
+	unsigned int i, count;
+
+	classes = array_get(&reg->db_classes, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( classes[i] == db_class ) {
+			array_delete(&reg->db_classes, i, 1);
+			break;
+		}
+	}
+}
+
+/*
+ * Database instance
+ */
+
+int sieve_duplicate_db_open
+(struct sieve_instance *svinst, const char *location,
+	struct sieve_duplicate_db **db_r)
+{
+	const struct sieve_duplicate_db *db_class;
+	struct sieve_duplicate_db *db;
+	const char *driver, *data, *const *options;
+	const char *p;
+	int ret;
+
+	*db_r = NULL;
+	if ( location == NULL || *location == '\0' )
+		return 0;
+
+	T_BEGIN {
+		p = strchr(location, ':');
+		if ( p == NULL ) {
+			driver = location;
+			data = "";
+		} else {
+			driver = t_strdup_until(location, p);
+			data = p + 1;
+		}
+		options = t_strsplit(data, ";");
+		data = options[0];
+		options++;
+
+		db_class = sieve_duplicate_db_find_class(svinst, driver);
+		if ( db_class == NULL ) {
+			sieve_sys_error(svinst,
+				"duplicate db: Unknown driver `%s' in location `%s'",
+				driver, location);
+			ret = -1;
+		} else {
+			db = db_class->v.alloc();
+			db->svinst = svinst;
+			db->driver_name = db_class->driver_name;
+			db->v = db_class->v;
+			db->location = p_strdup(db->pool, location);
+
+			if ( (ret=db->v.init(db, data, options)) < 0 ) {
+				db->v.destroy(db);
+				pool_unref(&db->pool);
+			} else {
+				*db_r = db;
+				ret = 1;
+			}
+		}
+	} T_END;
+
+	return ret;
+}
+
+void sieve_duplicate_db_close(struct sieve_duplicate_db **_db)
+{
+	struct sieve_duplicate_db *db = *_db;
+
+	*_db = NULL;
+
+	if ( db->v.flush != NULL )
+		db->v.flush(db);
+	if ( db->v.destroy != NULL )
+		db->v.destroy(db);
+	pool_unref(&db->pool);
+}
+
+int sieve_duplicate_db_check
+(struct sieve_duplicate_db *db, const char *user,
+	const void *id, size_t id_size)
+{
+	return db->v.check(db, ( user == NULL ? "" : user ), id, id_size);
+}
+
+void sieve_duplicate_db_mark
+(struct sieve_duplicate_db *db, const char *user,
+	const void *id, size_t id_size, time_t time)
+{
+	db->v.mark(db, ( user == NULL ? "" : user ), id, id_size, time);
+}
+
+void sieve_duplicate_db_flush(struct sieve_duplicate_db *db)
+{
+	if ( db->v.flush != NULL )
+		db->v.flush(db);
+}
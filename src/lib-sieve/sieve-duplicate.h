@@ -0,0 +1,53 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __SIEVE_DUPLICATE_H
+#define __SIEVE_DUPLICATE_H
+
+#include "sieve-common.h"
+
+/*
+ * Duplicate tracking database
+ */
+
+/* Records the IDs of the responses and deliveries that were already handled
+   by the vacation, duplicate and redirect actions. Normally, this is left to
+   the environment through the duplicate_* callbacks of the script
+   environment. When a database is assigned to the script environment, it
+   is used instead.
+
+   The database location has the form "<driver>:<data>[;<option>...]".
+ */
+
+struct sieve_duplicate_db;
+
+void sieve_duplicate_dbs_init(struct sieve_instance *svinst);
+void sieve_duplicate_dbs_deinit(struct sieve_instance *svinst);
+
+void sieve_duplicate_db_class_register
+	(struct sieve_instance *svinst,
+		const struct sieve_duplicate_db *db_class);
+void sieve_duplicate_db_class_unregister
+	(struct sieve_instance *svinst,
+		const struct sieve_duplicate_db *db_class);
+
+/* Returns 1 when the database is opened, 0 when no location is configured
+   and -1 when opening failed (the error is logged). */
+int sieve_duplicate_db_open
+	(struct sieve_instance *svinst, const char *location,
+		struct sieve_duplicate_db **db_r);
+/* Flushes and closes the database */
+void sieve_duplicate_db_close(struct sieve_duplicate_db **_db);
+
+/* Returns 1 when the id was marked for this user before and 0 otherwise
+   (also when the database fails) */
+int sieve_duplicate_db_check
+	(struct sieve_duplicate_db *db, const char *user,
+		const void *id, size_t id_size);
+/* Marks the id for this user until the indicated expiry time */
+void sieve_duplicate_db_mark
+	(struct sieve_duplicate_db *db, const char *user,
+		const void *id, size_t id_size, time_t time);
+void sieve_duplicate_db_flush(struct sieve_duplicate_db *db);
+
+#endif /* __SIEVE_DUPLICATE_H */
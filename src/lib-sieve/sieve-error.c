@@ -4,7 +4,7 @@
 #include "lib.h"
 #include "str.h"
 #include "array.h"
-#include "ostream.h"
+#include "write-full.h"
 #include "var-expand.h"
 #include "eacces-error.h"
 
@@ -922,6 +922,9 @@ struct sieve_error_handler *sieve_strbuf_ehandler_create
  * Logfile error handler
  *
  * - Output errors to a log file
+ * - Messages are collected in memory and written using a single write() when
+ *   the handler is freed, while the privileges of the user are still in
+ *   effect.
  */
 
 struct sieve_logfile_ehandler {
@@ -929,44 +932,137 @@ struct sieve_logfile_ehandler {
 
 	const char *logfile;
 	bool started;
-	int fd;
-	struct ostream *stream;
+	buffer_t *buffer;
 };
 
-static void ATTR_FORMAT(4, 0) sieve_logfile_vprintf
-(struct sieve_logfile_ehandler *ehandler, const char *location,
-	const char *prefix, const char *fmt, va_list args)
+static int sieve_logfile_open
+(struct sieve_instance *svinst, const char *logfile, size_t size)
+{
+	const char *rotated;
+	struct stat st;
+	int fd;
+
+	/* Open the logfile */
+
+	fd = open(logfile, O_CREAT | O_APPEND | O_WRONLY, 0600);
+	if ( fd == -1 ) {
+		if ( errno == EACCES ) {
+			sieve_sys_error(svinst,
+				"failed to open logfile (LOGGING TO STDERR): %s",
+				eacces_error_get_creating("open", logfile));
+		} else {
+			sieve_sys_error(svinst,
+				"failed to open logfile (LOGGING TO STDERR): "
+				"open(%s) failed: %m", logfile);
+		}
+		return STDERR_FILENO;
+	}
+
+	/* Stat the log file to obtain size information */
+	if ( fstat(fd, &st) != 0 ) {
+		sieve_sys_error(svinst,
+			"failed to stat logfile (logging to STDERR): "
+			"fstat(fd=%s) failed: %m", logfile);
+
+		if ( close(fd) < 0 ) {
+			sieve_sys_error(svinst,
+				"failed to close logfile after error: "
+				"close(fd=%s) failed: %m", logfile);
+		}
+		return STDERR_FILENO;
+	}
+
+	/* Rotate log when it would grow too large; the size of the whole write is
+	   known beforehand */
+	if ( st.st_size == 0 || (uoff_t)st.st_size + size < LOGFILE_MAX_SIZE )
+		return fd;
+
+	/* Close open file */
+	if ( close(fd) < 0 ) {
+		sieve_sys_error(svinst,
+			"failed to close logfile: close(fd=%s) failed: %m", logfile);
+	}
+
+	/* Rotate logfile */
+	rotated = t_strconcat(logfile, ".0", NULL);
+	if ( rename(logfile, rotated) < 0 && errno != ENOENT ) {
+		if ( errno == EACCES ) {
+			sieve_sys_error(svinst,
+				"failed to rotate logfile: %s",
+				eacces_error_get_creating("rename",
+					t_strconcat(logfile, ", ", rotated, NULL)));
+		} else {
+			sieve_sys_error(svinst,
+				"failed to rotate logfile: rename(%s, %s) failed: %m",
+				logfile, rotated);
+		}
+	}
+
+	/* Open clean logfile (overwrites existing if rename() failed earlier) */
+	fd = open(logfile, O_CREAT | O_APPEND | O_WRONLY | O_TRUNC, 0600);
+	if ( fd == -1 ) {
+		if ( errno == EACCES ) {
+			sieve_sys_error(svinst,
+				"failed to open logfile (LOGGING TO STDERR): %s",
+				eacces_error_get_creating("open", logfile));
+		} else {
+			sieve_sys_error(svinst,
+				"failed to open logfile (LOGGING TO STDERR): "
+				"open(%s) failed: %m", logfile);
+		}
+		return STDERR_FILENO;
+	}
+	return fd;
+}
+
+static void sieve_logfile_write
+(struct sieve_instance *svinst, const char *logfile,
+	const buffer_t *data)
 {
-	string_t *outbuf;
-	ssize_t ret = 0, remain;
-	const char *data;
+	int fd;
 
-	if ( ehandler->stream == NULL ) return;
+	if ( data->used == 0 )
+		return;
 
 	T_BEGIN {
-		outbuf = t_str_new(256);
-		if ( location != NULL && *location != '\0' )
-			str_printfa(outbuf, "%s: ", location);
-		str_printfa(outbuf, "%s: ", prefix);
-		str_vprintfa(outbuf, fmt, args);
-		str_append(outbuf, ".\n");
-
-		remain = str_len(outbuf);
-		data = (const char *) str_data(outbuf);
-
-		while ( remain > 0 ) {
-			if ( (ret=o_stream_send(ehandler->stream, data, remain)) < 0 )
-				break;
-
-			remain -= ret;
-			data += ret;
+		fd = sieve_logfile_open(svinst, logfile, data->used);
+
+		if ( write_full(fd, data->data, data->used) < 0 ) {
+			sieve_sys_error(svinst,
+				"failed to write logfile: write(%s) failed: %m", logfile);
+		}
+
+		if ( fd != STDERR_FILENO && close(fd) < 0 ) {
+			sieve_sys_error(svinst, "failed to close logfile: "
+				"close(fd=%s) failed: %m", logfile);
 		}
 	} T_END;
+}
 
-	if ( ret < 0 ) {
-		sieve_sys_error(ehandler->handler.svinst,
-			"o_stream_send() failed on logfile %s: %m", ehandler->logfile);
-	}
+/* Error handler */
+
+static void sieve_logfile_flush(struct sieve_logfile_ehandler *ehandler)
+{
+	sieve_logfile_write
+		(ehandler->handler.svinst, ehandler->logfile, ehandler->buffer);
+	buffer_set_used_size(ehandler->buffer, 0);
+}
+
+static void ATTR_FORMAT(4, 0) sieve_logfile_vprintf
+(struct sieve_logfile_ehandler *ehandler, const char *location,
+	const char *prefix, const char *fmt, va_list args)
+{
+	string_t *outbuf = ehandler->buffer;
+
+	/* Write what was collected so far when a script logs a lot */
+	if ( outbuf->used >= LOGFILE_MAX_SIZE )
+		sieve_logfile_flush(ehandler);
+
+	if ( location != NULL && *location != '\0' )
+		str_printfa(outbuf, "%s: ", location);
+	str_printfa(outbuf, "%s: ", prefix);
+	str_vprintfa(outbuf, fmt, args);
+	str_append(outbuf, ".\n");
 }
 
 inline static void ATTR_FORMAT(4, 5) sieve_logfile_printf
@@ -983,105 +1079,19 @@ inline static void ATTR_FORMAT(4, 5) sieve_logfile_printf
 
 static void sieve_logfile_start(struct sieve_logfile_ehandler *ehandler)
 {
-	struct sieve_instance *svinst = ehandler->handler.svinst;
-	struct ostream *ostream = NULL;
-	struct stat st;
 	struct tm *tm;
 	char buf[256];
 	time_t now;
-	int fd;
-
-	/* Open the logfile */
-
-	fd = open(ehandler->logfile, O_CREAT | O_APPEND | O_WRONLY, 0600);
-	if (fd == -1) {
-		if ( errno == EACCES ) {
-			sieve_sys_error(svinst, "failed to open logfile (LOGGING TO STDERR): %s",
-				eacces_error_get_creating("open", ehandler->logfile));
-		} else {
-			sieve_sys_error(svinst, "failed to open logfile (LOGGING TO STDERR): "
-				"open(%s) failed: %m", ehandler->logfile);
-		}
-		fd = STDERR_FILENO;
-	} else {
-		/* fd_close_on_exec(fd, TRUE); Necessary? */
-
-		/* Stat the log file to obtain size information */
-		if ( fstat(fd, &st) != 0 ) {
-			sieve_sys_error(svinst, "failed to stat logfile (logging to STDERR): "
-				"fstat(fd=%s) failed: %m", ehandler->logfile);
-
-			if ( close(fd) < 0 ) {
-				sieve_sys_error(svinst, "failed to close logfile after error: "
-					"close(fd=%s) failed: %m", ehandler->logfile);
-			}
 
-			fd = STDERR_FILENO;
-		}
-
-		/* Rotate log when it has grown too large */
-		if ( st.st_size >= LOGFILE_MAX_SIZE ) {
-			const char *rotated;
-
-			/* Close open file */
-			if ( close(fd) < 0 ) {
-				sieve_sys_error(svinst,
-					"failed to close logfile: close(fd=%s) failed: %m", ehandler->logfile);
-			}
-
-			/* Rotate logfile */
-			rotated = t_strconcat(ehandler->logfile, ".0", NULL);
-			if ( rename(ehandler->logfile, rotated) < 0 && errno != ENOENT ) {
-				if ( errno == EACCES ) {
-					sieve_sys_error(svinst,
-						"failed to rotate logfile: %s",
-						eacces_error_get_creating("rename",
-							t_strconcat(ehandler->logfile, ", ", rotated, NULL)));
-				} else {
-					sieve_sys_error(svinst,
-						"failed to rotate logfile: rename(%s, %s) failed: %m",
-						ehandler->logfile, rotated);
-				}
-			}
-
-			/* Open clean logfile (overwrites existing if rename() failed earlier) */
-			fd = open(ehandler->logfile,
-				O_CREAT | O_APPEND | O_WRONLY | O_TRUNC, 0600);
-			if (fd == -1) {
-				if ( errno == EACCES ) {
-					sieve_sys_error(svinst,
-						"failed to open logfile (LOGGING TO STDERR): %s",
-						eacces_error_get_creating("open", ehandler->logfile));
-				} else {
-					sieve_sys_error(svinst,
-						"failed to open logfile (LOGGING TO STDERR): open(%s) failed: %m",
-						ehandler->logfile);
-				}
-				fd = STDERR_FILENO;
-			}
-		}
-	}
-
-	ostream = o_stream_create_fd(fd, 0);
-	if ( ostream == NULL ) {
-		/* Can't we do anything else in this most awkward situation? */
-		sieve_sys_error(svinst, "failed to open log stream on open file: "
-			"o_stream_create_fd(fd=%s) failed "
-			"(non-critical messages are not logged!)", ehandler->logfile);
-	}
-
-	ehandler->fd = fd;
-	ehandler->stream = ostream;
+	ehandler->buffer = buffer_create_dynamic(default_pool, 1024);
 	ehandler->started = TRUE;
 
-	if ( ostream != NULL ) {
-		now = time(NULL);
-		tm = localtime(&now);
+	now = time(NULL);
+	tm = localtime(&now);
 
-		if (strftime(buf, sizeof(buf), "%b %d %H:%M:%S", tm) > 0) {
-			sieve_logfile_printf(ehandler, "sieve", "info",
-				"started log at %s", buf);
-		}
+	if (strftime(buf, sizeof(buf), "%b %d %H:%M:%S", tm) > 0) {
+		sieve_logfile_printf(ehandler, "sieve", "info",
+			"started log at %s", buf);
 	}
 }
 
@@ -1139,15 +1149,11 @@ static void sieve_logfile_free
 	struct sieve_logfile_ehandler *handler =
 		(struct sieve_logfile_ehandler *) ehandler;
 
-	if ( handler->stream != NULL ) {
-		o_stream_destroy(&(handler->stream));
-		if ( handler->fd != STDERR_FILENO ){
-			if ( close(handler->fd) < 0 ) {
-				sieve_sys_error(ehandler->svinst, "failed to close logfile: "
-					"close(fd=%s) failed: %m", handler->logfile);
-			}
-		}
-	}
+	if ( handler->buffer == NULL )
+		return;
+
+	sieve_logfile_flush(handler);
+	buffer_free(&handler->buffer);
 }
 
 struct sieve_error_handler *sieve_logfile_ehandler_create
@@ -1171,8 +1177,7 @@ struct sieve_error_handler *sieve_logfile_ehandler_create
 	 */
 	ehandler->logfile = p_strdup(pool, logfile);
 	ehandler->started = FALSE;
-	ehandler->stream = NULL;
-	ehandler->fd = -1;
+	ehandler->buffer = NULL;
 
 	return &(ehandler->handler);
 }
@@ -291,6 +291,21 @@ void sieve_extensions_configure(struct sieve_instance *svinst)
 		sieve_extensions_set_string(svinst, extensions, FALSE, TRUE);
 }
 
+void sieve_extensions_reset(struct sieve_instance *svinst)
+{
+	struct sieve_extension_registry *ext_reg = svinst->ext_reg;
+	struct sieve_extension *const *exts;
+	unsigned int i, ext_count;
+
+	exts = array_get(&ext_reg->extensions, &ext_count);
+	for ( i = 0; i < ext_count; i++ ) {
+		const struct sieve_extension_def *extdef = exts[i]->def;
+
+		if ( exts[i]->loaded && extdef != NULL && extdef->reset != NULL )
+			extdef->reset(exts[i]);
+	}
+}
+
 void sieve_extensions_deinit(struct sieve_instance *svinst)
 {
 	sieve_extension_registry_deinit(svinst);
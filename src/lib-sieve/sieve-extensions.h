@@ -29,6 +29,8 @@ struct sieve_extension_def {
 	/* Registration */
 	bool (*load)(const struct sieve_extension *ext, void **context);
 	void (*unload)(const struct sieve_extension *ext);
+	/* Drop state that belongs to the user the instance was used for */
+	void (*reset)(const struct sieve_extension *ext);
 
 	/* Compilation */
 	bool (*validator_load)
@@ -116,6 +118,7 @@ struct sieve_extension {
 
 bool sieve_extensions_init(struct sieve_instance *svinst);
 void sieve_extensions_configure(struct sieve_instance *svinst);
+void sieve_extensions_reset(struct sieve_instance *svinst);
 void sieve_extensions_deinit(struct sieve_instance *svinst);
 
 /*
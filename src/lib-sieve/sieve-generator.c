@@ -439,6 +439,26 @@ bool sieve_generate_block
 	return result;
 }
 
+static void sieve_generator_emit_header_fields
+(struct sieve_generator *gentr, struct sieve_binary *sbin)
+{
+	struct sieve_binary_block *sblock;
+	const char *const *fields;
+	unsigned int count, i;
+	bool dynamic;
+
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_HEADER_FIELDS);
+	i_assert(sblock != NULL);
+
+	fields = sieve_ast_header_fields_get
+		(gentr->genenv.ast, &count, &dynamic);
+
+	(void)sieve_binary_emit_byte(sblock, ( dynamic ? 1 : 0 ));
+	(void)sieve_binary_emit_unsigned(sblock, count);
+	for ( i = 0; i < count; i++ )
+		(void)sieve_binary_emit_cstring(sblock, fields[i]);
+}
+
 struct sieve_binary *sieve_generator_run
 (struct sieve_generator *gentr, struct sieve_binary_block **sblock_r)
 {
@@ -501,8 +521,13 @@ struct sieve_binary *sieve_generator_run
 		if ( !sieve_generate_block
 			(&gentr->genenv, sieve_ast_root(gentr->genenv.ast)))
 			result = FALSE;
-		else if ( topmost )
-			sieve_binary_activate(sbin);
+		else {
+			/* Record the header fields this script inspects */
+			sieve_generator_emit_header_fields(gentr, sbin);
+
+			if ( topmost )
+				sieve_binary_activate(sbin);
+		}
 	}
 
 	/* Cleanup */
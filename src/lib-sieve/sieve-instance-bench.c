@@ -0,0 +1,163 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+/* Compares sieve_init() for every recipient of a delivery with reusing a
+   detached instance through sieve_reinit(), as the LDA plugin does. Each
+   recipient opens the same global script, like a sieve_before script.
+ */
+
+#include "lib.h"
+#include "time-util.h"
+#include "unlink-directory.h"
+#include "write-full.h"
+
+#include "sieve.h"
+#include "sieve-error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+#define BENCH_RECIPIENTS 2000
+
+static const char *const bench_settings[] = {
+	"sieve_extensions", "+vnd.dovecot.debug +vnd.dovecot.environment",
+	"recipient_delimiter", "+",
+	NULL
+};
+
+static const char *bench_get_setting
+(void *context ATTR_UNUSED, const char *identifier)
+{
+	unsigned int i;
+
+	for ( i = 0; bench_settings[i] != NULL; i += 2 ) {
+		if ( strcmp(bench_settings[i], identifier) == 0 )
+			return bench_settings[i+1];
+	}
+	return NULL;
+}
+
+static const char *bench_script_path;
+
+static const struct sieve_callbacks bench_callbacks = {
+	NULL,
+	bench_get_setting
+};
+
+static void
+bench_environment(unsigned int n, struct sieve_environment *svenv)
+{
+	memset(svenv, 0, sizeof(*svenv));
+	svenv->username = t_strdup_printf("user%u@example.com", n);
+	svenv->home_dir = t_strdup_printf("/home/user%u", n);
+	svenv->hostname = "mx.example.com";
+	svenv->base_dir = "/var/run/dovecot";
+	svenv->temp_dir = "/tmp";
+	svenv->flags = SIEVE_FLAG_HOME_RELATIVE;
+	svenv->location = SIEVE_ENV_LOCATION_MDA;
+	svenv->delivery_phase = SIEVE_DELIVERY_PHASE_DURING;
+}
+
+static void bench_script_create(const char *dir)
+{
+	static const char script[] =
+		"require \"fileinto\";\n"
+		"if header :contains \"X-Spam-Flag\" \"yes\" {\n"
+		"  fileinto \"Junk\";\n"
+		"  stop;\n"
+		"}\n";
+	int fd;
+
+	bench_script_path = t_strconcat(dir, "/before.sieve", NULL);
+	fd = open(bench_script_path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if ( fd == -1 )
+		i_fatal("open(%s) failed: %m", bench_script_path);
+	if ( write_full(fd, script, sizeof(script)-1) < 0 )
+		i_fatal("write(%s) failed: %m", bench_script_path);
+	i_close_fd(&fd);
+}
+
+static void bench_script_open(struct sieve_instance *svinst)
+{
+	struct sieve_binary *sbin;
+	enum sieve_error error;
+
+	sbin = sieve_open(svinst, bench_script_path, NULL,
+		sieve_system_ehandler_get(svinst), 0, &error);
+	if ( sbin == NULL )
+		i_fatal("Failed to open %s", bench_script_path);
+	sieve_close(&sbin);
+}
+
+static void bench_recipients(bool reuse)
+{
+	struct sieve_instance *idle = NULL;
+	unsigned int n;
+
+	for ( n = 0; n < BENCH_RECIPIENTS; n++ ) T_BEGIN {
+		struct sieve_environment svenv;
+		struct sieve_instance *svinst = NULL;
+
+		bench_environment(n, &svenv);
+
+		if ( idle != NULL ) {
+			svinst = idle;
+			idle = NULL;
+			if ( !sieve_reinit(svinst, &svenv, NULL, FALSE) )
+				i_fatal("Failed to reuse Sieve instance");
+		} else {
+			svinst = sieve_init(&svenv, &bench_callbacks, NULL, FALSE);
+			if ( svinst == NULL )
+				i_fatal("Failed to initialize Sieve");
+		}
+
+		bench_script_open(svinst);
+
+		if ( reuse ) {
+			sieve_detach(svinst);
+			idle = svinst;
+		} else {
+			sieve_deinit(&svinst);
+		}
+	} T_END;
+
+	if ( idle != NULL )
+		sieve_deinit(&idle);
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/sieve-instance-bench.XXXXXX";
+	struct timeval start, init_end, reuse_end;
+
+	lib_init();
+
+	if ( mkdtemp(dir) == NULL )
+		i_fatal("mkdtemp(%s) failed: %m", dir);
+	bench_script_create(dir);
+
+	/* With sieve_init(), the binary of the global script is loaded from disk
+	   for every recipient; with sieve_reinit(), it is found in the binary
+	   cache that survived sieve_detach() */
+	if ( gettimeofday(&start, NULL) < 0 )
+		i_fatal("gettimeofday(): %m");
+	bench_recipients(FALSE);
+	if ( gettimeofday(&init_end, NULL) < 0 )
+		i_fatal("gettimeofday(): %m");
+	bench_recipients(TRUE);
+	if ( gettimeofday(&reuse_end, NULL) < 0 )
+		i_fatal("gettimeofday(): %m");
+
+	if ( unlink_directory(dir, TRUE) < 0 )
+		i_error("unlink_directory(%s) failed: %m", dir);
+
+	printf("sieve_init: %lld usecs, sieve_reinit: %lld usecs "
+		"for %u recipients\n", timeval_diff_usecs(&init_end, &start),
+		timeval_diff_usecs(&reuse_end, &init_end), BENCH_RECIPIENTS);
+
+	lib_deinit();
+	return 0;
+}
@@ -22,6 +22,7 @@
 #include "sieve-result.h"
 #include "sieve-comparators.h"
 #include "sieve-runtime-trace.h"
+#include "sieve-trace-ring.h"
 
 #include "sieve-interpreter.h"
 
@@ -53,6 +54,61 @@ struct sieve_interpreter_loop {
 	void *context;
 };
 
+/*
+ * Decoded code
+ */
+
+/* Operations are decoded only once per code block: the first time an
+   operation is executed, its definition and the address of its operands are
+   recorded by address. This is kept with the binary, so later executions of
+   the same script skip decoding altogether. */
+
+struct sieve_interpreter_op {
+	const struct sieve_operation_def *def;
+	const struct sieve_extension *ext;
+
+	/* Address of the first operand */
+	sieve_size_t operands;
+};
+
+struct sieve_interpreter_code {
+	size_t size;
+
+	/* Address -> index of decoded operation + 1 */
+	unsigned int *index;
+	ARRAY(struct sieve_interpreter_op) ops;
+};
+
+static void sieve_interpreter_code_free(void *data)
+{
+	struct sieve_interpreter_code *code =
+		(struct sieve_interpreter_code *)data;
+
+	array_free(&code->ops);
+	i_free(code->index);
+	i_free(code);
+}
+
+static struct sieve_interpreter_code *sieve_interpreter_code_get
+(struct sieve_binary *sbin, struct sieve_binary_block *sblock)
+{
+	struct sieve_interpreter_code *code;
+	const char *key;
+	void *data;
+
+	key = t_strdup_printf("interpreter:%u", sieve_binary_block_get_id(sblock));
+	if ( sieve_binary_cache_lookup(sbin, key, &data) )
+		return (struct sieve_interpreter_code *)data;
+
+	code = i_new(struct sieve_interpreter_code, 1);
+	code->size = sieve_binary_block_get_size(sblock);
+	code->index = i_new(unsigned int, code->size + 1);
+	i_array_init(&code->ops, 64);
+
+	sieve_binary_cache_insert(sbin, key, code, sieve_interpreter_code_free);
+	return code;
+}
+
 /*
  * Interpreter
  */
@@ -80,9 +136,11 @@ struct sieve_interpreter {
 	/* Runtime environment */
 	struct sieve_runtime_env runenv;
 	struct sieve_runtime_trace trace;
+	struct sieve_trace_ring *trace_ring;
 
 	/* Current operation */
 	struct sieve_operation oprtn;
+	struct sieve_interpreter_code *code;
 
 	/* Location information */
 	struct sieve_binary_debug_reader *dreader;
@@ -137,6 +195,14 @@ static struct sieve_interpreter *_sieve_interpreter_create
 		interp->runenv.trace = &interp->trace;
 	}
 
+	/* Binary trace; a nested interpreter adds to that of its parent */
+	if ( parent == NULL ) {
+		interp->trace_ring = sieve_trace_ring_create(svinst, sbin);
+	} else if ( parent->trace_ring != NULL && parent->runenv.sbin == sbin ) {
+		interp->trace_ring = parent->trace_ring;
+		sieve_trace_ring_ref(interp->trace_ring);
+	}
+
 	if ( senv->exec_status == NULL )
 		interp->runenv.exec_status = p_new(interp->pool, struct sieve_exec_status, 1);
 	else
@@ -150,6 +216,10 @@ static struct sieve_interpreter *_sieve_interpreter_create
 	interp->runenv.pc = 0;
 	address = &(interp->runenv.pc);
 
+	T_BEGIN {
+		interp->code = sieve_interpreter_code_get(sbin, sblock);
+	} T_END;
+
 	sieve_runtime_trace_begin(&(interp->runenv));
 
 	p_array_init(&interp->extensions, pool, sieve_extensions_get_count(svinst));
@@ -295,6 +365,9 @@ void sieve_interpreter_free(struct sieve_interpreter **_interp)
 			eregs[i].intext->free(eregs[i].ext, interp, eregs[i].context);
 	}
 
+	if ( interp->trace_ring != NULL )
+		sieve_trace_ring_unref(&interp->trace_ring);
+
 	sieve_binary_debug_reader_deinit(&interp->dreader);
 	sieve_binary_unref(&renv->sbin);
 	sieve_error_handler_unref(&renv->ehandler);
@@ -889,39 +962,80 @@ bool sieve_interpreter_get_test_result
  * Code execute
  */
 
+static bool sieve_interpreter_operation_decode
+(struct sieve_interpreter *interp)
+{
+	struct sieve_interpreter_code *code = interp->code;
+	struct sieve_operation *oprtn = &(interp->oprtn);
+	sieve_size_t *address = &(interp->runenv.pc);
+	sieve_size_t pc = *address;
+	struct sieve_interpreter_op *op;
+	unsigned int idx;
+
+	i_assert( pc < code->size );
+
+	if ( (idx=code->index[pc]) > 0 ) {
+		/* Decoded before */
+		op = array_idx_modifiable(&code->ops, idx - 1);
+		oprtn->address = pc;
+		oprtn->def = op->def;
+		oprtn->ext = op->ext;
+		*address = op->operands;
+		return TRUE;
+	}
+
+	/* Read the operation */
+	if ( !sieve_operation_read(interp->runenv.sblock, address, oprtn) )
+		return FALSE;
+
+	op = array_append_space(&code->ops);
+	op->def = oprtn->def;
+	op->ext = oprtn->ext;
+	op->operands = *address;
+	code->index[pc] = array_count(&code->ops);
+	return TRUE;
+}
+
 static int sieve_interpreter_operation_execute
 (struct sieve_interpreter *interp)
 {
 	struct sieve_operation *oprtn = &(interp->oprtn);
 	sieve_size_t *address = &(interp->runenv.pc);
+	const struct sieve_operation_def *op;
+	struct timespec op_start;
+	int result = SIEVE_EXEC_OK;
 
-	sieve_runtime_trace_toplevel(&interp->runenv);
+	if ( interp->trace_ring != NULL )
+		sieve_trace_ring_clock(&op_start);
 
-	/* Read the operation */
-	if ( sieve_operation_read(interp->runenv.sblock, address, oprtn) ) {
-		const struct sieve_operation_def *op = oprtn->def;
-		int result = SIEVE_EXEC_OK;
-
-		/* Reset cached command location */
-		interp->command_line = 0;
-
-		/* Execute the operation */
-		if ( op->execute != NULL ) { /* Noop ? */
-			T_BEGIN {
-				result = op->execute(&(interp->runenv), address);
-			} T_END;
-		} else {
-			sieve_runtime_trace
-				(&interp->runenv, SIEVE_TRLVL_COMMANDS, "OP: %s (NOOP)",
-					sieve_operation_mnemonic(oprtn));
-		}
+	if ( !sieve_interpreter_operation_decode(interp) ) {
+		/* Binary corrupt */
+		sieve_runtime_trace_error(&interp->runenv,
+			"Encountered invalid operation");
+		return SIEVE_EXEC_BIN_CORRUPT;
+	}
 
-		return result;
+	/* Reset cached command location */
+	interp->command_line = 0;
+
+	/* Execute the operation */
+	op = oprtn->def;
+	if ( op->execute != NULL ) { /* Noop ? */
+		T_BEGIN {
+			result = op->execute(&(interp->runenv), address);
+		} T_END;
+	} else {
+		sieve_runtime_trace
+			(&interp->runenv, SIEVE_TRLVL_COMMANDS, "OP: %s (NOOP)",
+				sieve_operation_mnemonic(oprtn));
 	}
 
-	/* Binary corrupt */
-	sieve_runtime_trace_error(&interp->runenv, "Encountered invalid operation");
-	return SIEVE_EXEC_BIN_CORRUPT;
+	if ( interp->trace_ring != NULL ) {
+		sieve_trace_ring_add(interp->trace_ring, interp->runenv.sblock,
+			oprtn, interp->test_result, result, &op_start);
+	}
+
+	return result;
 }
 
 int sieve_interpreter_continue
@@ -929,6 +1043,8 @@ int sieve_interpreter_continue
 {
 	const struct sieve_runtime_env *renv = &interp->runenv;
 	sieve_size_t *address = &(interp->runenv.pc);
+	size_t code_size = interp->code->size;
+	bool trace = ( renv->trace != NULL );
 	int ret = SIEVE_EXEC_OK;
 
 	sieve_result_ref(renv->result);
@@ -938,7 +1054,7 @@ int sieve_interpreter_continue
 		*interrupted = FALSE;
 
 	while ( ret == SIEVE_EXEC_OK && !interp->interrupted &&
-		*address < sieve_binary_block_get_size(renv->sblock) ) {
+		*address < code_size ) {
 		if ( interp->loop_limit != 0 && *address > interp->loop_limit ) {
 			sieve_runtime_trace_error(renv,
 				"program crossed loop boundary");
@@ -946,6 +1062,8 @@ int sieve_interpreter_continue
 			break;
 		}
 
+		if ( trace )
+			sieve_runtime_trace_toplevel(renv);
 		ret = sieve_interpreter_operation_execute(interp);
 	}
 
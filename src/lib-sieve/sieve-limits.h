@@ -35,6 +35,17 @@
 
 #define SIEVE_MAX_MATCH_VALUES         32
 
+/* Message bodies up to this size are decoded into memory once and kept for
+   all later tests; larger ones are streamed each time they are matched */
+#define SIEVE_DEFAULT_BODY_STREAM_MIN_SIZE (1024*1024)
+
+/* Streamed bodies are passed to the tests in chunks of at most this size */
+#define SIEVE_MESSAGE_BODY_STREAM_CHUNK_SIZE 1024
+
+#define SIEVE_DEFAULT_BINARY_CACHE_SIZE (1024*1024)
+
+#define SIEVE_DEFAULT_TRACE_RING_MAX_SIZE (1024*1024)
+
 /*
  * Actions
  */
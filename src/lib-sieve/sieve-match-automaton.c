@@ -0,0 +1,288 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "mempool.h"
+#include "array.h"
+
+#include "sieve-match-automaton.h"
+
+/*
+ * Multi-key substring automaton
+ *
+ * This is an Aho-Corasick automaton that is fully resolved into a DFA, so
+ * that each input byte costs exactly one table lookup. The input alphabet is
+ * compressed to the byte classes that actually occur in the keys; class 0 is
+ * shared by all other bytes. State 0 is the root.
+ */
+
+struct sieve_match_automaton_key {
+	const unsigned char *data;
+	size_t size;
+	unsigned int id;
+
+	/* Next key (index + 1) ending in the same state */
+	unsigned int next;
+};
+
+struct sieve_match_automaton {
+	pool_t pool;
+
+	const unsigned char *fold;
+	unsigned short classes[256];
+	unsigned int class_count;
+
+	ARRAY(struct sieve_match_automaton_key) keys;
+
+	/* state * class_count + class -> state */
+	ARRAY(unsigned int) delta;
+	/* state -> first key (index + 1) ending exactly in this state */
+	ARRAY(unsigned int) output;
+	/* state -> nearest proper suffix state with output, or 0 */
+	ARRAY(unsigned int) link;
+	/* state -> first key (index + 1) found when entering this state */
+	ARRAY(unsigned int) first;
+
+	unsigned int compiled:1;
+};
+
+struct sieve_match_automaton *sieve_match_automaton_create
+(const unsigned char *fold)
+{
+	struct sieve_match_automaton *aut;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_match_automaton", 1024);
+	aut = p_new(pool, struct sieve_match_automaton, 1);
+	aut->pool = pool;
+	aut->fold = fold;
+	p_array_init(&aut->keys, pool, 16);
+
+	return aut;
+}
+
+void sieve_match_automaton_free(struct sieve_match_automaton **_aut)
+{
+	struct sieve_match_automaton *aut = *_aut;
+
+	*_aut = NULL;
+
+	if ( array_is_created(&aut->delta) )
+		array_free(&aut->delta);
+	if ( array_is_created(&aut->output) )
+		array_free(&aut->output);
+	if ( array_is_created(&aut->link) )
+		array_free(&aut->link);
+	if ( array_is_created(&aut->first) )
+		array_free(&aut->first);
+	pool_unref(&aut->pool);
+}
+
+void sieve_match_automaton_add
+(struct sieve_match_automaton *aut,
+	const unsigned char *key, size_t key_size, unsigned int key_id)
+{
+	struct sieve_match_automaton_key *akey;
+
+	i_assert( !aut->compiled );
+	i_assert( key_size > 0 );
+
+	akey = array_append_space(&aut->keys);
+	akey->data = p_memdup(aut->pool, key, key_size);
+	akey->size = key_size;
+	akey->id = key_id;
+}
+
+unsigned int sieve_match_automaton_key_count
+(struct sieve_match_automaton *aut)
+{
+	return array_count(&aut->keys);
+}
+
+static unsigned int sieve_match_automaton_new_state
+(struct sieve_match_automaton *aut)
+{
+	unsigned int state = array_count(&aut->output);
+	unsigned int i;
+
+	for ( i = 0; i < aut->class_count; i++ )
+		array_append_zero(&aut->delta);
+	array_append_zero(&aut->output);
+	return state;
+}
+
+void sieve_match_automaton_compile
+(struct sieve_match_automaton *aut)
+{
+	struct sieve_match_automaton_key *keys;
+	unsigned int key_count, nclasses, state_count, state, i;
+	ARRAY(unsigned int) queue, fail;
+	unsigned int *delta, *output, *link, *first, *failv;
+	size_t j;
+
+	i_assert( !aut->compiled );
+
+	keys = array_get_modifiable(&aut->keys, &key_count);
+
+	/* Compress alphabet */
+	nclasses = 1;
+	for ( i = 0; i < key_count; i++ ) {
+		for ( j = 0; j < keys[i].size; j++ ) {
+			if ( aut->classes[keys[i].data[j]] == 0 )
+				aut->classes[keys[i].data[j]] = nclasses++;
+		}
+	}
+	if ( aut->fold != NULL ) {
+		/* Input is folded through the same class map */
+		for ( i = 0; i < 256; i++ )
+			aut->classes[i] = aut->classes[aut->fold[i]];
+	}
+	aut->class_count = nclasses;
+
+	/* Build trie; a zero transition means "no edge" at this point */
+	i_array_init(&aut->delta, nclasses * 64);
+	i_array_init(&aut->output, 64);
+	(void)sieve_match_automaton_new_state(aut);
+
+	for ( i = 0; i < key_count; i++ ) {
+		unsigned int *out;
+
+		state = 0;
+		for ( j = 0; j < keys[i].size; j++ ) {
+			unsigned int cls = aut->classes[keys[i].data[j]];
+			unsigned int next =
+				*array_idx(&aut->delta, state * nclasses + cls);
+
+			if ( next == 0 ) {
+				next = sieve_match_automaton_new_state(aut);
+				array_idx_set(&aut->delta, state * nclasses + cls, &next);
+			}
+			state = next;
+		}
+
+		/* Append to the list of keys ending in this state */
+		out = array_idx_modifiable(&aut->output, state);
+		while ( *out != 0 )
+			out = &keys[*out - 1].next;
+		*out = i + 1;
+	}
+
+	/* Resolve failure links breadth-first into a complete DFA */
+	state_count = array_count(&aut->output);
+	i_array_init(&aut->link, state_count);
+	i_array_init(&aut->first, state_count);
+	array_idx_clear(&aut->link, state_count - 1);
+	array_idx_clear(&aut->first, state_count - 1);
+	i_array_init(&fail, state_count);
+	array_idx_clear(&fail, state_count - 1);
+	i_array_init(&queue, state_count);
+
+	delta = array_idx_modifiable(&aut->delta, 0);
+	output = array_idx_modifiable(&aut->output, 0);
+	link = array_idx_modifiable(&aut->link, 0);
+	first = array_idx_modifiable(&aut->first, 0);
+	failv = array_idx_modifiable(&fail, 0);
+
+	for ( i = 0; i < nclasses; i++ ) {
+		if ( delta[i] != 0 )
+			array_append(&queue, &delta[i], 1);
+	}
+
+	for ( j = 0; j < array_count(&queue); j++ ) {
+		unsigned int s = *array_idx(&queue, j);
+		unsigned int f = failv[s];
+
+		link[s] = ( output[f] != 0 ? f : link[f] );
+		first[s] = ( output[s] != 0 ? output[s] : first[f] );
+
+		for ( i = 0; i < nclasses; i++ ) {
+			unsigned int t = delta[s * nclasses + i];
+			unsigned int ft = delta[f * nclasses + i];
+
+			if ( t != 0 ) {
+				failv[t] = ft;
+				array_append(&queue, &t, 1);
+			} else {
+				delta[s * nclasses + i] = ft;
+			}
+		}
+	}
+
+	array_free(&queue);
+	array_free(&fail);
+	aut->compiled = TRUE;
+}
+
+bool sieve_match_automaton_find
+(struct sieve_match_automaton *aut, unsigned int *state,
+	const unsigned char *data, size_t size, unsigned int *key_id_r)
+{
+	const unsigned int *delta, *first;
+	const unsigned short *classes = aut->classes;
+	unsigned int nclasses = aut->class_count;
+	unsigned int s = *state;
+	size_t i;
+
+	i_assert( aut->compiled );
+
+	delta = array_idx(&aut->delta, 0);
+	first = array_idx(&aut->first, 0);
+
+	for ( i = 0; i < size; i++ ) {
+		s = delta[s * nclasses + classes[data[i]]];
+		if ( first[s] != 0 ) {
+			*state = s;
+			*key_id_r = array_idx(&aut->keys, first[s] - 1)->id;
+			return TRUE;
+		}
+	}
+
+	*state = s;
+	return FALSE;
+}
+
+bool sieve_match_automaton_scan
+(struct sieve_match_automaton *aut, unsigned int *state,
+	const unsigned char *data, size_t size,
+	sieve_match_automaton_callback_t *callback, void *context)
+{
+	const struct sieve_match_automaton_key *keys;
+	const unsigned int *delta, *output, *link, *first;
+	const unsigned short *classes = aut->classes;
+	unsigned int nclasses = aut->class_count;
+	unsigned int s = *state;
+	size_t i;
+
+	i_assert( aut->compiled );
+
+	if ( array_count(&aut->keys) == 0 )
+		return FALSE;
+
+	keys = array_idx(&aut->keys, 0);
+	delta = array_idx(&aut->delta, 0);
+	output = array_idx(&aut->output, 0);
+	link = array_idx(&aut->link, 0);
+	first = array_idx(&aut->first, 0);
+
+	for ( i = 0; i < size; i++ ) {
+		unsigned int t;
+
+		s = delta[s * nclasses + classes[data[i]]];
+		if ( first[s] == 0 )
+			continue;
+
+		for ( t = ( output[s] != 0 ? s : link[s] ); t != 0; t = link[t] ) {
+			unsigned int k;
+
+			for ( k = output[t]; k != 0; k = keys[k-1].next ) {
+				if ( callback(context, keys[k-1].id) ) {
+					*state = s;
+					return TRUE;
+				}
+			}
+		}
+	}
+
+	*state = s;
+	return FALSE;
+}
@@ -0,0 +1,51 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __SIEVE_MATCH_AUTOMATON_H
+#define __SIEVE_MATCH_AUTOMATON_H
+
+#include "sieve-common.h"
+
+/*
+ * Multi-key substring automaton (Aho-Corasick)
+ */
+
+struct sieve_match_automaton;
+
+/* Called for each key occurrence found by sieve_match_automaton_scan().
+   Returning TRUE stops the scan. */
+typedef bool sieve_match_automaton_callback_t
+	(void *context, unsigned int key_id);
+
+/* The fold table translates each input byte before it is matched (e.g. to
+   lowercase). It must remain valid for the lifetime of the automaton. Keys
+   are assumed to be folded already. When fold is NULL, bytes are matched
+   as-is. */
+struct sieve_match_automaton *sieve_match_automaton_create
+	(const unsigned char *fold);
+void sieve_match_automaton_free(struct sieve_match_automaton **_aut);
+
+void sieve_match_automaton_add
+	(struct sieve_match_automaton *aut,
+		const unsigned char *key, size_t key_size, unsigned int key_id);
+void sieve_match_automaton_compile
+	(struct sieve_match_automaton *aut);
+
+unsigned int sieve_match_automaton_key_count
+	(struct sieve_match_automaton *aut);
+
+/* Searching is resumable: the caller keeps the automaton state, which must be
+   initialized to zero before the first chunk of a value is scanned. */
+
+/* Find the first key occurrence. Returns TRUE and the id of the matched key
+   when found. */
+bool sieve_match_automaton_find
+	(struct sieve_match_automaton *aut, unsigned int *state,
+		const unsigned char *data, size_t size, unsigned int *key_id_r);
+/* Report all key occurrences through the callback */
+bool sieve_match_automaton_scan
+	(struct sieve_match_automaton *aut, unsigned int *state,
+		const unsigned char *data, size_t size,
+		sieve_match_automaton_callback_t *callback, void *context);
+
+#endif /* __SIEVE_MATCH_AUTOMATON_H */
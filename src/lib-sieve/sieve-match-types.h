@@ -67,6 +67,15 @@ struct sieve_match_type_def {
 			const char *key, size_t key_size);
 
 	void (*match_deinit)(struct sieve_match_context *mctx);
+
+	/* Streamed value (optional): the value is passed in consecutive chunks,
+	   so that it never needs to be available as a whole */
+
+	int (*match_value_begin)
+		(struct sieve_match_context *mctx, struct sieve_stringlist *key_list);
+	int (*match_value_more)
+		(struct sieve_match_context *mctx, const char *data, size_t size);
+	int (*match_value_end)(struct sieve_match_context *mctx);
 };
 
 /*
@@ -125,6 +125,67 @@ int sieve_match_value
 	return match;
 }
 
+bool sieve_match_type_can_stream(const struct sieve_match_type *mcht)
+{
+	return ( mcht->def != NULL && mcht->def->match_value_begin != NULL &&
+		mcht->def->match_value_more != NULL &&
+		mcht->def->match_value_end != NULL );
+}
+
+int sieve_match_value_begin
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	const struct sieve_match_type *mcht = mctx->match_type;
+	const struct sieve_runtime_env *renv = mctx->runenv;
+
+	i_assert( sieve_match_type_can_stream(mcht) );
+
+	if ( mctx->trace )
+		sieve_runtime_trace(renv, 0, "matching streamed value");
+
+	/* Match to key values */
+
+	sieve_stringlist_reset(key_list);
+
+	if ( mctx->trace )
+		sieve_stringlist_set_trace(key_list, TRUE);
+
+	sieve_runtime_trace_descend(renv);
+
+	if ( mcht->def->match_value_begin(mctx, key_list) < 0 ) {
+		sieve_runtime_trace_ascend(renv);
+		mctx->match_status = -1;
+		return -1;
+	}
+	return 0;
+}
+
+int sieve_match_value_more
+(struct sieve_match_context *mctx, const char *data, size_t size)
+{
+	const struct sieve_match_type *mcht = mctx->match_type;
+
+	return mcht->def->match_value_more(mctx, data, size);
+}
+
+int sieve_match_value_end(struct sieve_match_context *mctx)
+{
+	const struct sieve_match_type *mcht = mctx->match_type;
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	int match;
+
+	match = mcht->def->match_value_end(mctx);
+
+	sieve_runtime_trace_ascend(renv);
+
+	if ( mctx->match_status < 0 || match < 0 )
+		mctx->match_status = -1;
+	else
+		mctx->match_status =
+			( mctx->match_status > match ? mctx->match_status : match );
+	return match;
+}
+
 int sieve_match_end(struct sieve_match_context **mctx, int *exec_status)
 {
 	const struct sieve_match_type *mcht = (*mctx)->match_type;
@@ -40,6 +40,17 @@ int sieve_match_value
 		struct sieve_stringlist *key_list);
 int sieve_match_end(struct sieve_match_context **mctx, int *exec_status);
 
+/* Streamed value matching (only for match types that support it). The
+   value_more() function returns 1 when the result for this value is known
+   and no more data is needed. */
+bool sieve_match_type_can_stream(const struct sieve_match_type *mcht);
+
+int sieve_match_value_begin
+	(struct sieve_match_context *mctx, struct sieve_stringlist *key_list);
+int sieve_match_value_more
+	(struct sieve_match_context *mctx, const char *data, size_t size);
+int sieve_match_value_end(struct sieve_match_context *mctx);
+
 /* Default matching operation */
 int sieve_match
 	(const struct sieve_runtime_env *renv,
@@ -5,6 +5,7 @@
 #include "ioloop.h"
 #include "mempool.h"
 #include "array.h"
+#include "hash.h"
 #include "str.h"
 #include "str-sanitize.h"
 #include "istream.h"
@@ -23,6 +24,7 @@
 #include "edit-mail.h"
 
 #include "sieve-common.h"
+#include "sieve-limits.h"
 #include "sieve-stringlist.h"
 #include "sieve-error.h"
 #include "sieve-extensions.h"
@@ -61,6 +63,7 @@ struct sieve_message_header {
 };
 
 struct sieve_message_part {
+	pool_t pool;
 	struct sieve_message_part *parent, *next, *children;
 
 	ARRAY(struct sieve_message_header) headers;
@@ -75,6 +78,39 @@ struct sieve_message_part {
 
 	unsigned int have_body:1; /* there's the empty end-of-headers line */
 	unsigned int epilogue:1;  /* this is a multipart epilogue */
+	unsigned int body_saved:1; /* decoded body is available */
+};
+
+struct sieve_message_header_value {
+	const char *value;
+	size_t size;
+};
+
+struct sieve_message_header_field {
+	/* Values as stored in the message [0] and MIME-decoded [1], with trailing
+	   whitespace removed. Each list is terminated by an item with a NULL
+	   value and is stored in a single allocation together with the value
+	   strings. */
+	const struct sieve_message_header_value *values[2];
+};
+
+/* Data derived from the content of the message alone; this is shared by all
+   contexts of the same unmodified message */
+struct sieve_message_analysis {
+	pool_t pool;
+	int refcount;
+
+	/* Header fields */
+
+	pool_t header_pool;
+	HASH_TABLE(const char *, struct sieve_message_header_field *) header_cache;
+
+	/* Body */
+
+	ARRAY(struct sieve_message_part *) cached_body_parts;
+	buffer_t *raw_body;
+
+	unsigned int parts_parsed:1;
 };
 
 struct sieve_message_version {
@@ -112,11 +148,14 @@ struct sieve_message_context {
 
 	ARRAY(void *) ext_contexts;
 
-	/* Body */
+	/* Header fields and body parts of the current message version; analyses
+	   replaced by an edit are retained until the context is reset, since part
+	   iterators and body parts obtained from them may still be in use */
+
+	struct sieve_message_analysis *analysis;
+	ARRAY(struct sieve_message_analysis *) stale_analyses;
 
-	ARRAY(struct sieve_message_part *) cached_body_parts;
 	ARRAY(struct sieve_message_part_data) return_body_parts;
-	buffer_t *raw_body;
 
 	unsigned int edit_snapshot:1;
 	unsigned int substitute_snapshot:1;
@@ -161,6 +200,54 @@ static inline void sieve_message_version_free
 	}
 }
 
+/*
+ * Message analysis
+ */
+
+struct sieve_message_analysis *sieve_message_analysis_create(void)
+{
+	struct sieve_message_analysis *analysis;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_message_analysis", 4096);
+	analysis = p_new(pool, struct sieve_message_analysis, 1);
+	analysis->pool = pool;
+	analysis->refcount = 1;
+
+	p_array_init(&analysis->cached_body_parts, pool, 8);
+
+	return analysis;
+}
+
+void sieve_message_analysis_ref(struct sieve_message_analysis *analysis)
+{
+	analysis->refcount++;
+}
+
+static void sieve_message_header_cache_invalidate
+(struct sieve_message_analysis *analysis)
+{
+	if ( analysis->header_pool == NULL )
+		return;
+
+	hash_table_destroy(&analysis->header_cache);
+	pool_unref(&analysis->header_pool);
+}
+
+void sieve_message_analysis_unref(struct sieve_message_analysis **_analysis)
+{
+	struct sieve_message_analysis *analysis = *_analysis;
+
+	i_assert( analysis->refcount > 0 );
+
+	*_analysis = NULL;
+	if ( --analysis->refcount != 0 )
+		return;
+
+	sieve_message_header_cache_invalidate(analysis);
+	pool_unref(&analysis->pool);
+}
+
 /*
  * Message context object
  */
@@ -212,6 +299,21 @@ static void sieve_message_context_clear(struct sieve_message_context *msgctx)
 	msgctx->envelope_parsed = FALSE;
 }
 
+static void sieve_message_context_analysis_clear
+(struct sieve_message_context *msgctx)
+{
+	struct sieve_message_analysis **stale;
+
+	if ( msgctx->analysis != NULL )
+		sieve_message_analysis_unref(&msgctx->analysis);
+
+	if ( array_is_created(&msgctx->stale_analyses) ) {
+		array_foreach_modifiable(&msgctx->stale_analyses, stale)
+			sieve_message_analysis_unref(stale);
+		array_clear(&msgctx->stale_analyses);
+	}
+}
+
 void sieve_message_context_unref(struct sieve_message_context **msgctx)
 {
 	i_assert((*msgctx)->refcount > 0);
@@ -223,6 +325,9 @@ void sieve_message_context_unref(struct sieve_message_context **msgctx)
 		mail_user_unref(&(*msgctx)->raw_mail_user);
 
 	sieve_message_context_clear(*msgctx);
+	sieve_message_context_analysis_clear(*msgctx);
+	if ( array_is_created(&(*msgctx)->stale_analyses) )
+		array_free(&(*msgctx)->stale_analyses);
 
 	if ( (*msgctx)->context_pool != NULL )
 		pool_unref(&((*msgctx)->context_pool));
@@ -233,6 +338,7 @@ void sieve_message_context_unref(struct sieve_message_context **msgctx)
 
 static void sieve_message_context_flush(struct sieve_message_context *msgctx)
 {
+	const struct sieve_message_data *msgdata = msgctx->msgdata;
 	pool_t pool;
 
 	if ( msgctx->context_pool != NULL )
@@ -244,9 +350,17 @@ static void sieve_message_context_flush(struct sieve_message_context *msgctx)
 	p_array_init(&msgctx->ext_contexts, pool,
 		sieve_extensions_get_count(msgctx->svinst));
 
-	p_array_init(&msgctx->cached_body_parts, pool, 8);
 	p_array_init(&msgctx->return_body_parts, pool, 8);
-	msgctx->raw_body = NULL;
+
+	/* The analysis provided with the message data applies only to the
+	   original message */
+	sieve_message_context_analysis_clear(msgctx);
+	if ( array_count(&msgctx->versions) == 0 && msgdata->analysis != NULL ) {
+		msgctx->analysis = msgdata->analysis;
+		sieve_message_analysis_ref(msgctx->analysis);
+	} else {
+		msgctx->analysis = sieve_message_analysis_create();
+	}
 }
 
 void sieve_message_context_reset(struct sieve_message_context *msgctx)
@@ -478,6 +592,27 @@ struct mail *sieve_message_get_mail
 	return versions[count-1].mail;
 }
 
+static void sieve_message_analysis_invalidate
+(struct sieve_message_context *msgctx)
+{
+	struct sieve_message_analysis *analysis = msgctx->analysis;
+
+	if ( analysis->refcount == 1 && !analysis->parts_parsed ) {
+		/* Only the header cache is in use and nobody else sees it */
+		sieve_message_header_cache_invalidate(analysis);
+		return;
+	}
+
+	/* The analysis is shared with the contexts of other recipients, which
+	   still see the original message, or a part iterator may still be walking
+	   its parts (e.g. an edit inside foreverypart). Keep it around and
+	   continue with a new one. */
+	if ( !array_is_created(&msgctx->stale_analyses) )
+		i_array_init(&msgctx->stale_analyses, 4);
+	array_append(&msgctx->stale_analyses, &analysis, 1);
+	msgctx->analysis = sieve_message_analysis_create();
+}
+
 struct edit_mail *sieve_message_edit
 (struct sieve_message_context *msgctx)
 {
@@ -494,6 +629,11 @@ struct edit_mail *sieve_message_edit
 
 	msgctx->edit_snapshot = FALSE;
 
+	/* The header of the message is about to change; the header fields are
+	   read again and the part structure is parsed again the next time these
+	   are needed. */
+	sieve_message_analysis_invalidate(msgctx);
+
 	return version->edit_mail;
 }
 
@@ -526,7 +666,7 @@ struct sieve_message_header_list {
 	struct sieve_stringlist *field_names;
 
 	const char *header_name;
-	const char *const *headers;
+	const struct sieve_message_header_value *headers;
 	int headers_index;
 
 	unsigned int mime_decode:1;
@@ -551,19 +691,76 @@ struct sieve_header_list *sieve_message_header_list_create
 	return &hdrlist->hdrlist;
 }
 
-// NOTE: get rid of this once we have a proper Sieve string type
-static inline string_t *_header_right_trim(const char *raw)
+/* Header cache */
+
+static int sieve_message_header_cache_get
+(struct sieve_message_context *msgctx, const char *field_name,
+	bool mime_decode, const struct sieve_message_header_value **values_r)
 {
-	string_t *result;
-	int i;
+	struct sieve_message_analysis *analysis = msgctx->analysis;
+	struct mail *mail = sieve_message_get_mail(msgctx);
+	struct sieve_message_header_field *field;
+	struct sieve_message_header_value *values;
+	const char *const *headers;
+	unsigned int count, i;
+	size_t *sizes, total;
+	char *data;
+	int ret;
+
+	if ( analysis->header_pool == NULL ) {
+		analysis->header_pool =
+			pool_alloconly_create("sieve_message_header_cache", 4096);
+		hash_table_create(&analysis->header_cache,
+			default_pool, 0, strcase_hash, strcasecmp);
+	}
+
+	field = hash_table_lookup(analysis->header_cache, field_name);
+	if ( field != NULL && field->values[mime_decode ? 1 : 0] != NULL ) {
+		*values_r = field->values[mime_decode ? 1 : 0];
+		return 0;
+	}
+
+	/* Fetch all matching headers from the e-mail */
+	if ( mime_decode )
+		ret = mail_get_headers_utf8(mail, field_name, &headers);
+	else
+		ret = mail_get_headers(mail, field_name, &headers);
+	if ( ret < 0 )
+		return -1;
+
+	/* Trim trailing whitespace once for all tests */
+	count = ( headers == NULL ? 0 : str_array_length(headers) );
+	sizes = t_new(size_t, count + 1);
+	total = sizeof(*values) * (count + 1);
+	for ( i = 0; i < count; i++ ) {
+		size_t size = strlen(headers[i]);
 
-	for ( i = strlen(raw)-1; i >= 0; i-- ) {
-		if ( raw[i] != ' ' && raw[i] != '\t' ) break;
+		while ( size > 0 &&
+			(headers[i][size-1] == ' ' || headers[i][size-1] == '\t') )
+			size--;
+		sizes[i] = size;
+		total += size + 1;
 	}
 
-	result = t_str_new(i+1);
-	str_append_n(result, raw, i + 1);
-	return result;
+	values = p_malloc(analysis->header_pool, total);
+	data = (char *)&values[count + 1];
+	for ( i = 0; i < count; i++ ) {
+		memcpy(data, headers[i], sizes[i]);
+		values[i].value = data;
+		values[i].size = sizes[i];
+		data += sizes[i] + 1;
+	}
+
+	if ( field == NULL ) {
+		field = p_new(analysis->header_pool,
+			struct sieve_message_header_field, 1);
+		hash_table_insert(analysis->header_cache,
+			p_strdup(analysis->header_pool, field_name), field);
+	}
+	field->values[mime_decode ? 1 : 0] = values;
+
+	*values_r = values;
+	return 0;
 }
 
 /* String list implementation */
@@ -584,7 +781,7 @@ static int sieve_message_header_list_next_item
 	/* Check for end of current header list */
 	if ( hdrlist->headers == NULL ) {
 		hdrlist->headers_index = 0;
- 	} else if ( hdrlist->headers[hdrlist->headers_index] == NULL ) {
+ 	} else if ( hdrlist->headers[hdrlist->headers_index].value == NULL ) {
 		hdrlist->headers = NULL;
 		hdrlist->headers_index = 0;
 	}
@@ -608,22 +805,15 @@ static int sieve_message_header_list_next_item
 		}
 
 		/* Fetch all matching headers from the e-mail */
-		if ( hdrlist->mime_decode ) {
-			ret = mail_get_headers_utf8(mail,
-				str_c(hdr_item), &hdrlist->headers);
-		} else {
-			ret = mail_get_headers(mail,
-				str_c(hdr_item), &hdrlist->headers);
-		}
-
-		if (ret < 0) {
+		if ( sieve_message_header_cache_get(renv->msgctx, str_c(hdr_item),
+			hdrlist->mime_decode, &hdrlist->headers) < 0 ) {
 			_hdrlist->strlist.exec_status =
 				sieve_runtime_mail_error(renv, mail,
 					"failed to read header field `%s'", str_c(hdr_item));
 			return -1;
 		}
 
-		if ( hdrlist->headers == NULL || hdrlist->headers[0] == NULL ) {
+		if ( hdrlist->headers[0].value == NULL ) {
 			/* Try next item when no headers found */
 			hdrlist->headers = NULL;
 		}
@@ -632,7 +822,9 @@ static int sieve_message_header_list_next_item
 	/* Return next item */
 	if ( name_r != NULL )
 		*name_r = hdrlist->header_name;
-	*value_r = _header_right_trim(hdrlist->headers[hdrlist->headers_index++]);
+	*value_r = t_str_new_const(hdrlist->headers[hdrlist->headers_index].value,
+		hdrlist->headers[hdrlist->headers_index].size);
+	hdrlist->headers_index++;
 	return 1;
 }
 
@@ -856,6 +1048,9 @@ int sieve_message_get_header_fields
  * Message part
  */
 
+static void sieve_message_part_extract_text
+	(struct sieve_message_part *body_part);
+
 struct sieve_message_part *sieve_message_part_parent
 (struct sieve_message_part *mpart)
 {
@@ -921,6 +1116,7 @@ void sieve_message_part_get_data
 		data->content = "";
 		data->size = 0;
 	} else {
+		sieve_message_part_extract_text(mpart);
 		data->content = mpart->text_body;
 		data->size = mpart->text_body_size;
 	}
@@ -941,6 +1137,16 @@ static void str_replace_nuls(string_t *str)
 	}
 }
 
+/* We currently only support extracting plain text from:
+
+    - text/html -> HTML
+    - application/xhtml+xml -> XHTML
+
+   Other text types are read as is. Any non-text types are skipped.
+ */
+static const char * const _text_content_types[] =
+	{ "application/xhtml+xml", "text", NULL };
+
 static bool _is_wanted_content_type
 (const char * const *wanted_types, const char *content_type)
 ATTR_NULL(1)
@@ -980,7 +1186,44 @@ ATTR_NULL(1)
 	return FALSE;
 }
 
-static bool sieve_message_body_get_return_parts
+static void sieve_message_part_extract_text
+(struct sieve_message_part *body_part)
+{
+	struct mail_html2text *html2text;
+	buffer_t *text_buf;
+	char *part_data;
+
+	if ( body_part->text_body != NULL )
+		return;
+
+	if ( body_part->children != NULL || body_part->epilogue ||
+		body_part->decoded_body_size == 0 ||
+		!mail_html2text_content_type_match(body_part->content_type) ) {
+		/* Text is the same as the decoded body */
+		body_part->text_body = body_part->decoded_body;
+		body_part->text_body_size = body_part->decoded_body_size;
+		return;
+	}
+
+	text_buf = buffer_create_dynamic(default_pool, 4096);
+
+	/* Remove HTML markup */
+	html2text = mail_html2text_init(0);
+	mail_html2text_more(html2text,
+		(const unsigned char *)body_part->decoded_body,
+		body_part->decoded_body_size, text_buf);
+	mail_html2text_deinit(&html2text);
+
+	/* Make NUL-terminated copy in the pool of the decoded body */
+	part_data = p_malloc(body_part->pool, text_buf->used + 1);
+	memcpy(part_data, text_buf->data, text_buf->used);
+	body_part->text_body = part_data;
+	body_part->text_body_size = text_buf->used;
+
+	buffer_free(&text_buf);
+}
+
+static void sieve_message_body_get_return_parts
 (const struct sieve_runtime_env *renv,
 	const char * const *wanted_types,
 	bool extract_text)
@@ -990,15 +1233,11 @@ static bool sieve_message_body_get_return_parts
 	unsigned int i, count;
 	struct sieve_message_part_data *return_part;
 
-	/* Check whether any body parts are cached already */
-	body_parts = array_get(&msgctx->cached_body_parts, &count);
-	if ( count == 0 )
-		return FALSE;
-
 	/* Clear result array */
 	array_clear(&msgctx->return_body_parts);
 
 	/* Fill result array with requested content_types */
+	body_parts = array_get(&msgctx->analysis->cached_body_parts, &count);
 	for (i = 0; i < count; i++) {
 		if (!body_parts[i]->have_body) {
 			/* Part has no body; according to RFC this MUST not match to anything and
@@ -1017,79 +1256,41 @@ static bool sieve_message_body_get_return_parts
 		return_part->content_type = body_parts[i]->content_type;
 		return_part->content_disposition = body_parts[i]->content_disposition;
 
-		/* Depending on whether a decoded body part is requested, the appropriate
-		 * cache item is read. If it is missing, this function fails and the cache
-		 * needs to be completed by sieve_message_parts_add_missing().
+		/* Depending on whether a decoded body part is requested, the
+		 * appropriate version is returned; text is extracted on demand.
 		 */
 		if (extract_text) {
-			if (body_parts[i]->text_body == NULL)
-				return FALSE;
+			sieve_message_part_extract_text(body_parts[i]);
 			return_part->content = body_parts[i]->text_body;
 			return_part->size = body_parts[i]->text_body_size;
 		} else {
-			if (body_parts[i]->decoded_body == NULL)
-				return FALSE;
 			return_part->content = body_parts[i]->decoded_body;
-			return_part->size = body_parts[i]->decoded_body_size;				
+			return_part->size = body_parts[i]->decoded_body_size;
 		}
 	}
-
-	return TRUE;
 }
 
 static void sieve_message_part_save
 (const struct sieve_runtime_env *renv, buffer_t *buf,
-	struct sieve_message_part *body_part,
-	bool extract_text)
+	struct sieve_message_part *body_part)
 {
 	struct sieve_message_context *msgctx = renv->msgctx;
-	pool_t pool = msgctx->context_pool;
-	buffer_t *result_buf, *text_buf = NULL;
+	pool_t pool = msgctx->analysis->pool;
 	char *part_data;
-	size_t part_size;
 
-	/* Extract text if requested */
-	result_buf = buf;
-	if ( extract_text && body_part->children == NULL &&
-		!body_part->epilogue ) {
-
-		if ( buf->used > 0 && mail_html2text_content_type_match
-			(body_part->content_type) ) {
-			struct mail_html2text *html2text;
-
-			text_buf = buffer_create_dynamic(default_pool, 4096);
-
-			/* Remove HTML markup */
-			html2text = mail_html2text_init(0);
-			mail_html2text_more(html2text, buf->data, buf->used, text_buf);
-			mail_html2text_deinit(&html2text);
-
-			result_buf = text_buf;
-		}
+	if ( body_part->body_saved ) {
+		/* Stored by an earlier pass */
+		buffer_set_used_size(buf, 0);
+		return;
 	}
 
-	/* Add terminating NUL to the body part buffer */
-	buffer_append_c(result_buf, '\0');
-
-	/* Make copy of the buffer */
-	part_data = p_malloc(pool, result_buf->used);
-	memcpy(part_data, result_buf->data, result_buf->used);
-	part_size = result_buf->used - 1;
-
-	/* Free text buffer if used */
-	if ( text_buf != NULL)
-		buffer_free(&text_buf);
+	/* Make NUL-terminated copy of the buffer */
+	part_data = p_malloc(pool, buf->used + 1);
+	memcpy(part_data, buf->data, buf->used);
 
-	/* Depending on whether the part is processed into text, store message
-	 * body in the appropriate cache location.
-	 */
-	if ( !extract_text ) {
-		body_part->decoded_body = part_data;
-		body_part->decoded_body_size = part_size;
-	} else {
-		body_part->text_body = part_data;
-		body_part->text_body_size = part_size;
-	}
+	body_part->decoded_body = part_data;
+	body_part->decoded_body_size = buf->used;
+	body_part->body_saved = TRUE;
 
 	/* Clear buffer */
 	buffer_set_used_size(buf, 0);
@@ -1143,22 +1344,182 @@ _parse_content_disposition(const struct message_header_line *hdr)
 	return str_c(content_disp);
 }
 
-/* sieve_message_parts_add_missing():
- *   Add requested message body parts to the cache that are missing.
- */
-static int sieve_message_parts_add_missing
+/* Streamed body parts */
+
+struct sieve_message_body_stream {
+	const struct sieve_message_body_stream_callbacks *callbacks;
+	void *context;
+
+	const char *const *content_types;
+
+	/* Part currently being passed to the callbacks */
+	struct sieve_message_part *part;
+
+	struct mail_html2text *html2text;
+	buffer_t *text_buf;
+
+	unsigned int extract_text:1;
+	unsigned int part_done:1; /* no more data wanted for this part */
+	unsigned int stopped:1;   /* no more parts wanted at all */
+};
+
+static bool sieve_message_stream_part_begin
+(struct sieve_message_body_stream *stream,
+	struct sieve_message_part *body_part)
+{
+	struct sieve_message_part_data data;
+
+	if ( stream->stopped )
+		return FALSE;
+	if ( stream->part == body_part )
+		return !stream->part_done;
+
+	i_assert( stream->part == NULL );
+
+	/* Parts without a body are never part of the result */
+	if ( !body_part->have_body || !_is_wanted_content_type
+		(stream->content_types, body_part->content_type) )
+		return FALSE;
+
+	memset(&data, 0, sizeof(data));
+	data.content_type = body_part->content_type;
+	data.content_disposition = body_part->content_disposition;
+
+	stream->part = body_part;
+	if ( stream->callbacks->part_begin(stream->context, &data) < 0 ) {
+		stream->stopped = TRUE;
+		return FALSE;
+	}
+
+	if ( stream->extract_text && !body_part->epilogue &&
+		mail_html2text_content_type_match(body_part->content_type) ) {
+		/* Remove HTML markup on the fly */
+		stream->html2text = mail_html2text_init(0);
+	}
+	return TRUE;
+}
+
+static void sieve_message_stream_part_more
+(struct sieve_message_body_stream *stream,
+	struct sieve_message_part *body_part,
+	const unsigned char *data, size_t size)
+{
+	const unsigned char *chunk;
+	size_t chunk_size;
+	int ret;
+
+	if ( !sieve_message_stream_part_begin(stream, body_part) )
+		return;
+
+	/* Pass the data in bounded chunks, so that the text extracted from HTML
+	   does not grow with the size of the decoded block */
+	while ( size > 0 && !stream->stopped && !stream->part_done ) {
+		chunk = data;
+		chunk_size = I_MIN(size, SIEVE_MESSAGE_BODY_STREAM_CHUNK_SIZE);
+		data += chunk_size;
+		size -= chunk_size;
+
+		if ( stream->html2text != NULL ) {
+			buffer_set_used_size(stream->text_buf, 0);
+			mail_html2text_more
+				(stream->html2text, chunk, chunk_size, stream->text_buf);
+			chunk = stream->text_buf->data;
+			chunk_size = stream->text_buf->used;
+			if ( chunk_size == 0 )
+				continue;
+		}
+
+		ret = stream->callbacks->part_more
+			(stream->context, chunk, chunk_size);
+		if ( ret < 0 )
+			stream->stopped = TRUE;
+		else if ( ret > 0 )
+			stream->part_done = TRUE;
+	}
+}
+
+static void sieve_message_stream_part_end
+(struct sieve_message_body_stream *stream,
+	struct sieve_message_part *body_part)
+{
+	/* Parts with an empty body are passed as well */
+	if ( !stream->stopped && (stream->part == body_part ||
+		sieve_message_stream_part_begin(stream, body_part)) ) {
+		if ( stream->callbacks->part_end(stream->context) != 0 )
+			stream->stopped = TRUE;
+	}
+
+	if ( stream->html2text != NULL )
+		mail_html2text_deinit(&stream->html2text);
+	stream->part = NULL;
+	stream->part_done = FALSE;
+}
+
+static inline bool sieve_message_stream_wants_data
+(struct sieve_message_body_stream *stream)
+{
+	return ( stream == NULL || (!stream->stopped && !stream->part_done) );
+}
+
+static void sieve_message_part_flush
 (const struct sieve_runtime_env *renv,
-	const char *const *content_types,
-	bool extract_text, bool iter_all)
+	struct sieve_message_body_stream *stream, buffer_t *buf,
+	struct sieve_message_part *body_part)
+{
+	if ( stream == NULL ) {
+		sieve_message_part_save(renv, buf, body_part);
+		return;
+	}
+
+	/* Only headers of message/rfc822 parts are collected in the buffer */
+	if ( buf->used > 0 ) {
+		sieve_message_stream_part_more(stream, body_part, buf->data, buf->used);
+		buffer_set_used_size(buf, 0);
+	}
+	sieve_message_stream_part_end(stream, body_part);
+}
+
+static bool sieve_message_parts_have_bodies
+(struct sieve_message_context *msgctx, const char *const *content_types)
 	ATTR_NULL(2)
+{
+	struct sieve_message_part *const *body_parts;
+	unsigned int i, count;
+
+	body_parts = array_get(&msgctx->analysis->cached_body_parts, &count);
+	for (i = 0; i < count; i++) {
+		if ( body_parts[i]->have_body && !body_parts[i]->body_saved &&
+			_is_wanted_content_type(content_types, body_parts[i]->content_type) )
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* sieve_message_parts_parse():
+ *   Parse the complete part structure of the message in a single pass. All
+ *   headers are stored, but only the bodies of the requested content types are
+ *   decoded and kept; when other bodies are needed later, one more pass
+ *   stores all of them. Text is extracted from the bodies only when it is
+ *   requested. When a stream is provided, no bodies are kept at all; these
+ *   are passed to the stream callbacks instead.
+ *
+ *   A later pass over the same message reuses the part structures of the
+ *   first one by index, so that these stay valid for part iterators and
+ *   nothing is allocated again for the headers and content types.
+ */
+static int sieve_message_parts_parse
+(const struct sieve_runtime_env *renv, const char *const *content_types,
+	struct sieve_message_body_stream *stream) ATTR_NULL(2, 3)
 {
 	struct sieve_message_context *msgctx = renv->msgctx;
-	pool_t pool = msgctx->context_pool;
+	struct sieve_message_analysis *analysis = msgctx->analysis;
+	pool_t pool = analysis->pool;
 	struct mail *mail = sieve_message_get_mail(renv->msgctx);
 	enum message_parser_flags mparser_flags =
 		MESSAGE_PARSER_FLAG_INCLUDE_MULTIPART_BLOCKS;
 	enum message_header_parser_flags hparser_flags =
-		MESSAGE_HEADER_PARSER_FLAG_SKIP_INITIAL_LWSP;
+		MESSAGE_HEADER_PARSER_FLAG_SKIP_INITIAL_LWSP |
+		MESSAGE_HEADER_PARSER_FLAG_CLEAN_ONELINE;
 	ARRAY(struct sieve_message_header) headers;
 	struct sieve_message_part *body_part, *header_part, *last_part;
 	struct message_parser_ctx *parser;
@@ -1168,15 +1529,17 @@ static int sieve_message_parts_add_missing
 	buffer_t *buf;
 	struct istream *input;
 	unsigned int idx = 0;
-	bool save_body = FALSE, have_all;
+	bool save_body = FALSE, reparse;
 	string_t *hdr_content = NULL;
 	int ret;
 
-	/* First check whether any are missing */
-	if ( !iter_all && sieve_message_body_get_return_parts
-		(renv, content_types, extract_text) ) {
-		/* Cache hit; all are present */
-		return SIEVE_EXEC_OK;
+	/* Check whether the parts were parsed already */
+	if ( stream == NULL && analysis->parts_parsed ) {
+		if ( sieve_message_parts_have_bodies(msgctx, content_types) )
+			return SIEVE_EXEC_OK;
+
+		/* Store all bodies this time, so that this is the last pass */
+		content_types = NULL;
 	}
 
 	/* Get the message stream */
@@ -1189,16 +1552,18 @@ static int sieve_message_parts_add_missing
 			"failed to parse input message parts");
 	}
 
+	/* The part structure of the message was already parsed; only bodies are
+	 * added this time.
+	 */
+	reparse = analysis->parts_parsed;
+	if ( !reparse )
+		array_clear(&analysis->cached_body_parts);
+
 	buf = buffer_create_dynamic(default_pool, 4096);
 	body_part = header_part = last_part = NULL;
 
-	if (iter_all) {
-		t_array_init(&headers, 64);
-		hdr_content = t_str_new(512);
-		hparser_flags |= MESSAGE_HEADER_PARSER_FLAG_CLEAN_ONELINE;
-	} else {
-		memset(&headers, 0, sizeof(headers));
-	}
+	t_array_init(&headers, 64);
+	hdr_content = t_str_new(512);
 
 	/* Initialize body decoder */
 	decoder = message_decoder_init(NULL, 0);
@@ -1210,7 +1575,6 @@ static int sieve_message_parts_add_missing
 		input, hparser_flags, mparser_flags);
 	while ( (ret=message_parser_parse_next_block
 		(parser, &block)) > 0 ) {
-		struct sieve_message_part **body_part_idx;
 		struct message_header_line *hdr = block.hdr;
 		struct sieve_message_header *header;
 		unsigned char *data;
@@ -1224,13 +1588,10 @@ static int sieve_message_parts_add_missing
 				if ( block.part->parent == prev_mpart &&
 					strcmp(body_part->content_type, "message/rfc822") == 0 ) {
 					message_rfc822 = TRUE;
-				} else {
-					if ( save_body ) {
-						sieve_message_part_save
-							(renv, buf, body_part, extract_text);
-					}
+				} else if ( save_body ) {
+					sieve_message_part_flush(renv, stream, buf, body_part);
 				}
-				if ( iter_all && !array_is_created(&body_part->headers) &&
+				if ( !array_is_created(&body_part->headers) &&
 					array_count(&headers) > 0 ) {
 					p_array_init(&body_part->headers, pool, array_count(&headers));
 					array_copy(&body_part->headers.arr, 0,
@@ -1239,14 +1600,16 @@ static int sieve_message_parts_add_missing
 			}
 
 			/* Start processing next part */
-			body_part_idx = array_idx_modifiable
-				(&msgctx->cached_body_parts, idx);
-			if ( *body_part_idx == NULL )
-				*body_part_idx = p_new(pool, struct sieve_message_part, 1);
-			body_part = *body_part_idx;
-			body_part->content_type = "text/plain";
-			if ( iter_all )
-				array_clear(&headers);
+			if ( reparse ) {
+				i_assert( idx < array_count(&analysis->cached_body_parts) );
+				body_part = *array_idx(&analysis->cached_body_parts, idx);
+			} else {
+				body_part = p_new(pool, struct sieve_message_part, 1);
+				body_part->pool = pool;
+				body_part->content_type = "text/plain";
+				array_append(&analysis->cached_body_parts, &body_part, 1);
+			}
+			array_clear(&headers);
 
 			/* Copy tree structure */
 			if ( block.part->context != NULL ) {
@@ -1258,8 +1621,9 @@ static int sieve_message_parts_add_missing
 				body_part->content_type = epipart->content_type;
 				body_part->have_body = TRUE;
 				body_part->epilogue = TRUE;
-				save_body = iter_all || _is_wanted_content_type
-					(content_types, body_part->content_type);
+				save_body = ( (stream != NULL || !body_part->body_saved) &&
+					_is_wanted_content_type
+						(content_types, body_part->content_type) );
 
 			} else {
 				struct sieve_message_part *parent = NULL;
@@ -1295,9 +1659,8 @@ static int sieve_message_parts_add_missing
 			 */
 			if ( message_rfc822 ) {
 				i_assert(idx > 0);
-				body_part_idx = array_idx_modifiable
-					(&msgctx->cached_body_parts, idx-1);
-				header_part = *body_part_idx;
+				header_part = *array_idx
+					(&analysis->cached_body_parts, idx-1);
 			} else {
 				header_part = NULL;
 			}
@@ -1323,15 +1686,15 @@ static int sieve_message_parts_add_missing
 			if ( hdr == NULL ) {
 				/* Save headers for message/rfc822 part */
 				if ( header_part != NULL ) {
-					sieve_message_part_save
-						(renv, buf, header_part, FALSE);
+					sieve_message_part_flush(renv, stream, buf, header_part);
 					header_part = NULL;
 				}
 
 				/* Save bodies only if we have a wanted content-type */
 				i_assert( body_part != NULL );
-				save_body = iter_all || _is_wanted_content_type
-					(content_types, body_part->content_type);
+				save_body = ( (stream != NULL || !body_part->body_saved) &&
+					_is_wanted_content_type
+						(content_types, body_part->content_type) );
 				continue;
 			}
 
@@ -1356,11 +1719,15 @@ static int sieve_message_parts_add_missing
 				}
 			}
 
+			/* Headers and content type are known from the first pass */
+			if ( reparse )
+				continue;
+
 			if ( strcasecmp(hdr->name, "Content-Type" ) == 0 )
 				hdr_field = _HDR_CONTENT_TYPE;
 			else if ( strcasecmp(hdr->name, "Content-Disposition" ) == 0 )
 				hdr_field = _HDR_CONTENT_DISPOSITION;
-			else if ( iter_all && !array_is_created(&body_part->headers) )
+			else if ( !array_is_created(&body_part->headers) )
 				hdr_field = _HDR_OTHER;
 			else {
 				/* Not interested in this header */
@@ -1375,7 +1742,7 @@ static int sieve_message_parts_add_missing
 				continue;
 			}
 
-			if ( iter_all && !array_is_created(&body_part->headers) ) {
+			if ( !array_is_created(&body_part->headers) ) {
 				const unsigned char *value, *vp;
 				size_t vlen;
 
@@ -1448,35 +1815,31 @@ static int sieve_message_parts_add_missing
 		}
 
 		/* Reading body */
-		if ( save_body ) {
+		if ( save_body && sieve_message_stream_wants_data(stream) ) {
 			(void)message_decoder_decode_next_block
 					(decoder, &block, &decoded);
-			buffer_append(buf, decoded.data, decoded.size);
+			if ( stream != NULL ) {
+				sieve_message_stream_part_more
+					(stream, body_part, decoded.data, decoded.size);
+			} else {
+				buffer_append(buf, decoded.data, decoded.size);
+			}
 		}
 	}
 
 	/* Save last body part if necessary */
 	if ( header_part != NULL ) {
-		sieve_message_part_save
-			(renv, buf, header_part, FALSE);
+		sieve_message_part_flush(renv, stream, buf, header_part);
 	} else if ( body_part != NULL && save_body ) {
-		sieve_message_part_save
-			(renv, buf, body_part, extract_text);
+		sieve_message_part_flush(renv, stream, buf, body_part);
 	}
-	if ( iter_all && !array_is_created(&body_part->headers) &&
+	if ( body_part != NULL && !array_is_created(&body_part->headers) &&
 		array_count(&headers) > 0 ) {
 		p_array_init(&body_part->headers, pool, array_count(&headers));
 		array_copy(&body_part->headers.arr, 0,
 			&headers.arr, 0, array_count(&headers));
 	}
 
-	/* Try to fill the return_body_parts array once more */
-	have_all = iter_all || sieve_message_body_get_return_parts
-		(renv, content_types, extract_text);
-
-	/* This time, failure is a bug */
-	i_assert(have_all);
-
 	/* Cleanup */
 	(void)message_parser_deinit(&parser, &mparts);
 	message_decoder_deinit(&decoder);
@@ -1491,6 +1854,8 @@ static int sieve_message_parts_add_missing
 			i_stream_get_error(input));
 		return SIEVE_EXEC_TEMP_FAILURE;
 	}
+
+	analysis->parts_parsed = TRUE;
 	return SIEVE_EXEC_OK;
 }
 
@@ -1504,8 +1869,11 @@ int sieve_message_body_get_content
 
 	T_BEGIN {
 		/* Fill the return_body_parts array */
-		status = sieve_message_parts_add_missing
-			(renv, content_types, FALSE, FALSE);
+		status = sieve_message_parts_parse(renv, content_types, NULL);
+		if ( status > 0 ) {
+			sieve_message_body_get_return_parts
+				(renv, content_types, FALSE);
+		}
 	} T_END;
 
 	/* Check status */
@@ -1523,23 +1891,16 @@ int sieve_message_body_get_text
 (const struct sieve_runtime_env *renv,
 	struct sieve_message_part_data **parts_r)
 {
-	static const char * const _text_content_types[] =
-		{ "application/xhtml+xml", "text", NULL };
 	struct sieve_message_context *msgctx = renv->msgctx;
 	int status;
 
-	/* We currently only support extracting plain text from:
-
-	    - text/html -> HTML
-	    - application/xhtml+xml -> XHTML
-
-	   Other text types are read as is. Any non-text types are skipped.
-	 */
-
 	T_BEGIN {
 		/* Fill the return_body_parts array */
-		status = sieve_message_parts_add_missing
-			(renv, _text_content_types, TRUE, FALSE);
+		status = sieve_message_parts_parse(renv, _text_content_types, NULL);
+		if ( status > 0 ) {
+			sieve_message_body_get_return_parts
+				(renv, _text_content_types, TRUE);
+		}
 	} T_END;
 
 	/* Check status */
@@ -1558,10 +1919,11 @@ int sieve_message_body_get_raw
 	struct sieve_message_part_data **parts_r)
 {
 	struct sieve_message_context *msgctx = renv->msgctx;
+	struct sieve_message_analysis *analysis = msgctx->analysis;
 	struct sieve_message_part_data *return_part;
 	buffer_t *buf;
 
-	if ( msgctx->raw_body == NULL ) {
+	if ( analysis->raw_body == NULL ) {
 		struct mail *mail = sieve_message_get_mail(renv->msgctx);
 		struct istream *input;
 		struct message_size hdr_size, body_size;
@@ -1569,8 +1931,7 @@ int sieve_message_body_get_raw
 		size_t size;
 		int ret;
 
-		msgctx->raw_body = buf = buffer_create_dynamic
-			(msgctx->context_pool, 1024*64);
+		buf = buffer_create_dynamic(analysis->pool, 1024*64);
 
 		/* Get stream for message */
  		if ( mail_get_stream(mail, &hdr_size, &body_size, &input) < 0 ) {
@@ -1600,8 +1961,10 @@ int sieve_message_body_get_raw
 		/* Add terminating NUL to the body part buffer */
 		buffer_append_c(buf, '\0');
 
+		/* Only a complete body is kept; the analysis may be shared */
+		analysis->raw_body = buf;
 	} else {
-		buf = msgctx->raw_body;
+		buf = analysis->raw_body;
 	}
 
 	/* Clear result array */
@@ -1626,6 +1989,161 @@ int sieve_message_body_get_raw
 	return SIEVE_EXEC_OK;
 }
 
+/*
+ * Streamed message body
+ */
+
+static int sieve_message_body_stream_buffer
+(const struct sieve_message_body_stream_callbacks *callbacks, void *context,
+	const struct sieve_message_part_data *parts)
+{
+	for ( ; parts->content != NULL; parts++ ) {
+		if ( callbacks->part_begin(context, parts) < 0 )
+			break;
+		if ( parts->size > 0 && callbacks->part_more(context,
+			(const unsigned char *)parts->content, parts->size) < 0 )
+			break;
+		if ( callbacks->part_end(context) != 0 )
+			break;
+	}
+	return SIEVE_EXEC_OK;
+}
+
+static int sieve_message_body_stream_parts
+(const struct sieve_runtime_env *renv,
+	const char * const *content_types, bool extract_text,
+	const struct sieve_message_body_stream_callbacks *callbacks,
+	void *context)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	struct mail *mail = sieve_message_get_mail(msgctx);
+	struct sieve_message_body_stream stream;
+	uoff_t size;
+	int status;
+
+	/* Small bodies are stored, so that the next test finds them in memory
+	   rather than decoding the message again. Only large bodies, for which
+	   memory matters more than the repeated pass, are streamed. */
+	if ( (msgctx->analysis->parts_parsed &&
+		sieve_message_parts_have_bodies(msgctx, content_types)) ||
+		(mail_get_physical_size(mail, &size) == 0 &&
+			size <= renv->svinst->body_stream_min_size) ) {
+		struct sieve_message_part_data *parts;
+
+		/* The bodies are in memory or small enough to be */
+		if ( extract_text )
+			status = sieve_message_body_get_text(renv, &parts);
+		else {
+			status = sieve_message_body_get_content
+				(renv, content_types, &parts);
+		}
+		if ( status <= 0 )
+			return status;
+		return sieve_message_body_stream_buffer(callbacks, context, parts);
+	}
+
+	memset(&stream, 0, sizeof(stream));
+	stream.callbacks = callbacks;
+	stream.context = context;
+	stream.content_types = content_types;
+	stream.extract_text = extract_text;
+	if ( extract_text )
+		stream.text_buf = buffer_create_dynamic(default_pool, 4096);
+
+	T_BEGIN {
+		status = sieve_message_parts_parse(renv, content_types, &stream);
+	} T_END;
+
+	if ( stream.html2text != NULL )
+		mail_html2text_deinit(&stream.html2text);
+	if ( stream.text_buf != NULL )
+		buffer_free(&stream.text_buf);
+	return status;
+}
+
+int sieve_message_body_stream_content
+(const struct sieve_runtime_env *renv,
+	const char * const *content_types,
+	const struct sieve_message_body_stream_callbacks *callbacks,
+	void *context)
+{
+	return sieve_message_body_stream_parts
+		(renv, content_types, FALSE, callbacks, context);
+}
+
+int sieve_message_body_stream_text
+(const struct sieve_runtime_env *renv,
+	const struct sieve_message_body_stream_callbacks *callbacks,
+	void *context)
+{
+	return sieve_message_body_stream_parts
+		(renv, _text_content_types, TRUE, callbacks, context);
+}
+
+int sieve_message_body_stream_raw
+(const struct sieve_runtime_env *renv,
+	const struct sieve_message_body_stream_callbacks *callbacks,
+	void *context)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	struct sieve_message_part_data part;
+	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	struct istream *input;
+	struct message_size hdr_size, body_size;
+	const unsigned char *data;
+	size_t size;
+	uoff_t msg_size;
+	bool started = FALSE;
+	int ret = 0, cret = 0;
+
+	if ( msgctx->analysis->raw_body != NULL ||
+		(mail_get_physical_size(mail, &msg_size) == 0 &&
+			msg_size <= renv->svinst->body_stream_min_size) ) {
+		struct sieve_message_part_data *parts;
+
+		/* The body is in memory already or small enough to be */
+		if ( (ret=sieve_message_body_get_raw(renv, &parts)) <= 0 )
+			return ret;
+		return sieve_message_body_stream_buffer(callbacks, context, parts);
+	}
+
+	/* Get stream for message */
+	if ( mail_get_stream(mail, &hdr_size, &body_size, &input) < 0 ) {
+		return sieve_runtime_mail_error(renv, mail,
+			"failed to open input message");
+	}
+
+	/* Skip stream to beginning of body */
+	i_stream_skip(input, hdr_size.physical_size);
+
+	/* Pass the raw message body; an empty body is no part at all */
+	memset(&part, 0, sizeof(part));
+	while ( cret == 0 &&
+		(ret=i_stream_read_more(input, &data, &size)) > 0 ) {
+		if ( !started ) {
+			if ( callbacks->part_begin(context, &part) < 0 )
+				return SIEVE_EXEC_OK;
+			started = TRUE;
+		}
+		size = I_MIN(size, SIEVE_MESSAGE_BODY_STREAM_CHUNK_SIZE);
+		cret = callbacks->part_more(context, data, size);
+		i_stream_skip(input, size);
+	}
+
+	if ( cret == 0 && ret < 0 && input->stream_errno != 0 ) {
+		sieve_runtime_critical(renv, NULL,
+			"failed to read input message",
+			"read(%s) failed: %s",
+			i_stream_get_name(input),
+			i_stream_get_error(input));
+		return SIEVE_EXEC_TEMP_FAILURE;
+	}
+
+	if ( started && cret >= 0 )
+		(void)callbacks->part_end(context);
+	return SIEVE_EXEC_OK;
+}
+
 /*
  * Message part iterator
  */
@@ -1640,9 +2158,8 @@ int sieve_message_part_iter_init
 	int status;
 
 	T_BEGIN {
-		/* Fill the return_body_parts array */
-		status = sieve_message_parts_add_missing
-			(renv, NULL, TRUE, TRUE);
+		/* Parse the message part structure with all bodies */
+		status = sieve_message_parts_parse(renv, NULL, NULL);
 	} T_END;
 
 	/* Check status */
@@ -1651,10 +2168,11 @@ int sieve_message_part_iter_init
 
 	memset(iter, 0, sizeof(*iter));
 	iter->renv = renv;
+	iter->analysis = msgctx->analysis;
 	iter->index = 0;
 	iter->offset = 0;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);
+	parts = array_get(&iter->analysis->cached_body_parts, &count);
 	if (count == 0)
 		iter->root = NULL;
 	else
@@ -1666,14 +2184,12 @@ int sieve_message_part_iter_init
 void sieve_message_part_iter_subtree(struct sieve_message_part_iter *iter,
 	struct sieve_message_part_iter *subtree)
 {
-	const struct sieve_runtime_env *renv = iter->renv;
-	struct sieve_message_context *msgctx = renv->msgctx;
 	struct sieve_message_part *const *parts;
 	unsigned int count;
 
 	*subtree = *iter;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);
+	parts = array_get(&iter->analysis->cached_body_parts, &count);
 	if ( subtree->index >= count)
 		subtree->root = NULL;
 	else
@@ -1684,14 +2200,12 @@ void sieve_message_part_iter_subtree(struct sieve_message_part_iter *iter,
 void sieve_message_part_iter_children(struct sieve_message_part_iter *iter,
 	struct sieve_message_part_iter *child)
 {
-	const struct sieve_runtime_env *renv = iter->renv;
-	struct sieve_message_context *msgctx = renv->msgctx;
 	struct sieve_message_part *const *parts;
 	unsigned int count;
 
 	*child = *iter;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);	
+	parts = array_get(&iter->analysis->cached_body_parts, &count);	
 	if ( (child->index+1) >= count || parts[child->index]->children == NULL)
 		child->root = NULL;
 	else
@@ -1702,15 +2216,13 @@ void sieve_message_part_iter_children(struct sieve_message_part_iter *iter,
 struct sieve_message_part *sieve_message_part_iter_current
 (struct sieve_message_part_iter *iter)
 {
-	const struct sieve_runtime_env *renv = iter->renv;
-	struct sieve_message_context *msgctx = renv->msgctx;
 	struct sieve_message_part *const *parts;
 	unsigned int count;
 
 	if ( iter->root == NULL )
 		return NULL;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);
+	parts = array_get(&iter->analysis->cached_body_parts, &count);
 	if ( iter->index >= count )
 		return NULL;
 	do {
@@ -1727,10 +2239,7 @@ struct sieve_message_part *sieve_message_part_iter_current
 struct sieve_message_part *sieve_message_part_iter_next
 (struct sieve_message_part_iter *iter)
 {
-	const struct sieve_runtime_env *renv = iter->renv;
-	struct sieve_message_context *msgctx = renv->msgctx;
-
-	if ( iter->index >= array_count(&msgctx->cached_body_parts) )
+	if ( iter->index >= array_count(&iter->analysis->cached_body_parts) )
 		return NULL;
 	iter->index++;
 
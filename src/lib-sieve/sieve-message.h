@@ -14,6 +14,20 @@
 
 const char *sieve_message_get_new_id(const struct sieve_instance *svinst);
 
+/*
+ * Message analysis
+ */
+
+/* Holds the header fields and the part structure of a message once these are
+   parsed. Passing the same analysis object in the message data for several
+   executions (e.g. for all recipients of a delivery) avoids parsing the same
+   message again for each of them. It is only used for the message as it was
+   received; edited or substituted messages are analyzed separately. */
+
+struct sieve_message_analysis *sieve_message_analysis_create(void);
+void sieve_message_analysis_ref(struct sieve_message_analysis *analysis);
+void sieve_message_analysis_unref(struct sieve_message_analysis **_analysis);
+
 /*
  * Message context
  */
@@ -252,12 +266,44 @@ int sieve_message_body_get_raw
 	(const struct sieve_runtime_env *renv,
 		struct sieve_message_part_data **parts_r);
 
+/* Streamed variants of the functions above: the body of each part is passed
+   to the callbacks in chunks as it is decoded, rather than being stored in
+   the message context. A callback returning -1 aborts the stream. When
+   part_more() returns 1, no more data is passed for the current part and
+   when part_end() returns 1, no further parts are passed at all. Messages up
+   to the sieve_body_stream_min_size setting are stored as usual and passed
+   from memory, so that repeated tests only decode these once. */
+
+struct sieve_message_body_stream_callbacks {
+	int (*part_begin)
+		(void *context, const struct sieve_message_part_data *part);
+	int (*part_more)
+		(void *context, const unsigned char *data, size_t size);
+	int (*part_end)(void *context);
+};
+
+int sieve_message_body_stream_content
+	(const struct sieve_runtime_env *renv,
+		const char * const *content_types,
+		const struct sieve_message_body_stream_callbacks *callbacks,
+		void *context);
+int sieve_message_body_stream_text
+	(const struct sieve_runtime_env *renv,
+		const struct sieve_message_body_stream_callbacks *callbacks,
+		void *context);
+int sieve_message_body_stream_raw
+	(const struct sieve_runtime_env *renv,
+		const struct sieve_message_body_stream_callbacks *callbacks,
+		void *context);
+
 /*
  * Message part iterator
  */
 
 struct sieve_message_part_iter {
 	const struct sieve_runtime_env *renv;
+	/* Parts stay valid when the message is edited during the iteration */
+	struct sieve_message_analysis *analysis;
 	struct sieve_message_part *root;
 	unsigned int index, offset;
 };
@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "array.h"
 
 #include "strtrim.h"
 
@@ -18,6 +19,26 @@
  * Access to settings
  */
 
+static void sieve_settings_snapshot_add
+	(struct sieve_instance *svinst, const char *identifier,
+		const char *value);
+
+const char *sieve_setting_get
+(struct sieve_instance *svinst, const char *identifier)
+{
+	const struct sieve_callbacks *callbacks = svinst->callbacks;
+	const char *value;
+
+	if ( callbacks == NULL || callbacks->get_setting == NULL )
+		return NULL;
+
+	value = callbacks->get_setting(svinst->context, identifier);
+
+	if ( svinst->settings_snapshot != NULL )
+		sieve_settings_snapshot_add(svinst, identifier, value);
+	return value;
+}
+
 bool sieve_setting_get_uint_value
 (struct sieve_instance *svinst, const char *setting,
 	unsigned long long int *value_r)
@@ -227,6 +248,39 @@ void sieve_settings_load
 		svinst->max_redirects = (unsigned int) uint_setting;
 	}
 
+	svinst->binary_mmap_disable = FALSE;
+	(void)sieve_setting_get_bool_value
+		(svinst, "sieve_binary_mmap_disable", &svinst->binary_mmap_disable);
+
+	svinst->binary_cache_size = SIEVE_DEFAULT_BINARY_CACHE_SIZE;
+	if ( sieve_setting_get_size_value
+		(svinst, "sieve_binary_cache_size", &size_setting) ) {
+		svinst->binary_cache_size = size_setting;
+	}
+
+	svinst->body_stream_min_size = SIEVE_DEFAULT_BODY_STREAM_MIN_SIZE;
+	if ( sieve_setting_get_size_value
+		(svinst, "sieve_body_stream_min_size", &size_setting) ) {
+		svinst->body_stream_min_size = size_setting;
+	}
+
+	svinst->trace_ring_path = NULL;
+	str_setting = sieve_setting_get(svinst, "sieve_trace_ring");
+	if ( str_setting != NULL && *str_setting != '\0' )
+		svinst->trace_ring_path = p_strdup(svinst->pool, str_setting);
+
+	svinst->trace_ring_sample = 1;
+	if ( sieve_setting_get_uint_value
+		(svinst, "sieve_trace_ring_sample", &uint_setting) ) {
+		svinst->trace_ring_sample = (unsigned int) uint_setting;
+	}
+
+	svinst->trace_ring_max_size = SIEVE_DEFAULT_TRACE_RING_MAX_SIZE;
+	if ( sieve_setting_get_size_value
+		(svinst, "sieve_trace_ring_max_size", &size_setting) ) {
+		svinst->trace_ring_max_size = size_setting;
+	}
+
 	(void)sieve_address_source_parse_from_setting(svinst,
 		svinst->pool, "sieve_redirect_envelope_from",
 		&svinst->redirect_from);
@@ -244,4 +298,79 @@ void sieve_settings_load
 	}
 }
 
+/*
+ * Settings snapshot
+ */
+
+struct sieve_setting_value {
+	const char *identifier;
+	const char *value;
+};
+
+struct sieve_settings_snapshot {
+	ARRAY(struct sieve_setting_value) values;
+
+	unsigned int recording:1;
+};
 
+void sieve_settings_snapshot_start(struct sieve_instance *svinst)
+{
+	struct sieve_settings_snapshot *snapshot;
+
+	i_assert( svinst->settings_snapshot == NULL );
+
+	snapshot = p_new(svinst->pool, struct sieve_settings_snapshot, 1);
+	p_array_init(&snapshot->values, svinst->pool, 64);
+	snapshot->recording = TRUE;
+
+	svinst->settings_snapshot = snapshot;
+}
+
+void sieve_settings_snapshot_stop(struct sieve_instance *svinst)
+{
+	if ( svinst->settings_snapshot != NULL )
+		svinst->settings_snapshot->recording = FALSE;
+}
+
+static void sieve_settings_snapshot_add
+(struct sieve_instance *svinst, const char *identifier, const char *value)
+{
+	struct sieve_settings_snapshot *snapshot = svinst->settings_snapshot;
+	const struct sieve_setting_value *sval;
+	struct sieve_setting_value *new_sval;
+
+	if ( !snapshot->recording )
+		return;
+
+	/* Values are stable within one context; keep the first one */
+	array_foreach(&snapshot->values, sval) {
+		if ( strcmp(sval->identifier, identifier) == 0 )
+			return;
+	}
+
+	new_sval = array_append_space(&snapshot->values);
+	new_sval->identifier = p_strdup(svinst->pool, identifier);
+	new_sval->value = p_strdup(svinst->pool, value);
+}
+
+bool sieve_settings_snapshot_matches
+(struct sieve_instance *svinst, void *context)
+{
+	const struct sieve_callbacks *callbacks = svinst->callbacks;
+	struct sieve_settings_snapshot *snapshot = svinst->settings_snapshot;
+	const struct sieve_setting_value *sval;
+
+	if ( snapshot == NULL || snapshot->recording )
+		return FALSE;
+	if ( callbacks == NULL || callbacks->get_setting == NULL )
+		return TRUE;
+
+	array_foreach(&snapshot->values, sval) {
+		const char *value =
+			callbacks->get_setting(context, sval->identifier);
+
+		if ( null_strcmp(value, sval->value) != 0 )
+			return FALSE;
+	}
+	return TRUE;
+}
@@ -10,16 +10,8 @@
  * Access to settings
  */
 
-static inline const char *sieve_setting_get
-(struct sieve_instance *svinst, const char *identifier)
-{
-	const struct sieve_callbacks *callbacks = svinst->callbacks;
-
-	if ( callbacks == NULL || callbacks->get_setting == NULL )
-		return NULL;
-
-	return callbacks->get_setting(svinst->context, identifier);
-}
+const char *sieve_setting_get
+	(struct sieve_instance *svinst, const char *identifier);
 
 bool sieve_setting_get_uint_value
 	(struct sieve_instance *svinst, const char *setting,
@@ -44,6 +36,20 @@ bool sieve_setting_get_duration_value
 void sieve_settings_load
 	(struct sieve_instance *svinst);
 
+/*
+ * Settings snapshot
+ */
+
+/* Records the settings read while the instance is being initialized. The
+   configuration of an instance depends only on those, so it can be reused for
+   another user context that yields the same values. */
+
+void sieve_settings_snapshot_start(struct sieve_instance *svinst);
+void sieve_settings_snapshot_stop(struct sieve_instance *svinst);
+
+bool sieve_settings_snapshot_matches
+	(struct sieve_instance *svinst, void *context);
+
 /*
  * Home directory
  */
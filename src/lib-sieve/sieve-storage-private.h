@@ -224,6 +224,11 @@ extern const struct sieve_storage sieve_dict_storage;
 
 extern const struct sieve_storage sieve_ldap_storage;
 
+#ifdef SIEVE_BUILTIN_LDAP
+/* Closes the pooled connections that are no longer used */
+void sieve_ldap_db_deinit(void);
+#endif
+
 /*
  * Error handling
  */
@@ -47,7 +47,10 @@ void sieve_storages_init(struct sieve_instance *svinst)
 
 void sieve_storages_deinit(struct sieve_instance *svinst ATTR_UNUSED)
 {
-	/* nothing yet */
+#ifdef SIEVE_BUILTIN_LDAP
+	/* The plugin does this at unload */
+	sieve_ldap_db_deinit();
+#endif
 }
 
 void sieve_storage_class_register
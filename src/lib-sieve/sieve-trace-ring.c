@@ -0,0 +1,415 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "str.h"
+#include "istream.h"
+#include "ostream.h"
+#include "home-expand.h"
+#include "eacces-error.h"
+#include "write-full.h"
+
+#include "sieve-common.h"
+#include "sieve-error.h"
+#include "sieve-script.h"
+#include "sieve-binary.h"
+#include "sieve-code.h"
+
+#include "sieve-trace-ring.h"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/*
+ * Trace ring
+ */
+
+struct sieve_trace_ring {
+	int refcount;
+
+	struct sieve_instance *svinst;
+	char *path;
+	char *binary_path;
+	time_t start_time;
+
+	/* Total number of operations recorded */
+	unsigned int count;
+	struct sieve_trace_record records[SIEVE_TRACE_RING_RECORDS];
+};
+
+static const char *sieve_trace_ring_get_path
+(struct sieve_instance *svinst)
+{
+	const char *path = svinst->trace_ring_path;
+
+	if ( svinst->home_dir != NULL ) {
+		/* Expand home dir if necessary */
+		if ( path[0] == '~' ) {
+			path = home_expand_tilde(path, svinst->home_dir);
+		} else if ( path[0] != '/' ) {
+			path = t_strconcat(svinst->home_dir, "/", path, NULL);
+		}
+	} else if ( path[0] != '/' ) {
+		return NULL;
+	}
+	return path;
+}
+
+static const char *sieve_trace_ring_binary_path
+(struct sieve_binary *sbin)
+{
+	struct sieve_script *script;
+	const char *path;
+
+	if ( (path=sieve_binary_path(sbin)) != NULL )
+		return path;
+	if ( (script=sieve_binary_script(sbin)) != NULL )
+		return sieve_script_location(script);
+	return "";
+}
+
+struct sieve_trace_ring *sieve_trace_ring_create
+(struct sieve_instance *svinst, struct sieve_binary *sbin)
+{
+	struct sieve_trace_ring *ring;
+	const char *path;
+
+	if ( svinst->trace_ring_path == NULL || *svinst->trace_ring_path == '\0' )
+		return NULL;
+
+	/* Sample 1 in N executions */
+	if ( svinst->trace_ring_sample > 1 &&
+		(rand() % svinst->trace_ring_sample) != 0 )
+		return NULL;
+
+	if ( (path=sieve_trace_ring_get_path(svinst)) == NULL )
+		return NULL;
+
+	ring = i_new(struct sieve_trace_ring, 1);
+	ring->refcount = 1;
+	ring->svinst = svinst;
+	ring->path = i_strdup(path);
+	ring->binary_path = i_strdup(sieve_trace_ring_binary_path(sbin));
+	ring->start_time = ioloop_time;
+	return ring;
+}
+
+void sieve_trace_ring_ref(struct sieve_trace_ring *ring)
+{
+	ring->refcount++;
+}
+
+void sieve_trace_ring_add
+(struct sieve_trace_ring *ring, struct sieve_binary_block *sblock,
+	const struct sieve_operation *oprtn, bool test_result, int exec_status,
+	const struct timespec *start)
+{
+	struct sieve_trace_record *rec;
+	struct timespec end;
+	unsigned long long nsecs;
+
+	sieve_trace_ring_clock(&end);
+	nsecs = (unsigned long long)(end.tv_sec - start->tv_sec) * 1000000000ULL +
+		end.tv_nsec - start->tv_nsec;
+
+	rec = &ring->records[ring->count++ % SIEVE_TRACE_RING_RECORDS];
+	rec->address = (uint32_t)oprtn->address;
+	rec->elapsed_nsecs = ( nsecs > (uint32_t)-1 ?
+		(uint32_t)-1 : (uint32_t)nsecs );
+	rec->block_id = (uint16_t)sieve_binary_block_get_id(sblock);
+	rec->code = ( oprtn->def == NULL ? 0 : (uint8_t)oprtn->def->code );
+	rec->flags = 0;
+	if ( oprtn->ext != NULL )
+		rec->flags |= SIEVE_TRACE_RECORD_FLAG_EXTENSION;
+	if ( test_result )
+		rec->flags |= SIEVE_TRACE_RECORD_FLAG_TEST_TRUE;
+	if ( exec_status != SIEVE_EXEC_OK )
+		rec->flags |= SIEVE_TRACE_RECORD_FLAG_FAILED;
+}
+
+static int sieve_trace_ring_open
+(struct sieve_trace_ring *ring, size_t size)
+{
+	struct sieve_instance *svinst = ring->svinst;
+	const char *rotated;
+	struct stat st;
+	int fd;
+
+	fd = open(ring->path, O_CREAT | O_APPEND | O_WRONLY, 0600);
+	if ( fd == -1 ) {
+		if ( errno == EACCES ) {
+			sieve_sys_error(svinst, "trace: %s",
+				eacces_error_get_creating("open", ring->path));
+		} else {
+			sieve_sys_error(svinst, "trace: "
+				"open(%s) failed: %m", ring->path);
+		}
+		return -1;
+	}
+
+	if ( svinst->trace_ring_max_size == 0 )
+		return fd;
+	if ( fstat(fd, &st) < 0 ) {
+		sieve_sys_error(svinst, "trace: "
+			"fstat(%s) failed: %m", ring->path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	if ( st.st_size == 0 ||
+		(uoff_t)st.st_size + size <= svinst->trace_ring_max_size )
+		return fd;
+
+	/* Rotate the trace file; there is only ever one old file */
+	i_close_fd(&fd);
+	rotated = t_strconcat(ring->path, ".0", NULL);
+	if ( rename(ring->path, rotated) < 0 && errno != ENOENT ) {
+		sieve_sys_error(svinst, "trace: "
+			"rename(%s, %s) failed: %m", ring->path, rotated);
+	}
+
+	fd = open(ring->path, O_CREAT | O_APPEND | O_WRONLY | O_TRUNC, 0600);
+	if ( fd == -1 ) {
+		sieve_sys_error(svinst, "trace: "
+			"open(%s) failed: %m", ring->path);
+		return -1;
+	}
+	return fd;
+}
+
+static void sieve_trace_ring_write(struct sieve_trace_ring *ring)
+{
+	struct sieve_trace_ring_header hdr;
+	unsigned int first, count;
+	buffer_t *buf;
+	int fd;
+
+	count = I_MIN(ring->count, SIEVE_TRACE_RING_RECORDS);
+	first = ( ring->count > SIEVE_TRACE_RING_RECORDS ?
+		ring->count % SIEVE_TRACE_RING_RECORDS : 0 );
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SIEVE_TRACE_RING_MAGIC;
+	hdr.version = SIEVE_TRACE_RING_VERSION;
+	hdr.record_size = sizeof(struct sieve_trace_record);
+	hdr.record_count = count;
+	hdr.records_lost = ring->count - count;
+	hdr.start_time = ring->start_time;
+	hdr.binary_path_size = strlen(ring->binary_path);
+
+	/* Assemble the block, so that it is appended with a single write */
+	buf = buffer_create_dynamic(pool_datastack_create(), sizeof(hdr) +
+		hdr.binary_path_size + count * sizeof(struct sieve_trace_record));
+	buffer_append(buf, &hdr, sizeof(hdr));
+	buffer_append(buf, ring->binary_path, hdr.binary_path_size);
+	buffer_append(buf, &ring->records[first],
+		(count - first) * sizeof(struct sieve_trace_record));
+	buffer_append(buf, &ring->records[0],
+		first * sizeof(struct sieve_trace_record));
+
+	if ( (fd=sieve_trace_ring_open(ring, buf->used)) < 0 )
+		return;
+	if ( write_full(fd, buf->data, buf->used) < 0 ) {
+		sieve_sys_error(ring->svinst, "trace: "
+			"write(%s) failed: %m", ring->path);
+	}
+	i_close_fd(&fd);
+}
+
+void sieve_trace_ring_unref(struct sieve_trace_ring **_ring)
+{
+	struct sieve_trace_ring *ring = *_ring;
+
+	*_ring = NULL;
+
+	i_assert( ring->refcount > 0 );
+	if ( --ring->refcount > 0 )
+		return;
+
+	if ( ring->count > 0 ) T_BEGIN {
+		sieve_trace_ring_write(ring);
+	} T_END;
+
+	i_free(ring->binary_path);
+	i_free(ring->path);
+	i_free(ring);
+}
+
+/*
+ * Decoding
+ */
+
+struct sieve_trace_dump_block {
+	struct sieve_binary_block *sblock;
+	struct sieve_binary_debug_reader *dreader;
+	unsigned int id;
+};
+
+static int sieve_trace_read
+(struct istream *input, void *data, size_t size)
+{
+	const unsigned char *idata;
+	size_t isize;
+	int ret;
+
+	while ( (ret=i_stream_read_data(input, &idata, &isize, size-1)) == 0 );
+	if ( ret < 0 ) {
+		if ( input->stream_errno != 0 )
+			return -1;
+		/* Only the end of the file may fall between two items */
+		return ( isize == 0 ? 0 : -1 );
+	}
+	memcpy(data, idata, size);
+	i_stream_skip(input, size);
+	return 1;
+}
+
+static void sieve_trace_dump_block_set
+(struct sieve_binary *sbin, struct sieve_trace_dump_block *tblock,
+	unsigned int id)
+{
+	struct sieve_binary_block *debug_block;
+	unsigned int debug_block_id;
+	sieve_size_t address = 0;
+
+	if ( tblock->sblock != NULL && tblock->id == id )
+		return;
+
+	sieve_binary_debug_reader_deinit(&tblock->dreader);
+	tblock->id = id;
+	tblock->sblock = sieve_binary_block_get(sbin, id);
+	if ( tblock->sblock == NULL )
+		return;
+
+	/* The code block starts with the id of its debug block */
+	if ( sieve_binary_read_unsigned(tblock->sblock, &address, &debug_block_id) &&
+		(debug_block=sieve_binary_block_get(sbin, debug_block_id)) != NULL )
+		tblock->dreader = sieve_binary_debug_reader_init(debug_block);
+}
+
+static void sieve_trace_dump_record
+(struct sieve_binary *sbin, struct sieve_trace_dump_block *tblock,
+	const struct sieve_trace_record *rec, string_t *line)
+{
+	struct sieve_operation oprtn;
+	sieve_size_t address = rec->address;
+	const char *mnemonic = "(unknown)";
+	unsigned int src_line = 0;
+
+	sieve_trace_dump_block_set(sbin, tblock, rec->block_id);
+
+	if ( tblock->sblock != NULL &&
+		sieve_operation_read(tblock->sblock, &address, &oprtn) &&
+		oprtn.def != NULL ) {
+		if ( oprtn.def->code != rec->code ||
+			(oprtn.ext != NULL) !=
+				((rec->flags & SIEVE_TRACE_RECORD_FLAG_EXTENSION) != 0) )
+			mnemonic = "(mismatch)";
+		else
+			mnemonic = oprtn.def->mnemonic;
+	}
+	if ( tblock->dreader != NULL )
+		src_line = sieve_binary_debug_read_line(tblock->dreader, rec->address);
+
+	str_printfa(line, "%3u:%08x: ", rec->block_id, rec->address);
+	if ( src_line > 0 )
+		str_printfa(line, "%4u: ", src_line);
+	else
+		str_append(line, "      ");
+	str_printfa(line, "%-24s %-6s %10u%s\n", mnemonic,
+		( (rec->flags & SIEVE_TRACE_RECORD_FLAG_TEST_TRUE) != 0 ?
+			"true" : "false" ),
+		rec->elapsed_nsecs,
+		( (rec->flags & SIEVE_TRACE_RECORD_FLAG_FAILED) != 0 ?
+			" FAILED" : "" ));
+}
+
+static int sieve_trace_dump_ring
+(struct sieve_binary *sbin, struct sieve_trace_dump_block *tblock,
+	struct istream *input, const struct sieve_trace_ring_header *hdr,
+	struct ostream *stream)
+{
+	const char *bin_path = sieve_trace_ring_binary_path(sbin);
+	struct sieve_trace_record rec;
+	string_t *line;
+	char *path;
+	unsigned int i;
+
+	path = t_malloc(hdr->binary_path_size + 1);
+	path[hdr->binary_path_size] = '\0';
+	if ( hdr->binary_path_size > 0 &&
+		sieve_trace_read(input, path, hdr->binary_path_size) <= 0 ) {
+		o_stream_nsend_str(stream, "Trace is truncated.\n");
+		return -1;
+	}
+
+	line = t_str_new(256);
+	str_printfa(line, "\n## Trace of '%s' at %s\n", path,
+		t_strflocaltime("%Y-%m-%d %H:%M:%S", (time_t)hdr->start_time));
+	if ( strcmp(path, bin_path) != 0 ) {
+		str_printfa(line,
+			"## Warning: recorded for another binary than '%s'\n", bin_path);
+	}
+	if ( hdr->records_lost > 0 ) {
+		str_printfa(line, "## %u earlier operations were dropped\n",
+			hdr->records_lost);
+	}
+	str_append(line, "Block:Address  Line  Operation"
+		"                Result  Time (ns)\n");
+	o_stream_nsend(stream, str_data(line), str_len(line));
+
+	for ( i = 0; i < hdr->record_count; i++ ) {
+		if ( sieve_trace_read(input, &rec, sizeof(rec)) <= 0 ) {
+			o_stream_nsend_str(stream, "Trace is truncated.\n");
+			return -1;
+		}
+		str_truncate(line, 0);
+		sieve_trace_dump_record(sbin, tblock, &rec, line);
+		o_stream_nsend(stream, str_data(line), str_len(line));
+	}
+	return 0;
+}
+
+int sieve_trace_ring_dump
+(struct sieve_binary *sbin, struct istream *input, struct ostream *stream)
+{
+	struct sieve_trace_dump_block tblock;
+	struct sieve_trace_ring_header hdr;
+	int ret;
+
+	memset(&tblock, 0, sizeof(tblock));
+
+	/* The trace file is a sequence of rings, one for each execution */
+	while ( (ret=sieve_trace_read(input, &hdr, sizeof(hdr))) > 0 ) {
+		if ( hdr.magic != SIEVE_TRACE_RING_MAGIC ||
+			hdr.version != SIEVE_TRACE_RING_VERSION ||
+			hdr.record_size != sizeof(struct sieve_trace_record) ) {
+			o_stream_nsend_str(stream, "Trace is corrupt or incompatible.\n");
+			ret = -1;
+			break;
+		}
+		/* The sizes are used for allocation below */
+		if ( hdr.binary_path_size >= PATH_MAX ||
+			hdr.record_count > SIEVE_TRACE_RING_RECORDS ) {
+			o_stream_nsend_str(stream, "Trace is corrupt.\n");
+			ret = -1;
+			break;
+		}
+
+		T_BEGIN {
+			ret = sieve_trace_dump_ring(sbin, &tblock, input, &hdr, stream);
+		} T_END;
+		if ( ret < 0 )
+			break;
+	}
+
+	sieve_binary_debug_reader_deinit(&tblock.dreader);
+
+	if ( input->stream_errno != 0 ) {
+		i_error("read(%s) failed: %s", i_stream_get_name(input),
+			i_stream_get_error(input));
+		return -1;
+	}
+	return ( ret < 0 ? -1 : 0 );
+}
@@ -0,0 +1,93 @@
+/* Copyright (c) 2002-2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __SIEVE_TRACE_RING_H
+#define __SIEVE_TRACE_RING_H
+
+#include "sieve-common.h"
+
+#include <time.h>
+
+/*
+ * Binary runtime trace
+ *
+ * - Records a fixed-size entry for each executed operation in a ring buffer.
+ *   Nothing is formatted at runtime; the buffer is appended to the trace file
+ *   as a single block when the execution ends. The trace is decoded against
+ *   the binary's debug information by sieve-dump.
+ */
+
+#define SIEVE_TRACE_RING_MAGIC 0x5e7eace1
+#define SIEVE_TRACE_RING_VERSION 1
+
+/* Number of operations kept for one execution; older ones are dropped */
+#define SIEVE_TRACE_RING_RECORDS 1024
+
+/* File format */
+
+struct sieve_trace_ring_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+
+	uint32_t record_count;
+	uint32_t records_lost;
+
+	uint64_t start_time;
+
+	/* Followed by the binary path and the records */
+	uint32_t binary_path_size;
+	uint32_t unused;
+};
+
+enum sieve_trace_record_flags {
+	/* Operation is defined by an extension */
+	SIEVE_TRACE_RECORD_FLAG_EXTENSION = (1 << 0),
+	/* Test result after the operation */
+	SIEVE_TRACE_RECORD_FLAG_TEST_TRUE = (1 << 1),
+	/* Operation did not yield SIEVE_EXEC_OK */
+	SIEVE_TRACE_RECORD_FLAG_FAILED    = (1 << 2)
+};
+
+struct sieve_trace_record {
+	uint32_t address;
+	uint32_t elapsed_nsecs;
+	uint16_t block_id;
+	uint8_t code;
+	uint8_t flags; /* enum sieve_trace_record_flags */
+};
+
+/*
+ * Trace ring
+ */
+
+struct sieve_trace_ring;
+
+/* Returns NULL when tracing is not configured or when this execution is not
+   sampled. */
+struct sieve_trace_ring *sieve_trace_ring_create
+	(struct sieve_instance *svinst, struct sieve_binary *sbin);
+void sieve_trace_ring_ref(struct sieve_trace_ring *ring);
+/* Writes the trace when the last reference is dropped */
+void sieve_trace_ring_unref(struct sieve_trace_ring **_ring);
+
+static inline void sieve_trace_ring_clock(struct timespec *ts_r)
+{
+	if ( clock_gettime(CLOCK_MONOTONIC, ts_r) < 0 )
+		i_fatal("clock_gettime() failed: %m");
+}
+
+void sieve_trace_ring_add
+	(struct sieve_trace_ring *ring, struct sieve_binary_block *sblock,
+		const struct sieve_operation *oprtn, bool test_result, int exec_status,
+		const struct timespec *start);
+
+/*
+ * Decoding
+ */
+
+int sieve_trace_ring_dump
+	(struct sieve_binary *sbin, struct istream *input,
+		struct ostream *stream);
+
+#endif /* __SIEVE_TRACE_RING_H */
@@ -19,9 +19,11 @@ struct sieve_script;
 struct sieve_binary;
 
 struct sieve_message_data;
+struct sieve_message_analysis;
 struct sieve_script_env;
 struct sieve_exec_status;
 struct sieve_trace_log;
+struct sieve_duplicate_db;
 
 /*
  * System environment
@@ -134,6 +136,9 @@ struct sieve_message_data {
 	const char *final_envelope_to;
 	const char *auth_user;
 	const char *id;
+
+	/* Optional; shared with other executions for the same message */
+	struct sieve_message_analysis *analysis;
 };
 
 /*
@@ -217,6 +222,8 @@ struct sieve_script_env {
 			time_t time);
 	void (*duplicate_flush)
 		(const struct sieve_script_env *senv);
+	/* Database used instead of the callbacks above when not NULL */
+	struct sieve_duplicate_db *duplicate_db;
 
 	/* Interface for rejecting mail */
 	int (*reject_mail)(const struct sieve_script_env *senv,
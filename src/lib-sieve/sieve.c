@@ -18,8 +18,10 @@
 #include "sieve-address.h"
 #include "sieve-script.h"
 #include "sieve-storage-private.h"
+#include "sieve-duplicate.h"
 #include "sieve-ast.h"
 #include "sieve-binary.h"
+#include "sieve-binary-lru.h"
 #include "sieve-actions.h"
 #include "sieve-result.h"
 
@@ -28,6 +30,7 @@
 #include "sieve-generator.h"
 #include "sieve-interpreter.h"
 #include "sieve-binary-dumper.h"
+#include "sieve-trace-ring.h"
 
 #include "sieve.h"
 #include "sieve-common.h"
@@ -44,21 +47,16 @@
  * Main Sieve library interface
  */
 
-struct sieve_instance *sieve_init
-(const struct sieve_environment *env,
-	const struct sieve_callbacks *callbacks, void *context, bool debug)
+static void sieve_set_environment
+(struct sieve_instance *svinst, const struct sieve_environment *env)
 {
-	struct sieve_instance *svinst;
 	const char *domain;
 	pool_t pool;
 
-	/* Create Sieve engine instance */
-	pool = pool_alloconly_create("sieve", 8192);
-	svinst = p_new(pool, struct sieve_instance, 1);
-	svinst->pool = pool;
-	svinst->callbacks = callbacks;
-	svinst->context = context;
-	svinst->debug = debug;
+	if ( svinst->env_pool != NULL )
+		pool_unref(&svinst->env_pool);
+	pool = svinst->env_pool = pool_alloconly_create("sieve environment", 512);
+
 	svinst->base_dir = p_strdup_empty(pool, env->base_dir);
 	svinst->username = p_strdup_empty(pool, env->username);
 	svinst->home_dir = p_strdup_empty(pool, env->home_dir);
@@ -90,6 +88,23 @@ struct sieve_instance *sieve_init
 	}
 	svinst->hostname = p_strdup_empty(pool, env->hostname);
 	svinst->domainname = p_strdup(pool, domain);
+}
+
+struct sieve_instance *sieve_init
+(const struct sieve_environment *env,
+	const struct sieve_callbacks *callbacks, void *context, bool debug)
+{
+	struct sieve_instance *svinst;
+	pool_t pool;
+
+	/* Create Sieve engine instance */
+	pool = pool_alloconly_create("sieve", 8192);
+	svinst = p_new(pool, struct sieve_instance, 1);
+	svinst->pool = pool;
+	svinst->callbacks = callbacks;
+	svinst->context = context;
+	svinst->debug = debug;
+	sieve_set_environment(svinst, env);
 
 	sieve_errors_init(svinst);
 
@@ -98,9 +113,13 @@ struct sieve_instance *sieve_init
 			PIGEONHOLE_NAME, PIGEONHOLE_VERSION_FULL);
 	}
 
+	/* Everything configured from here on depends only on the settings */
+	sieve_settings_snapshot_start(svinst);
+
 	/* Read configuration */
 
 	sieve_settings_load(svinst);
+	sieve_binary_lru_init(svinst, svinst->binary_cache_size);
 
 	/* Initialize extensions */
 	if ( !sieve_extensions_init(svinst) ) {
@@ -111,12 +130,17 @@ struct sieve_instance *sieve_init
 	/* Initialize storage classes */
 	sieve_storages_init(svinst);
 
+	/* Initialize duplicate database classes */
+	sieve_duplicate_dbs_init(svinst);
+
 	/* Initialize plugins */
 	sieve_plugins_load(svinst, NULL, NULL);
 
 	/* Configure extensions */
 	sieve_extensions_configure(svinst);
 
+	sieve_settings_snapshot_stop(svinst);
+
 	return svinst;
 }
 
@@ -124,15 +148,49 @@ void sieve_deinit(struct sieve_instance **_svinst)
 {
 	struct sieve_instance *svinst = *_svinst;
 
+	sieve_binary_lru_deinit(svinst);
 	sieve_plugins_unload(svinst);
+	sieve_duplicate_dbs_deinit(svinst);
 	sieve_storages_deinit(svinst);
 	sieve_extensions_deinit(svinst);
 	sieve_errors_deinit(svinst);
 
+	pool_unref(&svinst->env_pool);
 	pool_unref(&(svinst)->pool);
 	*_svinst = NULL;
 }
 
+void sieve_detach(struct sieve_instance *svinst)
+{
+	/* Drop everything that belongs to the current user */
+	sieve_binary_lru_detach(svinst);
+	sieve_extensions_reset(svinst);
+
+	/* The system error handler is typically bound to the session */
+	sieve_errors_deinit(svinst);
+	sieve_errors_init(svinst);
+
+	svinst->context = NULL;
+}
+
+bool sieve_reinit
+(struct sieve_instance *svinst, const struct sieve_environment *env,
+	void *context, bool debug)
+{
+	if ( !sieve_settings_snapshot_matches(svinst, context) )
+		return FALSE;
+
+	svinst->context = context;
+	svinst->debug = debug;
+	sieve_set_environment(svinst, env);
+
+	if ( debug ) {
+		sieve_sys_debug(svinst, "%s version %s reinitializing",
+			PIGEONHOLE_NAME, PIGEONHOLE_VERSION_FULL);
+	}
+	return TRUE;
+}
+
 void sieve_set_extensions
 (struct sieve_instance *svinst, const char *extensions)
 {
@@ -346,6 +404,10 @@ static int sieve_run
 	/* Run the interpreter */
 	ret = sieve_interpreter_run(interp, *result);
 
+	/* Never hand out a corrupt binary from the cache again */
+	if ( ret == SIEVE_EXEC_BIN_CORRUPT )
+		sieve_binary_lru_invalidate(sieve_binary_svinst(sbin), sbin);
+
 	/* Free the interpreter */
 	sieve_interpreter_free(&interp);
 
@@ -370,10 +432,21 @@ struct sieve_binary *sieve_open_script
 	struct sieve_binary *sbin;
 
 	T_BEGIN {
-		/* Then try to open the matching binary */
-		sbin = sieve_script_binary_load(script, error_r);
+		/* First check whether the binary is still cached; the cache verifies
+		   that it is up-to-date */
+		if ( (sbin=sieve_binary_lru_lookup(svinst, script, flags)) != NULL ) {
+			if ( svinst->debug ) {
+				sieve_sys_debug(svinst,
+					"Script binary %s found in cache",
+					sieve_binary_path(sbin));
+			}
+			if ( error_r != NULL )
+				*error_r = SIEVE_ERROR_NONE;
+		}
 
-		if (sbin != NULL) {
+		/* Then try to open the matching binary */
+		if ( sbin == NULL &&
+			(sbin=sieve_script_binary_load(script, error_r)) != NULL ) {
 			/* Ok, it exists; now let's see if it is up to date */
 			if ( !sieve_binary_up_to_date(sbin, flags) ) {
 				/* Not up to date */
@@ -384,20 +457,20 @@ struct sieve_binary *sieve_open_script
 
 				sieve_binary_unref(&sbin);
 				sbin = NULL;
+			} else {
+				if ( svinst->debug ) {
+					sieve_sys_debug(svinst,
+						"Script binary %s successfully loaded",
+						sieve_binary_path(sbin));
+				}
+				sieve_binary_lru_insert(svinst, script, flags, sbin);
 			}
 		}
 
 		/* If the binary does not exist or is not up-to-date, we need
 		 * to (re-)compile.
 		 */
-		if ( sbin != NULL ) {
-			if ( svinst->debug ) {
-				sieve_sys_debug(svinst,
-					"Script binary %s successfully loaded",
-					sieve_binary_path(sbin));
-			}
-
-		} else {
+		if ( sbin == NULL ) {
 			sbin = sieve_compile_script(script, ehandler, flags, error_r);
 
 			if ( sbin != NULL ) {
@@ -509,6 +582,12 @@ void sieve_hexdump
 	sieve_binary_dumper_free(&dumpr);
 }
 
+int sieve_trace_dump
+(struct sieve_binary *sbin, struct istream *input, struct ostream *stream)
+{
+	return sieve_trace_ring_dump(sbin, input, stream);
+}
+
 int sieve_test
 (struct sieve_binary *sbin, const struct sieve_message_data *msgdata,
 	const struct sieve_script_env *senv, struct sieve_error_handler *ehandler,
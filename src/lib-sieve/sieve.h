@@ -28,6 +28,23 @@ struct sieve_instance *sieve_init
  */
 void sieve_deinit(struct sieve_instance **_svinst);
 
+/* sieve_detach():
+ *   Releases the instance from the user it was initialized or reinitialized
+ *   for, so that it can be kept around for reuse. Caches of the user's
+ *   scripts and binaries are dropped; those of global scripts are kept.
+ */
+void sieve_detach(struct sieve_instance *svinst);
+
+/* sieve_reinit():
+ *   Reuses a detached instance for another user, which avoids loading all
+ *   extensions and plugins again. This fails when the settings read during
+ *   sieve_init() have different values in the new context; the caller then
+ *   needs to create a new instance using sieve_init().
+ */
+bool sieve_reinit
+	(struct sieve_instance *svinst, const struct sieve_environment *env,
+		void *context, bool debug);
+
 /* sieve_get_capabilities():
  *
  */
@@ -151,6 +168,15 @@ void sieve_dump
 void sieve_hexdump
 	(struct sieve_binary *sbin, struct ostream *stream);
 
+/* sieve_trace_dump:
+ *
+ *   Decodes a binary runtime trace (sieve_trace_ring=) recorded for this
+ *   binary to the specified ostream. Returns -1 when the trace could not be
+ *   read.
+ */
+int sieve_trace_dump
+	(struct sieve_binary *sbin, struct istream *input, struct ostream *stream);
+
 /* sieve_test:
  *
  *   Executes the bytecode, but only prints the result to the given stream.
@@ -4,8 +4,11 @@
 #include "lib.h"
 #include "str.h"
 #include "strfuncs.h"
+#include "md5.h"
+#include "hex-binary.h"
 #include "istream.h"
 #include "dict.h"
+#include "hostpid.h"
 
 #include "sieve-common.h"
 #include "sieve-error.h"
@@ -195,18 +198,52 @@ static int sieve_dict_script_binary_dump_metadata
 	return TRUE;
 }
 
+static const char *sieve_dict_script_get_cache_name
+(struct sieve_dict_script *dscript, const char *id)
+{
+	struct sieve_dict_storage *dstorage =
+		(struct sieve_dict_storage *)dscript->script.storage;
+	struct md5_context ctx;
+	unsigned char digest[MD5_RESULTLEN];
+
+	/* Data IDs are only unique within the dict of a particular user */
+	md5_init(&ctx);
+	md5_update(&ctx, dstorage->uri, strlen(dstorage->uri)+1);
+	md5_update(&ctx, dstorage->username, strlen(dstorage->username)+1);
+	md5_update(&ctx, id, strlen(id));
+	md5_final(&ctx, digest);
+
+	return binary_to_hex(digest, sizeof(digest));
+}
+
 static const char * sieve_dict_script_get_binpath
 (struct sieve_dict_script *dscript)
 {
 	struct sieve_script *script = &dscript->script;
 	struct sieve_storage *storage = script->storage;
+	struct sieve_dict_storage *dstorage =
+		(struct sieve_dict_storage *)storage;
 
 	if ( dscript->binpath == NULL ) {
 		if ( storage->bin_dir == NULL )
 			return NULL;
-		dscript->binpath = p_strconcat(script->pool,
-			storage->bin_dir, "/",
-			sieve_binfile_from_name(script->name), NULL);
+
+		if ( !dstorage->bin_cache ) {
+			dscript->binpath = p_strconcat(script->pool,
+				storage->bin_dir, "/",
+				sieve_binfile_from_name(script->name), NULL);
+		} else {
+			/* A changed script gets a new data ID and thereby a new
+			   binary; the binary of an unchanged script is found
+			   with just the name lookup. */
+			if ( dscript->data_id == NULL &&
+				sieve_script_open(script, NULL) < 0 )
+				return NULL;
+			dscript->binpath = p_strconcat(script->pool,
+				storage->bin_dir, "/", sieve_binfile_from_name
+					(sieve_dict_script_get_cache_name
+						(dscript, dscript->data_id)), NULL);
+		}
 	}
 
 	return dscript->binpath;
@@ -225,20 +262,84 @@ static struct sieve_binary *sieve_dict_script_binary_load
 		dscript->binpath, script, error_r);
 }
 
+static void sieve_dict_script_binary_replace
+(struct sieve_dict_script *dscript)
+{
+	struct sieve_script *script = &dscript->script;
+	struct sieve_storage *storage = script->storage;
+	const char *binfile, *link_path, *tmp_path;
+	char old_binfile[PATH_MAX];
+	ssize_t len;
+
+	/* A symlink named after the script points to its current binary, so
+	   that the binary of the previous version can be found and removed */
+	binfile = sieve_binfile_from_name
+		(sieve_dict_script_get_cache_name(dscript, dscript->data_id));
+	link_path = t_strconcat(storage->bin_dir, "/",
+		sieve_dict_script_get_cache_name(dscript, script->name),
+		".svlink", NULL);
+
+	len = readlink(link_path, old_binfile, sizeof(old_binfile)-1);
+	if ( len < 0 ) {
+		if ( errno != ENOENT ) {
+			sieve_storage_sys_error(storage,
+				"readlink(%s) failed: %m", link_path);
+			return;
+		}
+	} else {
+		old_binfile[len] = '\0';
+		if ( strcmp(old_binfile, binfile) == 0 )
+			return;
+		if ( strchr(old_binfile, '/') == NULL ) {
+			const char *old_path = t_strconcat
+				(storage->bin_dir, "/", old_binfile, NULL);
+
+			if ( unlink(old_path) < 0 && errno != ENOENT ) {
+				sieve_storage_sys_error(storage,
+					"unlink(%s) failed: %m", old_path);
+			}
+		}
+	}
+
+	tmp_path = t_strdup_printf("%s.%s.%s",
+		link_path, my_pid, my_hostname);
+	if ( symlink(binfile, tmp_path) < 0 ) {
+		sieve_storage_sys_error(storage,
+			"symlink(%s, %s) failed: %m", binfile, tmp_path);
+		return;
+	}
+	if ( rename(tmp_path, link_path) < 0 ) {
+		sieve_storage_sys_error(storage,
+			"rename(%s, %s) failed: %m", tmp_path, link_path);
+		if ( unlink(tmp_path) < 0 && errno != ENOENT ) {
+			sieve_storage_sys_error(storage,
+				"unlink(%s) failed: %m", tmp_path);
+		}
+	}
+}
+
 static int sieve_dict_script_binary_save
 (struct sieve_script *script, struct sieve_binary *sbin, bool update,
 	enum sieve_error *error_r)
 {
 	struct sieve_dict_script *dscript =
 		(struct sieve_dict_script *)script;
+	struct sieve_dict_storage *dstorage =
+		(struct sieve_dict_storage *)script->storage;
 
 	if ( sieve_dict_script_get_binpath(dscript) == NULL )
 		return 0;
 	if ( sieve_storage_setup_bindir(script->storage, 0700) < 0 )
 		return -1;
 
-	return sieve_binary_save(sbin,
-		dscript->binpath, update, 0600, error_r);
+	if ( sieve_binary_save(sbin,
+		dscript->binpath, update, 0600, error_r) < 0 )
+		return -1;
+
+	if ( dstorage->bin_cache ) T_BEGIN {
+		sieve_dict_script_binary_replace(dscript);
+	} T_END;
+	return 0;
 }
 
 static bool sieve_dict_script_equals
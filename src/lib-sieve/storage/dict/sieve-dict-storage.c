@@ -2,9 +2,11 @@
  */
 
 #include "lib.h"
+#include "home-expand.h"
 #include "dict.h"
 
 #include "sieve-common.h"
+#include "sieve-settings.h"
 #include "sieve-error.h"
 
 #include "sieve-dict-storage.h"
@@ -34,6 +36,7 @@ static int sieve_dict_storage_init
 		(struct sieve_dict_storage *)storage;
 	struct sieve_instance *svinst = storage->svinst;
 	const char *uri = storage->location, *username = NULL;
+	const char *cache_dir = NULL;
 
 	if ( options != NULL ) {
 		while ( *options != NULL ) {
@@ -41,6 +44,9 @@ static int sieve_dict_storage_init
 
 			if ( strncasecmp(option, "user=", 5) == 0 && option[5] != '\0' ) {
 				username = option+5;
+			} else if ( strncasecmp(option, "cachedir=", 9) == 0 &&
+				option[9] != '\0' ) {
+				cache_dir = option+9;
 			} else {
 				sieve_storage_set_critical(storage,
 					"Invalid option `%s'", option);
@@ -69,8 +75,39 @@ static int sieve_dict_storage_init
 		return -1;
 	}
 
+	if ( cache_dir != NULL ) {
+		if ( storage->bin_dir != NULL ) {
+			sieve_storage_set_critical(storage,
+				"The bindir and cachedir options cannot be used together");
+			*error_r = SIEVE_ERROR_TEMP_FAILURE;
+			return -1;
+		}
+
+		if ( cache_dir[0] == '~' ) {
+			/* home-relative path. change to absolute. */
+			const char *home = sieve_environment_get_homedir(svinst);
+
+			if ( home != NULL ) {
+				cache_dir = home_expand_tilde(cache_dir, home);
+			} else if ( cache_dir[1] == '/' || cache_dir[1] == '\0' ) {
+				sieve_storage_set_critical(storage,
+					"cachedir is relative to home directory (~/), "
+					"but home directory cannot be determined");
+				*error_r = SIEVE_ERROR_TEMP_FAILURE;
+				return -1;
+			}
+		}
+
+		/* The cache is the binary directory, with binaries named after
+		   the data ID rather than the script name */
+		storage->bin_dir = p_strdup(storage->pool, cache_dir);
+		dstorage->bin_cache = TRUE;
+	}
+
 	sieve_storage_sys_debug(storage,
-		"user=%s, uri=%s", username, uri);
+		"user=%s, uri=%s%s%s", username, uri,
+		( dstorage->bin_cache ? ", cachedir=" : "" ),
+		( dstorage->bin_cache ? storage->bin_dir : "" ));
 
 	dstorage->uri = p_strdup(storage->pool, uri);
 	dstorage->username = p_strdup(storage->pool, username);
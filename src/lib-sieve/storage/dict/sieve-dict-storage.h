@@ -25,6 +25,9 @@ struct sieve_dict_storage {
 	const char *uri;
 
 	struct dict *dict;
+
+	/* Binaries are named after the script's data ID */
+	unsigned int bin_cache:1;
 };
 
 int sieve_dict_storage_get_dict
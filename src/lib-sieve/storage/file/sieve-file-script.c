@@ -551,12 +551,23 @@ static int sieve_file_storage_script_delete(struct sieve_script *script)
 {
 	struct sieve_file_script *fscript =
 		(struct sieve_file_script *)script;
+	struct sieve_file_quota_index *qidx;
+	struct stat st;
 	int ret = 0;
 
 	if ( sieve_file_storage_pre_modify(script->storage) < 0 )
 		return -1;
 
+	qidx = sieve_file_storage_quota_update_begin
+		((struct sieve_file_storage *)script->storage);
+	if ( qidx != NULL && stat(fscript->path, &st) < 0 )
+		sieve_file_storage_quota_update_rollback(&qidx);
+
 	ret = unlink(fscript->path);
+	if ( ret >= 0 && qidx != NULL ) {
+		sieve_file_storage_quota_update_commit
+			(&qidx, -1, -(int64_t)st.st_size);
+	}
 	if ( ret < 0 ) {
 		if ( errno == ENOENT ) {
 			sieve_script_set_error(script,
@@ -568,6 +579,7 @@ static int sieve_file_storage_script_delete(struct sieve_script *script)
 				fscript->path);
 		}
 	}
+	sieve_file_storage_quota_update_rollback(&qidx);
 	return ret;
 }
 
@@ -660,12 +672,16 @@ static int sieve_file_storage_script_rename
 	struct sieve_storage *storage = script->storage;
 	struct sieve_file_storage *fstorage =
 		(struct sieve_file_storage *)storage;
+	struct sieve_file_quota_index *qidx;
 	const char *newpath, *newfile, *link_path;
 	int ret = 0;
 
 	if ( sieve_file_storage_pre_modify(storage) < 0 )
 		return -1;
 
+	/* Renaming changes the directory, but not the usage */
+	qidx = sieve_file_storage_quota_update_begin(fstorage);
+
 	T_BEGIN {
 		newfile = sieve_script_file_from_name(newname);
 		newpath = t_strconcat( fstorage->path, "/", newfile, NULL );
@@ -694,6 +710,8 @@ static int sieve_file_storage_script_rename
 					sieve_script_sys_error(script,
 						"Failed to clean up after rename: "
 						"unlink(%s) failed: %m", fscript->path);
+				} else {
+					sieve_file_storage_quota_update_commit(&qidx, 0, 0);
 				}
 
 				if ( script->name != NULL && *script->name != '\0' )
@@ -729,6 +747,9 @@ static int sieve_file_storage_script_rename
 		}
 	} T_END;
 
+	/* Anything else leaves the index outdated, if the directory was changed
+	   at all */
+	sieve_file_storage_quota_update_rollback(&qidx);
 	return ret;
 }
 
@@ -3,6 +3,9 @@
 
 #include "lib.h"
 #include "str.h"
+#include "strnum.h"
+#include "write-full.h"
+#include "file-lock.h"
 
 #include "sieve.h"
 #include "sieve-script.h"
@@ -14,17 +17,315 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-int sieve_file_storage_quota_havespace
-(struct sieve_storage *storage, const char *scriptname, size_t size,
-	enum sieve_storage_quota *quota_r, uint64_t *limit_r)
+/*
+ * Usage index
+ */
+
+/* The total usage of the storage is recorded in a small index file in the
+   storage directory, together with the timestamps the directory had right
+   after the index was last updated. The index is valid for as long as the
+   directory is not changed. Our own changes to the directory update the index
+   while it is locked, so only changes made by others require a new scan. */
+
+#define SIEVE_FILE_QUOTA_INDEX_VERSION 1
+#define SIEVE_FILE_QUOTA_INDEX_LOCK_TIMEOUT 10
+#define SIEVE_FILE_QUOTA_INDEX_MAX_SIZE 256
+
+struct sieve_file_quota_stamp {
+	uint64_t ino;
+	uint64_t mtime, mtime_nsec;
+	uint64_t ctime, ctime_nsec;
+};
+
+struct sieve_file_quota_index {
+	struct sieve_file_storage *fstorage;
+
+	char *path;
+	int fd;
+	struct file_lock *lock;
+
+	struct sieve_file_quota_stamp stamp;
+	uint64_t scripts, storage;
+};
+
+static void sieve_file_quota_stamp_get
+(const struct stat *st, struct sieve_file_quota_stamp *stamp_r)
 {
-	struct sieve_file_storage *fstorage =
-		(struct sieve_file_storage *)storage;
+	memset(stamp_r, 0, sizeof(*stamp_r));
+	stamp_r->ino = st->st_ino;
+	stamp_r->mtime = st->st_mtime;
+	stamp_r->mtime_nsec = ST_MTIME_NSEC(*st);
+	stamp_r->ctime = st->st_ctime;
+	stamp_r->ctime_nsec = ST_CTIME_NSEC(*st);
+}
+
+static bool sieve_file_quota_stamp_equals
+(const struct sieve_file_quota_stamp *stamp1,
+	const struct sieve_file_quota_stamp *stamp2)
+{
+	return ( stamp1->ino == stamp2->ino &&
+		stamp1->mtime == stamp2->mtime &&
+		stamp1->mtime_nsec == stamp2->mtime_nsec &&
+		stamp1->ctime == stamp2->ctime &&
+		stamp1->ctime_nsec == stamp2->ctime_nsec );
+}
+
+static int sieve_file_quota_dir_stamp
+(struct sieve_file_storage *fstorage,
+	struct sieve_file_quota_stamp *stamp_r)
+{
+	struct stat st;
+
+	if ( stat(fstorage->path, &st) < 0 ) {
+		sieve_storage_sys_warning(&fstorage->storage,
+			"quota: stat(%s) failed: %m", fstorage->path);
+		return -1;
+	}
+
+	sieve_file_quota_stamp_get(&st, stamp_r);
+	return 0;
+}
+
+static void sieve_file_quota_index_close
+(struct sieve_file_quota_index **_qidx)
+{
+	struct sieve_file_quota_index *qidx = *_qidx;
+
+	*_qidx = NULL;
+
+	if ( qidx->lock != NULL )
+		file_unlock(&qidx->lock);
+	if ( close(qidx->fd) < 0 ) {
+		sieve_storage_sys_warning(&qidx->fstorage->storage,
+			"quota: close(%s) failed: %m", qidx->path);
+	}
+	i_free(qidx->path);
+	i_free(qidx);
+}
+
+static int sieve_file_quota_index_open
+(struct sieve_file_storage *fstorage, int lock_type, bool create,
+	struct sieve_file_quota_index **qidx_r)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	struct sieve_file_quota_index *qidx;
+	struct file_lock *lock;
+	const char *path;
+	int fd, ret;
+
+	*qidx_r = NULL;
+
+	path = t_strconcat(fstorage->path, "/",
+		SIEVE_FILE_STORAGE_QUOTA_INDEX_FNAME, NULL);
+
+	if ( create ) {
+		mode_t old_mask = umask(0777 & ~(fstorage->file_create_mode));
+		fd = open(path, O_RDWR | O_CREAT, 0777);
+		umask(old_mask);
+	} else {
+		fd = open(path, O_RDWR);
+	}
+	if ( fd < 0 ) {
+		if ( errno == ENOENT )
+			return 0;
+		sieve_storage_sys_warning(storage,
+			"quota: open(%s) failed: %m", path);
+		return -1;
+	}
+
+	ret = file_wait_lock(fd, path, lock_type, FILE_LOCK_METHOD_FCNTL,
+		SIEVE_FILE_QUOTA_INDEX_LOCK_TIMEOUT, &lock);
+	if ( ret <= 0 ) {
+		if ( ret == 0 ) {
+			sieve_storage_sys_warning(storage,
+				"quota: Timed out locking %s", path);
+		} else {
+			sieve_storage_sys_warning(storage,
+				"quota: Failed to lock %s: %m", path);
+		}
+		i_close_fd(&fd);
+		return -1;
+	}
+
+	qidx = i_new(struct sieve_file_quota_index, 1);
+	qidx->fstorage = fstorage;
+	qidx->path = i_strdup(path);
+	qidx->fd = fd;
+	qidx->lock = lock;
+
+	*qidx_r = qidx;
+	return 1;
+}
+
+static bool sieve_file_quota_index_parse
+(struct sieve_file_quota_index *qidx, const char *line)
+{
+	const char *const *fields = t_strsplit(line, " ");
+	uint64_t values[8];
+	unsigned int i;
+
+	if ( str_array_length(fields) != N_ELEMENTS(values) )
+		return FALSE;
+	for ( i = 0; i < N_ELEMENTS(values); i++ ) {
+		if ( str_to_uint64(fields[i], &values[i]) < 0 )
+			return FALSE;
+	}
+	if ( values[0] != SIEVE_FILE_QUOTA_INDEX_VERSION )
+		return FALSE;
+
+	qidx->stamp.ino = values[1];
+	qidx->stamp.mtime = values[2];
+	qidx->stamp.mtime_nsec = values[3];
+	qidx->stamp.ctime = values[4];
+	qidx->stamp.ctime_nsec = values[5];
+	qidx->scripts = values[6];
+	qidx->storage = values[7];
+	return TRUE;
+}
+
+/* Returns 1 when the index is valid for the current directory, 0 when it is
+   outdated or unreadable, and -1 when the directory could not be checked. */
+static int sieve_file_quota_index_read
+(struct sieve_file_quota_index *qidx)
+{
+	struct sieve_file_quota_stamp stamp;
+	char buf[SIEVE_FILE_QUOTA_INDEX_MAX_SIZE];
+	const char *line;
+	ssize_t ret;
+
+	ret = pread(qidx->fd, buf, sizeof(buf) - 1, 0);
+	if ( ret < 0 ) {
+		sieve_storage_sys_warning(&qidx->fstorage->storage,
+			"quota: read(%s) failed: %m", qidx->path);
+		return 0;
+	}
+	buf[ret] = '\0';
+	if ( ret == 0 || buf[ret-1] != '\n' )
+		return 0;
+	line = t_strndup(buf, ret - 1);
+	if ( !sieve_file_quota_index_parse(qidx, line) )
+		return 0;
+
+	if ( sieve_file_quota_dir_stamp(qidx->fstorage, &stamp) < 0 )
+		return -1;
+	return ( sieve_file_quota_stamp_equals(&stamp, &qidx->stamp) ? 1 : 0 );
+}
+
+static void sieve_file_quota_index_write
+(struct sieve_file_quota_index *qidx,
+	const struct sieve_file_quota_stamp *expected_stamp)
+{
+	struct sieve_storage *storage = &qidx->fstorage->storage;
+	struct sieve_file_quota_stamp stamp;
+	const char *line;
+
+	if ( sieve_file_quota_dir_stamp(qidx->fstorage, &stamp) < 0 )
+		memset(&stamp, 0, sizeof(stamp));
+	else if ( expected_stamp != NULL &&
+		!sieve_file_quota_stamp_equals(&stamp, expected_stamp) ) {
+		/* Changed by someone else meanwhile */
+		memset(&stamp, 0, sizeof(stamp));
+	} else if ( stamp.mtime_nsec == 0 && stamp.ctime_nsec == 0 &&
+		(time_t)stamp.ctime >= time(NULL) - 1 ) {
+		/* Without sub-second timestamps, another change within this same
+		   second would go unnoticed; don't trust this stamp */
+		memset(&stamp, 0, sizeof(stamp));
+	}
+	qidx->stamp = stamp;
+
+	line = t_strdup_printf("%u %llu %llu %llu %llu %llu %llu %llu\n",
+		SIEVE_FILE_QUOTA_INDEX_VERSION,
+		(unsigned long long)stamp.ino,
+		(unsigned long long)stamp.mtime,
+		(unsigned long long)stamp.mtime_nsec,
+		(unsigned long long)stamp.ctime,
+		(unsigned long long)stamp.ctime_nsec,
+		(unsigned long long)qidx->scripts,
+		(unsigned long long)qidx->storage);
+
+	/* The index is rewritten in place; creating a new file would change the
+	   directory */
+	if ( pwrite_full(qidx->fd, line, strlen(line), 0) < 0 ) {
+		sieve_storage_sys_warning(storage,
+			"quota: write(%s) failed: %m", qidx->path);
+	} else if ( ftruncate(qidx->fd, strlen(line)) < 0 ) {
+		sieve_storage_sys_warning(storage,
+			"quota: ftruncate(%s) failed: %m", qidx->path);
+	}
+}
+
+/*
+ * Usage updates
+ */
+
+struct sieve_file_quota_index *sieve_file_storage_quota_update_begin
+(struct sieve_file_storage *fstorage)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	struct sieve_file_quota_index *qidx;
+
+	if ( storage->max_scripts == 0 && storage->max_storage == 0 )
+		return NULL;
+
+	if ( sieve_file_quota_index_open
+		(fstorage, F_WRLCK, FALSE, &qidx) <= 0 )
+		return NULL;
+
+	/* An outdated index is not updated; the next quota check scans the
+	   directory anyway */
+	if ( sieve_file_quota_index_read(qidx) <= 0 ) {
+		sieve_file_quota_index_close(&qidx);
+		return NULL;
+	}
+	return qidx;
+}
+
+void sieve_file_storage_quota_update_commit
+(struct sieve_file_quota_index **_qidx, int scripts_diff,
+	int64_t storage_diff)
+{
+	struct sieve_file_quota_index *qidx = *_qidx;
+
+	if ( qidx == NULL )
+		return;
+
+	if ( scripts_diff < 0 && qidx->scripts < (uint64_t)-scripts_diff )
+		qidx->scripts = 0;
+	else
+		qidx->scripts += scripts_diff;
+	if ( storage_diff < 0 && qidx->storage < (uint64_t)-storage_diff )
+		qidx->storage = 0;
+	else
+		qidx->storage += storage_diff;
+
+	T_BEGIN {
+		sieve_file_quota_index_write(qidx, NULL);
+	} T_END;
+	sieve_file_quota_index_close(_qidx);
+}
+
+void sieve_file_storage_quota_update_rollback
+(struct sieve_file_quota_index **_qidx)
+{
+	if ( *_qidx == NULL )
+		return;
+	sieve_file_quota_index_close(_qidx);
+}
+
+/*
+ * Quota checking
+ */
+
+static int sieve_file_storage_quota_scan
+(struct sieve_file_storage *fstorage, uint64_t *scripts_r,
+	uint64_t *storage_r)
+{
+	struct sieve_storage *storage = &fstorage->storage;
 	struct dirent *dp;
 	DIR *dirp;
-	uint64_t script_count = 1;
-	uint64_t script_storage = size;
-	int result = 1;
+	int result = 0;
+
+	*scripts_r = *storage_r = 0;
 
 	/* Open the directory */
 	if ( (dirp = opendir(fstorage->path)) == NULL ) {
@@ -35,8 +336,8 @@ int sieve_file_storage_quota_havespace
 
 	/* Scan all files */
 	for (;;) {
-		const char *name;
-		bool replaced = FALSE;
+		const char *name, *path;
+		struct stat st;
 
 		/* Read next entry */
 		errno = 0;
@@ -64,47 +365,18 @@ int sieve_file_storage_quota_havespace
 			strcmp(fstorage->active_fname, dp->d_name) == 0 )
 			continue;
 
-		if ( strcmp(name, scriptname) == 0 )
-			replaced = TRUE;
+		(*scripts_r)++;
 
-		/* Check count quota if necessary */
-		if ( storage->max_scripts > 0 ) {
-			if ( !replaced ) {
-				script_count++;
+		/* Determine the size of the script */
+		path = t_strconcat(fstorage->path, "/", dp->d_name, NULL);
 
-				if ( script_count > storage->max_scripts ) {
-					*quota_r = SIEVE_STORAGE_QUOTA_MAXSCRIPTS;
-					*limit_r = storage->max_scripts;
-					result = 0;
-					break;
-				}
-			}
+		if ( stat(path, &st) < 0 ) {
+			sieve_storage_sys_warning(storage,
+				"quota: stat(%s) failed: %m", path);
+			continue;
 		}
 
-		/* Check storage quota if necessary */
-		if ( storage->max_storage > 0 ) {
-			const char *path;
-			struct stat st;
-
-			path = t_strconcat(fstorage->path, "/", dp->d_name, NULL);
-
-			if ( stat(path, &st) < 0 ) {
-				sieve_storage_sys_warning(storage,
-					"quota: stat(%s) failed: %m", path);
-				continue;
-			}
-
-			if ( !replaced ) {
-				script_storage += st.st_size;
-
-				if ( script_storage > storage->max_storage ) {
-					*quota_r = SIEVE_STORAGE_QUOTA_MAXSTORAGE;
-					*limit_r = storage->max_storage;
-					result = 0;
-					break;
-				}
-			}
-		}
+		*storage_r += st.st_size;
 	}
 
 	/* Close directory */
@@ -115,6 +387,99 @@ int sieve_file_storage_quota_havespace
 	return result;
 }
 
+static int sieve_file_storage_quota_usage
+(struct sieve_file_storage *fstorage, uint64_t *scripts_r,
+	uint64_t *storage_r)
+{
+	struct sieve_file_quota_index *qidx;
+	struct sieve_file_quota_stamp stamp;
+	int ret;
+
+	/* Use the index when it is up-to-date */
+	if ( sieve_file_quota_index_open
+		(fstorage, F_RDLCK, FALSE, &qidx) > 0 ) {
+		ret = sieve_file_quota_index_read(qidx);
+		if ( ret > 0 ) {
+			*scripts_r = qidx->scripts;
+			*storage_r = qidx->storage;
+		}
+		sieve_file_quota_index_close(&qidx);
+		if ( ret > 0 )
+			return 0;
+	}
+
+	/* Scan the directory and record the result. The index is created before
+	   the directory is stamped, since that changes the directory too. */
+	if ( sieve_file_quota_index_open
+		(fstorage, F_WRLCK, TRUE, &qidx) <= 0 )
+		return sieve_file_storage_quota_scan(fstorage, scripts_r, storage_r);
 
+	if ( sieve_file_quota_dir_stamp(fstorage, &stamp) < 0 ) {
+		sieve_file_quota_index_close(&qidx);
+		return sieve_file_storage_quota_scan(fstorage, scripts_r, storage_r);
+	}
 
+	if ( (ret=sieve_file_storage_quota_scan
+		(fstorage, scripts_r, storage_r)) == 0 ) {
+		qidx->scripts = *scripts_r;
+		qidx->storage = *storage_r;
+		sieve_file_quota_index_write(qidx, &stamp);
+	}
+	sieve_file_quota_index_close(&qidx);
+	return ret;
+}
 
+int sieve_file_storage_quota_havespace
+(struct sieve_storage *storage, const char *scriptname, size_t size,
+	enum sieve_storage_quota *quota_r, uint64_t *limit_r)
+{
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)storage;
+	uint64_t script_count, script_storage;
+	const char *fname, *path;
+	struct stat st;
+	bool replaced = FALSE;
+
+	if ( sieve_file_storage_quota_usage
+		(fstorage, &script_count, &script_storage) < 0 )
+		return -1;
+
+	/* Does the new script replace an existing one? */
+	fname = sieve_script_file_from_name(scriptname);
+	path = t_strconcat(fstorage->path, "/", fname, NULL);
+	if ( *(fstorage->link_path) == '\0' &&
+		strcmp(fstorage->active_fname, fname) == 0 ) {
+		/* Active script link; not counted */
+	} else if ( stat(path, &st) == 0 ) {
+		replaced = TRUE;
+		script_storage -= I_MIN(script_storage, (uint64_t)st.st_size);
+	} else if ( errno != ENOENT ) {
+		sieve_storage_sys_warning(storage,
+			"quota: stat(%s) failed: %m", path);
+	}
+
+	/* Check count quota if necessary */
+	if ( storage->max_scripts > 0 ) {
+		if ( !replaced )
+			script_count++;
+
+		if ( script_count > storage->max_scripts ) {
+			*quota_r = SIEVE_STORAGE_QUOTA_MAXSCRIPTS;
+			*limit_r = storage->max_scripts;
+			return 0;
+		}
+	}
+
+	/* Check storage quota if necessary */
+	if ( storage->max_storage > 0 ) {
+		script_storage += size;
+
+		if ( script_storage > storage->max_storage ) {
+			*quota_r = SIEVE_STORAGE_QUOTA_MAXSTORAGE;
+			*limit_r = storage->max_storage;
+			return 0;
+		}
+	}
+
+	return 1;
+}
@@ -370,7 +370,11 @@ int sieve_file_storage_save_commit
 	struct sieve_storage *storage = sctx->storage;
 	struct sieve_file_storage *fstorage =
 		(struct sieve_file_storage *)sctx->storage;
+	struct sieve_file_quota_index *qidx;
 	const char *dest_path;
+	struct stat st;
+	int scripts_diff = 0;
+	int64_t storage_diff = 0;
 	bool failed = FALSE;
 
 	i_assert(fsctx->output == NULL);
@@ -379,7 +383,31 @@ int sieve_file_storage_save_commit
 		dest_path = t_strconcat(fstorage->path, "/",
 			sieve_script_file_from_name(sctx->scriptname), NULL);
 
+		/* Determine how the usage of the storage changes */
+		qidx = sieve_file_storage_quota_update_begin(fstorage);
+		if ( qidx != NULL ) {
+			if ( stat(fsctx->tmp_path, &st) < 0 ) {
+				sieve_storage_sys_warning(storage, "save: "
+					"stat(%s) failed: %m", fsctx->tmp_path);
+				sieve_file_storage_quota_update_rollback(&qidx);
+			} else {
+				storage_diff = st.st_size;
+				if ( stat(dest_path, &st) == 0 )
+					storage_diff -= st.st_size;
+				else if ( errno == ENOENT )
+					scripts_diff = 1;
+				else
+					sieve_file_storage_quota_update_rollback(&qidx);
+			}
+		}
+
 		failed = ( sieve_file_storage_script_move(fsctx, dest_path) < 0 );
+		if ( failed ) {
+			sieve_file_storage_quota_update_rollback(&qidx);
+		} else {
+			sieve_file_storage_quota_update_commit
+				(&qidx, scripts_diff, storage_diff);
+		}
 		if ( sctx->mtime != (time_t)-1 )
 			sieve_file_storage_update_mtime(storage, dest_path, sctx->mtime);
 	} T_END;
@@ -828,6 +828,7 @@ static void sieve_file_storage_set_modified
 {
 	struct sieve_file_storage *fstorage =
 		(struct sieve_file_storage *)storage;
+	struct sieve_file_quota_index *qidx;
 	struct utimbuf times;
 	time_t cur_mtime;
 
@@ -839,6 +840,10 @@ static void sieve_file_storage_set_modified
 		mtime = ioloop_time;
 	}
 
+	/* Changing the timestamp of the directory would invalidate the usage
+	   index otherwise */
+	qidx = sieve_file_storage_quota_update_begin(fstorage);
+
 	times.actime = mtime;
 	times.modtime = mtime;
 	if ( utime(fstorage->path, &times) < 0 ) {
@@ -854,8 +859,10 @@ static void sieve_file_storage_set_modified
 				"utime(%s) failed: %m", fstorage->path);
 		}
 	} else {
+		sieve_file_storage_quota_update_commit(&qidx, 0, 0);
 		fstorage->prev_mtime = mtime;
 	}
+	sieve_file_storage_quota_update_rollback(&qidx);
 }
 
 /*
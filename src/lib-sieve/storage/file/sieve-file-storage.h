@@ -113,10 +113,26 @@ int sieve_file_storage_save_as_active
 
 /* Quota */
 
+/* Name of the usage index file in the storage directory */
+#define SIEVE_FILE_STORAGE_QUOTA_INDEX_FNAME "dovecot-sieve.quota"
+
+struct sieve_file_quota_index;
+
 int sieve_file_storage_quota_havespace
 (struct sieve_storage *storage, const char *scriptname, size_t size,
 	enum sieve_storage_quota *quota_r, uint64_t *limit_r);
 
+/* Keeps the usage index locked while the storage directory is modified. When
+   there is no usable index, NULL is returned; commit and rollback accept
+   that. */
+struct sieve_file_quota_index *sieve_file_storage_quota_update_begin
+	(struct sieve_file_storage *fstorage);
+void sieve_file_storage_quota_update_commit
+	(struct sieve_file_quota_index **_qidx, int scripts_diff,
+		int64_t storage_diff);
+void sieve_file_storage_quota_update_rollback
+	(struct sieve_file_quota_index **_qidx);
+
 /*
  * Sieve script filenames
  */
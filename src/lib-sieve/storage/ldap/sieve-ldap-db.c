@@ -16,6 +16,7 @@
 #include "ioloop.h"
 #include "array.h"
 #include "hash.h"
+#include "llist.h"
 #include "aqueue.h"
 #include "str.h"
 #include "time-util.h"
@@ -305,7 +306,7 @@ void db_ldap_request(struct ldap_connection *conn,
 static int db_ldap_connect_finish(struct ldap_connection *conn, int ret)
 {
 	struct sieve_storage *storage = &conn->lstorage->storage;
-	const struct sieve_ldap_storage_settings *set = &conn->lstorage->set;
+	const struct sieve_ldap_storage_settings *set = conn->set;
 
 	if (ret == LDAP_SERVER_DOWN) {
 		sieve_storage_sys_error(storage, "db: "
@@ -409,6 +410,25 @@ db_ldap_find_request(struct ldap_connection *conn, int msgid,
 	return NULL;
 }
 
+static void db_ldap_result_unref(struct db_ldap_result **_res)
+{
+	struct db_ldap_result *res = *_res;
+
+	*_res = NULL;
+	i_assert(res->refcount > 0);
+	if (--res->refcount == 0) {
+		ldap_msgfree(res->msg);
+		i_free(res);
+	}
+}
+
+static void
+db_ldap_request_free(struct ldap_request *request)
+{
+	if (request->result != NULL)
+		db_ldap_result_unref(&request->result);
+}
+
 static bool
 db_ldap_handle_request_result(struct ldap_connection *conn,
 			      struct ldap_request *request, unsigned int idx,
@@ -466,6 +486,8 @@ db_ldap_handle_request_result(struct ldap_connection *conn,
 	if (final_result) {
 		conn->pending_count--;
 		aqueue_delete(conn->request_queue, idx);
+		/* the callback may free the request once it is finished */
+		db_ldap_request_free(request);
 	}
 
 	T_BEGIN {
@@ -481,25 +503,6 @@ db_ldap_handle_request_result(struct ldap_connection *conn,
 	return TRUE;
 }
 
-static void db_ldap_result_unref(struct db_ldap_result **_res)
-{
-	struct db_ldap_result *res = *_res;
-
-	*_res = NULL;
-	i_assert(res->refcount > 0);
-	if (--res->refcount == 0) {
-		ldap_msgfree(res->msg);
-		i_free(res);
-	}
-}
-
-static void
-db_ldap_request_free(struct ldap_request *request)
-{
-	if (request->result != NULL)
-		db_ldap_result_unref(&request->result);
-}
-
 static void
 db_ldap_handle_result(struct ldap_connection *conn, struct db_ldap_result *res)
 {
@@ -521,8 +524,7 @@ db_ldap_handle_result(struct ldap_connection *conn, struct db_ldap_result *res)
 		return;
 	}
 
-	if (db_ldap_handle_request_result(conn, request, idx, res))
-		db_ldap_request_free(request);
+	(void)db_ldap_handle_request_result(conn, request, idx, res);
 }
 
 static void ldap_input(struct ldap_connection *conn)
@@ -632,7 +634,7 @@ static void ldap_connection_timeout(struct ldap_connection *conn)
 
 static int db_ldap_bind(struct ldap_connection *conn)
 {
-	const struct sieve_ldap_storage_settings *set = &conn->lstorage->set;
+	const struct sieve_ldap_storage_settings *set = conn->set;
 	int msgid;
 
 	i_assert(conn->conn_state != LDAP_CONN_STATE_BINDING);
@@ -711,7 +713,7 @@ db_ldap_set_opt_str(struct ldap_connection *conn, int opt, const char *value,
 
 static int db_ldap_set_tls_options(struct ldap_connection *conn)
 {
-	const struct sieve_ldap_storage_settings *set = &conn->lstorage->set;
+	const struct sieve_ldap_storage_settings *set = conn->set;
 
 	if (!set->tls)
 		return 0;
@@ -754,7 +756,7 @@ static int db_ldap_set_tls_options(struct ldap_connection *conn)
 
 static int db_ldap_set_options(struct ldap_connection *conn)
 {
-	const struct sieve_ldap_storage_settings *set = &conn->lstorage->set;
+	const struct sieve_ldap_storage_settings *set = conn->set;
 	struct sieve_storage *storage = &conn->lstorage->storage;
 	unsigned int ldap_version;
 	int value;
@@ -794,7 +796,7 @@ static int db_ldap_set_options(struct ldap_connection *conn)
 
 int sieve_ldap_db_connect(struct ldap_connection *conn)
 {
-	const struct sieve_ldap_storage_settings *set = &conn->lstorage->set;
+	const struct sieve_ldap_storage_settings *set = conn->set;
 	struct sieve_storage *storage = &conn->lstorage->storage;
 	struct timeval start, end;
 	int debug_level;
@@ -999,56 +1001,226 @@ const char *ldap_escape(const char *str)
 	return str_c(ret);
 }
 
+
+/*
+ * Shared connections
+ */
+
+static bool
+db_ldap_settings_equal(const struct sieve_ldap_storage_settings *set1,
+		       const struct sieve_ldap_storage_settings *set2)
+{
+	return (null_strcmp(set1->hosts, set2->hosts) == 0 &&
+		null_strcmp(set1->uris, set2->uris) == 0 &&
+		null_strcmp(set1->dn, set2->dn) == 0 &&
+		null_strcmp(set1->dnpass, set2->dnpass) == 0 &&
+		set1->tls == set2->tls &&
+		set1->sasl_bind == set2->sasl_bind &&
+		null_strcmp(set1->sasl_mech, set2->sasl_mech) == 0 &&
+		null_strcmp(set1->sasl_realm, set2->sasl_realm) == 0 &&
+		null_strcmp(set1->sasl_authz_id, set2->sasl_authz_id) == 0 &&
+		null_strcmp(set1->tls_ca_cert_file,
+			    set2->tls_ca_cert_file) == 0 &&
+		null_strcmp(set1->tls_ca_cert_dir,
+			    set2->tls_ca_cert_dir) == 0 &&
+		null_strcmp(set1->tls_cert_file, set2->tls_cert_file) == 0 &&
+		null_strcmp(set1->tls_key_file, set2->tls_key_file) == 0 &&
+		null_strcmp(set1->tls_cipher_suite,
+			    set2->tls_cipher_suite) == 0 &&
+		null_strcmp(set1->tls_require_cert,
+			    set2->tls_require_cert) == 0 &&
+		set1->ldap_deref == set2->ldap_deref &&
+		set1->ldap_version == set2->ldap_version &&
+		null_strcmp(set1->debug_level, set2->debug_level) == 0);
+}
+
+static struct sieve_ldap_storage_settings *
+db_ldap_settings_dup(pool_t pool,
+		     const struct sieve_ldap_storage_settings *src)
+{
+	struct sieve_ldap_storage_settings *set;
+
+	/* Only the settings that apply to the connection itself; the search
+	   settings are taken from the storage making the request. */
+	set = p_new(pool, struct sieve_ldap_storage_settings, 1);
+	set->hosts = p_strdup(pool, src->hosts);
+	set->uris = p_strdup(pool, src->uris);
+	set->dn = p_strdup(pool, src->dn);
+	set->dnpass = p_strdup(pool, src->dnpass);
+	set->tls = src->tls;
+	set->sasl_bind = src->sasl_bind;
+	set->sasl_mech = p_strdup(pool, src->sasl_mech);
+	set->sasl_realm = p_strdup(pool, src->sasl_realm);
+	set->sasl_authz_id = p_strdup(pool, src->sasl_authz_id);
+	set->tls_ca_cert_file = p_strdup(pool, src->tls_ca_cert_file);
+	set->tls_ca_cert_dir = p_strdup(pool, src->tls_ca_cert_dir);
+	set->tls_cert_file = p_strdup(pool, src->tls_cert_file);
+	set->tls_key_file = p_strdup(pool, src->tls_key_file);
+	set->tls_cipher_suite = p_strdup(pool, src->tls_cipher_suite);
+	set->tls_require_cert = p_strdup(pool, src->tls_require_cert);
+	set->deref = p_strdup(pool, src->deref);
+	set->ldap_version = src->ldap_version;
+	set->debug_level = p_strdup(pool, src->debug_level);
+	set->ldap_deref = src->ldap_deref;
+	set->ldap_tls_require_cert = src->ldap_tls_require_cert;
+	return set;
+}
+
+static unsigned int db_ldap_idle_count(void)
+{
+	struct ldap_connection *conn;
+	unsigned int count = 0;
+
+	for (conn = ldap_connections; conn != NULL; conn = conn->next) {
+		if (conn->lstorage == NULL)
+			count++;
+	}
+	return count;
+}
+
+static void
+db_ldap_conn_attach(struct ldap_connection *conn,
+		    struct sieve_ldap_storage *lstorage)
+{
+	array_append(&conn->storages, &lstorage, 1);
+	if (conn->lstorage != NULL)
+		return;
+
+	/* idle connection: pick up anything the server sent meanwhile,
+	   which includes noticing that it closed the connection */
+	if (conn->to_idle != NULL)
+		timeout_remove(&conn->to_idle);
+	conn->lstorage = lstorage;
+	sieve_storage_sys_debug(&lstorage->storage, "db: "
+		"Reusing idle connection to %s",
+		conn->set->uris != NULL ? conn->set->uris : conn->set->hosts);
+	db_ldap_enable_input(conn, TRUE);
+}
+
+static void sieve_ldap_db_scripts_clear(struct ldap_connection *conn);
+
+static void db_ldap_conn_destroy(struct ldap_connection *conn)
+{
+	struct ldap_connection **p;
+
+	for (p = &ldap_connections; *p != NULL; p = &(*p)->next) {
+		if (*p == conn) {
+			*p = conn->next;
+			break;
+		}
+	}
+
+	if (conn->to_idle != NULL)
+		timeout_remove(&conn->to_idle);
+	db_ldap_abort_requests(conn, UINT_MAX, 0, FALSE, "Shutting down");
+	i_assert(conn->pending_count == 0);
+	db_ldap_conn_close(conn);
+	i_assert(conn->to == NULL);
+
+	sieve_ldap_db_scripts_clear(conn);
+	hash_table_destroy(&conn->scripts);
+
+	array_free(&conn->storages);
+	array_free(&conn->request_array);
+	aqueue_deinit(&conn->request_queue);
+
+	pool_unref(&conn->pool);
+}
+
+static void db_ldap_conn_idle_timeout(struct ldap_connection *conn)
+{
+	i_assert(conn->lstorage == NULL);
+	db_ldap_conn_destroy(conn);
+}
+
 struct ldap_connection *
 sieve_ldap_db_init(struct sieve_ldap_storage *lstorage)
 {
 	struct ldap_connection *conn;
 	pool_t pool;
 
-	pool = pool_alloconly_create("ldap_connection", 1024);
+	for (conn = ldap_connections; conn != NULL; conn = conn->next) {
+		if (db_ldap_settings_equal(conn->set, &lstorage->set)) {
+			db_ldap_conn_attach(conn, lstorage);
+			return conn;
+		}
+	}
+
+	pool = pool_alloconly_create("ldap_connection", 2048);
 	conn = p_new(pool, struct ldap_connection, 1);
 	conn->pool = pool;
-	conn->refcount = 1;
-	conn->lstorage = lstorage;
+	conn->set = db_ldap_settings_dup(pool, &lstorage->set);
 
 	conn->conn_state = LDAP_CONN_STATE_DISCONNECTED;
 	conn->default_bind_msgid = -1;
 	conn->fd = -1;
 
+	i_array_init(&conn->storages, 4);
 	i_array_init(&conn->request_array, 512);
 	conn->request_queue = aqueue_init(&conn->request_array.arr);
+	hash_table_create(&conn->scripts, default_pool, 0, str_hash, strcmp);
+
+	conn->lstorage = lstorage;
+	array_append(&conn->storages, &lstorage, 1);
 
 	conn->next = ldap_connections;
 	ldap_connections = conn;
 	return conn;
 }
 
-void sieve_ldap_db_unref(struct ldap_connection **_conn)
+void sieve_ldap_db_unref(struct ldap_connection **_conn,
+	struct sieve_ldap_storage *lstorage)
 {
 	struct ldap_connection *conn = *_conn;
-	struct ldap_connection **p;
+	struct sieve_ldap_storage *const *lstorages;
+	unsigned int i, count;
 
 	*_conn = NULL;
-	i_assert(conn->refcount >= 0);
-	if (--conn->refcount > 0)
-		return;
 
-	for (p = &ldap_connections; *p != NULL; p = &(*p)->next) {
-		if (*p == conn) {
-			*p = conn->next;
+	lstorages = array_get(&conn->storages, &count);
+	for (i = 0; i < count; i++) {
+		if (lstorages[i] == lstorage)
 			break;
+	}
+	i_assert(i < count);
+	array_delete(&conn->storages, i, 1);
+
+	if (array_count(&conn->storages) > 0) {
+		if (conn->lstorage == lstorage) {
+			lstorages = array_idx(&conn->storages, 0);
+			conn->lstorage = *lstorages;
 		}
+		return;
 	}
 
-	db_ldap_abort_requests(conn, UINT_MAX, 0, FALSE, "Shutting down");
-	i_assert(conn->pending_count == 0);
-	db_ldap_conn_close(conn);
-	i_assert(conn->to == NULL);
+	/* Keep a bound connection around for the next storage that needs
+	   it, but only when it has nothing left to do. */
+	if (conn->conn_state != LDAP_CONN_STATE_BOUND ||
+	    aqueue_count(conn->request_queue) > 0 ||
+	    db_ldap_idle_count() >= DB_LDAP_MAX_IDLE_CONNECTIONS) {
+		db_ldap_conn_destroy(conn);
+		return;
+	}
 
-	array_free(&conn->request_array);
-	aqueue_deinit(&conn->request_queue);
+	sieve_storage_sys_debug(&lstorage->storage, "db: "
+		"Keeping idle connection for reuse");
+	db_ldap_enable_input(conn, FALSE);
+	if (conn->to != NULL)
+		timeout_remove(&conn->to);
+	conn->lstorage = NULL;
+	conn->to_idle = timeout_add(DB_LDAP_IDLE_RECONNECT_SECS*1000,
+				    db_ldap_conn_idle_timeout, conn);
+}
 
-	pool_unref(&conn->pool);
+void sieve_ldap_db_deinit(void)
+{
+	struct ldap_connection *conn, *next;
+
+	for (conn = ldap_connections; conn != NULL; conn = next) {
+		next = conn->next;
+		if (conn->lstorage == NULL)
+			db_ldap_conn_destroy(conn);
+	}
 }
 
 static void db_ldap_switch_ioloop(struct ldap_connection *conn)
@@ -1059,32 +1231,30 @@ static void db_ldap_switch_ioloop(struct ldap_connection *conn)
 		conn->io = io_loop_move_io(&conn->io);
 }
 
-static void db_ldap_wait(struct ldap_connection *conn)
+static void db_ldap_wait(struct ldap_connection *conn, const bool *finished)
 {
 	struct sieve_storage *storage = &conn->lstorage->storage;
 	struct ioloop *prev_ioloop = current_ioloop;
 
 	i_assert(conn->ioloop == NULL);
 
-	if (aqueue_count(conn->request_queue) == 0)
+	/* without I/O or a timeout nothing is going to finish the request */
+	if (*finished || (conn->io == NULL && conn->to == NULL))
 		return;
 
 	conn->ioloop = io_loop_create();
 	db_ldap_switch_ioloop(conn);
-	/* either we're waiting for network I/O or we're getting out of a
-	   callback using timeout_add_short(0) */
-	i_assert(io_loop_have_ios(conn->ioloop) ||
-		 io_loop_have_immediate_timeouts(conn->ioloop));
 
+	/* other requests on this connection are handled meanwhile */
 	do {
 		sieve_storage_sys_debug(storage, "db: "
-			"Waiting for %d requests to finish",
+			"Waiting for request to finish (%d requests queued)",
 			aqueue_count(conn->request_queue) );
 		io_loop_run(conn->ioloop);
-	} while (aqueue_count(conn->request_queue) > 0);
+	} while (!*finished && (conn->io != NULL || conn->to != NULL));
 
 	sieve_storage_sys_debug(storage, "db: "
-		"All requests finished");
+		"Request finished");
 
 	current_ioloop = prev_ioloop;
 	db_ldap_switch_ioloop(conn);
@@ -1092,17 +1262,139 @@ static void db_ldap_wait(struct ldap_connection *conn)
 	io_loop_destroy(&conn->ioloop);
 }
 
-static void sieve_ldap_db_script_free(unsigned char *script)
+/*
+ * Script cache
+ */
+
+struct sieve_ldap_db_script {
+	struct sieve_ldap_db_script *prev, *next;
+	int refcount;
+
+	char *dn, *attr, *modattr;
+
+	unsigned char *data;
+	size_t size;
+};
+
+static struct sieve_ldap_db_script *
+sieve_ldap_db_script_create(const char *dn, const char *attr,
+	const char *modattr, const void *data, size_t size)
+{
+	struct sieve_ldap_db_script *script;
+
+	script = i_new(struct sieve_ldap_db_script, 1);
+	script->refcount = 1;
+	script->dn = i_strdup(dn);
+	script->attr = i_strdup(attr);
+	script->modattr = i_strdup(modattr);
+	script->data = i_malloc(I_MAX(size, 1));
+	memcpy(script->data, data, size);
+	script->size = size;
+	return script;
+}
+
+static void sieve_ldap_db_script_unref(struct sieve_ldap_db_script **_script)
 {
+	struct sieve_ldap_db_script *script = *_script;
+
+	*_script = NULL;
+	i_assert(script->refcount > 0);
+	if (--script->refcount > 0)
+		return;
+
+	i_free(script->dn);
+	i_free(script->attr);
+	i_free(script->modattr);
+	i_free(script->data);
 	i_free(script);
 }
 
+static void sieve_ldap_db_script_stream_destroyed(
+	struct sieve_ldap_db_script *script)
+{
+	sieve_ldap_db_script_unref(&script);
+}
+
+static struct istream *
+sieve_ldap_db_script_open_stream(struct sieve_ldap_db_script *script)
+{
+	struct istream *input;
+
+	/* the stream keeps the script data alive, even once it is dropped
+	   from the cache */
+	input = i_stream_create_from_data(script->data, script->size);
+	script->refcount++;
+	i_stream_add_destroy_callback(input,
+		sieve_ldap_db_script_stream_destroyed, script);
+	return input;
+}
+
+static void
+sieve_ldap_db_scripts_remove(struct ldap_connection *conn,
+	struct sieve_ldap_db_script *script)
+{
+	hash_table_remove(conn->scripts, script->dn);
+	DLLIST2_REMOVE(&conn->scripts_head, &conn->scripts_tail, script);
+	i_assert(conn->scripts_count > 0);
+	conn->scripts_count--;
+	sieve_ldap_db_script_unref(&script);
+}
+
+static void
+sieve_ldap_db_scripts_add(struct ldap_connection *conn,
+	struct sieve_ldap_db_script *script)
+{
+	struct sieve_ldap_db_script *old_script;
+
+	i_assert(script->modattr != NULL);
+
+	old_script = hash_table_lookup(conn->scripts, script->dn);
+	if (old_script == script)
+		return;
+	if (old_script != NULL)
+		sieve_ldap_db_scripts_remove(conn, old_script);
+
+	script->refcount++;
+	hash_table_insert(conn->scripts, script->dn, script);
+	DLLIST2_PREPEND(&conn->scripts_head, &conn->scripts_tail, script);
+	if (++conn->scripts_count > DB_LDAP_MAX_CACHED_SCRIPTS)
+		sieve_ldap_db_scripts_remove(conn, conn->scripts_tail);
+}
+
+static struct sieve_ldap_db_script *
+sieve_ldap_db_scripts_lookup(struct ldap_connection *conn,
+	const char *dn, const char *attr, const char *modattr)
+{
+	struct sieve_ldap_db_script *script;
+
+	if (modattr == NULL || *modattr == '\0')
+		return NULL;
+
+	script = hash_table_lookup(conn->scripts, dn);
+	if (script == NULL || strcmp(script->attr, attr) != 0 ||
+	    strcmp(script->modattr, modattr) != 0)
+		return NULL;
+
+	DLLIST2_REMOVE(&conn->scripts_head, &conn->scripts_tail, script);
+	DLLIST2_PREPEND(&conn->scripts_head, &conn->scripts_tail, script);
+	return script;
+}
+
+static void sieve_ldap_db_scripts_clear(struct ldap_connection *conn)
+{
+	while (conn->scripts_head != NULL)
+		sieve_ldap_db_scripts_remove(conn, conn->scripts_head);
+}
+
+/*
+ * Script requests
+ */
+
 static int
 sieve_ldap_db_get_script_modattr(struct ldap_connection *conn,
-	LDAPMessage *entry, pool_t pool, const char **modattr_r)
+	struct sieve_storage *storage, LDAPMessage *entry,
+	const char *mod_attr, pool_t pool, const char **modattr_r)
 {
-	const struct sieve_ldap_storage_settings *set = &conn->lstorage->set;
-	struct sieve_storage *storage = &conn->lstorage->storage;
 	char *attr, **vals;
 	BerElement *ber;
 
@@ -1110,7 +1402,7 @@ sieve_ldap_db_get_script_modattr(struct ldap_connection *conn,
 
 	attr = ldap_first_attribute(conn->ld, entry, &ber);
 	while (attr != NULL) {
-		if (strcmp(attr, set->sieve_ldap_mod_attr) == 0) {
+		if (strcmp(attr, mod_attr) == 0) {
 			vals = ldap_get_values(conn->ld, entry, attr);
 			if (vals == NULL || vals[0] == NULL)
 				return 0;
@@ -1118,7 +1410,7 @@ sieve_ldap_db_get_script_modattr(struct ldap_connection *conn,
 			if (vals[1] != NULL) {
 				sieve_storage_sys_warning(storage, "db: "
 					"Search returned more than one Sieve modified attribute `%s'; "
-					"using only the first one.", set->sieve_ldap_mod_attr);
+					"using only the first one.", mod_attr);
 			} 
 
 			*modattr_r = p_strdup(pool, vals[0]);
@@ -1137,19 +1429,17 @@ sieve_ldap_db_get_script_modattr(struct ldap_connection *conn,
 
 static int
 sieve_ldap_db_get_script(struct ldap_connection *conn,
-	LDAPMessage *entry, struct istream **script_r)
+	struct sieve_storage *storage, LDAPMessage *entry,
+	const char *script_attr, const char *dn, const char *modattr,
+	struct sieve_ldap_db_script **script_r)
 {
-	const struct sieve_ldap_storage_settings *set = &conn->lstorage->set;
-	struct sieve_storage *storage = &conn->lstorage->storage;
 	char *attr;
-	unsigned char *data;
-	size_t size;
 	struct berval **vals;
 	BerElement *ber;
 
 	attr = ldap_first_attribute(conn->ld, entry, &ber);
 	while (attr != NULL) {
-		if (strcmp(attr, set->sieve_ldap_script_attr) == 0) {
+		if (strcmp(attr, script_attr) == 0) {
 			vals = ldap_get_values_len(conn->ld, entry, attr);
 			if (vals == NULL || vals[0] == NULL)
 				return 0;
@@ -1157,23 +1447,18 @@ sieve_ldap_db_get_script(struct ldap_connection *conn,
 			if (vals[1] != NULL) {
 				sieve_storage_sys_warning(storage, "db: "
 					"Search returned more than one Sieve script attribute `%s'; "
-					"using only the first one.", set->sieve_ldap_script_attr);
+					"using only the first one.", script_attr);
 			} 
 
-			size = vals[0]->bv_len;
-			data = i_malloc(size);
-
 			sieve_storage_sys_debug(storage, "db: "
-				"Found script with length %"PRIuSIZE_T, size);
+				"Found script with length %"PRIuSIZE_T,
+				(size_t)vals[0]->bv_len);
+
+			*script_r = sieve_ldap_db_script_create(dn, script_attr,
+				modattr, vals[0]->bv_val, vals[0]->bv_len);
 
-			memcpy(data, vals[0]->bv_val, size);
-		
 			ldap_value_free_len(vals);
 			ldap_memfree(attr);
-
-			*script_r = i_stream_create_from_data(data, size);
-			i_stream_add_destroy_callback
-				(*script_r,	sieve_ldap_db_script_free, data);
 			return 1;
 		}
 		ldap_memfree(attr);
@@ -1195,10 +1480,9 @@ auth_request_var_expand_static_tab[] = {
 };
 
 static const struct var_expand_table *
-db_ldap_get_var_expand_table(struct ldap_connection *conn,
+db_ldap_get_var_expand_table(struct sieve_ldap_storage *lstorage,
 	const char *name)
 {
-	struct sieve_ldap_storage *lstorage = conn->lstorage;
 	struct sieve_instance *svinst = lstorage->storage.svinst;
 	const unsigned int auth_count =
 		N_ELEMENTS(auth_request_var_expand_static_tab);
@@ -1221,163 +1505,256 @@ db_ldap_get_var_expand_table(struct ldap_connection *conn,
 	return tab;
 }
 
-struct sieve_ldap_script_lookup_request {
+struct sieve_ldap_script_request {
 	struct ldap_request request;
 
+	struct ldap_connection *conn;
+	/* NULL once the requester is no longer interested in the result */
+	struct sieve_ldap_storage *lstorage;
+
+	const char *mod_attr;
+	/* NULL unless the script itself is retrieved */
+	const char *script_attr;
+
 	unsigned int entries;
 	const char *result_dn;
 	const char *result_modattr;
+	struct sieve_ldap_db_script *result_script;
+
+	bool finished;
+	bool error;
 };
 
 static void
-sieve_ldap_lookup_script_callback(struct ldap_connection *conn,
-			  struct ldap_request *request, LDAPMessage *res)
+sieve_ldap_script_request_free(struct sieve_ldap_script_request *srequest)
 {
-	struct sieve_storage *storage = &conn->lstorage->storage;
-	struct sieve_ldap_script_lookup_request *srequest =
-		(struct sieve_ldap_script_lookup_request *)request;
+	if (srequest->result_script != NULL)
+		sieve_ldap_db_script_unref(&srequest->result_script);
+	pool_unref(&srequest->request.pool);
+}
 
-	if (res == NULL) {
-		io_loop_stop(conn->ioloop);
-		return;
-	}
+static void
+sieve_ldap_script_request_entry(struct ldap_connection *conn,
+	struct sieve_ldap_script_request *srequest, LDAPMessage *res)
+{
+	struct sieve_storage *storage = &srequest->lstorage->storage;
+	pool_t pool = srequest->request.pool;
+	char *dn;
 
-	if (ldap_msgtype(res) != LDAP_RES_SEARCH_RESULT) {
-		if (srequest->result_dn == NULL) {
-			srequest->result_dn = p_strdup
-				(request->pool, ldap_get_dn(conn->ld, res));
-			(void)sieve_ldap_db_get_script_modattr
-				(conn, res, request->pool, &srequest->result_modattr);
-		} else if (srequest->entries++ == 0) {
+	if (srequest->result_dn != NULL) {
+		if (srequest->entries++ == 0) {
 			sieve_storage_sys_warning(storage, "db: "
 				"Search returned more than one entry for Sieve script; "
 				"using only the first one.");
 		}
-	} else {
-		io_loop_stop(conn->ioloop);
 		return;
 	}
+
+	dn = ldap_get_dn(conn->ld, res);
+	srequest->result_dn = p_strdup(pool, dn);
+	ldap_memfree(dn);
+
+	(void)sieve_ldap_db_get_script_modattr(conn, storage, res,
+		srequest->mod_attr, pool, &srequest->result_modattr);
+	if (srequest->script_attr != NULL) {
+		(void)sieve_ldap_db_get_script(conn, storage, res,
+			srequest->script_attr, srequest->result_dn,
+			srequest->result_modattr, &srequest->result_script);
+	}
 }
 
-int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
-	const char *name, const char **dn_r, const char **modattr_r)
+static void
+sieve_ldap_script_request_callback(struct ldap_connection *conn,
+	struct ldap_request *request, LDAPMessage *res)
+{
+	struct sieve_ldap_script_request *srequest =
+		(struct sieve_ldap_script_request *)request;
+
+	if (res != NULL && ldap_msgtype(res) != LDAP_RES_SEARCH_RESULT) {
+		if (srequest->lstorage != NULL)
+			sieve_ldap_script_request_entry(conn, srequest, res);
+		return;
+	}
+
+	/* final reply */
+	if (res == NULL) {
+		srequest->error = TRUE;
+	} else if (srequest->result_script != NULL &&
+		   srequest->result_modattr != NULL &&
+		   *srequest->result_modattr != '\0') {
+		sieve_ldap_db_scripts_add(conn, srequest->result_script);
+	}
+
+	if (srequest->lstorage == NULL) {
+		sieve_ldap_script_request_free(srequest);
+		return;
+	}
+	srequest->finished = TRUE;
+	if (conn->ioloop != NULL)
+		io_loop_stop(conn->ioloop);
+}
+
+static struct sieve_ldap_script_request *
+sieve_ldap_script_request_create(struct ldap_connection *conn,
+	struct sieve_ldap_storage *lstorage, const char *pool_name,
+	bool fetch_script)
+{
+	const struct sieve_ldap_storage_settings *set = &lstorage->set;
+	struct sieve_ldap_script_request *request;
+	char **attr_names;
+	pool_t pool;
+
+	pool = pool_alloconly_create(pool_name, 1024);
+	request = p_new(pool, struct sieve_ldap_script_request, 1);
+	request->request.pool = pool;
+	request->request.callback = sieve_ldap_script_request_callback;
+	request->conn = conn;
+	request->lstorage = lstorage;
+
+	attr_names = p_new(pool, char *, 3);
+	attr_names[0] = p_strdup(pool, set->sieve_ldap_mod_attr);
+	request->mod_attr = attr_names[0];
+	if (fetch_script) {
+		attr_names[1] = p_strdup(pool, set->sieve_ldap_script_attr);
+		request->script_attr = attr_names[1];
+	}
+	request->request.attributes = attr_names;
+	return request;
+}
+
+struct sieve_ldap_script_request *
+sieve_ldap_db_lookup_script(struct ldap_connection *conn,
+	struct sieve_ldap_storage *lstorage, const char *name,
+	bool fetch_script)
 {
-	struct sieve_ldap_storage *lstorage = conn->lstorage;
 	struct sieve_storage *storage = &lstorage->storage;
 	const struct sieve_ldap_storage_settings *set = &lstorage->set;
-	struct sieve_ldap_script_lookup_request *request;
+	struct sieve_ldap_script_request *request;
 	const struct var_expand_table *vars;
-	char **attr_names;
+	pool_t pool;
 	string_t *str;
 
-	pool_t pool = pool_alloconly_create
-		("sieve_ldap_script_lookup_request", 512);
-	request = p_new(pool, struct sieve_ldap_script_lookup_request, 1);
-	request->request.pool = pool;
+	request = sieve_ldap_script_request_create(conn, lstorage,
+		"sieve_ldap_script_lookup_request", fetch_script);
+	pool = request->request.pool;
 
-	vars = db_ldap_get_var_expand_table(conn, name);
+	vars = db_ldap_get_var_expand_table(lstorage, name);
 
 	str = t_str_new(512);
 	var_expand(str, set->base, vars);
 	request->request.base = p_strdup(pool, str_c(str));
 
-	attr_names = p_new(pool, char *, 3);
-	attr_names[0] = p_strdup(pool, set->sieve_ldap_mod_attr);
-
 	str_truncate(str, 0);
 	var_expand(str, set->sieve_ldap_filter, vars);
-	request->request.scope = lstorage->set.ldap_scope;
+	request->request.scope = set->ldap_scope;
 	request->request.filter = p_strdup(pool, str_c(str));
-	request->request.attributes = attr_names;
 
 	sieve_storage_sys_debug(storage,
 			       "base=%s scope=%s filter=%s fields=%s",
-			       request->request.base, lstorage->set.scope,
-			       request->request.filter, attr_names == NULL ? "(all)" :
-			       t_strarray_join((const char **)attr_names, ","));
+			       request->request.base, set->scope,
+			       request->request.filter,
+			       t_strarray_join((const char **)
+					       request->request.attributes, ","));
 
-	request->request.callback = sieve_ldap_lookup_script_callback;
 	db_ldap_request(conn, &request->request);
-	db_ldap_wait(conn);
-
-	*dn_r = t_strdup(request->result_dn);
-	*modattr_r = t_strdup(request->result_modattr);
-	pool_unref(&request->request.pool);
-	return (*dn_r == NULL ? 0 : 1);
+	return request;
 }
 
-struct sieve_ldap_script_read_request {
-	struct ldap_request request;
+int sieve_ldap_db_lookup_script_finish(
+	struct sieve_ldap_script_request **_request,
+	const char **dn_r, const char **modattr_r)
+{
+	struct sieve_ldap_script_request *request = *_request;
+	int ret;
 
-	unsigned int entries;
-	struct istream *result;
-};
+	*_request = NULL;
+	*dn_r = *modattr_r = NULL;
 
-static void
-sieve_ldap_read_script_callback(struct ldap_connection *conn,
-			  struct ldap_request *request, LDAPMessage *res)
-{
-	struct sieve_storage *storage = &conn->lstorage->storage;
-	struct sieve_ldap_script_read_request *srequest =
-		(struct sieve_ldap_script_read_request *)request;
+	db_ldap_wait(request->conn, &request->finished);
+	if (!request->finished) {
+		/* the callback frees it once the request is aborted */
+		request->lstorage = NULL;
+		return -1;
+	}
 
-	if (res == NULL) {
-		io_loop_stop(conn->ioloop);
-		return;
+	if (request->error) {
+		ret = -1;
+	} else {
+		*dn_r = t_strdup(request->result_dn);
+		*modattr_r = t_strdup(request->result_modattr);
+		ret = (*dn_r == NULL ? 0 : 1);
 	}
+	sieve_ldap_script_request_free(request);
+	return ret;
+}
 
-	if (ldap_msgtype(res) != LDAP_RES_SEARCH_RESULT) {
+void sieve_ldap_db_lookup_script_abort(
+	struct sieve_ldap_script_request **_request)
+{
+	struct sieve_ldap_script_request *request = *_request;
 
-		if (srequest->result == NULL) {
-			(void)sieve_ldap_db_get_script(conn, res, &srequest->result);
-		} else {
-			sieve_storage_sys_error(storage, "db: "
-				"Search returned more than one entry for Sieve script DN");
-			if (srequest->result != NULL)
-				i_stream_unref(&srequest->result);
-		}
+	*_request = NULL;
 
-	} else {
-		io_loop_stop(conn->ioloop);
+	if (request->finished) {
+		sieve_ldap_script_request_free(request);
 		return;
 	}
+	/* the callback frees it once the reply arrives */
+	request->lstorage = NULL;
 }
 
 int sieve_ldap_db_read_script(struct ldap_connection *conn,
-	const char *dn, struct istream **script_r)
+	struct sieve_ldap_storage *lstorage, const char *dn,
+	const char *modattr, struct istream **script_r)
 {
-	struct sieve_ldap_storage *lstorage = conn->lstorage;
 	struct sieve_storage *storage = &lstorage->storage;
 	const struct sieve_ldap_storage_settings *set = &lstorage->set;
-	struct sieve_ldap_script_read_request *request;
-	char **attr_names;
+	struct sieve_ldap_script_request *request;
+	struct sieve_ldap_db_script *script;
+	int ret;
 
-	pool_t pool = pool_alloconly_create
-		("sieve_ldap_script_read_request", 512);
-	request = p_new(pool, struct sieve_ldap_script_read_request, 1);
-	request->request.pool = pool;
-	request->request.base = p_strdup(pool, dn);
+	*script_r = NULL;
 
-	attr_names = p_new(pool, char *, 3);
-	attr_names[0] = p_strdup(pool, set->sieve_ldap_script_attr);
+	script = sieve_ldap_db_scripts_lookup(conn, dn,
+		set->sieve_ldap_script_attr, modattr);
+	if (script != NULL) {
+		sieve_storage_sys_debug(storage, "db: "
+			"Using cached script for %s=%s",
+			set->sieve_ldap_mod_attr, modattr);
+		*script_r = sieve_ldap_db_script_open_stream(script);
+		return 1;
+	}
 
+	request = sieve_ldap_script_request_create(conn, lstorage,
+		"sieve_ldap_script_read_request", TRUE);
+	request->request.base = p_strdup(request->request.pool, dn);
 	request->request.scope = LDAP_SCOPE_BASE;
 	request->request.filter = "(objectClass=*)";
-	request->request.attributes = attr_names;
 
 	sieve_storage_sys_debug(storage,
 			       "base=%s scope=base filter=%s fields=%s",
 			       request->request.base, request->request.filter,
-			       attr_names == NULL ? "(all)" :
-			       t_strarray_join((const char **)attr_names, ","));
+			       t_strarray_join((const char **)
+					       request->request.attributes, ","));
 
-	request->request.callback = sieve_ldap_read_script_callback;
 	db_ldap_request(conn, &request->request);
-	db_ldap_wait(conn);
+	db_ldap_wait(conn, &request->finished);
+	if (!request->finished) {
+		request->lstorage = NULL;
+		return -1;
+	}
 
-	*script_r = request->result;
-	pool_unref(&request->request.pool);
-	return (*script_r == NULL ? 0 : 1);
+	if (request->error)
+		ret = -1;
+	else if (request->result_script == NULL)
+		ret = 0;
+	else {
+		*script_r = sieve_ldap_db_script_open_stream
+			(request->result_script);
+		ret = 1;
+	}
+	sieve_ldap_script_request_free(request);
+	return ret;
 }
 
 
@@ -15,6 +15,12 @@
 /* If server disconnects us, don't reconnect if no requests have been sent
    for this many seconds. */
 #define DB_LDAP_IDLE_RECONNECT_SECS 60
+/* Maximum number of bound connections kept open for reuse once no storage
+   uses them anymore. These are closed after DB_LDAP_IDLE_RECONNECT_SECS,
+   since the server would likely drop them by then anyway. */
+#define DB_LDAP_MAX_IDLE_CONNECTIONS 4
+/* Maximum number of scripts cached for each connection. */
+#define DB_LDAP_MAX_CACHED_SCRIPTS 64
 
 #include <ldap.h>
 
@@ -49,6 +55,9 @@
 
 struct ldap_connection;
 struct ldap_request;
+struct sieve_ldap_script_request;
+struct sieve_ldap_storage_settings;
+struct sieve_ldap_db_script;
 
 typedef void db_search_callback_t(struct ldap_connection *conn,
 				  struct ldap_request *request,
@@ -85,10 +94,14 @@ enum ldap_connection_state {
 struct ldap_connection {
 	struct ldap_connection *next;
 
+	/* Connections are shared by all storages with the same server and
+	   bind settings; lstorage is one of those used for logging. It is
+	   NULL while the connection is idle. */
 	struct sieve_ldap_storage *lstorage;
+	ARRAY(struct sieve_ldap_storage *) storages;
 
 	pool_t pool;
-	int refcount;
+	struct sieve_ldap_storage_settings *set;
 
 	LDAP *ld;
 	enum ldap_connection_state conn_state;
@@ -97,6 +110,8 @@ struct ldap_connection {
 	int fd;
 	struct io *io;
 	struct timeout *to;
+	/* Closes the connection when it stays idle for too long */
+	struct timeout *to_idle;
 	struct ioloop *ioloop;
 
 	/* Request queue contains sent requests at tail (msgid != -1) and
@@ -108,6 +123,12 @@ struct ldap_connection {
 
 	/* Timestamp when we last received a reply */
 	time_t last_reply_stamp;
+
+	/* Scripts read through this connection, indexed by DN. The list is
+	   ordered by last use. */
+	HASH_TABLE(char *, struct sieve_ldap_db_script *) scripts;
+	struct sieve_ldap_db_script *scripts_head, *scripts_tail;
+	unsigned int scripts_count;
 };
 
 
@@ -130,11 +151,30 @@ int sieve_ldap_db_connect(struct ldap_connection *conn);
 
 struct ldap_connection *
 sieve_ldap_db_init(struct sieve_ldap_storage *lstorage);
-void sieve_ldap_db_unref(struct ldap_connection **conn);
-
-int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
-	const char *name, const char **dn_r, const char **modattr_r);
+void sieve_ldap_db_unref(struct ldap_connection **conn,
+	struct sieve_ldap_storage *lstorage);
+void sieve_ldap_db_deinit(void);
+
+/* Sends the lookup for the named script without waiting for the reply, so
+   that lookups for several scripts can be in progress at once. When
+   fetch_script is TRUE, the script itself is retrieved along with the entry
+   and kept in the connection's script cache. */
+struct sieve_ldap_script_request *
+sieve_ldap_db_lookup_script(struct ldap_connection *conn,
+	struct sieve_ldap_storage *lstorage, const char *name,
+	bool fetch_script);
+/* Waits for the lookup to finish. Returns 1 if found, 0 if not and -1 on
+   error. */
+int sieve_ldap_db_lookup_script_finish(
+	struct sieve_ldap_script_request **_request,
+	const char **dn_r, const char **modattr_r);
+void sieve_ldap_db_lookup_script_abort(
+	struct sieve_ldap_script_request **_request);
+
+/* Reads the script at the given DN. The cached script is used when its
+   modified attribute still matches modattr. */
 int sieve_ldap_db_read_script(struct ldap_connection *conn,
-	const char *dn, struct istream **script_r);
+	struct sieve_ldap_storage *lstorage, const char *dn,
+	const char *modattr, struct istream **script_r);
 
 #endif
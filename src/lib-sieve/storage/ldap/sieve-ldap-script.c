@@ -51,9 +51,25 @@ struct sieve_ldap_script *sieve_ldap_script_init
 	lscript = sieve_ldap_script_alloc();
 	sieve_script_init(&lscript->script,
 		storage, &sieve_ldap_script, location, name);
+
+	/* Send the lookup right away; it is only waited for once the script
+	   is opened, so lookups for scripts created before that proceed in
+	   parallel. Without a binary directory, the script is compiled each
+	   time it is opened, so it is retrieved along with the lookup. */
+	lscript->lookup = sieve_ldap_db_lookup_script(lstorage->conn,
+		lstorage, name, ( storage->bin_dir == NULL ));
 	return lscript;
 }
 
+static void sieve_ldap_script_destroy(struct sieve_script *script)
+{
+	struct sieve_ldap_script *lscript =
+		(struct sieve_ldap_script *)script;
+
+	if ( lscript->lookup != NULL )
+		sieve_ldap_db_lookup_script_abort(&lscript->lookup);
+}
+
 static int sieve_ldap_script_open
 (struct sieve_script *script, enum sieve_error *error_r)
 {
@@ -62,17 +78,25 @@ static int sieve_ldap_script_open
 	struct sieve_storage *storage = script->storage;
 	struct sieve_ldap_storage *lstorage =
 		(struct sieve_ldap_storage *)storage;
+	const char *dn, *modattr;
 	int ret;
 
 	if ( sieve_ldap_db_connect(lstorage->conn) < 0 ) {
+		if ( lscript->lookup != NULL )
+			sieve_ldap_db_lookup_script_abort(&lscript->lookup);
 		sieve_storage_set_critical(storage,
 			"Failed to connect to LDAP database");
 		*error_r = storage->error_code;
 		return -1;
 	}
 
-	if ( (ret=sieve_ldap_db_lookup_script(lstorage->conn,
-		script->name, &lscript->dn, &lscript->modattr)) <= 0 ) {
+	if ( lscript->lookup == NULL ) {
+		lscript->lookup = sieve_ldap_db_lookup_script(lstorage->conn,
+			lstorage, script->name, ( storage->bin_dir == NULL ));
+	}
+
+	if ( (ret=sieve_ldap_db_lookup_script_finish
+		(&lscript->lookup, &dn, &modattr)) <= 0 ) {
 		if ( ret == 0 ) {
 			sieve_script_sys_debug(script,
 				"Script entry not found");
@@ -86,6 +110,8 @@ static int sieve_ldap_script_open
 		return -1;
 	}
 
+	lscript->dn = p_strdup(script->pool, dn);
+	lscript->modattr = p_strdup(script->pool, modattr);
 	return 0;
 }
 
@@ -102,8 +128,8 @@ static int sieve_ldap_script_get_stream
 
 	i_assert(lscript->dn != NULL);
 
-	if ( (ret=sieve_ldap_db_read_script(
-		lstorage->conn, lscript->dn, stream_r)) <= 0 ) {
+	if ( (ret=sieve_ldap_db_read_script(lstorage->conn, lstorage,
+		lscript->dn, lscript->modattr, stream_r)) <= 0 ) {
 		if ( ret == 0 ) {
 			sieve_script_sys_debug(script,
 				"Script attribute not found");
@@ -293,6 +319,8 @@ static bool sieve_ldap_script_equals
 const struct sieve_script sieve_ldap_script = {
 	.driver_name = SIEVE_LDAP_STORAGE_DRIVER_NAME,
 	.v = {
+		.destroy = sieve_ldap_script_destroy,
+
 		.open = sieve_ldap_script_open,
 
 		.get_stream = sieve_ldap_script_get_stream,
@@ -99,7 +99,7 @@ static void sieve_ldap_storage_destroy
 		(struct sieve_ldap_storage *)storage;
 
 	if ( lstorage->conn != NULL )
-		sieve_ldap_db_unref(&lstorage->conn);
+		sieve_ldap_db_unref(&lstorage->conn, lstorage);
 }
 
 /*
@@ -221,7 +221,7 @@ void sieve_storage_ldap_plugin_init(void)
 
 void sieve_storage_ldap_plugin_deinit(void)
 {
-	/* Nothing */
+	sieve_ldap_db_deinit();
 }
 #endif
 
@@ -86,6 +86,8 @@ int sieve_ldap_storage_active_script_get_name
 struct sieve_ldap_script {
 	struct sieve_script script;
 
+	struct sieve_ldap_script_request *lookup;
+
 	const char *dn;
 	const char *modattr;
 
@@ -3,6 +3,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "hash.h"
 #include "str.h"
 #include "mempool.h"
 #include "llist.h"
@@ -34,9 +35,7 @@ static struct mail_vfuncs edit_mail_vfuncs;
 
 struct edit_mail_istream;
 struct istream *edit_mail_istream_create(struct edit_mail *edmail);
-
-static struct _header_index *edit_mail_header_clone
-	(struct edit_mail *edmail, struct _header *header);
+static uoff_t edit_mail_istream_get_size(struct istream *input);
 
 /*
  * Raw storage
@@ -92,8 +91,14 @@ struct _header_field {
 struct _header_field_index {
 	struct _header_field_index *prev, *next;
 
+	/* Neighbouring fields with the same header name */
+	struct _header_field_index *header_prev, *header_next;
+
 	struct _header_field *field;
 	struct _header_index *header;
+
+	/* Appended before the original header was parsed */
+	unsigned int appended:1;
 };
 
 struct _header {
@@ -188,6 +193,7 @@ struct edit_mail {
 
 	struct _header_index *headers_head, *headers_tail;
 	struct _header_field_index *header_fields_head, *header_fields_tail;
+	HASH_TABLE(const char *, struct _header_index *) header_index;
 	struct message_size hdr_size, body_size;
 
 	struct message_size wrapped_hdr_size, wrapped_body_size;
@@ -200,6 +206,8 @@ struct edit_mail {
 	unsigned int crlf:1;
 	unsigned int eoh_crlf:1;
 	unsigned int headers_parsed:1;
+	/* The header fields above belong to the parent snapshot */
+	unsigned int headers_shared:1;
 	unsigned int destroying_stream:1;
 };
 
@@ -254,6 +262,9 @@ struct edit_mail *edit_mail_wrap(struct mail *mail)
 	if ( size_diff == 0 || size_diff <= (hdr_size.lines + body_size.lines)/2 )
 		edmail->crlf = edmail->eoh_crlf = TRUE;
 
+	hash_table_create(&edmail->header_index, default_pool, 0,
+		strcase_hash, strcasecmp);
+
 	array_create(&edmail->mail.module_contexts, pool, sizeof(void *), 5);
 
 	edmail->mail.v = edit_mail_vfuncs;
@@ -268,7 +279,6 @@ struct edit_mail *edit_mail_wrap(struct mail *mail)
 
 struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail)
 {
-	struct _header_field_index *field_idx, *field_idx_new;
 	struct edit_mail *edmail_new;
 	pool_t pool;
 
@@ -306,35 +316,21 @@ struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail)
 	edmail_new->stream = NULL;
 
 	if ( edmail->modified ) {
-		field_idx = edmail->header_fields_head;
-		while ( field_idx != NULL ) {
-			struct _header_field_index *next = field_idx->next;
-
-			field_idx_new = i_new(struct _header_field_index, 1);
-
-			field_idx_new->header =
-				edit_mail_header_clone(edmail_new, field_idx->header->header);
-
-			field_idx_new->field = field_idx->field;
-			_header_field_ref(field_idx_new->field);
-
-			DLLIST2_APPEND
-				(&edmail_new->header_fields_head, &edmail_new->header_fields_tail,
-					field_idx_new);
-
-			field_idx_new->header->count++;
-			if ( field_idx->header->first == field_idx )
-				field_idx_new->header->first = field_idx_new;
-			if ( field_idx->header->last == field_idx )
-				field_idx_new->header->last = field_idx_new;
-
-			if ( field_idx == edmail->header_fields_appended )
-				edmail_new->header_fields_appended = field_idx_new;
-
-			field_idx = next;
-		}
+		/* The parent is not modified anymore once the snapshot is taken, so
+		   its header fields are shared until the snapshot itself is modified
+		   (copy-on-write; see edit_mail_headers_own()). */
+		edmail_new->headers_head = edmail->headers_head;
+		edmail_new->headers_tail = edmail->headers_tail;
+		edmail_new->header_fields_head = edmail->header_fields_head;
+		edmail_new->header_fields_tail = edmail->header_fields_tail;
+		edmail_new->header_fields_appended = edmail->header_fields_appended;
+		edmail_new->header_index = edmail->header_index;
+		edmail_new->headers_shared = TRUE;
 
 		edmail_new->modified = TRUE;
+	} else {
+		hash_table_create(&edmail_new->header_index, default_pool, 0,
+			strcase_hash, strcasecmp);
 	}
 
 	edmail_new->headers_parsed = edmail->headers_parsed;
@@ -345,36 +341,54 @@ struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail)
 	return edmail_new;
 }
 
-void edit_mail_reset(struct edit_mail *edmail)
+static void edit_mail_headers_clear(struct edit_mail *edmail)
 {
 	struct _header_index *header_idx;
 	struct _header_field_index *field_idx;
 
-	if ( edmail->stream != NULL ) {
-		i_stream_unref(&edmail->stream);
-		edmail->stream = NULL;
-	}
+	if ( edmail->headers_shared ) {
+		/* Owned by the parent */
+		hash_table_create(&edmail->header_index, default_pool, 0,
+			strcase_hash, strcasecmp);
+		edmail->headers_shared = FALSE;
+	} else {
+		hash_table_clear(edmail->header_index, FALSE);
 
-	field_idx = edmail->header_fields_head;
-	while ( field_idx != NULL ) {
-		struct _header_field_index *next = field_idx->next;
+		field_idx = edmail->header_fields_head;
+		while ( field_idx != NULL ) {
+			struct _header_field_index *next = field_idx->next;
 
-		_header_field_unref(field_idx->field);
-		i_free(field_idx);
+			_header_field_unref(field_idx->field);
+			i_free(field_idx);
 
-		field_idx = next;
-	}
+			field_idx = next;
+		}
 
-	header_idx = edmail->headers_head;
-	while ( header_idx != NULL ) {
-		struct _header_index *next = header_idx->next;
+		header_idx = edmail->headers_head;
+		while ( header_idx != NULL ) {
+			struct _header_index *next = header_idx->next;
 
-		_header_unref(header_idx->header);
-		i_free(header_idx);
+			_header_unref(header_idx->header);
+			i_free(header_idx);
 
-		header_idx = next;
+			header_idx = next;
+		}
 	}
 
+	edmail->headers_head = edmail->headers_tail = NULL;
+	edmail->header_fields_head = edmail->header_fields_tail = NULL;
+	edmail->header_fields_appended = NULL;
+}
+
+void edit_mail_reset(struct edit_mail *edmail)
+{
+	if ( edmail->stream != NULL ) {
+		i_stream_unref(&edmail->stream);
+		edmail->stream = NULL;
+	}
+
+	edit_mail_headers_clear(edmail);
+
 	edmail->modified = FALSE;
 }
 
@@ -387,6 +401,7 @@ void edit_mail_unwrap(struct edit_mail **edmail)
 		return;
 
 	edit_mail_reset(*edmail);
+	hash_table_destroy(&(*edmail)->header_index);
 
 	if ( (*edmail)->wrapped_stream != NULL ) {
 		i_stream_unref(&(*edmail)->wrapped_stream);
@@ -421,13 +436,205 @@ struct mail *edit_mail_get_mail(struct edit_mail *edmail)
  * Editing
  */
 
+static void edit_mail_headers_own(struct edit_mail *edmail);
+
 static inline void edit_mail_modify(struct edit_mail *edmail)
 {
+	edit_mail_headers_own(edmail);
+
+	/* The stream holds the message as it was */
+	if ( edmail->stream != NULL )
+		i_stream_unref(&edmail->stream);
+
 	edmail->mail.mail.seq++;
 	edmail->modified = TRUE;
 	edmail->snapshot_modified = TRUE;
 }
 
+/* Header index */
+
+static struct _header_index *edit_mail_header_find
+(struct edit_mail *edmail, const char *field_name)
+{
+	if ( field_name == NULL )
+		return NULL;
+	return hash_table_lookup(edmail->header_index, field_name);
+}
+
+static struct _header_index *edit_mail_header_index_add
+(struct edit_mail *edmail, struct _header *header)
+{
+	struct _header_index *header_idx;
+
+	header_idx = i_new(struct _header_index, 1);
+	header_idx->header = header;
+
+	DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail, header_idx);
+	hash_table_insert(edmail->header_index, header->name, header_idx);
+
+	return header_idx;
+}
+
+static void edit_mail_header_index_remove
+(struct edit_mail *edmail, struct _header_index *header_idx)
+{
+	i_assert( header_idx->count == 0 );
+
+	hash_table_remove(edmail->header_index, header_idx->header->name);
+	DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
+
+	_header_unref(header_idx->header);
+	i_free(header_idx);
+}
+
+static struct _header_index *edit_mail_header_create
+(struct edit_mail *edmail, const char *field_name)
+{
+	struct _header_index *header_idx;
+
+	if ( (header_idx=edit_mail_header_find(edmail, field_name)) == NULL ) {
+		header_idx = edit_mail_header_index_add
+			(edmail, _header_create(field_name));
+	}
+
+	return header_idx;
+}
+
+static struct _header_index *edit_mail_header_clone
+(struct edit_mail *edmail, struct _header *header)
+{
+	struct _header_index *header_idx;
+
+	if ( (header_idx=edit_mail_header_find(edmail, header->name)) != NULL ) {
+		i_assert( header_idx->header == header );
+		return header_idx;
+	}
+
+	_header_ref(header);
+	return edit_mail_header_index_add(edmail, header);
+}
+
+/* The fields of each header are linked in the order in which they appear in
+   the message, so that these can be found without scanning all fields. */
+
+static void _header_field_index_append
+(struct _header_field_index *field_idx)
+{
+	struct _header_index *header_idx = field_idx->header;
+
+	field_idx->header_next = NULL;
+	field_idx->header_prev = header_idx->last;
+	if ( header_idx->last != NULL )
+		header_idx->last->header_next = field_idx;
+	else
+		header_idx->first = field_idx;
+	header_idx->last = field_idx;
+	header_idx->count++;
+}
+
+static void _header_field_index_prepend
+(struct _header_field_index *field_idx)
+{
+	struct _header_index *header_idx = field_idx->header;
+
+	field_idx->header_prev = NULL;
+	field_idx->header_next = header_idx->first;
+	if ( header_idx->first != NULL )
+		header_idx->first->header_prev = field_idx;
+	else
+		header_idx->last = field_idx;
+	header_idx->first = field_idx;
+	header_idx->count++;
+}
+
+static void _header_field_index_link
+(struct _header_field_index *field_idx)
+{
+	struct _header_index *header_idx = field_idx->header;
+	struct _header_field_index *prev = NULL, *next;
+
+	/* Find the preceding field with the same name */
+	if ( header_idx->count > 0 ) {
+		prev = field_idx->prev;
+		while ( prev != NULL && prev->header != header_idx )
+			prev = prev->prev;
+	}
+
+	next = ( prev == NULL ? header_idx->first : prev->header_next );
+
+	field_idx->header_prev = prev;
+	field_idx->header_next = next;
+	if ( prev != NULL )
+		prev->header_next = field_idx;
+	else
+		header_idx->first = field_idx;
+	if ( next != NULL )
+		next->header_prev = field_idx;
+	else
+		header_idx->last = field_idx;
+	header_idx->count++;
+}
+
+static void _header_field_index_unlink
+(struct _header_field_index *field_idx)
+{
+	struct _header_index *header_idx = field_idx->header;
+
+	i_assert( header_idx->count > 0 );
+
+	if ( field_idx->header_prev != NULL )
+		field_idx->header_prev->header_next = field_idx->header_next;
+	else
+		header_idx->first = field_idx->header_next;
+	if ( field_idx->header_next != NULL )
+		field_idx->header_next->header_prev = field_idx->header_prev;
+	else
+		header_idx->last = field_idx->header_prev;
+
+	field_idx->header_prev = field_idx->header_next = NULL;
+	header_idx->count--;
+}
+
+static void edit_mail_headers_own(struct edit_mail *edmail)
+{
+	struct _header_field_index *field_idx, *field_idx_new, *appended;
+
+	if ( !edmail->headers_shared )
+		return;
+
+	/* Copy the header fields shared with the parent */
+	field_idx = edmail->header_fields_head;
+	appended = edmail->header_fields_appended;
+
+	edmail->headers_head = edmail->headers_tail = NULL;
+	edmail->header_fields_head = edmail->header_fields_tail = NULL;
+	edmail->header_fields_appended = NULL;
+	hash_table_create(&edmail->header_index, default_pool, 0,
+		strcase_hash, strcasecmp);
+	edmail->headers_shared = FALSE;
+
+	while ( field_idx != NULL ) {
+		field_idx_new = i_new(struct _header_field_index, 1);
+
+		field_idx_new->header =
+			edit_mail_header_clone(edmail, field_idx->header->header);
+
+		field_idx_new->field = field_idx->field;
+		_header_field_ref(field_idx_new->field);
+		field_idx_new->appended = field_idx->appended;
+
+		DLLIST2_APPEND
+			(&edmail->header_fields_head, &edmail->header_fields_tail,
+				field_idx_new);
+		_header_field_index_append(field_idx_new);
+
+		if ( field_idx == appended )
+			edmail->header_fields_appended = field_idx_new;
+
+		field_idx = field_idx->next;
+	}
+}
+
 /* Header modification */
 
 static inline char *_header_value_unfold
@@ -469,57 +676,6 @@ static inline char *_header_value_unfold
 	return i_strndup(str_c(out), str_len(out));
 }
 
-static struct _header_index *edit_mail_header_find
-(struct edit_mail *edmail, const char *field_name)
-{
-	struct _header_index *header_idx;
-
-	header_idx = edmail->headers_head;
-	while ( header_idx != NULL ) {
-		if ( strcasecmp(header_idx->header->name, field_name) == 0 )
-			return header_idx;
-
-		header_idx = header_idx->next;
-	}
-
-	return NULL;
-}
-
-static struct _header_index *edit_mail_header_create
-(struct edit_mail *edmail, const char *field_name)
-{
-	struct _header_index *header_idx;
-
-	if ( (header_idx=edit_mail_header_find(edmail, field_name)) == NULL ) {
-		header_idx = i_new(struct _header_index, 1);
-		header_idx->header = _header_create(field_name);
-
-		DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail, header_idx);
-	}
-
-	return header_idx;
-}
-
-static struct _header_index *edit_mail_header_clone
-(struct edit_mail *edmail, struct _header *header)
-{
-	struct _header_index *header_idx;
-
-	header_idx = edmail->headers_head;
-	while ( header_idx != NULL ) {
-		if ( header_idx->header == header )
-			return header_idx;
-
-		header_idx = header_idx->next;
-	}
-
-	header_idx = i_new(struct _header_index, 1);
-	header_idx->header = header;
-	_header_ref(header);
-	DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail, header_idx);
-
-	return header_idx;
-}
 
 static struct _header_field_index *
 edit_mail_header_field_create
@@ -578,32 +734,9 @@ static void edit_mail_header_field_delete
 	edmail->hdr_size.virtual_size -= field->virtual_size;
 	edmail->hdr_size.lines -= field->lines;
 
-	header_idx->count--;
-	if ( update_index ) {
-		if ( header_idx->count == 0 ) {
-			DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
-			_header_unref(header_idx->header);
-			i_free(header_idx);
-		} else if ( header_idx->first == field_idx ) {
-			struct _header_field_index *hfield = header_idx->first->next;
-
-			while ( hfield != NULL && hfield->header != header_idx ) {
-				hfield = hfield->next;
-			}
-
-			i_assert( hfield != NULL );
-			header_idx->first = hfield;
-		} else if ( header_idx->last == field_idx ) {
-			struct _header_field_index *hfield = header_idx->last->prev;
-
-			while ( hfield != NULL && hfield->header != header_idx ) {
-				hfield = hfield->prev;
-			}
-
-			i_assert( hfield != NULL );
-			header_idx->last = hfield;
-		}
-	}
+	_header_field_index_unlink(field_idx);
+	if ( update_index && header_idx->count == 0 )
+		edit_mail_header_index_remove(edmail, header_idx);
 
 	DLLIST2_REMOVE
 		(&edmail->header_fields_head, &edmail->header_fields_tail, field_idx);
@@ -653,58 +786,23 @@ edit_mail_header_field_replace
 		edmail->header_fields_tail = field_idx_new;
 
 	if ( header_idx_new == header_idx ) {
-		if (header_idx->first == field_idx)
+		/* Take its place among the fields with the same name */
+		field_idx_new->header_prev = field_idx->header_prev;
+		field_idx_new->header_next = field_idx->header_next;
+		if ( field_idx->header_prev != NULL )
+			field_idx->header_prev->header_next = field_idx_new;
+		else
 			header_idx->first = field_idx_new;
-		if (header_idx->last == field_idx)
+		if ( field_idx->header_next != NULL )
+			field_idx->header_next->header_prev = field_idx_new;
+		else
 			header_idx->last = field_idx_new;
 	} else {
-		header_idx->count--;
-		header_idx_new->count++;
-
-		if ( update_index ) {
-			if ( header_idx->count == 0 ) {
-				DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
-				_header_unref(header_idx->header);
-				i_free(header_idx);
-			} else if ( header_idx->first == field_idx ) {
-				struct _header_field_index *hfield = header_idx->first->next;
-
-				while ( hfield != NULL && hfield->header != header_idx ) {
-					hfield = hfield->next;
-				}
-
-				i_assert( hfield != NULL );
-				header_idx->first = hfield;
-			} else if ( header_idx->last == field_idx ) {
-				struct _header_field_index *hfield = header_idx->last->prev;
+		_header_field_index_unlink(field_idx);
+		_header_field_index_link(field_idx_new);
 
-				while ( hfield != NULL && hfield->header != header_idx ) {
-					hfield = hfield->prev;
-				}
-
-				i_assert( hfield != NULL );
-				header_idx->last = hfield;
-			}
-			if ( header_idx_new->count > 0 ) {
-				struct _header_field_index *hfield;
-
-				hfield = edmail->header_fields_head;
-				while ( hfield != NULL && hfield->header != header_idx_new ) {
-					hfield = hfield->next;
-				}
-
-				i_assert( hfield != NULL );
-				header_idx_new->first = hfield;
-
-				hfield = edmail->header_fields_tail;
-				while ( hfield != NULL && hfield->header != header_idx_new ) {
-					hfield = hfield->prev;
-				}
-
-				i_assert( hfield != NULL );
-				header_idx_new->last = hfield;
-			}
-		}
+		if ( update_index && header_idx->count == 0 )
+			edit_mail_header_index_remove(edmail, header_idx);
 	}
 
 	_header_field_unref(field_idx->field);
@@ -725,6 +823,7 @@ static inline char *_header_decode
 	return i_strdup(str_c(str));
 }
 
+
 static int edit_mail_headers_parse
 (struct edit_mail *edmail)
 {
@@ -742,6 +841,8 @@ static int edit_mail_headers_parse
 
 	if ( edmail->headers_parsed ) return 1;
 
+	edit_mail_headers_own(edmail);
+
 	i_stream_seek(edmail->wrapped_stream, 0);
 	hparser = message_parse_header_init
 		(edmail->wrapped_stream, NULL, hparser_flags);
@@ -801,7 +902,6 @@ static int edit_mail_headers_parse
 			field_idx_new = i_new(struct _header_field_index, 1);
 
 			header_idx = edit_mail_header_create(edmail, hdr->name);
-			header_idx->count++;
 			field_idx_new->header = header_idx;
 			field_idx_new->field = field = _header_field_create(header_idx->header);
 
@@ -870,11 +970,15 @@ static int edit_mail_headers_parse
 	}
 
 	/* Rebuild header index */
+	for ( header_idx = edmail->headers_head; header_idx != NULL;
+		header_idx = header_idx->next ) {
+		header_idx->first = header_idx->last = NULL;
+		header_idx->count = 0;
+	}
 	current = edmail->header_fields_head;
 	while ( current != NULL ) {
-		if ( current->header->first == NULL )
-			current->header->first = current;
-		current->header->last = current;
+		current->appended = FALSE;
+		_header_field_index_append(current);
 
 		current = current->next;
 	}
@@ -895,30 +999,26 @@ void edit_mail_header_add
 (struct edit_mail *edmail, const char *field_name, const char *value,
 	bool last)
 {
-	struct _header_index *header_idx;
 	struct _header_field_index *field_idx;
 	struct _header_field *field;
 
 	edit_mail_modify(edmail);
 
 	field_idx = edit_mail_header_field_create(edmail, field_name, value);
-	header_idx = field_idx->header;
 	field = field_idx->field;
 
 	/* Add it to the header field index */
 	if ( last ) {
 		DLLIST2_APPEND
 			(&edmail->header_fields_head, &edmail->header_fields_tail, field_idx);
-
-		header_idx->last = field_idx;
-		if ( header_idx->first == NULL )
-			header_idx->first = field_idx;
+		_header_field_index_append(field_idx);
 
 		if ( !edmail->headers_parsed )  {
 			if ( edmail->header_fields_appended == NULL ) {
 				/* Record beginning of appended headers */
 				edmail->header_fields_appended = field_idx;
 			}
+			field_idx->appended = TRUE;
 
 			edmail->appended_hdr_size.physical_size += field->size;
 			edmail->appended_hdr_size.virtual_size += field->virtual_size;
@@ -927,14 +1027,9 @@ void edit_mail_header_add
 	} else {
 		DLLIST2_PREPEND
 			(&edmail->header_fields_head, &edmail->header_fields_tail, field_idx);
-
-		header_idx->first = field_idx;
-		if ( header_idx->last == NULL )
-			header_idx->last = field_idx;
+		_header_field_index_prepend(field_idx);
 	}
 
-	header_idx->count++;
-
 	edmail->hdr_size.physical_size += field->size;
 	edmail->hdr_size.virtual_size += field->virtual_size;
 	edmail->hdr_size.lines += field->lines;
@@ -952,6 +1047,9 @@ int edit_mail_header_delete
 	if ( edit_mail_headers_parse(edmail) <= 0 )
 		return -1;
 
+	/* The fields are modified below, so they cannot be shared */
+	edit_mail_headers_own(edmail);
+
 	/* Find the header entry */
 	if ( (header_idx=edit_mail_header_find(edmail, field_name)) == NULL ) {
 		/* Not found */
@@ -961,53 +1059,28 @@ int edit_mail_header_delete
 	/* Signal modification */
 	edit_mail_modify(edmail);
 
-	/* Iterate through all header fields and remove those that match */
+	/* Iterate through all header fields with this name and remove those that
+	   match */
 	field_idx = ( index >= 0 ? header_idx->first : header_idx->last );
 	while ( field_idx != NULL ) {
 		struct _header_field_index *next =
-			( index >= 0 ? field_idx->next : field_idx->prev );
+			( index >= 0 ? field_idx->header_next : field_idx->header_prev );
 
-		if ( field_idx->field->header == header_idx->header ) {
-			bool final;
-
-			if ( index >= 0 ) {
-				pos++;
-				final = ( header_idx->last == field_idx );
-			} else {
-				pos--;
-				final = ( header_idx->first == field_idx );
-			}
-
-			if ( index == 0 || index == pos ) {
-				if ( header_idx->first == field_idx ) header_idx->first = NULL;
-				if ( header_idx->last == field_idx ) header_idx->last = NULL;
-				edit_mail_header_field_delete(edmail, field_idx, FALSE);
-				ret++;
-			}
+		pos += ( index >= 0 ? 1 : -1 );
 
-			if ( final || (index != 0 && index == pos) )
-				break;
+		if ( index == 0 || index == pos ) {
+			edit_mail_header_field_delete(edmail, field_idx, FALSE);
+			ret++;
 		}
 
+		if ( index != 0 && index == pos )
+			break;
+
 		field_idx = next;
 	}
 
-	if ( index == 0 || header_idx->count == 0 ) {
-		DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
-		_header_unref(header_idx->header);
-		i_free(header_idx);
-	} else if ( header_idx->first == NULL || header_idx->last == NULL ) {
-		struct _header_field_index *current = edmail->header_fields_head;
-
-		while ( current != NULL ) {
-			if ( current->header == header_idx ) {
-				if ( header_idx->first == NULL )
-					header_idx->first = current;
-				header_idx->last = current;
-			}
-			current = current->next;
-		}
-	}
+	if ( header_idx->count == 0 )
+		edit_mail_header_index_remove(edmail, header_idx);
 
 	return ret;
 }
@@ -1016,8 +1089,8 @@ int edit_mail_header_replace
 (struct edit_mail *edmail, const char *field_name, int index,
 	const char *newname, const char *newvalue)
 {
-	struct _header_index *header_idx, *header_idx_new;
-	struct _header_field_index *field_idx, *field_idx_new;
+	struct _header_index *header_idx;
+	struct _header_field_index *field_idx;
 	int pos = 0;
 	int ret = 0;
 
@@ -1025,6 +1098,9 @@ int edit_mail_header_replace
 	if ( edit_mail_headers_parse(edmail) <= 0 )
 		return -1;
 
+	/* The fields are modified below, so they cannot be shared */
+	edit_mail_headers_own(edmail);
+
 	/* Find the header entry */
 	if ( (header_idx=edit_mail_header_find(edmail, field_name)) == NULL ) {
 		/* Not found */
@@ -1034,71 +1110,30 @@ int edit_mail_header_replace
 	/* Signal modification */
 	edit_mail_modify(edmail);
 
-	/* Iterate through all header fields and replace those that match */
+	/* Iterate through all header fields with this name and replace those that
+	   match */
 	field_idx = ( index >= 0 ? header_idx->first : header_idx->last );
-	field_idx_new = NULL;
 	while ( field_idx != NULL ) {
 		struct _header_field_index *next =
-			( index >= 0 ? field_idx->next : field_idx->prev );
+			( index >= 0 ? field_idx->header_next : field_idx->header_prev );
 
-		if ( field_idx->field->header == header_idx->header ) {
-			bool final;
-
-			if ( index >= 0 ) {
-				pos++;
-				final = ( header_idx->last == field_idx );
-			} else {
-				pos--;
-				final = ( header_idx->first == field_idx );
-			}
+		pos += ( index >= 0 ? 1 : -1 );
 
-			if ( index == 0 || index == pos ) {
-				if ( header_idx->first == field_idx ) header_idx->first = NULL;
-				if ( header_idx->last == field_idx ) header_idx->last = NULL;
-				field_idx_new = edit_mail_header_field_replace
-					(edmail, field_idx, newname, newvalue, FALSE);
-				ret++;
-			}
-
-			if ( final || (index != 0 && index == pos) )
-				break;
+		if ( index == 0 || index == pos ) {
+			(void)edit_mail_header_field_replace
+				(edmail, field_idx, newname, newvalue, FALSE);
+			ret++;
 		}
 
+		if ( index != 0 && index == pos )
+			break;
+
 		field_idx = next;
 	}
 
 	/* Update old header index */
-	if ( header_idx->count == 0 ) {
-		DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
-		_header_unref(header_idx->header);
-		i_free(header_idx);
-	} else if ( header_idx->first == NULL || header_idx->last == NULL ) {
-		struct _header_field_index *current = edmail->header_fields_head;
-
-		while ( current != NULL ) {
-			if ( current->header == header_idx ) {
-				if ( header_idx->first == NULL )
-					header_idx->first = current;
-				header_idx->last = current;
-			}
-			current = current->next;
-		}
-	}
-
-	/* Update new header index */	
-	if ( field_idx_new != NULL ) {
-		struct _header_field_index *current = edmail->header_fields_head;
-	
-		header_idx_new = field_idx_new->header;	
-		while ( current != NULL ) {
-			if ( current->header == header_idx_new ) {
-				if ( header_idx_new->first == NULL )
-					header_idx_new->first = current;
-				header_idx_new->last = current;
-			}
-			current = current->next;
-		}
-	}
+	if ( header_idx->count == 0 )
+		edit_mail_header_index_remove(edmail, header_idx);
 
 	return ret;
 }
@@ -1126,6 +1161,10 @@ int edit_mail_headers_iterate_init
 		return -1;
 	}
 
+	/* The iterator is used for modification, so it cannot point to
+	   shared fields */
+	edit_mail_headers_own(edmail);
+
 	header_idx = edit_mail_header_find(edmail, field_name);
 
 	if ( field_name != NULL && header_idx == NULL ) {
@@ -1136,7 +1175,7 @@ int edit_mail_headers_iterate_init
 	} else {
 		current =
 			( header_idx != NULL ? header_idx->last : edmail->header_fields_tail );
-		if ( current->header == NULL )
+		if ( current != NULL && current->header == NULL )
 			current = current->prev;
 	}
 
@@ -1179,16 +1218,21 @@ void edit_mail_headers_iterate_get
 bool edit_mail_headers_iterate_next
 (struct edit_mail_header_iter *edhiter)
 {
-	if ( edhiter->current == NULL )
+	struct _header_field_index *current = edhiter->current;
+
+	if ( current == NULL )
 		return FALSE;
 
-	do {
-		edhiter->current = 
-			( !edhiter->reverse ? edhiter->current->next : edhiter->current->prev );
-	} while ( edhiter->current != NULL && edhiter->current->header != NULL &&
-		edhiter->header != NULL && edhiter->current->header != edhiter->header );
+	if ( edhiter->header != NULL ) {
+		/* Only fields with the requested name */
+		current = ( !edhiter->reverse ?
+			current->header_next : current->header_prev );
+	} else {
+		current = ( !edhiter->reverse ? current->next : current->prev );
+	}
+	edhiter->current = current;
 
-	return ( edhiter->current != NULL && edhiter->current->header != NULL);
+	return ( current != NULL && current->header != NULL);
 }
 
 bool edit_mail_headers_iterate_remove
@@ -1366,19 +1410,16 @@ static int edit_mail_get_physical_size(struct mail *mail, uoff_t *size_r)
 {
 	struct edit_mail *edmail = (struct edit_mail *)mail;
 
-	*size_r = 0;
-	if ( !edmail->headers_parsed ) {
+	if ( !edmail->headers_parsed && !edmail->modified ) {
 		*size_r = edmail->wrapped_hdr_size.physical_size +
 			edmail->wrapped_body_size.physical_size;
-
-		if ( !edmail->modified )
-			return 0;
-	} else {
-		*size_r = edmail->wrapped_body_size.physical_size +
-			( edmail->eoh_crlf ? 2 : 1 );
+		return 0;
 	}
 
-	*size_r += edmail->hdr_size.physical_size + edmail->body_size.physical_size;
+	/* The stream knows its size without reading the message */
+	if ( edmail->stream == NULL )
+		edmail->stream = edit_mail_istream_create(edmail);
+	*size_r = edit_mail_istream_get_size(edmail->stream);
 	return 0;
 }
 
@@ -1413,36 +1454,12 @@ static int edit_mail_get_first_header
 	}
 
 	/* Get the first occurrence */
-	if ( edmail->header_fields_appended == NULL ) {
-		/* There are no appended headers, so first is found directly */
-		field = header_idx->first->field;
-	} else {
-		struct _header_field_index *field_idx;
-
-		/* Scan prepended headers */
-		field_idx = edmail->header_fields_head;
-		while ( field_idx != NULL ) {
-			if ( field_idx->header == header_idx )
-				break;
-
-			if ( field_idx == edmail->header_fields_appended ) {
-				field_idx = NULL;
-				break;
-			}
-			field_idx = field_idx->next;
-		}
-
-		if ( field_idx == NULL ) {
-			/* Check original message */
-			if ( (ret=edmail->wrapped->v.get_first_header
-				(&edmail->wrapped->mail, field_name, decode_to_utf8, value_r)) != 0 )
-				return ret;
-
-			/* Use first (apparently appended) header */
-			field = header_idx->first->field;
-		} else {
-			field = field_idx->field;
-		}
+	field = header_idx->first->field;
+	if ( header_idx->first->appended ) {
+		/* Not prepended; check original message first */
+		if ( (ret=edmail->wrapped->v.get_first_header
+			(&edmail->wrapped->mail, field_name, decode_to_utf8, value_r)) != 0 )
+			return ret;
 	}
 
 	if ( decode_to_utf8 )
@@ -1492,14 +1509,16 @@ static int edit_mail_get_headers
 	}
 
 	/* Fill result array */
-	p_array_init(&header_values, edmail->mail.pool, 32);
+	p_array_init(&header_values, edmail->mail.pool, header_idx->count + 32);
 	field_idx = header_idx->first;
 	while ( field_idx != NULL ) {
+		struct _header_field *field = field_idx->field;
+		const char *value;
 
 		/* If current field is the first appended one, we need to add original
 		 * headers first.
 		 */
-		if ( field_idx == edmail->header_fields_appended && headers != NULL ) {
+		if ( field_idx->appended && headers != NULL ) {
 			while ( *headers != NULL ) {
 				array_append(&header_values, headers, 1);
 
@@ -1508,22 +1527,14 @@ static int edit_mail_get_headers
 		}
 
 		/* Add modified header to the list */
-		if ( field_idx->field->header == header_idx->header ) {
-			struct _header_field *field = field_idx->field;
-
-			const char *value;
-			if ( decode_to_utf8 )
-				value = field->utf8_value;
-			else
-				value = (const char *)(field->data + field->body_offset);
+		if ( decode_to_utf8 )
+			value = field->utf8_value;
+		else
+			value = (const char *)(field->data + field->body_offset);
 
-			array_append(&header_values, &value, 1);
+		array_append(&header_values, &value, 1);
 
-			if ( field_idx == header_idx->last )
-				break;
-		}
-
-		field_idx = field_idx->next;
+		field_idx = field_idx->header_next;
 	}
 
 	/* Add original headers if necessary */
@@ -1714,16 +1725,37 @@ static struct mail_vfuncs edit_mail_vfuncs = {
  * Edit Mail Stream
  */
 
+/* The edited message is represented as a sequence of segments: blocks of
+   modified header fields held in memory and ranges of the original message
+   that are read directly from the wrapped stream. The segments are composed
+   once when the stream is created, so the size of the edited message is
+   known without reading it. Any modification of the mail discards the
+   stream; existing references keep reading the message as it was.
+ */
+
+struct edit_mail_segment {
+	/* Offset of this segment in the edited message */
+	uoff_t v_offset;
+	uoff_t size;
+
+	/* Header data, or NULL when the segment is read from the wrapped
+	   stream at parent_offset */
+	const unsigned char *data;
+	uoff_t parent_offset;
+};
+
 struct edit_mail_istream {
 	struct istream_private istream;
 	pool_t pool;
 	buffer_t *buffer;
 
-	struct edit_mail *mail;
-
-	struct _header_field_index *cur_header;
+	ARRAY(struct edit_mail_segment) segments;
+	unsigned int cur_segment;
+	uoff_t size;
 
-	unsigned int header_read:1;
+	/* The stream buffer currently points to the local buffer rather than
+	   directly to segment data */
+	unsigned int buffered:1;
 };
 
 static void edit_mail_istream_destroy(struct iostream_private *stream)
@@ -1735,393 +1767,288 @@ static void edit_mail_istream_destroy(struct iostream_private *stream)
 	pool_unref(&edstream->pool);
 }
 
-static ssize_t merge_from_parent
-(struct edit_mail_istream *edstream, uoff_t parent_v_offset,
-	uoff_t parent_end_v_offset, uoff_t copy_v_offset)
+static const struct edit_mail_segment *
+edit_mail_istream_find_segment
+(struct edit_mail_istream *edstream, uoff_t v_offset)
 {
-	struct istream_private *stream = &edstream->istream;
-	uoff_t v_offset = stream->istream.v_offset;
-	buffer_t *buffer = edstream->buffer;
-	const unsigned char *data;
-	size_t pos, cur_pos;
-	ssize_t ret;
+	const struct edit_mail_segment *segs;
+	unsigned int count, idx, left, right;
 
-	if (v_offset < copy_v_offset) {
-		i_assert(stream->skip == 0);
-		if (buffer->used < copy_v_offset - v_offset) {
-			copy_v_offset = v_offset + buffer->used;
-		}
-	}
+	segs = array_get(&edstream->segments, &count);
+	i_assert( count > 0 );
 
-	/* If we are still merging it with our local buffer, we need to update the
-   * parent seek offset to point to where we left of.
-	 */
-	if (v_offset < copy_v_offset) {
-		parent_v_offset += buffer->used - (copy_v_offset - v_offset) + stream->pos;
-		if (parent_v_offset >= parent_end_v_offset)
-			return 0;
-		cur_pos = 0;
-	} else {
-		buffer_set_used_size(buffer, 0);
-		stream->pos -= stream->skip;
-		stream->skip = 0;
-		cur_pos = stream->pos;
+	/* Mostly read sequentially */
+	idx = edstream->cur_segment;
+	if ( v_offset >= segs[idx].v_offset &&
+		v_offset < segs[idx].v_offset + segs[idx].size )
+		return &segs[idx];
+	if ( idx + 1 < count && v_offset >= segs[idx+1].v_offset &&
+		v_offset < segs[idx+1].v_offset + segs[idx+1].size ) {
+		edstream->cur_segment = idx + 1;
+		return &segs[idx+1];
 	}
 
-	i_stream_seek(stream->parent, parent_v_offset);
-
-	/* Read from parent */
-	data = i_stream_get_data(stream->parent, &pos);
-	if (pos > cur_pos)
-		ret = 0;
-	else do {
-		if ((ret = i_stream_read(stream->parent)) == -2)
-			return -2;
-
-		stream->istream.stream_errno = stream->parent->stream_errno;
-		stream->istream.eof = stream->parent->eof;
-		data = i_stream_get_data(stream->parent, &pos);
-		/* check again, in case the parent stream had been seeked
-		   backwards and the previous read() didn't get us far
-		   enough. */
-	} while (pos <= cur_pos && ret > 0);
-
-	/* Don't read beyond parent end offset */
-	if (pos > (parent_end_v_offset - parent_v_offset))
-		pos = parent_end_v_offset - parent_v_offset;
-
-	if (v_offset < copy_v_offset) {
-		/* Merging with our local buffer; copying data from parent */
-		if (pos > 0) {
-			ret = (ssize_t)(pos);
-			buffer_append(buffer, data, pos);
-			stream->buffer = buffer_get_data(buffer, &pos);
-			i_assert(ret > 0);
-			stream->pos = pos;
-		} else {
-			ret = (ret == 0 ? 0 : -1);
-		}
-	} else {
-		/* Just passing buffers from parent; no copying */
-		ret = pos > stream->pos ? (ssize_t)(pos - stream->pos) :
-			(ret == 0 ? 0 : -1);
-		stream->buffer = data;
-		stream->pos = pos;
+	left = 0; right = count;
+	while ( left + 1 < right ) {
+		idx = (left + right) / 2;
+		if ( segs[idx].v_offset <= v_offset )
+			left = idx;
+		else
+			right = idx;
 	}
 
-	i_assert(ret != -1 || stream->istream.eof ||
-		 stream->istream.stream_errno != 0);
-	return ret;
+	edstream->cur_segment = left;
+	return &segs[left];
 }
 
-static ssize_t merge_modified_headers(struct edit_mail_istream *edstream)
+static ssize_t edit_mail_istream_read_segment
+(struct edit_mail_istream *edstream, const struct edit_mail_segment *seg,
+	uoff_t seg_offset, size_t min_size, const unsigned char **data_r,
+	size_t *size_r)
 {
 	struct istream_private *stream = &edstream->istream;
-	struct edit_mail *edmail = edstream->mail;
+	uoff_t seg_left = seg->size - seg_offset;
 	size_t pos;
-	ssize_t ret = 0;
+	ssize_t ret = 1;
 
-	if (edstream->cur_header != NULL) {
-		/* Merge remaining parent buffer, if any */
-		if (edstream->buffer->used == 0 && stream->skip < stream->pos ) {
-			buffer_append(edstream->buffer,
-				stream->buffer + stream->skip, stream->pos - stream->skip);
-		}
+	i_assert( min_size < seg_left );
 
-		/* Add modified headers to buffer */
-		while ( edstream->cur_header != NULL && edstream->buffer->used < 1024 ) {
-			buffer_append(edstream->buffer, edstream->cur_header->field->data,
-				edstream->cur_header->field->size);
+	if ( seg->data != NULL ) {
+		*data_r = seg->data + seg_offset;
+		*size_r = (size_t)seg_left;
+		return 1;
+	}
 
-			edstream->cur_header = edstream->cur_header->next;
+	/* Pass the buffer of the wrapped stream on as is */
+	i_stream_seek(stream->parent,
+		stream->parent_start_offset + seg->parent_offset + seg_offset);
+	*data_r = i_stream_get_data(stream->parent, &pos);
+	while ( pos <= min_size && ret > 0 ) {
+		ret = i_stream_read(stream->parent);
 
-			/* Stop at end of prepended headers if original header is left unparsed */
-			if ( !edmail->headers_parsed
-				&& edstream->cur_header == edmail->header_fields_appended )
-				edstream->cur_header = NULL;
-		}
-
-		if ( edstream->buffer->used > 0 ) {
-			/* Output current buffer */
-			stream->buffer = buffer_get_data(edstream->buffer, &pos);
-			ret = (ssize_t)pos + stream->skip - stream->pos;
-			i_assert( ret >= 0 );
-			stream->pos = pos;
-			stream->skip = 0;
+		stream->istream.stream_errno = stream->parent->stream_errno;
+		*data_r = i_stream_get_data(stream->parent, &pos);
+	}
 
-			if ( ret != 0 )
-				return ret;
+	if ( pos > seg_left )
+		pos = (size_t)seg_left;
+	*size_r = pos;
 
-			if ( edstream->buffer->used >= 1024 )
-				return -2;
-		}
+	if ( pos > min_size )
+		return 1;
+	if ( ret == -1 && stream->istream.stream_errno == 0 ) {
+		/* Wrapped stream is shorter than it claimed to be */
+		stream->istream.eof = TRUE;
 	}
-	return 0;
+	return ret;
 }
 
 static ssize_t edit_mail_istream_read(struct istream_private *stream)
 {
 	struct edit_mail_istream *edstream =
 		(struct edit_mail_istream *)stream;
-	struct edit_mail *edmail = edstream->mail;
-	uoff_t parent_v_offset, parent_end_v_offset, copy_v_offset;
-	uoff_t v_offset = stream->istream.v_offset;
-	uoff_t prep_hdr_size, hdr_size;
-	ssize_t ret = 0;
+	const struct edit_mail_segment *seg;
+	const unsigned char *data;
+	uoff_t v_offset = stream->istream.v_offset, offset;
+	size_t avail = stream->pos - stream->skip, size;
+	ssize_t ret;
 
-	if (stream->istream.eof)
+	offset = v_offset + avail;
+	if ( offset >= edstream->size ) {
+		stream->istream.eof = TRUE;
 		return -1;
-
-	if ( edstream->buffer->used > 0 ) {
-		if ( stream->skip > 0 ) {
-			/* Remove skipped data from buffer */
-			buffer_copy
-				(edstream->buffer, 0, edstream->buffer, stream->skip, (size_t)-1);
-			stream->pos -= stream->skip;
+	}
+	if ( avail >= stream->max_buffer_size )
+		return -2;
+
+	seg = edit_mail_istream_find_segment(edstream, offset);
+
+	if ( v_offset >= seg->v_offset ) {
+		/* Buffered data (if any) lies within this segment: no copying */
+		ret = edit_mail_istream_read_segment(edstream, seg,
+			v_offset - seg->v_offset, avail, &data, &size);
+		if ( ret > 0 || size >= avail ) {
+			/* The wrapped stream may have moved its buffer */
+			stream->buffer = data;
 			stream->skip = 0;
-			buffer_set_used_size(edstream->buffer, stream->pos);
+			stream->pos = size;
+			edstream->buffered = FALSE;
 		}
+		return ( ret > 0 ? (ssize_t)(size - avail) : ret );
 	}
 
-	/* Merge prepended headers */
-	if (edstream->cur_header != NULL) {
-		if ( (ret=merge_modified_headers(edstream)) != 0 )
-			return ret;
-	}
-
-	if ( !edmail->headers_parsed &&	!edstream->header_read &&
-		edmail->header_fields_appended != NULL ) {
-		/* Output headers from original stream */
-
-		/* Size of the prepended header */
-		prep_hdr_size = edmail->hdr_size.physical_size -
-			edmail->appended_hdr_size.physical_size;
-
-		/* Offset of header end or appended header
-		 * Any final CR is dealt with later
-		 */
-		hdr_size = prep_hdr_size + edmail->wrapped_hdr_size.physical_size;
-
-		if ( v_offset < hdr_size - 1 ) {
-			parent_v_offset = stream->parent_start_offset +
-				(v_offset - prep_hdr_size);
-			parent_end_v_offset = stream->parent_start_offset +
-				edmail->wrapped_hdr_size.physical_size - 1;
-			copy_v_offset = prep_hdr_size;
-
-			if ( (ret=merge_from_parent(edstream, parent_v_offset,
-				parent_end_v_offset, copy_v_offset)) < 0 ) {
-				return ret;
-			}
-
-			if ( stream->pos >= hdr_size - 1 - v_offset ) {
-				/* Strip final CR too when it is present */
-				if ( stream->buffer[stream->pos-1] == '\r' ) {
-					stream->pos--;
-					ret--;
-					if (edstream->buffer->used > 0) 
-						buffer_set_used_size(edstream->buffer, edstream->buffer->used-1);
-				}
-
-				i_assert(ret >= 0);
-				edstream->header_read = TRUE;
-				edstream->cur_header = edmail->header_fields_appended;
-			}
-
-			if (ret != 0)
-				return ret;
-		}
-
-		/* Merge Appended headers */
-		if (edstream->cur_header != NULL) {
-			if ( (ret=merge_modified_headers(edstream)) != 0 )
-				return ret;
-		}
+	/* Buffered data continues into the next segment; merge both in the
+	   local buffer */
+	if ( !edstream->buffered ) {
+		buffer_set_used_size(edstream->buffer, 0);
+		buffer_append(edstream->buffer,
+			stream->buffer + stream->skip, avail);
+	} else if ( stream->skip > 0 ) {
+		buffer_copy(edstream->buffer, 0,
+			edstream->buffer, stream->skip, (size_t)-1);
+		buffer_set_used_size(edstream->buffer, avail);
 	}
+	stream->buffer = buffer_get_data(edstream->buffer, NULL);
+	stream->skip = 0;
+	stream->pos = avail;
+	edstream->buffered = TRUE;
 
-	/* Header does not come from original mail at all */
-	if ( edmail->headers_parsed ) {
-		parent_v_offset = stream->parent_start_offset +
-			(v_offset - edmail->hdr_size.physical_size) +
-			edmail->wrapped_hdr_size.physical_size - ( edmail->eoh_crlf ? 2 : 1);
-		copy_v_offset = edmail->hdr_size.physical_size;
-
-	/* Header comes partially from original mail and headers are added between
-	   header and body.
-	 */
-	} else if (edmail->header_fields_appended != NULL) {
-		parent_v_offset = stream->parent_start_offset +
-			(v_offset - edmail->hdr_size.physical_size);
-		copy_v_offset = edmail->hdr_size.physical_size +
-			edmail->wrapped_hdr_size.physical_size;
-
-	/* Header comes partially from original mail, but headers are only prepended.
-	 */
-	} else {
-		parent_v_offset = stream->parent_start_offset
-			+ (v_offset - edmail->hdr_size.physical_size);
-		copy_v_offset = edmail->hdr_size.physical_size;
-	}
+	if ( (ret=edit_mail_istream_read_segment(edstream, seg,
+		offset - seg->v_offset, 0, &data, &size)) <= 0 )
+		return ret;
 
-	return merge_from_parent
-		(edstream, parent_v_offset, (uoff_t)-1, copy_v_offset);
+	if ( size > stream->max_buffer_size - avail )
+		size = stream->max_buffer_size - avail;
+	buffer_append(edstream->buffer, data, size);
+	stream->buffer = buffer_get_data(edstream->buffer, &stream->pos);
+	return (ssize_t)size;
 }
 
-static void
-stream_reset_to(struct edit_mail_istream *edstream, uoff_t v_offset)
+static void edit_mail_istream_seek
+(struct istream_private *stream, uoff_t v_offset, bool mark ATTR_UNUSED)
 {
-	edstream->istream.istream.v_offset = v_offset;
-	edstream->istream.skip = 0;
-	edstream->istream.pos = 0;
-	edstream->istream.buffer = NULL;
-	buffer_set_used_size(edstream->buffer, 0);
-	i_stream_seek(edstream->istream.parent, 0);
+	struct edit_mail_istream *edstream =
+		(struct edit_mail_istream *)stream;
+
+	/* Segments are located again by the next read */
+	stream->istream.v_offset = v_offset;
+	stream->skip = stream->pos = 0;
+	stream->buffer = NULL;
+	edstream->buffered = FALSE;
 }
 
-static void
-stream_skip_to_header
-(struct edit_mail_istream *edstream, struct _header_field_index *header,
-	uoff_t skip)
+static void ATTR_NORETURN
+edit_mail_istream_sync(struct istream_private *stream ATTR_UNUSED)
 {
-	struct _header_field *field = header->field;
-	edstream->cur_header = header;
-
-	/* Partially fill the buffer if in the middle of the header */
-	if ( skip > 0 ) {
-		if ( skip < field->size ) {
-			buffer_append
-				(edstream->buffer, field->data + skip, field->size-skip );
-			skip = 0;
-		} else {
-			skip -= field->size;
-		}
-
-		i_assert( skip == 0 );
-	}
+	i_panic("edit-mail istream sync() not implemented");
 }
 
-static void edit_mail_istream_seek
-(struct istream_private *stream, uoff_t v_offset, bool mark ATTR_UNUSED)
+static int
+edit_mail_istream_stat(struct istream_private *stream, bool exact)
 {
 	struct edit_mail_istream *edstream =
 		(struct edit_mail_istream *)stream;
-	struct _header_field_index *cur_header;
-	struct edit_mail *edmail = edstream->mail;
-	uoff_t offset;
-
-	edstream->header_read = FALSE;
+	const struct stat *st;
 
-	/* The beginning */
-	if ( v_offset == 0 ) {
-		stream_reset_to(edstream, 0);
+	/* Stat the original stream */
+	if (i_stream_stat(stream->parent, exact, &st) < 0)
+		return -1;
 
-		if ( edmail->header_fields_head != edmail->header_fields_appended )
-			edstream->cur_header = edmail->header_fields_head;
-		return;
-	}
+	stream->statbuf = *st;
+	stream->statbuf.st_size = edstream->size;
+	return 0;
+}
 
-	/* Inside (prepended) headers */
-	if ( edmail->headers_parsed ) {
-		offset = edmail->hdr_size.physical_size;
-	} else {
-		offset = edmail->hdr_size.physical_size -
-			edmail->appended_hdr_size.physical_size;
-	}
+static void edit_mail_istream_add_segment
+(struct edit_mail_istream *edstream, const unsigned char *data,
+	uoff_t parent_offset, uoff_t size)
+{
+	struct edit_mail_segment *seg;
 
-	if ( v_offset < offset ) {
-		stream_reset_to(edstream, v_offset);
+	if ( size == 0 )
+		return;
 
-		/* Find the header */
-		cur_header = edmail->header_fields_head;
-		i_assert( cur_header != NULL &&
-			cur_header != edmail->header_fields_appended );
-		offset = cur_header->field->size;
-		while ( v_offset > offset ) {
-			cur_header = cur_header->next;
-			i_assert( cur_header != NULL &&
-				cur_header != edmail->header_fields_appended );
+	seg = array_append_space(&edstream->segments);
+	seg->v_offset = edstream->size;
+	seg->size = size;
+	seg->data = data;
+	seg->parent_offset = parent_offset;
 
-			offset += cur_header->field->size;
-		}
+	edstream->size += size;
+}
 
-		stream_skip_to_header(edstream, cur_header, (offset - v_offset));
+static void edit_mail_istream_add_fields
+(struct edit_mail_istream *edstream, struct _header_field_index *first,
+	struct _header_field_index *end)
+{
+	struct _header_field_index *field_idx;
+	unsigned char *data;
+	size_t size = 0;
+
+	/* Header fields are copied into one block; these are small and the
+	   stream must not depend on the fields of the mail */
+	for ( field_idx = first; field_idx != end; field_idx = field_idx->next )
+		size += field_idx->field->size;
+	if ( size == 0 )
 		return;
-	}
-
-	if ( !edmail->headers_parsed ) {
-		/* Inside original header */
-		offset = edmail->hdr_size.physical_size -
-			edmail->appended_hdr_size.physical_size +
-			edmail->wrapped_hdr_size.physical_size;
-		if ( v_offset < offset ) {
-			stream_reset_to(edstream, v_offset);
-			edstream->cur_header = NULL;
-			return;
-		}
 
-		edstream->header_read = TRUE;
-
-		/* Inside appended header */
-		offset = edmail->hdr_size.physical_size +
-			edmail->wrapped_hdr_size.physical_size;
-		if ( v_offset < offset ) {
-			stream_reset_to(edstream, v_offset);
+	data = p_malloc(edstream->pool, size);
+	size = 0;
+	for ( field_idx = first; field_idx != end; field_idx = field_idx->next ) {
+		memcpy(data + size, field_idx->field->data, field_idx->field->size);
+		size += field_idx->field->size;
+	}
 
-			offset -= edmail->appended_hdr_size.physical_size;
+	edit_mail_istream_add_segment(edstream, data, 0, size);
+}
 
-			cur_header = edmail->header_fields_appended;
-			i_assert( cur_header != NULL );
-			offset += cur_header->field->size;
+static uoff_t edit_mail_istream_eoh_size
+(struct istream *wrapped, uoff_t hdr_size)
+{
+	const unsigned char *data;
+	size_t size;
+	uoff_t start;
 
-			while ( v_offset > offset ) {
-				cur_header = edstream->cur_header->next;
-				i_assert( cur_header != NULL );
+	/* Determine the size of the empty line that ends the original header
+	   from its last few bytes, rather than by parsing the header */
+	if ( hdr_size == 0 )
+		return 0;
+	start = ( hdr_size > 3 ? hdr_size - 3 : 0 );
 
-				offset += cur_header->field->size;
-			}
+	i_stream_seek(wrapped, start);
+	if ( i_stream_read_data(wrapped, &data, &size, hdr_size - start - 1) <= 0 )
+		return 0;
+	size = hdr_size - start;
 
-			stream_skip_to_header(edstream, cur_header, (offset - v_offset));
-			return;
-		}
+	if ( data[size-1] != '\n' )
+		return 0;
+	if ( size >= 2 && data[size-2] == '\r' ) {
+		if ( size == 2 || data[size-3] == '\n' )
+			return 2;
+		return 0;
 	}
-
-	stream_reset_to(edstream, v_offset);
-	edstream->cur_header = NULL;
-}
-
-static void ATTR_NORETURN
-edit_mail_istream_sync(struct istream_private *stream ATTR_UNUSED)
-{
-	i_panic("edit-mail istream sync() not implemented");
+	if ( size == 1 || data[size-2] == '\n' )
+		return 1;
+	return 0;
 }
 
-static int
-edit_mail_istream_stat(struct istream_private *stream, bool exact)
+static void edit_mail_istream_build
+(struct edit_mail_istream *edstream, struct edit_mail *edmail)
 {
-	struct edit_mail_istream *edstream =
-		(struct edit_mail_istream *)stream;
-	struct edit_mail *edmail = edstream->mail;
-	const struct stat *st;
+	struct istream *wrapped = edmail->wrapped_stream;
+	uoff_t hdr_size = edmail->wrapped_hdr_size.physical_size;
+	uoff_t msg_size = hdr_size + edmail->wrapped_body_size.physical_size;
+	uoff_t eoh_offset;
 
-	/* Stat the original stream */
-	if (i_stream_stat(stream->parent, exact, &st) < 0)
-		return -1;
+	if ( edmail->headers_parsed ) {
+		/* All header fields are held by the mail; only the end of header and
+		   the body come from the original message */
+		edit_mail_istream_add_fields
+			(edstream, edmail->header_fields_head, NULL);
+
+		eoh_offset = hdr_size - edit_mail_istream_eoh_size(wrapped, hdr_size);
+		edit_mail_istream_add_segment
+			(edstream, NULL, eoh_offset, msg_size - eoh_offset);
+		return;
+	}
 
-	stream->statbuf = *st;
-	if (st->st_size == -1 || !exact)
-		return 0;
+	/* Prepended header fields */
+	edit_mail_istream_add_fields(edstream,
+		edmail->header_fields_head, edmail->header_fields_appended);
 
-	if ( !edmail->headers_parsed ) {
-		if ( !edmail->modified )
-			return 0;
-	} else {
-		stream->statbuf.st_size = edmail->wrapped_body_size.physical_size +
-			( edmail->eoh_crlf ? 2 : 1 );
+	if ( edmail->header_fields_appended == NULL ) {
+		edit_mail_istream_add_segment(edstream, NULL, 0, msg_size);
+		return;
 	}
 
-	stream->statbuf.st_size += edmail->hdr_size.physical_size +
-		edmail->body_size.physical_size;
-	return 0;
+	/* Original header, followed by the appended header fields before the
+	   end of header */
+	eoh_offset = hdr_size - edit_mail_istream_eoh_size(wrapped, hdr_size);
+	edit_mail_istream_add_segment(edstream, NULL, 0, eoh_offset);
+	edit_mail_istream_add_fields
+		(edstream, edmail->header_fields_appended, NULL);
+	edit_mail_istream_add_segment
+		(edstream, NULL, eoh_offset, msg_size - eoh_offset);
 }
 
 struct istream *edit_mail_istream_create
@@ -2133,9 +2060,11 @@ struct istream *edit_mail_istream_create
 	edstream = i_new(struct edit_mail_istream, 1);
 	edstream->pool = pool_alloconly_create(MEMPOOL_GROWING
 					      "edit mail stream", 4096);
-	edstream->mail = edmail;
 	edstream->buffer = buffer_create_dynamic(edstream->pool, 1024);
 
+	p_array_init(&edstream->segments, edstream->pool, 4);
+	edit_mail_istream_build(edstream, edmail);
+
 	edstream->istream.max_buffer_size = wrapped->real_stream->max_buffer_size;
 
 	edstream->istream.iostream.destroy = edit_mail_istream_destroy;
@@ -2148,11 +2077,15 @@ struct istream *edit_mail_istream_create
 	edstream->istream.istream.blocking = wrapped->blocking;
 	edstream->istream.istream.seekable = wrapped->seekable;
 
-	if ( edmail->header_fields_head != edmail->header_fields_appended )
-		edstream->cur_header = edmail->header_fields_head;
-
 	i_stream_seek(wrapped, 0);
 
 	return i_stream_create(&edstream->istream, wrapped, -1);
 }
 
+static uoff_t edit_mail_istream_get_size(struct istream *input)
+{
+	struct edit_mail_istream *edstream =
+		(struct edit_mail_istream *)input->real_stream;
+
+	return edstream->size;
+}
@@ -0,0 +1,206 @@
+/* Copyright (c) 2016 Pigeonhole authors, see the included COPYING file
+ */
+
+/* Mailbox rule lookups through the rule index versus matching each wildcard
+   rule pattern in turn, for a growing number of rules. Both must find the
+   same rules.
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "time-util.h"
+#include "imap-match.h"
+
+#include "imap-sieve-rule-index.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#define BENCH_LOOKUPS 20000
+#define BENCH_SEP '/'
+
+static const unsigned int bench_rule_counts[] = { 10, 100, 1000, 10000 };
+
+static const char *const bench_causes_copy[] = { "COPY", NULL };
+
+static void
+bench_rules_create(pool_t pool, unsigned int count,
+	ARRAY_TYPE(imap_sieve_mailbox_rule) *rules)
+{
+	unsigned int i;
+
+	for (i = 1; i <= count; i++) {
+		struct imap_sieve_mailbox_rule *rule;
+
+		rule = p_new(pool, struct imap_sieve_mailbox_rule, 1);
+		rule->index = i;
+		switch (i % 4) {
+		case 0:
+			rule->mailbox = p_strdup_printf(pool, "Tenant%u/*", i);
+			break;
+		case 1:
+			rule->mailbox = p_strdup_printf(pool, "Tenant%u/%%", i);
+			rule->causes = bench_causes_copy;
+			break;
+		case 2:
+			rule->mailbox = p_strdup_printf(pool, "Tenant%u/*", i);
+			rule->from = p_strdup_printf(pool, "Tenant%u/Spam*", i);
+			break;
+		case 3:
+			rule->mailbox = "*";
+			rule->from = p_strdup_printf(pool, "Shared%u/*", i);
+			break;
+		}
+		rule->before = p_strdup_printf(pool, "/etc/sieve/%u.sieve", i);
+		array_append(rules, &rule, 1);
+	}
+}
+
+static bool
+bench_linear_match_cause(const struct imap_sieve_mailbox_rule *rule,
+	const char *cause)
+{
+	const char *const *cp;
+
+	if (rule->causes == NULL)
+		return TRUE;
+	for (cp = rule->causes; *cp != NULL; cp++) {
+		if (strcasecmp(cause, *cp) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void
+bench_linear_match(const ARRAY_TYPE(imap_sieve_mailbox_rule) *patterns,
+	const char *dst_box, const char *src_box, const char *cause,
+	ARRAY_TYPE(imap_sieve_mailbox_rule) *rules)
+{
+	struct imap_sieve_mailbox_rule *const *rule_idx;
+
+	array_foreach(patterns, rule_idx) {
+		struct imap_sieve_mailbox_rule *rule = *rule_idx;
+		struct imap_match_glob *glob;
+
+		if (src_box == NULL && rule->from != NULL)
+			continue;
+		if (!bench_linear_match_cause(rule, cause))
+			continue;
+
+		if (strcmp(rule->mailbox, "*") != 0) {
+			glob = imap_match_init(pool_datastack_create(),
+				rule->mailbox, TRUE, BENCH_SEP);
+			if (imap_match(glob, dst_box) != IMAP_MATCH_YES)
+				continue;
+		}
+		if (rule->from != NULL) {
+			glob = imap_match_init(pool_datastack_create(),
+				rule->from, TRUE, BENCH_SEP);
+			if (imap_match(glob, src_box) != IMAP_MATCH_YES)
+				continue;
+		}
+		array_append(rules, &rule, 1);
+	}
+}
+
+static void
+bench_lookup(unsigned int count, unsigned int n,
+	const char **dst_box_r, const char **src_box_r, const char **cause_r)
+{
+	unsigned int id = (n * 7919) % count + 1;
+
+	*dst_box_r = t_strdup_printf("Tenant%u/Folder%u", id, n % 7);
+	switch (n % 3) {
+	case 0:
+		*src_box_r = NULL;
+		*cause_r = "APPEND";
+		break;
+	case 1:
+		*src_box_r = t_strdup_printf("Tenant%u/Spam", id);
+		*cause_r = "COPY";
+		break;
+	default:
+		*src_box_r = t_strdup_printf("Shared%u/Folder", id);
+		*cause_r = "COPY";
+		break;
+	}
+}
+
+static unsigned long long
+bench_run(struct imap_sieve_rule_index *idx,
+	const ARRAY_TYPE(imap_sieve_mailbox_rule) *patterns,
+	unsigned int count, unsigned int *matches_r)
+{
+	struct timeval start, end;
+	unsigned int n;
+
+	*matches_r = 0;
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday(): %m");
+
+	for (n = 0; n < BENCH_LOOKUPS; n++) T_BEGIN {
+		ARRAY_TYPE(imap_sieve_mailbox_rule) rules;
+		const char *dst_box, *src_box, *cause;
+
+		bench_lookup(count, n, &dst_box, &src_box, &cause);
+
+		t_array_init(&rules, 8);
+		if (idx != NULL) {
+			imap_sieve_rule_index_match(idx, dst_box, BENCH_SEP,
+				src_box, BENCH_SEP, cause, &rules);
+		} else {
+			bench_linear_match(patterns, dst_box, src_box, cause, &rules);
+		}
+		*matches_r += array_count(&rules);
+	} T_END;
+
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday(): %m");
+	return timeval_diff_usecs(&end, &start);
+}
+
+int main(void)
+{
+	unsigned int i;
+
+	lib_init();
+
+	printf("%8s %16s %16s\n", "rules", "index (ns/op)", "linear (ns/op)");
+
+	for (i = 0; i < N_ELEMENTS(bench_rule_counts); i++) {
+		unsigned int count = bench_rule_counts[i];
+		ARRAY_TYPE(imap_sieve_mailbox_rule) patterns;
+		struct imap_sieve_rule_index *idx;
+		struct imap_sieve_mailbox_rule *const *rule_idx;
+		unsigned long long idx_usecs, lin_usecs;
+		unsigned int idx_matches, lin_matches;
+		pool_t pool;
+
+		pool = pool_alloconly_create("rule index bench", 1024*1024);
+		p_array_init(&patterns, pool, count);
+		bench_rules_create(pool, count, &patterns);
+
+		idx = imap_sieve_rule_index_create();
+		array_foreach(&patterns, rule_idx)
+			imap_sieve_rule_index_add(idx, *rule_idx);
+
+		idx_usecs = bench_run(idx, &patterns, count, &idx_matches);
+		lin_usecs = bench_run(NULL, &patterns, count, &lin_matches);
+
+		if (idx_matches != lin_matches) {
+			i_fatal("Rule index found %u matches, "
+				"while linear matching found %u",
+				idx_matches, lin_matches);
+		}
+
+		printf("%8u %16llu %16llu\n", count,
+			idx_usecs * 1000 / BENCH_LOOKUPS,
+			lin_usecs * 1000 / BENCH_LOOKUPS);
+
+		imap_sieve_rule_index_free(&idx);
+		pool_unref(&pool);
+	}
+
+	lib_deinit();
+	return 0;
+}
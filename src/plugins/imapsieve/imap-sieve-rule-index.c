@@ -0,0 +1,325 @@
+/* Copyright (c) 2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "imap-match.h"
+
+#include "imap-sieve-rule-index.h"
+
+/*
+ * Types
+ */
+
+enum imap_sieve_rule_cause {
+	IMAP_SIEVE_RULE_CAUSE_APPEND = 0x01,
+	IMAP_SIEVE_RULE_CAUSE_COPY   = 0x02,
+	IMAP_SIEVE_RULE_CAUSE_FLAG   = 0x04,
+
+	IMAP_SIEVE_RULE_CAUSE_ANY    = 0x07
+};
+
+struct imap_sieve_rule_glob {
+	const char *pattern;
+	struct imap_match_glob *glob;
+	char sep;
+};
+
+struct imap_sieve_rule_entry {
+	struct imap_sieve_mailbox_rule *rule;
+	enum imap_sieve_rule_cause causes;
+
+	/* NULL pattern matches anything */
+	struct imap_sieve_rule_glob mailbox, from;
+};
+
+struct imap_sieve_rule_node {
+	/* Case-folded character leading to this node */
+	unsigned char chr;
+
+	ARRAY(struct imap_sieve_rule_node *) children;
+	ARRAY(struct imap_sieve_rule_entry *) entries;
+};
+
+struct imap_sieve_rule_index {
+	pool_t pool;
+
+	/* Tries of literal pattern prefixes: rules are filed either under
+	   their destination mailbox pattern or under their source mailbox
+	   pattern */
+	struct imap_sieve_rule_node *dst_root, *src_root;
+
+	ARRAY(struct imap_sieve_rule_entry *) entries;
+};
+
+/*
+ * Index object
+ */
+
+struct imap_sieve_rule_index *imap_sieve_rule_index_create(void)
+{
+	struct imap_sieve_rule_index *idx;
+	pool_t pool;
+
+	pool = pool_alloconly_create("imap_sieve_rule_index", 4096);
+	idx = p_new(pool, struct imap_sieve_rule_index, 1);
+	idx->pool = pool;
+	idx->dst_root = p_new(pool, struct imap_sieve_rule_node, 1);
+	idx->src_root = p_new(pool, struct imap_sieve_rule_node, 1);
+	p_array_init(&idx->entries, pool, 16);
+
+	return idx;
+}
+
+static void imap_sieve_rule_glob_free(struct imap_sieve_rule_glob *rglob)
+{
+	if (rglob->glob != NULL)
+		imap_match_deinit(&rglob->glob);
+}
+
+void imap_sieve_rule_index_free(struct imap_sieve_rule_index **_idx)
+{
+	struct imap_sieve_rule_index *idx = *_idx;
+	struct imap_sieve_rule_entry *const *entryp;
+
+	*_idx = NULL;
+
+	array_foreach(&idx->entries, entryp) {
+		imap_sieve_rule_glob_free(&(*entryp)->mailbox);
+		imap_sieve_rule_glob_free(&(*entryp)->from);
+	}
+	pool_unref(&idx->pool);
+}
+
+unsigned int imap_sieve_rule_index_count(struct imap_sieve_rule_index *idx)
+{
+	return array_count(&idx->entries);
+}
+
+/*
+ * Trie
+ */
+
+static inline unsigned char imap_sieve_rule_fold(char chr)
+{
+	/* Patterns and names may differ in case for INBOX; the trie only
+	   narrows the candidates down and imap_match() decides */
+	return i_tolower((unsigned char)chr);
+}
+
+static struct imap_sieve_rule_node *
+imap_sieve_rule_node_child(struct imap_sieve_rule_node *node,
+	unsigned char chr)
+{
+	struct imap_sieve_rule_node *const *childp;
+
+	if (!array_is_created(&node->children))
+		return NULL;
+	array_foreach(&node->children, childp) {
+		if ((*childp)->chr == chr)
+			return *childp;
+	}
+	return NULL;
+}
+
+static struct imap_sieve_rule_node *
+imap_sieve_rule_node_get(struct imap_sieve_rule_index *idx,
+	struct imap_sieve_rule_node *root, const char *prefix, size_t len)
+{
+	struct imap_sieve_rule_node *node = root, *child;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char chr = imap_sieve_rule_fold(prefix[i]);
+
+		child = imap_sieve_rule_node_child(node, chr);
+		if (child == NULL) {
+			child = p_new(idx->pool, struct imap_sieve_rule_node, 1);
+			child->chr = chr;
+			if (!array_is_created(&node->children))
+				p_array_init(&node->children, idx->pool, 4);
+			array_append(&node->children, &child, 1);
+		}
+		node = child;
+	}
+	return node;
+}
+
+static size_t imap_sieve_rule_pattern_prefix_len(const char *pattern)
+{
+	size_t len;
+
+	if (pattern == NULL)
+		return 0;
+	for (len = 0; pattern[len] != '\0'; len++) {
+		if (pattern[len] == '%' || pattern[len] == '*')
+			break;
+	}
+	return len;
+}
+
+/*
+ * Rules
+ */
+
+static enum imap_sieve_rule_cause
+imap_sieve_rule_cause_parse(const char *cause)
+{
+	if (strcasecmp(cause, "APPEND") == 0)
+		return IMAP_SIEVE_RULE_CAUSE_APPEND;
+	if (strcasecmp(cause, "COPY") == 0)
+		return IMAP_SIEVE_RULE_CAUSE_COPY;
+	if (strcasecmp(cause, "FLAG") == 0)
+		return IMAP_SIEVE_RULE_CAUSE_FLAG;
+	return 0;
+}
+
+void imap_sieve_rule_index_add(struct imap_sieve_rule_index *idx,
+	struct imap_sieve_mailbox_rule *rule)
+{
+	struct imap_sieve_rule_entry *entry;
+	struct imap_sieve_rule_node *node;
+	size_t dst_len, src_len;
+
+	entry = p_new(idx->pool, struct imap_sieve_rule_entry, 1);
+	entry->rule = rule;
+	if (strcmp(rule->mailbox, "*") != 0)
+		entry->mailbox.pattern = rule->mailbox;
+	entry->from.pattern = rule->from;
+
+	if (rule->causes == NULL || *rule->causes == NULL) {
+		entry->causes = IMAP_SIEVE_RULE_CAUSE_ANY;
+	} else {
+		const char *const *cp;
+
+		for (cp = rule->causes; *cp != NULL; cp++)
+			entry->causes |= imap_sieve_rule_cause_parse(*cp);
+	}
+
+	/* File the rule under the longest literal prefix */
+	dst_len = imap_sieve_rule_pattern_prefix_len(entry->mailbox.pattern);
+	src_len = imap_sieve_rule_pattern_prefix_len(entry->from.pattern);
+	if (src_len > dst_len) {
+		node = imap_sieve_rule_node_get(idx, idx->src_root,
+			entry->from.pattern, src_len);
+	} else {
+		node = imap_sieve_rule_node_get(idx, idx->dst_root,
+			entry->mailbox.pattern, dst_len);
+	}
+
+	if (!array_is_created(&node->entries))
+		p_array_init(&node->entries, idx->pool, 4);
+	array_append(&node->entries, &entry, 1);
+	array_append(&idx->entries, &entry, 1);
+}
+
+/*
+ * Matching
+ */
+
+static bool
+imap_sieve_rule_glob_match(struct imap_sieve_rule_glob *rglob,
+	const char *name, char sep)
+{
+	if (rglob->pattern == NULL)
+		return TRUE;
+
+	/* Globs are compiled once and only recompiled for a namespace with
+	   a different hierarchy separator */
+	if (rglob->glob == NULL || rglob->sep != sep) {
+		imap_sieve_rule_glob_free(rglob);
+		rglob->glob = imap_match_init(default_pool,
+			rglob->pattern, TRUE, sep);
+		rglob->sep = sep;
+	}
+	return (imap_match(rglob->glob, name) == IMAP_MATCH_YES);
+}
+
+static void
+imap_sieve_rule_node_match(struct imap_sieve_rule_node *node,
+	const char *dst_box, char dst_sep,
+	const char *src_box, char src_sep,
+	enum imap_sieve_rule_cause cause,
+	ARRAY_TYPE(imap_sieve_mailbox_rule) *matches)
+{
+	struct imap_sieve_rule_entry *const *entryp;
+
+	if (!array_is_created(&node->entries))
+		return;
+
+	array_foreach(&node->entries, entryp) {
+		struct imap_sieve_rule_entry *entry = *entryp;
+
+		if ((entry->causes & cause) == 0)
+			continue;
+		if (entry->from.pattern != NULL && src_box == NULL)
+			continue;
+		if (!imap_sieve_rule_glob_match(&entry->mailbox,
+			dst_box, dst_sep))
+			continue;
+		if (entry->from.pattern != NULL &&
+			!imap_sieve_rule_glob_match(&entry->from, src_box, src_sep))
+			continue;
+
+		array_append(matches, &entry->rule, 1);
+	}
+}
+
+static void
+imap_sieve_rule_trie_match(struct imap_sieve_rule_node *root,
+	const char *name, const char *dst_box, char dst_sep,
+	const char *src_box, char src_sep,
+	enum imap_sieve_rule_cause cause,
+	ARRAY_TYPE(imap_sieve_mailbox_rule) *matches)
+{
+	struct imap_sieve_rule_node *node = root;
+	const char *p = name;
+
+	/* Visit all nodes along the path spelled by the name; every rule
+	   filed on that path has a literal prefix matching the name */
+	for (;;) {
+		imap_sieve_rule_node_match(node, dst_box, dst_sep,
+			src_box, src_sep, cause, matches);
+		if (*p == '\0')
+			break;
+		node = imap_sieve_rule_node_child
+			(node, imap_sieve_rule_fold(*p++));
+		if (node == NULL)
+			break;
+	}
+}
+
+static int
+imap_sieve_mailbox_rule_index_cmp(struct imap_sieve_mailbox_rule *const *rule1,
+	struct imap_sieve_mailbox_rule *const *rule2)
+{
+	if ((*rule1)->index < (*rule2)->index)
+		return -1;
+	if ((*rule1)->index > (*rule2)->index)
+		return 1;
+	return 0;
+}
+
+void imap_sieve_rule_index_match(struct imap_sieve_rule_index *idx,
+	const char *dst_box, char dst_sep,
+	const char *src_box, char src_sep, const char *cause,
+	ARRAY_TYPE(imap_sieve_mailbox_rule) *rules)
+{
+	ARRAY_TYPE(imap_sieve_mailbox_rule) matches;
+	enum imap_sieve_rule_cause cause_flag;
+
+	if (array_count(&idx->entries) == 0)
+		return;
+	cause_flag = imap_sieve_rule_cause_parse(cause);
+
+	t_array_init(&matches, 8);
+	imap_sieve_rule_trie_match(idx->dst_root, dst_box,
+		dst_box, dst_sep, src_box, src_sep, cause_flag, &matches);
+	if (src_box != NULL) {
+		imap_sieve_rule_trie_match(idx->src_root, src_box,
+			dst_box, dst_sep, src_box, src_sep, cause_flag, &matches);
+	}
+
+	array_sort(&matches, imap_sieve_mailbox_rule_index_cmp);
+	array_append_array(rules, &matches);
+}
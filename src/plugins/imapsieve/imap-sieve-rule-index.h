@@ -0,0 +1,50 @@
+/* Copyright (c) 2016 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __IMAP_SIEVE_RULE_INDEX_H
+#define __IMAP_SIEVE_RULE_INDEX_H
+
+/*
+ * Mailbox rule
+ */
+
+struct imap_sieve_mailbox_rule {
+	unsigned int index;
+	const char *mailbox;
+	const char *from;
+	const char *const *causes;
+	const char *before, *after;
+};
+
+ARRAY_DEFINE_TYPE(imap_sieve_mailbox_rule,
+	struct imap_sieve_mailbox_rule *);
+
+/*
+ * Rule index
+ */
+
+/* Index of mailbox rules with wildcard patterns. Rules are filed under the
+   literal prefix of their most selective pattern, so that a lookup only
+   needs to verify the rules whose prefix matches the mailbox names involved.
+ */
+
+struct imap_sieve_rule_index;
+
+struct imap_sieve_rule_index *imap_sieve_rule_index_create(void);
+void imap_sieve_rule_index_free(struct imap_sieve_rule_index **_idx);
+
+/* The rule must remain valid for the lifetime of the index. A NULL `from'
+   pattern matches any source mailbox. */
+void imap_sieve_rule_index_add(struct imap_sieve_rule_index *idx,
+	struct imap_sieve_mailbox_rule *rule);
+unsigned int imap_sieve_rule_index_count(struct imap_sieve_rule_index *idx);
+
+/* Appends the matching rules to the array ordered by rule index. The src_box
+   is NULL when the event has no source mailbox. The separators are the
+   hierarchy separators of the respective namespaces. */
+void imap_sieve_rule_index_match(struct imap_sieve_rule_index *idx,
+	const char *dst_box, char dst_sep,
+	const char *src_box, char src_sep, const char *cause,
+	ARRAY_TYPE(imap_sieve_mailbox_rule) *rules) ATTR_NULL(4);
+
+#endif
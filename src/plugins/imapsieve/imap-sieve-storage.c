@@ -9,14 +9,15 @@
 #include "module-context.h"
 #include "mail-user.h"
 #include "mail-storage-private.h"
+#include "mail-search-build.h"
 #include "mailbox-attribute.h"
 #include "mailbox-list-private.h"
-#include "imap-match.h"
 #include "imap-util.h"
 
 #include "strtrim.h"
 
 #include "imap-sieve.h"
+#include "imap-sieve-rule-index.h"
 #include "imap-sieve-storage.h"
 
 #define MAILBOX_ATTRIBUTE_IMAPSIEVE_SCRIPT "imapsieve/script"
@@ -29,7 +30,6 @@
 #define IMAP_SIEVE_MAIL_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, imap_sieve_mail_module)
 
-struct imap_sieve_mailbox_rule;
 struct imap_sieve_user;
 struct imap_sieve_mailbox_event;
 struct imap_sieve_mailbox_transaction;
@@ -44,8 +44,6 @@ enum imap_sieve_command {
 	IMAP_SIEVE_CMD_OTHER
 };
 
-ARRAY_DEFINE_TYPE(imap_sieve_mailbox_rule,
-	struct imap_sieve_mailbox_rule *);
 ARRAY_DEFINE_TYPE(imap_sieve_mailbox_event,
 	struct imap_sieve_mailbox_event);
 
@@ -53,14 +51,6 @@ HASH_TABLE_DEFINE_TYPE(imap_sieve_mailbox_rule,
 	struct imap_sieve_mailbox_rule *,
 	struct imap_sieve_mailbox_rule *);
 
-struct imap_sieve_mailbox_rule {
-	unsigned int index;
-	const char *mailbox;
-	const char *from;
-	const char *const *causes;
-	const char *before, *after;
-};
-
 struct imap_sieve_user {
 	pool_t pool;
 
@@ -71,7 +61,7 @@ struct imap_sieve_user {
 	enum imap_sieve_command cur_cmd;
 
 	HASH_TABLE_TYPE(imap_sieve_mailbox_rule) mbox_rules;
-	ARRAY_TYPE(imap_sieve_mailbox_rule) mbox_patterns;
+	struct imap_sieve_rule_index *mbox_patterns;
 
 	unsigned int sieve_active:1;
 	unsigned int user_script:1;
@@ -554,6 +544,55 @@ imap_sieve_mailbox_transaction_free
 	pool_unref(&ismt->pool);
 }
 
+static void
+imap_sieve_mailbox_events_resolve(
+	struct imap_sieve_mailbox_transaction *ismt,
+	struct mail_transaction_commit_changes *changes)
+{
+	struct imap_sieve_mailbox_event *mevent;
+	struct seq_range_iter siter;
+
+	/* Determine UIDs for saved messages */
+	seq_range_array_iter_init(&siter, &changes->saved_uids);
+	array_foreach_modifiable(&ismt->events, mevent) {
+		uint32_t uid;
+
+		if (mevent->mail_uid == 0 &&
+			seq_range_array_iter_nth(&siter, mevent->save_seq, &uid))
+			mevent->mail_uid = uid;
+	}
+}
+
+static int
+imap_sieve_mailbox_event_cmp(
+	const struct imap_sieve_mailbox_event *const *ev1,
+	const struct imap_sieve_mailbox_event *const *ev2)
+{
+	if ((*ev1)->mail_uid != (*ev2)->mail_uid)
+		return ((*ev1)->mail_uid < (*ev2)->mail_uid ? -1 : 1);
+
+	/* Keep events for the same message in their original order */
+	if (*ev1 != *ev2)
+		return (*ev1 < *ev2 ? -1 : 1);
+	return 0;
+}
+
+static struct mail_search_args *
+imap_sieve_search_args_create(const ARRAY_TYPE(seq_range) *uids)
+{
+	struct mail_search_args *search_args;
+	struct mail_search_arg *arg;
+
+	search_args = mail_search_build_init();
+	arg = p_new(search_args->pool, struct mail_search_arg, 1);
+	arg->type = SEARCH_UIDSET;
+	p_array_init(&arg->value.seqset, search_args->pool,
+		array_count(uids) + 1);
+	array_append_array(&arg->value.seqset, uids);
+	search_args->args = arg;
+	return search_args;
+}
+
 static int
 imap_sieve_mailbox_transaction_run(
 	struct imap_sieve_mailbox_transaction *ismt,
@@ -567,13 +606,17 @@ imap_sieve_mailbox_transaction_run(
 	struct mailbox *src_box = ismt->src_box;
 	struct mail_user *user = box->storage->user;
 	struct imap_sieve_user *isuser = 	IMAP_SIEVE_USER_CONTEXT(user);
-	const struct imap_sieve_mailbox_event *mevent;
+	const struct imap_sieve_mailbox_event *mevent, *const *events;
 	struct mailbox_header_lookup_ctx *headers_ctx;
 	struct mailbox_transaction_context *st;
+	struct mail_search_context *search_ctx;
+	struct mail_search_args *search_args;
 	struct mailbox *sbox;
 	struct imap_sieve_run *isrun;
-	struct seq_range_iter siter;
+	ARRAY(const struct imap_sieve_mailbox_event *) sorted;
+	ARRAY_TYPE(seq_range) uids, discard_uids;
 	const char *cause, *script_name = NULL;
+	unsigned int count, i;
 	bool can_discard;
 	struct mail *mail;
 	int ret;
@@ -655,50 +698,94 @@ imap_sieve_mailbox_transaction_run(
 	sbox = mailbox_alloc(box->list, box->vname, 0);
 	if (mailbox_sync(sbox, 0) < 0) {
 		mailbox_free(&sbox);
+		imap_sieve_run_deinit(&isrun);
 		return -1;
 	}
 
-	/* Create transaction for event messages */
-	st = mailbox_transaction_begin(sbox, 0);
-	headers_ctx = mailbox_header_lookup_init(sbox, wanted_headers);
-	mail = mail_alloc(st, 0, headers_ctx);
-	mailbox_header_lookup_unref(&headers_ctx);
-
-	/* Iterate through all events */
-	seq_range_array_iter_init(&siter, &changes->saved_uids);
+	/* Determine UIDs for all events and order the events by UID */
+	imap_sieve_mailbox_events_resolve(ismt, changes);
+	i_array_init(&sorted, array_count(&ismt->events));
+	i_array_init(&uids, 32);
+	i_array_init(&discard_uids, 32);
 	array_foreach(&ismt->events, mevent) {
-		uint32_t uid;
+		if (mevent->mail_uid == 0) {
+			imap_sieve_mailbox_error(sbox,
+				"Failed to find message for Sieve event (UID=0)");
+			continue;
+		}
+		array_append(&sorted, &mevent, 1);
+		seq_range_array_add(&uids, mevent->mail_uid);
+	}
+	array_sort(&sorted, imap_sieve_mailbox_event_cmp);
 
-		/* Determine UID for saved message */
-		if (mevent->mail_uid > 0 ||
-			!seq_range_array_iter_nth(&siter, mevent->save_seq, &uid))
-			uid = mevent->mail_uid;
+	/* Create transaction for event messages; the headers inspected by
+	   the scripts are prefetched together with the default ones */
+	st = mailbox_transaction_begin(sbox, 0);
+	T_BEGIN {
+		headers_ctx = mailbox_header_lookup_init(sbox,
+			imap_sieve_run_get_wanted_headers(isrun, wanted_headers));
+	} T_END;
 
-		/* Select event message */
-		if (!mail_set_uid(mail, uid)) {
+	/* Fetch all event messages in one search */
+	events = array_get(&sorted, &count);
+	i = 0;
+	search_args = imap_sieve_search_args_create(&uids);
+	search_ctx = mailbox_search_init(st, search_args, NULL, 0, headers_ctx);
+	mail_search_args_unref(&search_args);
+	mailbox_header_lookup_unref(&headers_ctx);
+
+	while (count > 0 && mailbox_search_next(search_ctx, &mail) > 0) {
+		for (; i < count && events[i]->mail_uid < mail->uid; i++) {
 			imap_sieve_mailbox_error(sbox,
 				"Failed to find message for Sieve event (UID=%llu)",
-				(unsigned long long)uid);
-			continue;
+				(unsigned long long)events[i]->mail_uid);
 		}
 
-		i_assert(!mail->expunged);
+		/* Run scripts for each event of this mail */
+		for (; i < count && events[i]->mail_uid == mail->uid; i++) {
+			ret = imap_sieve_run_mail
+				(isrun, mail, events[i]->changed_flags);
+
+			/* Handle the result */
+			if (ret < 0) {
+				/* Sieve error; keep */
+			} else if (ret > 0 && can_discard) {
+				/* Discard; applied below */
+				seq_range_array_add(&discard_uids, mail->uid);
+			}
+		}
+	}
+	for (; i < count; i++) {
+		imap_sieve_mailbox_error(sbox,
+			"Failed to find message for Sieve event (UID=%llu)",
+			(unsigned long long)events[i]->mail_uid);
+	}
+	if (mailbox_search_deinit(&search_ctx) < 0) {
+		imap_sieve_mailbox_error(sbox,
+			"Failed to fetch messages for Sieve events: %s",
+			mailbox_get_last_error(sbox, NULL));
+	}
 
-		/* Run scripts for this mail */
-		ret = imap_sieve_run_mail
-			(isrun, mail, mevent->changed_flags);
+	/* Apply all discards at once */
+	if (array_count(&discard_uids) > 0) {
+		search_args = imap_sieve_search_args_create(&discard_uids);
+		search_ctx = mailbox_search_init(st, search_args, NULL, 0, NULL);
+		mail_search_args_unref(&search_args);
 
-		/* Handle the result */
-		if (ret < 0) {
-			/* Sieve error; keep */
-		} else if (ret > 0 && can_discard) {
-			/* Discard */
+		while (mailbox_search_next(search_ctx, &mail) > 0)
 			mail_update_flags(mail, MODIFY_ADD, MAIL_DELETED);
+
+		if (mailbox_search_deinit(&search_ctx) < 0) {
+			imap_sieve_mailbox_error(sbox,
+				"Failed to discard messages: %s",
+				mailbox_get_last_error(sbox, NULL));
 		}
 	}
 
 	/* Cleanup */
-	mail_free(&mail);
+	array_free(&sorted);
+	array_free(&uids);
+	array_free(&discard_uids);
 	ret = mailbox_transaction_commit(&st);
 	imap_sieve_run_deinit(&isrun);
 	mailbox_free(&sbox);
@@ -822,7 +909,7 @@ imap_sieve_mailbox_rules_init(struct mail_user *user)
 
 	hash_table_create(&isuser->mbox_rules, default_pool, 0,
 		imap_sieve_mailbox_rule_hash, imap_sieve_mailbox_rule_cmp);
-	i_array_init(&isuser->mbox_patterns, 8);
+	isuser->mbox_patterns = imap_sieve_rule_index_create();
 
 	identifier = t_str_new(256);
 	str_append(identifier, "imapsieve_mailbox");
@@ -918,7 +1005,7 @@ imap_sieve_mailbox_rules_init(struct mail_user *user)
 				!rule_pattern_has_wildcards(mbrule->from))) {
 			hash_table_insert(isuser->mbox_rules, mbrule, mbrule);
 		} else {
-			array_append(&isuser->mbox_patterns, &mbrule, 1);
+			imap_sieve_rule_index_add(isuser->mbox_patterns, mbrule);
 		}
 	}
 
@@ -951,42 +1038,30 @@ imap_sieve_mailbox_rules_match_patterns(struct mail_user *user,
 	struct imap_sieve_user *isuser = IMAP_SIEVE_USER_CONTEXT(user);
 	struct imap_sieve_mailbox_rule *const *rule_idx;
 	struct mail_namespace *dst_ns, *src_ns;
+	unsigned int count;
 
-	if (array_count(&isuser->mbox_patterns) == 0)
+	if (imap_sieve_rule_index_count(isuser->mbox_patterns) == 0)
 		return;
 
 	dst_ns = mailbox_get_namespace(dst_box);
 	src_ns = (src_box == NULL ? NULL :
 		mailbox_get_namespace(src_box));
 
-	array_foreach(&isuser->mbox_patterns, rule_idx) {
-		struct imap_sieve_mailbox_rule *rule = *rule_idx;
-		struct imap_match_glob *glob;
+	count = array_count(rules);
+	imap_sieve_rule_index_match(isuser->mbox_patterns,
+		mailbox_get_vname(dst_box), mail_namespace_get_sep(dst_ns),
+		(src_box == NULL ? NULL : mailbox_get_vname(src_box)),
+		(src_ns == NULL ? '\0' : mail_namespace_get_sep(src_ns)),
+		cause, rules);
 
-		if (src_ns == NULL && rule->from != NULL)
-			continue;
-		if (!imap_sieve_mailbox_rule_match_cause(rule, cause))
-			continue;
-
-		if (strcmp(rule->mailbox, "*") != 0) {
-			glob = imap_match_init(pool_datastack_create(),
-				rule->mailbox, TRUE, mail_namespace_get_sep(dst_ns));
-			if (imap_match(glob, mailbox_get_vname(dst_box))
-				!= IMAP_MATCH_YES)
-				continue;
-		}
-		if (rule->from != NULL) {
-			glob = imap_match_init(pool_datastack_create(),
-				rule->from, TRUE, mail_namespace_get_sep(src_ns));
-			if (imap_match(glob, mailbox_get_vname(src_box))
-				!= IMAP_MATCH_YES)
+	if (user->mail_debug) {
+		array_foreach(rules, rule_idx) {
+			if (array_foreach_idx(rules, rule_idx) < count)
 				continue;
+			imap_sieve_debug(user,
+				"Matched static mailbox rule [%u]",
+				(*rule_idx)->index);
 		}
-
-		imap_sieve_debug(user,
-			"Matched static mailbox rule [%u]",
-			rule->index);
-		array_append(rules, &rule, 1);
 	}
 }
 
@@ -1067,8 +1142,8 @@ static void imap_sieve_user_deinit(struct mail_user *user)
 
 	if (hash_table_is_created(isuser->mbox_rules))
 		hash_table_destroy(&isuser->mbox_rules);
-	if (array_is_created(&isuser->mbox_patterns))
-		array_free(&isuser->mbox_patterns);
+	if (isuser->mbox_patterns != NULL)
+		imap_sieve_rule_index_free(&isuser->mbox_patterns);
 
 	isuser->module_ctx.super.deinit(user);
 }
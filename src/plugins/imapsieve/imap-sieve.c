@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "array.h"
 #include "home-expand.h"
 #include "mail-storage.h"
 #include "mail-user.h"
@@ -12,6 +13,7 @@
 
 #include "sieve.h"
 #include "sieve-script.h"
+#include "sieve-binary.h"
 #include "sieve-storage.h"
 
 #include "ext-imapsieve-common.h"
@@ -468,6 +470,100 @@ imap_sieve_run_open_script(
 	return sbin;
 }
 
+static enum sieve_compile_flags
+imap_sieve_run_compile_flags(struct imap_sieve_run *isrun,
+	struct sieve_script *script)
+{
+	if ( script == isrun->user_script )
+		return SIEVE_COMPILE_FLAG_NOGLOBAL;
+	return SIEVE_COMPILE_FLAG_NO_ENVELOPE;
+}
+
+static struct sieve_binary *
+imap_sieve_run_get_binary(struct imap_sieve_run *isrun,
+	unsigned int index, enum sieve_error *error_r)
+{
+	struct imap_sieve *isieve = isrun->isieve;
+	struct imap_sieve_run_script *rscript = &isrun->scripts[index];
+	struct sieve_binary *sbin;
+
+	/* Binaries are opened once and reused for all mails in the run */
+	if ( rscript->binary != NULL )
+		return rscript->binary;
+
+	if ( isieve->user->mail_debug ) {
+		sieve_sys_debug(isieve->svinst,
+			"Opening script %d of %d from `%s'",
+			index+1, isrun->scripts_count,
+			sieve_script_location(rscript->script));
+	}
+
+	/* Already known to fail */
+	if ( rscript->compile_error != SIEVE_ERROR_NONE ) {
+		*error_r = rscript->compile_error;
+		return NULL;
+	}
+
+	/* Try to open/compile binary */
+	sbin = imap_sieve_run_open_script(isrun, rscript->script,
+		imap_sieve_run_compile_flags(isrun, rscript->script),
+		FALSE, error_r);
+	if ( sbin == NULL ) {
+		rscript->compile_error = *error_r;
+		return NULL;
+	}
+
+	rscript->binary = sbin;
+	return sbin;
+}
+
+const char *const *
+imap_sieve_run_get_wanted_headers(struct imap_sieve_run *isrun,
+	const char *const *base_headers)
+{
+	ARRAY_TYPE(const_string) headers;
+	enum sieve_error error;
+	unsigned int i;
+
+	t_array_init(&headers, 16);
+	if ( base_headers != NULL ) {
+		array_append(&headers, base_headers,
+			str_array_length(base_headers));
+	}
+
+	/* Open the binaries up front; stop where the execution sequence would
+	   stop anyway */
+	for ( i = 0; i < isrun->scripts_count; i++ ) {
+		struct sieve_binary *sbin;
+		const char *const *fields;
+		bool dynamic;
+
+		sbin = imap_sieve_run_get_binary(isrun, i, &error);
+		if ( sbin == NULL )
+			break;
+
+		/* Headers only known at runtime are fetched on demand */
+		fields = sieve_binary_get_header_fields(sbin, &dynamic);
+		if ( fields == NULL )
+			continue;
+		for ( ; *fields != NULL; fields++ ) {
+			const char *const *known;
+			unsigned int count, j;
+
+			known = array_get(&headers, &count);
+			for ( j = 0; j < count; j++ ) {
+				if ( strcasecmp(known[j], *fields) == 0 )
+					break;
+			}
+			if ( j == count )
+				array_append(&headers, fields, 1);
+		}
+	}
+
+	array_append_zero(&headers);
+	return array_idx(&headers, 0);
+}
+
 static int imap_sieve_handle_exec_status
 (struct imap_sieve_run *isrun,
 	struct sieve_script *script, int status, bool keep,
@@ -564,9 +660,9 @@ static int imap_sieve_run_scripts
 	/* Execute scripts */
 	for ( i = 0; i < count && more; i++ ) {
 		struct sieve_script *script = scripts[i].script;
-		struct sieve_binary *sbin = scripts[i].binary;
+		struct sieve_binary *sbin;
 
-		cpflags = 0;
+		cpflags = imap_sieve_run_compile_flags(isrun, script);
 		exflags = SIEVE_EXECUTE_FLAG_DEFER_KEEP |
 			SIEVE_EXECUTE_FLAG_NO_ENVELOPE;
 
@@ -574,36 +670,16 @@ static int imap_sieve_run_scripts
 		last_script = script;
 
 		if ( user_script ) {
-			cpflags |= SIEVE_COMPILE_FLAG_NOGLOBAL;
 			exflags |= SIEVE_EXECUTE_FLAG_NOGLOBAL;
 			ehandler = isrun->user_ehandler;
 		} else {
-			cpflags |= SIEVE_COMPILE_FLAG_NO_ENVELOPE;
 			ehandler = isieve->master_ehandler;
 		}
 
 		/* Open */
-		if (sbin == NULL) {
-			if ( debug ) {
-				sieve_sys_debug(svinst,
-					"Opening script %d of %d from `%s'",
-					i+1, count, sieve_script_location(script));
-			}
-
-			/* Already known to fail */
-			if (scripts[i].compile_error != SIEVE_ERROR_NONE) {
-				compile_error = scripts[i].compile_error;
-				break;
-			}
-
-			/* Try to open/compile binary */
-			scripts[i].binary = sbin = imap_sieve_run_open_script
-				(isrun, script, cpflags, FALSE, &compile_error);
-			if ( sbin == NULL ) {
-				scripts[i].compile_error = compile_error;
-				break;
-			}
-		}
+		sbin = imap_sieve_run_get_binary(isrun, i, &compile_error);
+		if ( sbin == NULL )
+			break;
 
 		/* Execute */
 		if ( debug ) {
@@ -54,6 +54,12 @@ int imap_sieve_run_init(struct imap_sieve *isieve,
 	struct imap_sieve_run **isrun_r)
 	ATTR_NULL(4, 5, 6);
 
+/* Opens all scripts of the run and returns the base_headers extended with the
+   header fields the scripts inspect, so that these can be prefetched. */
+const char *const *
+imap_sieve_run_get_wanted_headers(struct imap_sieve_run *isrun,
+	const char *const *base_headers) ATTR_NULL(2);
+
 int imap_sieve_run_mail
 (struct imap_sieve_run *isrun, struct mail *mail,
 	const char *changed_flags);
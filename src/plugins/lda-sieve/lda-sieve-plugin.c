@@ -5,6 +5,7 @@
 #include "array.h"
 #include "home-expand.h"
 #include "eacces-error.h"
+#include "istream.h"
 #include "mail-storage.h"
 #include "mail-deliver.h"
 #include "mail-user.h"
@@ -16,6 +17,9 @@
 #include "sieve.h"
 #include "sieve-script.h"
 #include "sieve-storage.h"
+#include "sieve-settings.h"
+#include "sieve-message.h"
+#include "sieve-duplicate.h"
 
 #include "lda-sieve-log.h"
 #include "lda-sieve-plugin.h"
@@ -37,6 +41,13 @@
 
 static deliver_mail_func_t *next_deliver_mail;
 
+/* Idle Sieve instance kept for the next recipient */
+static struct sieve_instance *lda_sieve_instance = NULL;
+
+/* Analysis of the message being delivered, shared by its recipients */
+static struct sieve_message_analysis *lda_sieve_msg_analysis = NULL;
+static struct istream *lda_sieve_msg_input = NULL;
+
 /*
  * Settings handling
  */
@@ -64,6 +75,77 @@ static const struct sieve_callbacks lda_sieve_callbacks = {
 	lda_sieve_get_setting
 };
 
+/*
+ * Sieve instance
+ */
+
+static struct sieve_instance *lda_sieve_instance_get
+(struct mail_deliver_context *mdctx, const struct sieve_environment *svenv,
+	bool debug)
+{
+	struct sieve_instance *svinst = lda_sieve_instance;
+
+	/* Reuse the instance of a previous recipient when its configuration
+	   applies to this one as well; loading all extensions and plugins for
+	   each recipient is expensive */
+	if ( svinst != NULL ) {
+		lda_sieve_instance = NULL;
+		if ( sieve_reinit(svinst, svenv, mdctx, debug) )
+			return svinst;
+		sieve_deinit(&svinst);
+	}
+
+	return sieve_init(svenv, &lda_sieve_callbacks, mdctx, debug);
+}
+
+static void lda_sieve_instance_put(struct sieve_instance **_svinst)
+{
+	struct sieve_instance *svinst = *_svinst;
+
+	*_svinst = NULL;
+	if ( svinst == NULL )
+		return;
+
+	i_assert( lda_sieve_instance == NULL );
+	sieve_detach(svinst);
+	lda_sieve_instance = svinst;
+}
+
+/*
+ * Message analysis
+ */
+
+static void lda_sieve_message_analysis_free(void)
+{
+	if ( lda_sieve_msg_analysis != NULL )
+		sieve_message_analysis_unref(&lda_sieve_msg_analysis);
+	if ( lda_sieve_msg_input != NULL )
+		i_stream_unref(&lda_sieve_msg_input);
+}
+
+static struct sieve_message_analysis *lda_sieve_message_analysis_get
+(struct mail *mail)
+{
+	struct istream *input;
+
+	/* All recipients of an LMTP transaction are delivered from the same
+	   source mail, which is recognized by its input stream. That stream is
+	   referenced for as long as the analysis is kept, so that a later message
+	   cannot show up at the same address. */
+	if ( mail_get_stream(mail, NULL, NULL, &input) < 0 ) {
+		lda_sieve_message_analysis_free();
+		return NULL;
+	}
+	if ( input == lda_sieve_msg_input )
+		return lda_sieve_msg_analysis;
+
+	lda_sieve_message_analysis_free();
+	lda_sieve_msg_analysis = sieve_message_analysis_create();
+	lda_sieve_msg_input = input;
+	i_stream_ref(input);
+	return lda_sieve_msg_analysis;
+}
+
 /*
  * Mail transmission
  */
@@ -773,6 +855,7 @@ static int lda_sieve_execute
 	struct sieve_exec_status estatus;
 	struct sieve_trace_config trace_config;
 	struct sieve_trace_log *trace_log;
+	struct sieve_duplicate_db *dup_db = NULL;
 	bool debug = mdctx->dest_user->mail_debug;
 	int ret;
 
@@ -822,6 +905,7 @@ static int lda_sieve_execute
 		msgdata.final_envelope_to = mdctx->final_dest_addr;
 		msgdata.auth_user = mdctx->dest_user->username;
 		(void)mail_get_first_header(msgdata.mail, "Message-ID", &msgdata.id);
+		msgdata.analysis = lda_sieve_message_analysis_get(msgdata.mail);
 
 		srctx->msgdata = &msgdata;
 
@@ -842,6 +926,11 @@ static int lda_sieve_execute
 		scriptenv.duplicate_mark = lda_sieve_duplicate_mark;
 		scriptenv.duplicate_check = lda_sieve_duplicate_check;
 		scriptenv.duplicate_flush = lda_sieve_duplicate_flush;
+		if ( sieve_duplicate_db_open(svinst,
+			sieve_setting_get(svinst, "sieve_duplicate_db"), &dup_db) > 0 ) {
+			/* Overrides the LDA's duplicate database */
+			scriptenv.duplicate_db = dup_db;
+		}
 		scriptenv.reject_mail = lda_sieve_reject_mail;
 		scriptenv.script_context = (void *) mdctx;
 		scriptenv.trace_log = trace_log;
@@ -862,6 +951,8 @@ static int lda_sieve_execute
 		mdctx->tried_default_save = estatus.tried_default_save;
 		*storage_r = estatus.last_storage;
 
+		if ( dup_db != NULL )
+			sieve_duplicate_db_close(&dup_db);
 		if ( trace_log != NULL )
 			sieve_trace_log_free(&trace_log);
 	}
@@ -896,7 +987,7 @@ static int lda_sieve_deliver_mail
 	svenv.location = SIEVE_ENV_LOCATION_MDA;
 	svenv.delivery_phase = SIEVE_DELIVERY_PHASE_DURING;
 
-	srctx.svinst = sieve_init(&svenv, &lda_sieve_callbacks, mdctx, debug);
+	srctx.svinst = lda_sieve_instance_get(mdctx, &svenv, debug);
 
 	/* Initialize master error handler */
 
@@ -929,7 +1020,7 @@ static int lda_sieve_deliver_mail
 	if ( srctx.user_ehandler != NULL )
 		sieve_error_handler_unref(&srctx.user_ehandler);
 	sieve_error_handler_unref(&srctx.master_ehandler);
-	sieve_deinit(&srctx.svinst);
+	lda_sieve_instance_put(&srctx.svinst);
 
 	return ret;
 }
@@ -951,4 +1042,8 @@ void sieve_plugin_deinit(void)
 {
 	/* Remove hook */
 	mail_deliver_hook_set(next_deliver_mail);
+
+	if ( lda_sieve_instance != NULL )
+		sieve_deinit(&lda_sieve_instance);
+	lda_sieve_message_analysis_free();
 }
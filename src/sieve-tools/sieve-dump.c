@@ -3,6 +3,8 @@
 
 #include "lib.h"
 #include "array.h"
+#include "istream.h"
+#include "ostream.h"
 #include "master-service.h"
 #include "master-service-settings.h"
 #include "mail-storage-service.h"
@@ -27,11 +29,39 @@
 static void print_help(void)
 {
 	printf(
-"Usage: sieve-dump [-c <config-file>] [-D] [-h] [-P <plugin>] [-x <extensions>]\n"
+"Usage: sieve-dump [-c <config-file>] [-D] [-h] [-P <plugin>]\n"
+"                  [-t <trace-file>] [-x <extensions>]\n"
 "                  <sieve-binary> [<out-file>]\n"
 	);
 }
 
+/*
+ * Trace decoding
+ */
+
+static int dump_trace
+(struct sieve_binary *sbin, const char *tracefile, const char *outfile)
+{
+	struct istream *input;
+	struct ostream *dumpstream;
+	int ret;
+
+	dumpstream = sieve_tool_open_output_stream(outfile);
+	if ( dumpstream == NULL )
+		i_fatal("Failed to create stream for sieve trace dump.");
+
+	input = i_stream_create_file(tracefile, (size_t)-1);
+	ret = sieve_trace_dump(sbin, input, dumpstream);
+	i_stream_unref(&input);
+
+	if ( o_stream_nfinish(dumpstream) < 0 ) {
+		i_fatal("write(%s) failed: %s", outfile,
+			o_stream_get_error(dumpstream));
+	}
+	o_stream_destroy(&dumpstream);
+	return ret;
+}
+
 /*
  * Tool implementation
  */
@@ -40,12 +70,12 @@ int main(int argc, char **argv)
 {
 	struct sieve_instance *svinst;
 	struct sieve_binary *sbin;
-	const char *binfile, *outfile;
+	const char *binfile, *outfile, *tracefile = NULL;
 	bool hexdump = FALSE;
 	int exit_status = EXIT_SUCCESS;
 	int c;
 
-	sieve_tool = sieve_tool_init("sieve-dump", &argc, &argv, "DhP:x:", FALSE);
+	sieve_tool = sieve_tool_init("sieve-dump", &argc, &argv, "DhP:t:x:", FALSE);
 
 	outfile = NULL;
 
@@ -55,6 +85,10 @@ int main(int argc, char **argv)
 			/* produce hexdump */
 			hexdump = TRUE;
 			break;
+		case 't':
+			/* decode binary runtime trace */
+			tracefile = optarg;
+			break;
 		default:
 			print_help();
 			i_fatal_status(EX_USAGE, "Unknown argument: %c", c);
@@ -82,7 +116,13 @@ int main(int argc, char **argv)
 	/* Dump binary */
 	sbin = sieve_load(svinst, binfile, NULL);
 	if ( sbin != NULL ) {
-		sieve_tool_dump_binary_to(sbin, outfile == NULL ? "-" : outfile, hexdump);
+		if ( tracefile != NULL ) {
+			if ( dump_trace(sbin, tracefile,
+				outfile == NULL ? "-" : outfile) < 0 )
+				exit_status = EXIT_FAILURE;
+		} else {
+			sieve_tool_dump_binary_to(sbin, outfile == NULL ? "-" : outfile, hexdump);
+		}
 
 		sieve_close(&sbin);
 	} else {
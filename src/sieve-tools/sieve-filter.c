@@ -6,9 +6,14 @@
 #include "ioloop.h"
 #include "env-util.h"
 #include "str.h"
+#include "strnum.h"
 #include "str-sanitize.h"
+#include "istream.h"
 #include "ostream.h"
+#include "write-full.h"
+#include "time-util.h"
 #include "array.h"
+#include "seq-range-array.h"
 #include "mail-namespace.h"
 #include "mail-storage.h"
 #include "mail-search-build.h"
@@ -25,6 +30,7 @@
 #include <fcntl.h>
 #include <pwd.h>
 #include <sysexits.h>
+#include <sys/wait.h>
 
 /*
  * Print help
@@ -33,8 +39,9 @@
 static void print_help(void)
 {
 	printf(
-"Usage: sieve-filter [-c <config-file>] [-C] [-D] [-e] [-m <default-mailbox>]\n"
-"                    [-P <plugin>] [-q <output-mailbox>] [-Q <mail-command>]\n"
+"Usage: sieve-filter [-c <config-file>] [-C] [-D] [-e] [-j <workers>]\n"
+"                    [-m <default-mailbox>] [-P <plugin>] [-q <output-mailbox>]\n"
+"                    [-Q <mail-command>] [-r <uid>] [-R <checkpoint-file>]\n"
 "                    [-s <script-file>] [-u <user>] [-v] [-W] [-x <extensions>]\n"
 "                    <script-file> <source-mailbox> [<discard-action>]\n"
 	);
@@ -50,6 +57,11 @@ enum sieve_filter_discard_action {
 struct sieve_filter_data {
 	enum sieve_filter_discard_action discard_action;
 	struct mailbox *move_mailbox;
+	enum mailbox_flags open_flags;
+
+	/* Progress is reported to the parent process through this pipe when
+	   filtering in parallel; -1 otherwise */
+	int progress_fd;
 
 	struct sieve_script_env *senv;
 	struct sieve_binary *main_sbin;
@@ -263,8 +275,34 @@ static void mail_search_build_add_flags
 	args->args = arg;
 }
 
+static void mail_search_build_add_uidset
+(struct mail_search_args *args, uint32_t uid1, uint32_t uid2)
+{
+	struct mail_search_arg *arg;
+
+	arg = p_new(args->pool, struct mail_search_arg, 1);
+	arg->type = SEARCH_UIDSET;
+	p_array_init(&arg->value.seqset, args->pool, 1);
+	seq_range_array_add_range(&arg->value.seqset, uid1, uid2);
+
+	arg->next = args->args;
+	args->args = arg;
+}
+
+static void filter_worker_report
+(const struct sieve_filter_data *sfdata, char type, uint32_t uid,
+	uoff_t size)
+{
+	const char *line;
+
+	line = t_strdup_printf("%c %u %"PRIuUOFF_T"\n", type, uid, size);
+	if ( write_full(sfdata->progress_fd, line, strlen(line)) < 0 )
+		i_error("write(progress pipe) failed: %m");
+}
+
 static int filter_mailbox
-(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
+(const struct sieve_filter_data *sfdata, struct mailbox *src_box,
+	uint32_t uid_first, uint32_t uid_last)
 {
 	struct sieve_filter_context sfctx;
 	struct mailbox *move_box = sfdata->move_mailbox;
@@ -304,6 +342,7 @@ static int filter_mailbox
 
 	search_args = mail_search_build_init();
 	mail_search_build_add_flags(search_args, MAIL_DELETED, TRUE);
+	mail_search_build_add_uidset(search_args, uid_first, uid_last);
 
 	t = mailbox_transaction_begin(src_box, 0);
 	search_ctx = mailbox_search_init(t, search_args, NULL, 0, NULL);
@@ -313,6 +352,13 @@ static int filter_mailbox
 
 	while ( ret >= 0 && mailbox_search_next(search_ctx, &mail) > 0 ) {
 		ret = filter_message(&sfctx, mail);
+
+		if ( ret >= 0 && sfdata->progress_fd != -1 ) {
+			uoff_t size = 0;
+
+			(void)mail_get_virtual_size(mail, &size);
+			filter_worker_report(sfdata, 'P', mail->uid, size);
+		}
 	}
 
 	/* Cleanup */
@@ -348,6 +394,454 @@ static int filter_mailbox
 	return ret;
 }
 
+/*
+ * Parallel filtering
+ */
+
+/* Messages are filtered and committed in batches of this size by each
+   worker; the checkpoint advances after each batch */
+#define FILTER_WORKER_BATCH_SIZE 1000
+#define FILTER_PROGRESS_INTERVAL_MSECS (5*1000)
+
+struct filter_parallel_context;
+
+struct filter_worker {
+	struct filter_parallel_context *pctx;
+	unsigned int index;
+	pid_t pid;
+
+	/* Messages assigned to this worker, in ascending UID order */
+	const uint32_t *uids;
+	unsigned int uid_count;
+
+	/* Lowest UID of which the result is not committed yet */
+	uint32_t pending_uid;
+
+	/* Output of the worker, merged in worker order when all are done */
+	FILE *out, *err;
+
+	struct istream *input;
+	struct io *io;
+
+	unsigned int complete:1;
+	unsigned int failed:1;
+};
+
+struct filter_parallel_context {
+	const struct sieve_filter_data *sfdata;
+	const char *checkpoint_path;
+
+	ARRAY(struct filter_worker) workers;
+	unsigned int running;
+
+	unsigned int total_msgs, done_msgs;
+	uoff_t done_bytes;
+	uint32_t last_uid, checkpoint_uid;
+	struct timeval start_time;
+
+	struct ioloop *ioloop;
+	struct timeout *to_progress;
+};
+
+static struct mailbox *filter_mailbox_reopen
+(struct mailbox *box, enum mailbox_flags open_flags)
+{
+	struct mailbox_list *list = mailbox_get_namespace(box)->list;
+	const char *vname = t_strdup(mailbox_get_vname(box));
+	enum mail_error error;
+
+	/* Don't share the open files with the other processes */
+	mailbox_free(&box);
+
+	box = mailbox_alloc(list, vname, open_flags);
+	if ( mailbox_open(box) < 0 ) {
+		i_fatal("Couldn't open mailbox '%s': %s",
+			vname, mailbox_get_last_error(box, &error));
+	}
+	return box;
+}
+
+static int filter_mailbox_get_uids
+(const struct sieve_filter_data *sfdata, struct mailbox *src_box,
+	uint32_t uid_first, ARRAY_TYPE(uint32_t) *uids)
+{
+	struct sieve_error_handler *ehandler = sfdata->ehandler;
+	struct mail_search_args *search_args;
+	struct mailbox_transaction_context *t;
+	struct mail_search_context *search_ctx;
+	struct mail *mail;
+	int ret = 0;
+
+	if ( mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_READ) < 0 ) {
+		sieve_error(ehandler, NULL, "failed to sync source mailbox");
+		return -1;
+	}
+
+	search_args = mail_search_build_init();
+	mail_search_build_add_flags(search_args, MAIL_DELETED, TRUE);
+	mail_search_build_add_uidset(search_args, uid_first, (uint32_t)-1);
+
+	t = mailbox_transaction_begin(src_box, 0);
+	search_ctx = mailbox_search_init(t, search_args, NULL, 0, NULL);
+	mail_search_args_unref(&search_args);
+
+	while ( mailbox_search_next(search_ctx, &mail) > 0 )
+		array_append(uids, &mail->uid, 1);
+
+	if ( mailbox_search_deinit(&search_ctx) < 0 ) {
+		sieve_error(ehandler, NULL, "failed to search source mailbox");
+		ret = -1;
+	}
+	mailbox_transaction_rollback(&t);
+	return ret;
+}
+
+static void ATTR_NORETURN
+filter_worker_run(struct filter_worker *worker, int progress_fd,
+	struct mailbox *src_box)
+{
+	struct sieve_filter_data wdata = *worker->pctx->sfdata;
+	unsigned int i, last;
+	int ret = 0;
+
+	/* Output goes to private files */
+	if ( dup2(fileno(worker->out), STDOUT_FILENO) < 0 ||
+		dup2(fileno(worker->err), STDERR_FILENO) < 0 )
+		i_fatal("dup2() failed: %m");
+
+	src_box = filter_mailbox_reopen(src_box, wdata.open_flags);
+	if ( wdata.move_mailbox != NULL ) {
+		wdata.move_mailbox =
+			filter_mailbox_reopen(wdata.move_mailbox, wdata.open_flags);
+	}
+	wdata.progress_fd = progress_fd;
+
+	for ( i = 0; ret >= 0 && i < worker->uid_count;
+		i += FILTER_WORKER_BATCH_SIZE ) {
+		last = I_MIN(i + FILTER_WORKER_BATCH_SIZE, worker->uid_count) - 1;
+
+		T_BEGIN {
+			ret = filter_mailbox
+				(&wdata, src_box, worker->uids[i], worker->uids[last]);
+		} T_END;
+
+		/* Batch is committed */
+		if ( ret >= 0 )
+			filter_worker_report(&wdata, 'C', worker->uids[last], 0);
+	}
+
+	if ( wdata.move_mailbox != NULL )
+		mailbox_free(&wdata.move_mailbox);
+	mailbox_free(&src_box);
+
+	exit( ret < 0 ? EX_TEMPFAIL : EX_OK );
+}
+
+static uint32_t filter_checkpoint_get(struct filter_parallel_context *pctx)
+{
+	const struct filter_worker *workers;
+	unsigned int count, i;
+	uint32_t uid = pctx->last_uid + 1;
+
+	workers = array_get(&pctx->workers, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( !workers[i].complete && workers[i].pending_uid < uid )
+			uid = workers[i].pending_uid;
+	}
+	return uid;
+}
+
+static int filter_checkpoint_read(const char *path, uint32_t *uid_r)
+{
+	char buf[32];
+	ssize_t ret;
+	int fd;
+
+	*uid_r = 0;
+
+	if ( (fd=open(path, O_RDONLY)) < 0 ) {
+		if ( errno == ENOENT )
+			return 0;
+		i_error("open(%s) failed: %m", path);
+		return -1;
+	}
+
+	ret = read(fd, buf, sizeof(buf)-1);
+	if ( ret < 0 )
+		i_error("read(%s) failed: %m", path);
+	if ( close(fd) < 0 )
+		i_error("close(%s) failed: %m", path);
+	if ( ret < 0 )
+		return -1;
+
+	buf[ret] = '\0';
+	if ( ret > 0 && buf[ret-1] == '\n' )
+		buf[ret-1] = '\0';
+	if ( str_to_uint32(buf, uid_r) < 0 ) {
+		i_error("Checkpoint file %s is corrupt", path);
+		return -1;
+	}
+	return 1;
+}
+
+static void filter_checkpoint_write(struct filter_parallel_context *pctx)
+{
+	const char *path = pctx->checkpoint_path, *path_tmp, *data;
+	uint32_t uid = filter_checkpoint_get(pctx);
+	int fd;
+
+	if ( path == NULL || uid == pctx->checkpoint_uid )
+		return;
+
+	/* Replace the file atomically */
+	path_tmp = t_strconcat(path, ".tmp", NULL);
+	data = t_strdup_printf("%u\n", uid);
+	if ( (fd=open(path_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 ) {
+		i_error("open(%s) failed: %m", path_tmp);
+		return;
+	}
+	if ( write_full(fd, data, strlen(data)) < 0 ) {
+		i_error("write(%s) failed: %m", path_tmp);
+		i_close_fd(&fd);
+		return;
+	}
+	if ( close(fd) < 0 ) {
+		i_error("close(%s) failed: %m", path_tmp);
+		return;
+	}
+	if ( rename(path_tmp, path) < 0 ) {
+		i_error("rename(%s, %s) failed: %m", path_tmp, path);
+		return;
+	}
+	pctx->checkpoint_uid = uid;
+}
+
+static void filter_progress_report
+(struct filter_parallel_context *pctx, bool final)
+{
+	struct timeval now;
+	long long msecs;
+
+	if ( gettimeofday(&now, NULL) < 0 )
+		i_fatal("gettimeofday(): %m");
+	msecs = timeval_diff_msecs(&now, &pctx->start_time);
+	if ( msecs <= 0 )
+		msecs = 1;
+
+	i_info("%s %u/%u messages in %lld.%03lld secs "
+		"(%llu msgs/s, %llu bytes/s); checkpoint uid=%u",
+		( final ? "Filtered" : "Filtering:" ),
+		pctx->done_msgs, pctx->total_msgs, msecs / 1000, msecs % 1000,
+		(unsigned long long)pctx->done_msgs * 1000 / msecs,
+		(unsigned long long)pctx->done_bytes * 1000 / msecs,
+		filter_checkpoint_get(pctx));
+}
+
+static void filter_progress_timeout(struct filter_parallel_context *pctx)
+{
+	filter_checkpoint_write(pctx);
+	filter_progress_report(pctx, FALSE);
+}
+
+static void filter_worker_input(struct filter_worker *worker)
+{
+	struct filter_parallel_context *pctx = worker->pctx;
+	const char *line;
+
+	while ( (line=i_stream_read_next_line(worker->input)) != NULL ) {
+		const char *const *args = t_strsplit(line, " ");
+		uint32_t uid;
+		uoff_t size;
+
+		if ( str_array_length(args) != 3 ||
+			str_to_uint32(args[1], &uid) < 0 ||
+			str_to_uoff(args[2], &size) < 0 ) {
+			i_error("Worker %u sent invalid progress line: %s",
+				worker->index, str_sanitize(line, 80));
+			continue;
+		}
+
+		switch ( args[0][0] ) {
+		case 'P':
+			/* Message filtered */
+			pctx->done_msgs++;
+			pctx->done_bytes += size;
+			break;
+		case 'C':
+			/* Messages up to uid committed */
+			worker->pending_uid = uid + 1;
+			if ( uid == worker->uids[worker->uid_count-1] )
+				worker->complete = TRUE;
+			break;
+		default:
+			i_error("Worker %u sent invalid progress line: %s",
+				worker->index, str_sanitize(line, 80));
+		}
+	}
+
+	if ( worker->input->eof || worker->input->stream_errno != 0 ) {
+		io_remove(&worker->io);
+		i_stream_destroy(&worker->input);
+
+		i_assert( pctx->running > 0 );
+		if ( --pctx->running == 0 )
+			io_loop_stop(pctx->ioloop);
+	}
+}
+
+static void filter_worker_merge_output(FILE *src, FILE *dest)
+{
+	char buf[IO_BLOCK_SIZE];
+	size_t n;
+
+	rewind(src);
+	while ( (n=fread(buf, 1, sizeof(buf), src)) > 0 )
+		(void)fwrite(buf, 1, n, dest);
+	fclose(src);
+}
+
+static int filter_mailbox_parallel
+(const struct sieve_filter_data *sfdata, struct mailbox *src_box,
+	unsigned int worker_count, uint32_t uid_first,
+	const char *checkpoint_path)
+{
+	struct filter_parallel_context pctx;
+	struct filter_worker *worker;
+	ARRAY_TYPE(uint32_t) uids;
+	const uint32_t *uidv;
+	unsigned int count, i;
+	int ret = 0;
+
+	memset(&pctx, 0, sizeof(pctx));
+	pctx.sfdata = sfdata;
+	pctx.checkpoint_path = checkpoint_path;
+
+	/* Determine the messages to filter */
+
+	i_array_init(&uids, 1024);
+	if ( filter_mailbox_get_uids(sfdata, src_box, uid_first, &uids) < 0 ) {
+		array_free(&uids);
+		return -1;
+	}
+
+	uidv = array_get(&uids, &count);
+	if ( count == 0 ) {
+		i_info("No messages to filter");
+		array_free(&uids);
+		return 0;
+	}
+	if ( worker_count > count )
+		worker_count = count;
+
+	pctx.total_msgs = count;
+	pctx.last_uid = uidv[count-1];
+	pctx.checkpoint_uid = uid_first;
+	if ( gettimeofday(&pctx.start_time, NULL) < 0 )
+		i_fatal("gettimeofday(): %m");
+
+	/* Split the UID range evenly between the workers */
+
+	i_array_init(&pctx.workers, worker_count);
+	fflush(stdout);
+	fflush(stderr);
+	for ( i = 0; i < worker_count; i++ ) {
+		unsigned int first = count * i / worker_count;
+		int fd[2];
+
+		worker = array_append_space(&pctx.workers);
+		worker->pctx = &pctx;
+		worker->index = i;
+		worker->uids = &uidv[first];
+		worker->uid_count = count * (i + 1) / worker_count - first;
+		worker->pending_uid = worker->uids[0];
+
+		if ( (worker->out=tmpfile()) == NULL ||
+			(worker->err=tmpfile()) == NULL ) {
+			i_error("tmpfile() failed: %m");
+			worker->failed = TRUE;
+			ret = -1;
+			break;
+		}
+		if ( pipe(fd) < 0 ) {
+			i_error("pipe() failed: %m");
+			worker->failed = TRUE;
+			ret = -1;
+			break;
+		}
+
+		if ( (worker->pid = fork()) == (pid_t)-1 ) {
+			i_error("fork() failed: %m");
+			i_close_fd(&fd[0]);
+			i_close_fd(&fd[1]);
+			worker->failed = TRUE;
+			ret = -1;
+			break;
+		}
+
+		if ( worker->pid == 0 ) {
+			/* child */
+			i_close_fd(&fd[0]);
+			filter_worker_run(worker, fd[1], src_box);
+		}
+
+		/* parent */
+		i_close_fd(&fd[1]);
+		worker->input = i_stream_create_fd_autoclose(&fd[0], 1024);
+		pctx.running++;
+	}
+
+	/* Collect progress until all workers are finished */
+
+	pctx.ioloop = io_loop_create();
+	array_foreach_modifiable(&pctx.workers, worker) {
+		if ( worker->input != NULL ) {
+			worker->io = io_add(i_stream_get_fd(worker->input), IO_READ,
+				filter_worker_input, worker);
+		}
+	}
+	pctx.to_progress = timeout_add(FILTER_PROGRESS_INTERVAL_MSECS,
+		filter_progress_timeout, &pctx);
+	if ( pctx.running > 0 )
+		io_loop_run(pctx.ioloop);
+	timeout_remove(&pctx.to_progress);
+	io_loop_destroy(&pctx.ioloop);
+
+	/* Merge the results in UID order */
+
+	array_foreach_modifiable(&pctx.workers, worker) {
+		int status;
+
+		if ( worker->pid > 0 ) {
+			if ( waitpid(worker->pid, &status, 0) < 0 ) {
+				i_error("waitpid() failed: %m");
+				worker->failed = TRUE;
+			} else if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+				worker->failed = TRUE;
+			}
+		}
+
+		if ( worker->out != NULL )
+			filter_worker_merge_output(worker->out, stdout);
+		if ( worker->err != NULL )
+			filter_worker_merge_output(worker->err, stderr);
+
+		if ( worker->failed ) {
+			i_error("Worker %u failed to filter messages with UID %u:%u",
+				worker->index, worker->pending_uid,
+				worker->uids[worker->uid_count-1]);
+			ret = -1;
+		}
+	}
+	fflush(stdout);
+
+	filter_checkpoint_write(&pctx);
+	filter_progress_report(&pctx, TRUE);
+
+	array_free(&pctx.workers);
+	array_free(&uids);
+	return ret;
+}
+
 static const char *mailbox_name_to_mutf7(const char *mailbox_utf8)
 {
 	string_t *str = t_str_new(128);
@@ -367,6 +861,9 @@ int main(int argc, char **argv)
 	struct sieve_instance *svinst;
 	ARRAY_TYPE (const_string) scriptfiles;
 	const char *scriptfile,	*src_mailbox, *dst_mailbox, *move_mailbox;
+	const char *checkpoint_path = NULL;
+	unsigned int workers = 0;
+	uint32_t resume_uid = 0;
 	struct sieve_filter_data sfdata;
 	enum sieve_filter_discard_action discard_action = SIEVE_FILTER_DACT_KEEP;
 	struct mail_user *mail_user;
@@ -381,7 +878,7 @@ int main(int argc, char **argv)
 	int c;
 
 	sieve_tool = sieve_tool_init("sieve-filter", &argc, &argv,
-		"m:s:x:P:u:q:Q:DCevW", FALSE);
+		"j:m:r:R:s:x:P:u:q:Q:DCevW", FALSE);
 
 	t_array_init(&scriptfiles, 16);
 
@@ -391,10 +888,28 @@ int main(int argc, char **argv)
 	verbose = FALSE;	
 	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
 		switch (c) {
+		case 'j':
+			/* number of parallel workers */
+			if ( str_to_uint(optarg, &workers) < 0 || workers == 0 ) {
+				print_help();
+				i_fatal_status(EX_USAGE, "Invalid -j argument: %s", optarg);
+			}
+			break;
 		case 'm':
 			/* default mailbox (keep box) */
 			dst_mailbox = optarg;
 			break;
+		case 'r':
+			/* resume at uid */
+			if ( str_to_uint32(optarg, &resume_uid) < 0 ) {
+				print_help();
+				i_fatal_status(EX_USAGE, "Invalid -r argument: %s", optarg);
+			}
+			break;
+		case 'R':
+			/* checkpoint file */
+			checkpoint_path = t_strdup(optarg);
+			break;
 		case 's':
 			/* scriptfile executed before main script */
 			{
@@ -487,6 +1002,11 @@ int main(int argc, char **argv)
 		i_fatal_status(EX_USAGE, "Unknown argument: %s", argv[optind]);
 	}
 
+	/* Resume where the previous run left off */
+	if ( checkpoint_path != NULL && resume_uid == 0 &&
+		filter_checkpoint_read(checkpoint_path, &resume_uid) < 0 )
+		i_fatal("Failed to read checkpoint file");
+
 	if ( dst_mailbox == NULL ) {
 		dst_mailbox = src_mailbox;
 	} else {
@@ -565,6 +1085,8 @@ int main(int argc, char **argv)
 	sfdata.senv = &scriptenv;
 	sfdata.discard_action = discard_action;
 	sfdata.move_mailbox = move_box;
+	sfdata.open_flags = open_flags;
+	sfdata.progress_fd = -1;
 	sfdata.main_sbin = main_sbin;
 	sfdata.ehandler = ehandler;
 	sfdata.execute = execute;
@@ -572,7 +1094,14 @@ int main(int argc, char **argv)
 	sfdata.default_move = default_move;
 
 	/* Apply Sieve filter to all messages found */
-	(void) filter_mailbox(&sfdata, src_box);
+	if ( workers > 0 || checkpoint_path != NULL ) {
+		(void) filter_mailbox_parallel(&sfdata, src_box,
+			( workers == 0 ? 1 : workers ), I_MAX(resume_uid, 1),
+			checkpoint_path);
+	} else {
+		(void) filter_mailbox
+			(&sfdata, src_box, I_MAX(resume_uid, 1), (uint32_t)-1);
+	}
 
 	/* Close the source mailbox */
 	if ( src_box != NULL )